@@ -115,95 +115,380 @@ out:
 
 static const char *gbt_req = "{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"], \"rules\" : [\"segwit\", \"signet\"]}]}\n";
 
+/* A minimal in place scanner for getblocktemplate responses. Rather than
+ * building a json tree of every transaction, header fields are decoded
+ * directly and the transaction data is decoded to binary within the response
+ * buffer itself, which becomes the contiguous txn_data of the template. */
+
+static char *gbt_ws(char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		p++;
+	return p;
+}
+
+/* Scan the json string at p without unescaping it, returning a pointer past
+ * it or NULL if it is invalid */
+static char *gbt_string(char *p, char **str, int *len)
+{
+	if (unlikely(*p != '"'))
+		return NULL;
+	*str = ++p;
+	while (42) {
+		p += strcspn(p, "\"\\");
+		if (*p == '"')
+			break;
+		if (unlikely(!*p || !*++p))
+			return NULL;
+		p++;
+	}
+	*len = p - *str;
+	return p + 1;
+}
+
+/* Skip any json value at p, returning a pointer past it or NULL if invalid */
+static char *gbt_skip(char *p)
+{
+	int depth = 0, len;
+	char *str;
+
+	if (*p == '"')
+		return gbt_string(p, &str, &len);
+	if (*p != '{' && *p != '[') {
+		len = strcspn(p, ",}] \t\r\n");
+		return len ? p + len : NULL;
+	}
+	while (*p) {
+		switch (*p) {
+			case '"':
+				p = gbt_string(p, &str, &len);
+				if (unlikely(!p))
+					return NULL;
+				continue;
+			case '{':
+			case '[':
+				depth++;
+				break;
+			case '}':
+			case ']':
+				if (!--depth)
+					return p + 1;
+				break;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+/* Step to the next member of the object being scanned at *pp, which is at
+ * its opening brace or just past the previous value. Returns 1 with *pp at
+ * the member's value, 0 with *pp past the end of the object, or -1 if
+ * invalid. */
+static int gbt_member(char **pp, char **key, int *keylen)
+{
+	char *p = gbt_ws(*pp);
+
+	if (*p == '{' || *p == ',')
+		p = gbt_ws(p + 1);
+	if (*p == '}') {
+		*pp = p + 1;
+		return 0;
+	}
+	p = gbt_string(p, key, keylen);
+	if (unlikely(!p))
+		return -1;
+	p = gbt_ws(p);
+	if (unlikely(*p != ':'))
+		return -1;
+	*pp = gbt_ws(p + 1);
+	return 1;
+}
+
+/* As gbt_member for the elements of an array */
+static int gbt_element(char **pp)
+{
+	char *p = gbt_ws(*pp);
+
+	if (*p == '[' || *p == ',')
+		p = gbt_ws(p + 1);
+	if (*p == ']') {
+		*pp = p + 1;
+		return 0;
+	}
+	if (unlikely(!*p))
+		return -1;
+	*pp = p;
+	return 1;
+}
+
+static bool gbt_keyis(const char *key, const int keylen, const char *name)
+{
+	return !strncmp(key, name, keylen) && !name[keylen];
+}
+
+/* Copy the json string at *pp into buf of size len, returning false if it is
+ * not a string or does not fit */
+static bool gbt_strcpy(char **pp, char *buf, const int len)
+{
+	int slen;
+	char *str;
+
+	*pp = gbt_string(*pp, &str, &slen);
+	if (unlikely(!*pp || slen >= len))
+		return false;
+	memcpy(buf, str, slen);
+	buf[slen] = '\0';
+	return true;
+}
+
+static bool gbt_int64(char **pp, int64_t *val)
+{
+	char *end;
+
+	*val = strtoll(*pp, &end, 10);
+	if (unlikely(end == *pp))
+		return false;
+	*pp = end;
+	return true;
+}
+
+/* Decode the 64 char hex string id at str */
+static bool gbt_id(const char *str, const int len, uchar *id)
+{
+	char hex[68];
+
+	if (unlikely(len != 64))
+		return false;
+	memcpy(hex, str, 64);
+	hex[64] = '\0';
+	return hex2bin(id, hex, 32);
+}
+
+/* Scan one transaction object at *pp, decoding its hex data down to *wpos in
+ * the response buffer and appending its txid to txn_hashes. */
+static bool gbt_transaction(char **pp, gbtbase_t *gbt, char *body, char **wpos)
+{
+	bool data = false, txid = false, hash = false;
+	gbttxn_t *txn = &gbt->gbttxns[gbt->txns];
+	int keylen, len, ret;
+	char *key, *str;
+
+	if (unlikely(**pp != '{'))
+		return false;
+	while ((ret = gbt_member(pp, &key, &keylen)) > 0) {
+		if (gbt_keyis(key, keylen, "data")) {
+			*pp = gbt_string(*pp, &str, &len);
+			if (unlikely(!*pp))
+				return false;
+			/* The write position never passes what has been read */
+			if (unlikely(len % 2 || !hex2bin_n(*wpos, str, len / 2)))
+				return false;
+			txn->ofs = *wpos - body;
+			txn->len = len / 2;
+			*wpos += len / 2;
+			data = true;
+		} else if (gbt_keyis(key, keylen, "txid")) {
+			*pp = gbt_string(*pp, &str, &len);
+			if (unlikely(!*pp || !gbt_id(str, len, txn->txid)))
+				return false;
+			memcpy(gbt->txn_hashes + gbt->txns * 65, str, 64);
+			txid = true;
+		} else if (gbt_keyis(key, keylen, "hash")) {
+			*pp = gbt_string(*pp, &str, &len);
+			if (unlikely(!*pp || !gbt_id(str, len, txn->hash)))
+				return false;
+			hash = true;
+		} else
+			*pp = gbt_skip(*pp);
+		if (unlikely(!*pp))
+			return false;
+	}
+	if (unlikely(ret < 0 || !data)) {
+		LOGWARNING("Cannot find transaction data in getblocktemplate");
+		return false;
+	}
+	/* Post-segwit, txid is the tx hash without witness data */
+	if (!txid) {
+		if (unlikely(!hash)) {
+			LOGERR("Missing txid for transaction in getblocktemplate");
+			return false;
+		}
+		memcpy(txn->txid, txn->hash, 32);
+		__bin2hex(gbt->txn_hashes + gbt->txns * 65, txn->txid, 32);
+		gbt->txn_hashes[gbt->txns * 65 + 64] = ' ';
+	} else if (!hash)
+		memcpy(txn->hash, txn->txid, 32);
+	return true;
+}
+
+/* Scan the transactions array at *pp into gbt, leaving no transactions
+ * counted if it fails partway. There can only be one array as its storage
+ * is sized as it's scanned. */
+static bool gbt_transactions(char **pp, gbtbase_t *gbt, char *body, char **wpos)
+{
+	int ret, size = 0;
+
+	if (unlikely(**pp != '[' || gbt->gbttxns))
+		return false;
+	while ((ret = gbt_element(pp)) > 0) {
+		if (gbt->txns == size) {
+			size = size ? size * 2 : 1024;
+			gbt->gbttxns = realloc(gbt->gbttxns, sizeof(gbttxn_t) * size);
+			gbt->txn_hashes = realloc(gbt->txn_hashes, size * 65 + 1);
+			if (unlikely(!gbt->gbttxns || !gbt->txn_hashes))
+				quit(1, "Failed to realloc in gbt_transactions");
+			memset(gbt->txn_hashes + gbt->txns * 65, 0x20, (size - gbt->txns) * 65); // Spaces
+		}
+		if (!gbt_transaction(pp, gbt, body, wpos)) {
+			gbt->txns = 0;
+			return false;
+		}
+		gbt->txns++;
+	}
+	if (unlikely(ret < 0)) {
+		gbt->txns = 0;
+		return false;
+	}
+	if (gbt->txn_hashes)
+		gbt->txn_hashes[gbt->txns * 65] = '\0';
+	return true;
+}
+
+/* Check any rules prefixed with ! in the rules array at *pp are understood */
+static bool gbt_rules(char **pp)
+{
+	char rule[64];
+	int ret;
+
+	if (unlikely(**pp != '['))
+		return false;
+	while ((ret = gbt_element(pp)) > 0) {
+		if (!gbt_strcpy(pp, rule, sizeof(rule)))
+			return false;
+		if (rule[0] == '!' && !check_required_rule(rule + 1)) {
+			LOGERR("Required rule not understood: %s", rule + 1);
+			return false;
+		}
+	}
+	return !ret;
+}
+
 /* Request getblocktemplate from bitcoind already connected with a connsock_t
  * and then summarise the information to the most efficient set of data
  * required to assemble a mining template, storing it in a gbtbase_t structure */
 bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 {
-	json_t *rules_array, *coinbase_aux, *res_val, *val;
-	const char *previousblockhash;
+	char previousblockhash[68] = {}, target[68] = {}, bits[12] = {}, flags[256] = {};
+	int64_t version = 0, curtime = 0, height = 0, coinbasevalue = 0;
 	char hash_swap[32], tmp[32];
-	uint64_t coinbasevalue;
-	const char *target;
-	const char *flags;
-	const char *bits;
-	const char *rule;
-	int version;
-	int curtime;
-	int height;
-	int i;
+	bool coinbase_aux = false;
+	char *body, *p, *key, *wpos;
 	bool ret = false;
+	int keylen, n;
 
-	val = json_rpc_call(cs, gbt_req);
-	if (!val) {
+	/* Callers pass uninitialised stack gbtbases */
+	memset(gbt, 0, sizeof(gbtbase_t));
+	body = json_rpc_raw(cs, gbt_req);
+	if (!body) {
 		LOGWARNING("%s:%s Failed to get valid json response to getblocktemplate", cs->url, cs->port);
 		return ret;
 	}
-	res_val = json_object_get(val, "result");
-	if (!res_val) {
+	p = body;
+	while ((n = gbt_member(&p, &key, &keylen)) > 0) {
+		if (gbt_keyis(key, keylen, "result"))
+			break;
+		p = gbt_skip(p);
+		if (unlikely(!p)) {
+			n = -1;
+			break;
+		}
+	}
+	if (n < 1 || *p != '{') {
 		LOGWARNING("Failed to get result in json response to getblocktemplate");
 		goto out;
 	}
 
-	rules_array = json_object_get(res_val, "rules");
-	if (rules_array) {
-		int rule_count =  json_array_size(rules_array);
-
-		for (i = 0; i < rule_count; i++) {
-			rule = json_string_value(json_array_get(rules_array, i));
-			if (rule && *rule++ == '!' && !check_required_rule(rule)) {
-				LOGERR("Required rule not understood: %s", rule);
-				goto out;
+	/* Transaction data is decoded to the start of the buffer as it's
+	 * scanned */
+	wpos = body;
+	while ((n = gbt_member(&p, &key, &keylen)) > 0) {
+		bool valid = true;
+
+		if (gbt_keyis(key, keylen, "rules"))
+			valid = gbt_rules(&p);
+		else if (gbt_keyis(key, keylen, "previousblockhash"))
+			valid = gbt_strcpy(&p, previousblockhash, 65);
+		else if (gbt_keyis(key, keylen, "target"))
+			valid = gbt_strcpy(&p, target, 65);
+		else if (gbt_keyis(key, keylen, "bits"))
+			valid = gbt_strcpy(&p, bits, sizeof(bits));
+		else if (gbt_keyis(key, keylen, "version"))
+			valid = gbt_int64(&p, &version);
+		else if (gbt_keyis(key, keylen, "curtime"))
+			valid = gbt_int64(&p, &curtime);
+		else if (gbt_keyis(key, keylen, "height"))
+			valid = gbt_int64(&p, &height);
+		else if (gbt_keyis(key, keylen, "coinbasevalue"))
+			valid = gbt_int64(&p, &coinbasevalue);
+		else if (gbt_keyis(key, keylen, "default_witness_commitment"))
+			valid = gbt_strcpy(&p, gbt->witness_commitment, sizeof(gbt->witness_commitment));
+		else if (gbt_keyis(key, keylen, "transactions"))
+			valid = gbt_transactions(&p, gbt, body, &wpos);
+		else if (gbt_keyis(key, keylen, "coinbaseaux") && *p == '{') {
+			coinbase_aux = true;
+			while (valid && (n = gbt_member(&p, &key, &keylen)) > 0) {
+				if (gbt_keyis(key, keylen, "flags"))
+					valid = gbt_strcpy(&p, flags, sizeof(flags));
+				else
+					valid = (p = gbt_skip(p));
 			}
+			valid &= !n;
+		} else
+			valid = (p = gbt_skip(p));
+		if (unlikely(!valid || !p)) {
+			n = -1;
+			break;
 		}
 	}
-
-	previousblockhash = json_string_value(json_object_get(res_val, "previousblockhash"));
-	target = json_string_value(json_object_get(res_val, "target"));
-	version = json_integer_value(json_object_get(res_val, "version"));
-	curtime = json_integer_value(json_object_get(res_val, "curtime"));
-	bits = json_string_value(json_object_get(res_val, "bits"));
-	height = json_integer_value(json_object_get(res_val, "height"));
-	coinbasevalue = json_integer_value(json_object_get(res_val, "coinbasevalue"));
-	coinbase_aux = json_object_get(res_val, "coinbaseaux");
-	flags = json_string_value(json_object_get(coinbase_aux, "flags"));
-	if (!flags)
-		flags = "";
-
-	if (unlikely(!previousblockhash || !target || !version || !curtime || !bits || !coinbase_aux)) {
-		LOGERR("JSON failed to decode GBT %s %s %d %d %s %s", previousblockhash, target, version, curtime, bits, flags);
+	if (unlikely(n < 0)) {
+		LOGERR("JSON failed to decode GBT at offset %d", (int)(p ? p - body : 0));
+		goto out;
+	}
+	if (unlikely(!*previousblockhash || !*target || !version || !curtime || !*bits || !coinbase_aux)) {
+		LOGERR("JSON failed to decode GBT %s %s %d %d %s %s", previousblockhash, target,
+		       (int)version, (int)curtime, bits, flags);
 		goto out;
 	}
 
-	/* Store getblocktemplate for remainder of json components as is */
-	json_incref(res_val);
-	json_object_del(val, "result");
-	gbt->json = res_val;
+	/* What remains of the buffer is the contiguous transaction data */
+	gbt->txn_datalen = wpos - body;
+	gbt->txn_data = realloc(body, gbt->txn_datalen + 1);
+	if (unlikely(!gbt->txn_data))
+		quit(1, "Failed to realloc txn_data in gen_gbtbase");
+	body = NULL;
+	if (!gbt->txn_hashes)
+		gbt->txn_hashes = ckzalloc(1);
 
 	hex2bin(hash_swap, previousblockhash, 32);
 	swap_256(tmp, hash_swap);
 	__bin2hex(gbt->prevhash, tmp, 32);
 
-	strncpy(gbt->target, target, 65);
+	memcpy(gbt->target, target, sizeof(target));
 
 	hex2bin(hash_swap, target, 32);
 	bswap_256(tmp, hash_swap);
 	gbt->diff = diff_from_target((uchar *)tmp);
-	json_object_set_new_nocheck(gbt->json, "diff", json_real(gbt->diff));
 
 	gbt->version = version;
 
 	gbt->curtime = curtime;
 
-	snprintf(gbt->ntime, 9, "%08x", curtime);
-	json_object_set_new_nocheck(gbt->json, "ntime", json_string_nocheck(gbt->ntime));
+	snprintf(gbt->ntime, 9, "%08x", (int)curtime);
 	sscanf(gbt->ntime, "%x", &gbt->ntime32);
 
-	snprintf(gbt->bbversion, 9, "%08x", version);
-	json_object_set_new_nocheck(gbt->json, "bbversion", json_string_nocheck(gbt->bbversion));
+	snprintf(gbt->bbversion, 9, "%08x", (int)version);
 
 	snprintf(gbt->nbit, 9, "%s", bits);
-	json_object_set_new_nocheck(gbt->json, "nbit", json_string_nocheck(gbt->nbit));
 
 	gbt->coinbasevalue = coinbasevalue;
 
@@ -213,15 +498,19 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 
 	ret = true;
 out:
-	json_decref(val);
+	if (!ret) {
+		free(body);
+		clear_gbtbase(gbt);
+	}
 	return ret;
 }
 
 void clear_gbtbase(gbtbase_t *gbt)
 {
 	free(gbt->flags);
-	if (gbt->json)
-		json_decref(gbt->json);
+	free(gbt->gbttxns);
+	free(gbt->txn_data);
+	free(gbt->txn_hashes);
 	memset(gbt, 0, sizeof(gbtbase_t));
 }
 
@@ -313,20 +602,31 @@ out:
 	return ret;
 }
 
-bool submit_block(connsock_t *cs, const char *params)
+static const char *submit_req = "{\"method\": \"submitblock\", \"params\": [\"";
+static const char *submit_end = "\"]}\n";
+
+/* Submit a block made up of data, which is the header, transaction count and
+ * coinbase, followed by txn_len of txn_data, without copying either */
+bool submit_block_data(connsock_t *cs, const char *data, const char *txn_data, const int txn_len)
 {
 	json_t *val, *res_val;
-	int len, retries = 0;
+	struct iovec iov[4];
+	int iovcnt = 0, retries = 0;
 	const char *res_ret;
 	bool ret = false;
-	char *rpc_req;
 
-	len = strlen(params) + 64;
+	iov[iovcnt].iov_base = (void *)submit_req;
+	iov[iovcnt++].iov_len = strlen(submit_req);
+	iov[iovcnt].iov_base = (void *)data;
+	iov[iovcnt++].iov_len = strlen(data);
+	if (txn_len) {
+		iov[iovcnt].iov_base = (void *)txn_data;
+		iov[iovcnt++].iov_len = txn_len;
+	}
+	iov[iovcnt].iov_base = (void *)submit_end;
+	iov[iovcnt++].iov_len = strlen(submit_end);
 retry:
-	rpc_req = ckalloc(len);
-	sprintf(rpc_req, "{\"method\": \"submitblock\", \"params\": [\"%s\"]}\n", params);
-	val = json_rpc_call(cs, rpc_req);
-	dealloc(rpc_req);
+	val = json_rpc_iov(cs, iov, iovcnt);
 	if (!val) {
 		LOGWARNING("%s:%s Failed to get valid json response to submitblock", cs->url, cs->port);
 		if (++retries < 5)
@@ -361,6 +661,11 @@ out:
 	return ret;
 }
 
+bool submit_block(connsock_t *cs, const char *params)
+{
+	return submit_block_data(cs, params, NULL, 0);
+}
+
 void precious_block(connsock_t *cs, const char *params)
 {
 	char *rpc_req;
@@ -19,6 +19,7 @@ void clear_gbtbase(gbtbase_t *gbt);
 int get_blockcount(connsock_t *cs);
 bool get_blockhash(connsock_t *cs, int height, char *hash);
 bool get_bestblockhash(connsock_t *cs, char *hash);
+bool submit_block_data(connsock_t *cs, const char *data, const char *txn_data, const int txn_len);
 bool submit_block(connsock_t *cs, const char *params);
 void precious_block(connsock_t *cs, const char *params);
 void submit_txn(connsock_t *cs, const char *params);
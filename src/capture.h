@@ -0,0 +1,49 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/* Traffic captures are a stream of records in host byte order, each starting
+ * with a capture_rec header and followed by its payload. A file starts with a
+ * version record and every record is stamped with the nanoseconds since the
+ * capture was started, in the order the pool saw them. */
+
+#define CAPTURE_MAGIC 0x50434b43 /* "CKCP" */
+#define CAPTURE_VERSION 1
+
+enum capture_type {
+	CAPTURE_REC_VERSION = 1,
+	CAPTURE_REC_CONNECT, /* Payload is the client address */
+	CAPTURE_REC_LINE, /* Payload is a line from the client without its EOL */
+	CAPTURE_REC_CLOSE, /* No payload */
+	CAPTURE_REC_WORKBASE, /* Payload is a json summary of the template */
+};
+
+struct capture_rec {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t server; /* Server the client connected to */
+	uint32_t len; /* Including this header */
+	int64_t ns;
+	int64_t clientid;
+} __attribute__((packed));
+
+struct capture_version {
+	struct capture_rec rec;
+	uint32_t magic;
+	uint32_t version;
+	/* Realtime the capture was started at */
+	int64_t startsec;
+	int64_t startnsec;
+} __attribute__((packed));
+
+#endif /* CAPTURE_H */
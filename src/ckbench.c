@@ -0,0 +1,744 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Stratum load generator. Opens many client connections to a pool, takes
+ * each through subscribe/authorize/suggest_difficulty and then submits
+ * synthetic shares at a fixed aggregate rate, reporting connection rates,
+ * submit to response latency and notify fan-out times. The shares are not
+ * real work so the pool will reject them as above target, but they travel
+ * the whole connector and stratifier submission path. */
+
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+
+static int msg_loglevel = LOG_NOTICE;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= msg_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+enum bench_state {
+	BENCH_CONNECTING,
+	BENCH_SUBSCRIBING,
+	BENCH_AUTHORISING,
+	BENCH_MINING,
+	BENCH_CLOSED
+};
+
+#define BENCH_PENDING 32
+#define BENCH_MAXBUF 1048576
+
+/* Ids below this are reserved for the handshake */
+#define BENCH_SHAREID 100
+
+struct pending {
+	int64_t id;
+	int64_t ns;
+};
+
+typedef struct bench_client {
+	int fd;
+	int id;
+	enum bench_state state;
+
+	int64_t connstart;
+	int64_t reqstart;
+
+	char *buf;
+	int bufsize;
+	int bufofs;
+
+	char *outbuf;
+	int outsize;
+	int outlen;
+	bool wantout;
+
+	int nonce2len;
+	uint64_t nonce2;
+	char job_id[32];
+	bool hasjob;
+
+	/* Ring of submits awaiting a response */
+	struct pending pending[BENCH_PENDING];
+	int pendhead;
+	int pendcount;
+	int64_t nextid;
+} bench_client_t;
+
+/* Growable array of latency samples in nanoseconds */
+struct latency {
+	int64_t *ns;
+	int64_t count;
+	int64_t size;
+};
+
+/* Arrival spread of one job across the mining clients */
+struct fanout {
+	char job_id[32];
+	bool clean;
+	int64_t start;
+	int64_t last;
+	int clients;
+};
+
+static struct option long_options[] = {
+	{"clients",	required_argument,	0,	'c'},
+	{"connrate",	required_argument,	0,	'C'},
+	{"suggest",	required_argument,	0,	'D'},
+	{"duration",	required_argument,	0,	'd'},
+	{"help",	no_argument,		0,	'h'},
+	{"loglevel",	required_argument,	0,	'l'},
+	{"rate",	required_argument,	0,	'r'},
+	{"url",		required_argument,	0,	'U'},
+	{"username",	required_argument,	0,	'u'},
+	{0, 0, 0, 0}
+};
+
+static volatile sig_atomic_t stopping;
+
+static bench_client_t *clients;
+static int noclients = 1000;
+static int epfd;
+static char *username = "ckbench";
+static double suggest;
+
+static struct addrinfo *serveraddr;
+
+static int64_t attempted, established, connfails, disconnects, peakconnrate;
+static int64_t benchstart, lastconn;
+static int64_t submitted, accepted, rejected, unmatched, sendstalls;
+static int connected, mining;
+
+static struct latency connlat, sublat, authlat, sharelat, cleanfanout, updatefanout;
+static struct fanout fanout;
+
+static void sighandler(const int __maybe_unused sig)
+{
+	stopping = 1;
+}
+
+static void add_latency(struct latency *lat, const int64_t ns)
+{
+	if (unlikely(lat->count >= lat->size)) {
+		lat->size = lat->size ? lat->size * 2 : 4096;
+		lat->ns = realloc(lat->ns, sizeof(int64_t) * lat->size);
+		if (unlikely(!lat->ns))
+			quit(1, "Failed to realloc latency samples in add_latency");
+	}
+	lat->ns[lat->count++] = ns;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+	const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_ms(const struct latency *lat, const double pct)
+{
+	int64_t idx = (int64_t)(pct / 100 * (lat->count - 1) + 0.5);
+
+	return (double)lat->ns[idx] / 1000000;
+}
+
+static void report_latency(const char *name, struct latency *lat)
+{
+	if (!lat->count) {
+		printf("%-20s no samples\n", name);
+		return;
+	}
+	qsort(lat->ns, lat->count, sizeof(int64_t), cmp_int64);
+	printf("%-20s %8"PRId64" samples  p50 %.3fms  p90 %.3fms  p99 %.3fms  p99.9 %.3fms  max %.3fms\n",
+	       name, lat->count, percentile_ms(lat, 50), percentile_ms(lat, 90),
+	       percentile_ms(lat, 99), percentile_ms(lat, 99.9),
+	       (double)lat->ns[lat->count - 1] / 1000000);
+}
+
+/* Raise the open file limit as far as allowed to fit every client */
+static void raise_nofile(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim))
+		return;
+	if (rlim.rlim_cur >= (rlim_t)noclients + 64)
+		return;
+	rlim.rlim_cur = (rlim_t)noclients + 64;
+	if (rlim.rlim_max != RLIM_INFINITY && rlim.rlim_cur > rlim.rlim_max)
+		rlim.rlim_cur = rlim.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rlim))
+		LOGWARNING("Failed to raise open file limit");
+	if (rlim.rlim_cur < (rlim_t)noclients + 64) {
+		LOGWARNING("Open file limit %lu only allows %lu clients",
+			   (unsigned long)rlim.rlim_cur, (unsigned long)rlim.rlim_cur - 64);
+		noclients = rlim.rlim_cur - 64;
+	}
+}
+
+static void close_client(bench_client_t *client)
+{
+	if (client->state == BENCH_CLOSED)
+		return;
+	if (client->state != BENCH_CONNECTING)
+		connected--;
+	if (client->state == BENCH_MINING)
+		mining--;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	Close(client->fd);
+	client->state = BENCH_CLOSED;
+	unmatched += client->pendcount;
+	client->pendcount = 0;
+}
+
+static void set_events(bench_client_t *client, const bool wantout)
+{
+	struct epoll_event event;
+
+	if (client->wantout == wantout)
+		return;
+	client->wantout = wantout;
+	event.events = EPOLLIN | EPOLLRDHUP | (wantout ? EPOLLOUT : 0);
+	event.data.u64 = client->id;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+/* Write out whatever is queued for the client, waiting on EPOLLOUT for the
+ * remainder if the socket buffer is full */
+static void flush_client(bench_client_t *client)
+{
+	int ofs = 0, ret;
+
+	while (ofs < client->outlen) {
+		ret = write(client->fd, client->outbuf + ofs, client->outlen - ofs);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			disconnects++;
+			close_client(client);
+			return;
+		}
+		ofs += ret;
+	}
+	client->outlen -= ofs;
+	if (client->outlen)
+		memmove(client->outbuf, client->outbuf + ofs, client->outlen);
+	set_events(client, client->outlen > 0);
+}
+
+static void send_client(bench_client_t *client, const char *msg, const int len)
+{
+	if (unlikely(client->outlen + len > client->outsize)) {
+		while (client->outlen + len > client->outsize)
+			client->outsize = client->outsize ? client->outsize * 2 : 1024;
+		client->outbuf = realloc(client->outbuf, client->outsize);
+		if (unlikely(!client->outbuf))
+			quit(1, "Failed to realloc outbuf in send_client");
+	}
+	memcpy(client->outbuf + client->outlen, msg, len);
+	client->outlen += len;
+	if (!client->wantout)
+		flush_client(client);
+}
+
+static void start_connect(bench_client_t *client)
+{
+	struct epoll_event event;
+	int fd;
+
+	attempted++;
+	client->connstart = monotonic_ns();
+	fd = socket(serveraddr->ai_family, serveraddr->ai_socktype | SOCK_CLOEXEC,
+		    serveraddr->ai_protocol);
+	if (unlikely(fd < 0)) {
+		LOGDEBUG("Failed to open socket for client %d: %s", client->id, strerror(errno));
+		connfails++;
+		return;
+	}
+	noblock_socket(fd);
+	nolinger_socket(fd);
+	if (connect(fd, serveraddr->ai_addr, serveraddr->ai_addrlen) && errno != EINPROGRESS) {
+		LOGDEBUG("Failed to connect client %d: %s", client->id, strerror(errno));
+		connfails++;
+		close(fd);
+		return;
+	}
+	client->fd = fd;
+	client->state = BENCH_CONNECTING;
+	client->wantout = true;
+	event.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+	event.data.u64 = client->id;
+	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event))) {
+		LOGWARNING("Failed to add client %d to epoll: %s", client->id, strerror(errno));
+		connfails++;
+		close(fd);
+		client->state = BENCH_CLOSED;
+	}
+}
+
+static void connect_complete(bench_client_t *client)
+{
+	socklen_t len = sizeof(int);
+	int64_t now = monotonic_ns();
+	char msg[128];
+	int err = 0;
+
+	if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		LOGDEBUG("Failed to connect client %d: %s", client->id, strerror(err));
+		connfails++;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+		Close(client->fd);
+		client->state = BENCH_CLOSED;
+		return;
+	}
+	established++;
+	connected++;
+	lastconn = now;
+	add_latency(&connlat, now - client->connstart);
+	client->state = BENCH_SUBSCRIBING;
+	client->reqstart = now;
+	set_events(client, false);
+	len = snprintf(msg, sizeof(msg), "{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[\"ckbench/%s\"]}\n",
+		       VERSION);
+	send_client(client, msg, len);
+}
+
+static void parse_subscribe(bench_client_t *client, json_t *val)
+{
+	json_t *res_val = json_object_get(val, "result");
+	int64_t now = monotonic_ns();
+	char msg[320];
+	int len;
+
+	if (unlikely(!json_is_array(res_val) || json_array_size(res_val) < 3)) {
+		LOGWARNING("Client %d failed to subscribe", client->id);
+		disconnects++;
+		close_client(client);
+		return;
+	}
+	client->nonce2len = json_integer_value(json_array_get(res_val, 2));
+	if (client->nonce2len < 1 || client->nonce2len > 8)
+		client->nonce2len = 8;
+	add_latency(&sublat, now - client->reqstart);
+	client->state = BENCH_AUTHORISING;
+	client->reqstart = now;
+	len = snprintf(msg, sizeof(msg), "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"%s.%d\",\"x\"]}\n",
+		       username, client->id);
+	send_client(client, msg, len);
+}
+
+static void parse_authorise(bench_client_t *client, json_t *val)
+{
+	int64_t now = monotonic_ns();
+	char msg[128];
+	int len;
+
+	if (unlikely(!json_is_true(json_object_get(val, "result")))) {
+		LOGWARNING("Client %d failed to authorise", client->id);
+		disconnects++;
+		close_client(client);
+		return;
+	}
+	add_latency(&authlat, now - client->reqstart);
+	client->state = BENCH_MINING;
+	mining++;
+	if (suggest > 0) {
+		len = snprintf(msg, sizeof(msg), "{\"id\":3,\"method\":\"mining.suggest_difficulty\",\"params\":[%g]}\n",
+			       suggest);
+		send_client(client, msg, len);
+	}
+}
+
+static void parse_share(bench_client_t *client, json_t *val, const int64_t id)
+{
+	int i, slot = 0;
+
+	for (i = 0; i < client->pendcount; i++) {
+		slot = (client->pendhead + i) % BENCH_PENDING;
+		if (client->pending[slot].id == id)
+			break;
+	}
+	if (unlikely(i == client->pendcount)) {
+		LOGDEBUG("Client %d got response to unknown id %"PRId64, client->id, id);
+		return;
+	}
+	add_latency(&sharelat, monotonic_ns() - client->pending[slot].ns);
+	if (json_is_true(json_object_get(val, "result")))
+		accepted++;
+	else
+		rejected++;
+	/* Responses normally arrive in order so this is the head of the ring */
+	if (i) {
+		int head = client->pendhead % BENCH_PENDING;
+
+		client->pending[slot] = client->pending[head];
+	}
+	client->pendhead = (client->pendhead + 1) % BENCH_PENDING;
+	client->pendcount--;
+}
+
+static void finish_fanout(void)
+{
+	if (!fanout.clients)
+		return;
+	if (fanout.clean)
+		add_latency(&cleanfanout, fanout.last - fanout.start);
+	else
+		add_latency(&updatefanout, fanout.last - fanout.start);
+	fanout.clients = 0;
+}
+
+/* Time from the first to the last mining client receiving each new job,
+ * counting only clients that already had a previous job to replace */
+static void parse_notify(bench_client_t *client, json_t *val)
+{
+	json_t *params = json_object_get(val, "params");
+	int64_t now = monotonic_ns();
+	const char *job_id;
+	bool hadjob;
+
+	job_id = json_string_value(json_array_get(params, 0));
+	if (unlikely(!job_id))
+		return;
+	if (!strcmp(job_id, client->job_id))
+		return;
+	strncpy(client->job_id, job_id, sizeof(client->job_id) - 1);
+	hadjob = client->hasjob;
+	client->hasjob = true;
+	if (!hadjob || client->state != BENCH_MINING)
+		return;
+	if (strcmp(job_id, fanout.job_id)) {
+		finish_fanout();
+		strncpy(fanout.job_id, job_id, sizeof(fanout.job_id) - 1);
+		fanout.clean = json_is_true(json_array_get(params, 8));
+		fanout.start = now;
+	}
+	fanout.last = now;
+	fanout.clients++;
+}
+
+static void parse_line(bench_client_t *client, const char *line)
+{
+	json_t *val, *id_val;
+	json_error_t err_val;
+	const char *method;
+
+	val = json_loads(line, 0, &err_val);
+	if (unlikely(!val)) {
+		LOGINFO("Client %d received invalid json: %s", client->id, err_val.text);
+		return;
+	}
+	method = json_string_value(json_object_get(val, "method"));
+	if (method) {
+		if (!strcmp(method, "mining.notify"))
+			parse_notify(client, val);
+		goto out;
+	}
+	id_val = json_object_get(val, "id");
+	if (!json_is_integer(id_val))
+		goto out;
+	switch (json_integer_value(id_val)) {
+		case 1:
+			if (client->state == BENCH_SUBSCRIBING)
+				parse_subscribe(client, val);
+			break;
+		case 2:
+			if (client->state == BENCH_AUTHORISING)
+				parse_authorise(client, val);
+			break;
+		case 3:
+			break;
+		default:
+			parse_share(client, val, json_integer_value(id_val));
+			break;
+	}
+out:
+	json_decref(val);
+}
+
+static void read_client(bench_client_t *client)
+{
+	char *eol, *line;
+	int ret;
+
+	while (42) {
+		if (client->bufsize - client->bufofs < 1024) {
+			if (unlikely(client->bufsize >= BENCH_MAXBUF)) {
+				LOGWARNING("Client %d overflowed its receive buffer", client->id);
+				disconnects++;
+				close_client(client);
+				return;
+			}
+			client->bufsize = client->bufsize ? client->bufsize * 2 : 4096;
+			client->buf = realloc(client->buf, client->bufsize);
+			if (unlikely(!client->buf))
+				quit(1, "Failed to realloc buf in read_client");
+		}
+		ret = read(client->fd, client->buf + client->bufofs, client->bufsize - client->bufofs - 1);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			ret = 0;
+		}
+		if (!ret) {
+			LOGDEBUG("Client %d disconnected", client->id);
+			disconnects++;
+			close_client(client);
+			return;
+		}
+		client->bufofs += ret;
+		client->buf[client->bufofs] = '\0';
+		line = client->buf;
+		while ((eol = strchr(line, '\n'))) {
+			*eol = '\0';
+			parse_line(client, line);
+			if (client->state == BENCH_CLOSED)
+				return;
+			line = eol + 1;
+		}
+		client->bufofs -= line - client->buf;
+		memmove(client->buf, line, client->bufofs + 1);
+	}
+}
+
+static bool submit_share(bench_client_t *client)
+{
+	int slot, len;
+	char msg[384];
+
+	if (client->pendcount >= BENCH_PENDING || !client->hasjob)
+		return false;
+	slot = (client->pendhead + client->pendcount) % BENCH_PENDING;
+	client->pending[slot].id = client->nextid;
+	client->pending[slot].ns = monotonic_ns();
+	client->pendcount++;
+	len = snprintf(msg, sizeof(msg), "{\"id\":%"PRId64",\"method\":\"mining.submit\",\"params\":"
+		       "[\"%s.%d\",\"%s\",\"%0*"PRIx64"\",\"%08x\",\"%08x\"]}\n",
+		       client->nextid++, username, client->id, client->job_id,
+		       client->nonce2len * 2, client->nonce2++, (uint32_t)time(NULL),
+		       (uint32_t)random());
+	send_client(client, msg, len);
+	submitted++;
+	return true;
+}
+
+static void handle_event(const struct epoll_event *event)
+{
+	bench_client_t *client = &clients[event->data.u64];
+
+	if (client->state == BENCH_CLOSED)
+		return;
+	if (client->state == BENCH_CONNECTING) {
+		if (event->events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			connect_complete(client);
+		return;
+	}
+	if (event->events & EPOLLOUT)
+		flush_client(client);
+	if (client->state == BENCH_CLOSED)
+		return;
+	if (event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		read_client(client);
+}
+
+static void report(const double elapsed)
+{
+	double ramp = (double)(lastconn - benchstart) / 1000000000;
+
+	printf("\nConnections: %"PRId64" attempted  %"PRId64" established  %"PRId64" failed"
+	       "  %"PRId64" disconnected\n", attempted, established, connfails, disconnects);
+	printf("Connection rate: %.1f/s average  %"PRId64"/s peak\n",
+	       ramp > 0 ? established / ramp : 0, peakconnrate);
+	printf("Shares: %"PRId64" submitted  %"PRId64" accepted  %"PRId64" rejected  %"PRId64
+	       " unanswered  %.1f/s  %"PRId64" send stalls\n", submitted, accepted, rejected,
+	       unmatched, elapsed > 0 ? submitted / elapsed : 0, sendstalls);
+	report_latency("Connect", &connlat);
+	report_latency("Subscribe", &sublat);
+	report_latency("Authorise", &authlat);
+	report_latency("Submit", &sharelat);
+	report_latency("Block change fanout", &cleanfanout);
+	report_latency("Update fanout", &updatefanout);
+}
+
+int main(int argc, char **argv)
+{
+	char *url = "127.0.0.1:3333", *sockaddr_url, *sockaddr_port;
+	int64_t start, now, lastsec, lastest = 0, nextconn = 0, drainuntil = 0;
+	int c, i, j, nfds, duration = 30, rrclient = 0;
+	double rate = 100, connrate = 0;
+	struct epoll_event *events;
+	struct addrinfo hints;
+	struct sigaction handler;
+
+	while ((c = getopt_long(argc, argv, "c:C:D:d:hl:r:U:u:", long_options, &i)) != -1) {
+		switch(c) {
+			case 'c':
+				noclients = atoi(optarg);
+				if (noclients < 1)
+					quit(1, "Invalid number of clients: %d", noclients);
+				break;
+			case 'C':
+				connrate = atof(optarg);
+				break;
+			case 'D':
+				suggest = atof(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'h':
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					if (jopt->has_arg) {
+						char *upper = alloca(strlen(jopt->name) + 1);
+						int offset = 0;
+
+						do {
+							upper[offset] = toupper(jopt->name[offset]);
+						} while (upper[offset++] != '\0');
+						printf("-%c %s | --%s %s\n", jopt->val,
+						       upper, jopt->name, upper);
+					} else
+						printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'l':
+				msg_loglevel = atoi(optarg);
+				if (msg_loglevel < LOG_EMERG ||
+				    msg_loglevel > LOG_DEBUG) {
+					quit(1, "Invalid loglevel: %d (range %d"
+						" - %d)",
+						msg_loglevel,
+						LOG_EMERG,
+						LOG_DEBUG);
+				}
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 'U':
+				url = strdup(optarg);
+				break;
+			case 'u':
+				username = strdup(optarg);
+				break;
+		}
+	}
+
+	if (!extract_sockaddr(url, &sockaddr_url, &sockaddr_port))
+		quit(1, "Failed to extract server address from %s", url);
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(sockaddr_url, sockaddr_port, &hints, &serveraddr))
+		quit(1, "Failed to resolve %s:%s", sockaddr_url, sockaddr_port);
+
+	raise_nofile();
+	clients = ckzalloc(sizeof(bench_client_t) * noclients);
+	for (i = 0; i < noclients; i++) {
+		clients[i].id = i;
+		clients[i].state = BENCH_CLOSED;
+		clients[i].nextid = BENCH_SHAREID;
+	}
+	events = ckalloc(sizeof(struct epoll_event) * 1024);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		quit(1, "Failed to create epoll");
+
+	handler.sa_handler = &sighandler;
+	handler.sa_flags = 0;
+	sigemptyset(&handler.sa_mask);
+	sigaction(SIGTERM, &handler, NULL);
+	sigaction(SIGINT, &handler, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	LOGWARNING("Benchmarking %s with %d clients at %.1f shares/s for %ds",
+		   url, noclients, rate, duration);
+
+	start = lastsec = benchstart = monotonic_ns();
+	while (42) {
+		double elapsed;
+		int64_t due;
+
+		now = monotonic_ns();
+		elapsed = (double)(now - start) / 1000000000;
+
+		if (!drainuntil && (stopping || elapsed >= duration)) {
+			/* Give outstanding submits a moment to be answered */
+			drainuntil = now + 2000000000ll;
+		}
+		if (drainuntil && (now >= drainuntil || !(submitted - accepted - rejected - unmatched)))
+			break;
+
+		/* Open new connections, paced by connrate if set */
+		due = connrate > 0 ? (int64_t)(connrate * elapsed) + 1 : noclients;
+		for (j = 0; !drainuntil && nextconn < noclients && nextconn < due && j < 1000; j++)
+			start_connect(&clients[nextconn++]);
+
+		/* Spread the submits round robin over the mining clients */
+		due = (int64_t)(rate * elapsed) - submitted;
+		for (j = 0; !drainuntil && mining && due > 0 && j < noclients; j++) {
+			bench_client_t *client = &clients[rrclient];
+
+			rrclient = (rrclient + 1) % noclients;
+			if (client->state != BENCH_MINING)
+				continue;
+			if (submit_share(client))
+				due--;
+			else
+				sendstalls++;
+		}
+
+		nfds = epoll_wait(epfd, events, 1024, rate > 0 || connrate > 0 ? 1 : 100);
+		for (i = 0; i < nfds; i++)
+			handle_event(&events[i]);
+
+		now = monotonic_ns();
+		if (now - lastsec >= 1000000000ll) {
+			if (established - lastest > peakconnrate)
+				peakconnrate = established - lastest;
+			LOGNOTICE("%ds: %d connected  %d mining  %"PRId64" submitted  %"PRId64
+				  " answered  %"PRId64" failed", (int)((now - start) / 1000000000),
+				  connected, mining, submitted, accepted + rejected, connfails);
+			lastest = established;
+			lastsec = now;
+		}
+	}
+	finish_fanout();
+	for (i = 0; i < noclients; i++)
+		close_client(&clients[i]);
+
+	report((double)(now - start) / 1000000000);
+	freeaddrinfo(serveraddr);
+	return 0;
+}
@@ -0,0 +1,559 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Microbenchmarks of the hashing, merkle and codec kernels on the share and
+ * workbase hot paths, run over inputs shaped like mainnet work. The merkle
+ * and share header kernels are the libckpool ones the stratifier's
+ * share_diff, submission_header and wb_merkle_bin_txns use. */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "sha2.h"
+
+static int msg_loglevel = LOG_WARNING;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= msg_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+static struct option long_options[] = {
+	{"filter",	required_argument,	0,	'f'},
+	{"help",	no_argument,		0,	'h'},
+	{"json",	no_argument,		0,	'j'},
+	{"loglevel",	required_argument,	0,	'l'},
+	{"repeat",	required_argument,	0,	'n'},
+	{"txns",	required_argument,	0,	'T'},
+	{"time",	required_argument,	0,	't'},
+	{0, 0, 0, 0}
+};
+
+/* Stops the compiler discarding the work being measured */
+static volatile uint64_t sink;
+
+static uint64_t prng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t prng(void)
+{
+	prng_state ^= prng_state << 13;
+	prng_state ^= prng_state >> 7;
+	prng_state ^= prng_state << 17;
+	return prng_state;
+}
+
+static void prng_fill(uchar *buf, const int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = prng();
+}
+
+/* Inputs sized like a mainnet template: 4 byte enonce1, 8 byte nonce2, a
+ * coinbase with witness commitment and a few thousand transactions */
+#define ENONCE1LEN 4
+#define ENONCE2LEN 8
+#define COINB1LEN 105
+#define COINB2LEN 140
+#define MAXMERKLES 20
+
+static int notxns = 3000;
+
+static uchar header[80];
+static uchar hash32[32];
+static char hash32hex[65];
+static char nonce2hex[ENONCE2LEN * 2 + 1];
+static const char *noncehex = "1a2b3c4d";
+
+static uchar coinb1bin[COINB1LEN];
+static uchar coinb2bin[COINB2LEN];
+static uchar enonce1bin[ENONCE1LEN];
+static uint32_t coinb1mid[8];
+static int coinb1midlen;
+static uchar coinbase[COINB1LEN + ENONCE1LEN + ENONCE2LEN + COINB2LEN];
+static const int cblen = sizeof(coinbase);
+static char coinbasehex[sizeof(coinbase) * 2 + 1];
+
+static uchar *txids;
+static uchar *hashbin;
+static uchar merklebin[MAXMERKLES][32];
+static char merklehash[MAXMERKLES][68];
+static int merkles;
+
+static const char *p2pkh = "1BvBMSEYstWetqTFn5Au4m4GFg7xJaNVN2";
+static const char *p2sh = "3J98t1WpEZ73CNmQviecrnyiWrnqRhWNLy";
+static const char *bech32 = "bc1qar0srrr7xfkvy5l643lydnw9re59gtzzwf5mdq";
+
+static void bench_sha256_80(const int64_t iters)
+{
+	uchar hash[32];
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		header[0] = i;
+		sha256(header, 80, hash);
+		sink += hash[0];
+	}
+}
+
+static void bench_sha256d_80(const int64_t iters)
+{
+	uchar hash1[32], hash[32];
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		header[0] = i;
+		sha256(header, 80, hash1);
+		sha256(hash1, 32, hash);
+		sink += hash[0];
+	}
+}
+
+/* Iterations count headers, hashed as many lanes at a time as the kernel takes */
+static void bench_sha256d_80_multi(const int64_t iters)
+{
+	const uchar *data[SHA256_MAX_LANES];
+	uchar *digest[SHA256_MAX_LANES];
+	uchar headers[SHA256_MAX_LANES][80];
+	uchar hashes[SHA256_MAX_LANES][32];
+	int lanes = sha256_multi_lanes(), j;
+	int64_t i;
+
+	if (lanes < 1 || lanes > SHA256_MAX_LANES)
+		lanes = SHA256_MAX_LANES;
+	for (j = 0; j < lanes; j++) {
+		memcpy(headers[j], header, 80);
+		headers[j][76] = j;
+		data[j] = headers[j];
+		digest[j] = hashes[j];
+	}
+	for (i = 0; i < iters; i += lanes) {
+		int count = iters - i < lanes ? iters - i : lanes;
+
+		headers[0][0] = i;
+		sha256d_80_multi(data, digest, count);
+		sink += hashes[0][0];
+	}
+}
+
+static void bench_gen_hash_64(const int64_t iters)
+{
+	uchar data[64], hash[32];
+	int64_t i;
+
+	memcpy(data, hash32, 32);
+	memcpy(data + 32, hash32, 32);
+	for (i = 0; i < iters; i++) {
+		data[0] = i;
+		gen_hash(data, hash, 64);
+		sink += hash[0];
+	}
+}
+
+static void bench_gen_hash_coinbase(const int64_t iters)
+{
+	uchar hash[32];
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		coinbase[COINB1LEN] = i;
+		gen_hash(coinbase, hash, cblen);
+		sink += hash[0];
+	}
+}
+
+/* Double hash of the coinbase resumed from the coinb1 midstate */
+static void bench_coinbase_midstate(const int64_t iters)
+{
+	uchar hash1[32], hash[32];
+	sha256_ctx ctx;
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		coinbase[COINB1LEN] = i;
+		sha256_resume(&ctx, coinb1mid, coinb1midlen);
+		sha256_update(&ctx, coinbase + coinb1midlen, cblen - coinb1midlen);
+		sha256_final(&ctx, hash1);
+		sha256(hash1, 32, hash);
+		sink += hash[0];
+	}
+}
+
+/* One iteration distills a whole template into its merkle branches as
+ * wb_merkle_bin_txns does */
+static void bench_merkle_branches(const int64_t iters)
+{
+	int64_t n;
+	int i;
+
+	for (n = 0; n < iters; n++) {
+		memset(hashbin, 0, 32);
+		for (i = 0; i < notxns; i++)
+			bswap_256(hashbin + 32 + 32 * i, txids + 32 * i);
+		merkles = merkle_branches(hashbin, notxns, &merklebin[0][0]);
+		for (i = 0; i < merkles; i++)
+			__bin2hex(&merklehash[i][0], &merklebin[i][0], 32);
+		sink += merklehash[0][0];
+	}
+}
+
+/* The full per share kernel sequence of share_diff */
+static void bench_share_diff(const int64_t iters)
+{
+	uchar cbhash[32], root[32], hash[32], swap[80];
+	sha256_ctx ctx;
+	uchar hash1[32];
+	int64_t n;
+	int len;
+
+	for (n = 0; n < iters; n++) {
+		memcpy(coinbase, coinb1bin, COINB1LEN);
+		len = COINB1LEN;
+		memcpy(coinbase + len, enonce1bin, ENONCE1LEN);
+		len += ENONCE1LEN;
+		hex2bin(coinbase + len, nonce2hex, ENONCE2LEN);
+		coinbase[len] = n;
+		len += ENONCE2LEN;
+		memcpy(coinbase + len, coinb2bin, COINB2LEN);
+		len += COINB2LEN;
+
+		sha256_resume(&ctx, coinb1mid, coinb1midlen);
+		sha256_update(&ctx, coinbase + coinb1midlen, len - coinb1midlen);
+		sha256_final(&ctx, hash1);
+		sha256(hash1, 32, cbhash);
+		merkle_root(root, cbhash, &merklebin[0][0], merkles);
+		share_header(swap, header, root, 0, noncehex, be32toh(*(uint32_t *)(header + 68)));
+		gen_hash(swap, hash, 80);
+		sink += diff_from_target(hash);
+	}
+}
+
+/* What submission_diff costs once the header is hashed */
+static void bench_diff_from_target(const int64_t iters)
+{
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		hash32[0] = i;
+		sink += diff_from_target(hash32);
+	}
+}
+
+static void bench_le256todouble(const int64_t iters)
+{
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		hash32[0] = i;
+		sink += le256todouble(hash32);
+	}
+}
+
+static void bench_hex2bin_32(const int64_t iters)
+{
+	uchar bin[32];
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		hex2bin(bin, hash32hex, 32);
+		sink += bin[0];
+	}
+}
+
+static void bench_hex2bin_nonce2(const int64_t iters)
+{
+	uchar bin[ENONCE2LEN];
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		hex2bin(bin, nonce2hex, ENONCE2LEN);
+		sink += bin[0];
+	}
+}
+
+static void bench_validhex_32(const int64_t iters)
+{
+	int64_t i;
+
+	for (i = 0; i < iters; i++)
+		sink += validhex(hash32hex);
+}
+
+static void bench_bin2hex_32(const int64_t iters)
+{
+	char hex[65];
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		hash32[0] = i;
+		__bin2hex(hex, hash32, 32);
+		sink += hex[0];
+	}
+}
+
+static void bench_bin2hex_coinbase(const int64_t iters)
+{
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		coinbase[0] = i;
+		__bin2hex(coinbasehex, coinbase, cblen);
+		sink += coinbasehex[0];
+	}
+}
+
+static void bench_b58tobin(const int64_t iters)
+{
+	char bin[25];
+	int64_t i;
+
+	for (i = 0; i < iters; i++) {
+		b58tobin(bin, p2pkh);
+		sink += bin[0];
+	}
+}
+
+static void bench_address_p2pkh(const int64_t iters)
+{
+	char txn[64];
+	int64_t i;
+
+	for (i = 0; i < iters; i++)
+		sink += address_to_txn(txn, p2pkh, false, false);
+}
+
+static void bench_address_p2sh(const int64_t iters)
+{
+	char txn[64];
+	int64_t i;
+
+	for (i = 0; i < iters; i++)
+		sink += address_to_txn(txn, p2sh, true, false);
+}
+
+static void bench_address_bech32(const int64_t iters)
+{
+	char txn[64];
+	int64_t i;
+
+	for (i = 0; i < iters; i++)
+		sink += address_to_txn(txn, bech32, false, true);
+}
+
+typedef struct microbench {
+	const char *name;
+	void (*func)(const int64_t iters);
+	/* Input bytes per op for throughput, 0 to report ops only */
+	int bytes;
+} microbench_t;
+
+static microbench_t benches[] = {
+	{"sha256_80",		bench_sha256_80,		80},
+	{"sha256d_80",		bench_sha256d_80,		80},
+	{"sha256d_80_multi",	bench_sha256d_80_multi,		80},
+	{"gen_hash_64",		bench_gen_hash_64,		64},
+	{"gen_hash_coinbase",	bench_gen_hash_coinbase,	sizeof(coinbase)},
+	{"coinbase_midstate",	bench_coinbase_midstate,	sizeof(coinbase)},
+	{"merkle_branches",	bench_merkle_branches,		0},
+	{"share_diff",		bench_share_diff,		0},
+	{"diff_from_target",	bench_diff_from_target,		32},
+	{"le256todouble",	bench_le256todouble,		32},
+	{"hex2bin_32",		bench_hex2bin_32,		64},
+	{"hex2bin_nonce2",	bench_hex2bin_nonce2,		ENONCE2LEN * 2},
+	{"validhex_32",		bench_validhex_32,		64},
+	{"bin2hex_32",		bench_bin2hex_32,		32},
+	{"bin2hex_coinbase",	bench_bin2hex_coinbase,		sizeof(coinbase)},
+	{"b58tobin",		bench_b58tobin,			34},
+	{"address_p2pkh",	bench_address_p2pkh,		34},
+	{"address_p2sh",	bench_address_p2sh,		34},
+	{"address_bech32",	bench_address_bech32,		42},
+	{NULL, NULL, 0}
+};
+
+static void init_inputs(void)
+{
+	sha256_ctx ctx;
+
+	prng_fill(header, 80);
+	prng_fill(hash32, 32);
+	__bin2hex(hash32hex, hash32, 32);
+	/* A share hash has its leading bytes zeroed by the work done */
+	memset(hash32 + 26, 0, 6);
+	sprintf(nonce2hex, "%016"PRIx64, prng());
+
+	prng_fill(coinb1bin, COINB1LEN);
+	prng_fill(coinb2bin, COINB2LEN);
+	prng_fill(enonce1bin, ENONCE1LEN);
+	memcpy(coinbase, coinb1bin, COINB1LEN);
+	memcpy(coinbase + COINB1LEN, enonce1bin, ENONCE1LEN);
+	hex2bin(coinbase + COINB1LEN + ENONCE1LEN, nonce2hex, ENONCE2LEN);
+	memcpy(coinbase + COINB1LEN + ENONCE1LEN + ENONCE2LEN, coinb2bin, COINB2LEN);
+
+	coinb1midlen = COINB1LEN & ~(SHA256_BLOCK_SIZE - 1);
+	sha256_init(&ctx);
+	sha256_update(&ctx, coinb1bin, coinb1midlen);
+	memcpy(coinb1mid, ctx.h, sizeof(coinb1mid));
+
+	txids = ckalloc(notxns * 32);
+	prng_fill(txids, notxns * 32);
+	hashbin = ckalloc(notxns * 32 + 64);
+	/* Leaves merkles filled in for share_diff */
+	bench_merkle_branches(1);
+}
+
+/* Time one run of iters, returning nanoseconds per op */
+static double time_bench(const microbench_t *bench, const int64_t iters)
+{
+	int64_t start = monotonic_ns();
+
+	bench->func(iters);
+	return (double)(monotonic_ns() - start) / iters;
+}
+
+static void run_bench(const microbench_t *bench, const int64_t runns, const int repeat,
+		      const bool json)
+{
+	double nsop, best = 0, total = 0;
+	int64_t iters = 1;
+	int i;
+
+	/* Calibrate to a run long enough to time accurately */
+	while (42) {
+		nsop = time_bench(bench, iters);
+		if (nsop * iters >= runns / 10 || iters >= (1ll << 40))
+			break;
+		iters *= 2;
+	}
+	iters = runns / nsop;
+	if (iters < 1)
+		iters = 1;
+
+	for (i = 0; i < repeat; i++) {
+		nsop = time_bench(bench, iters);
+		if (!i || nsop < best)
+			best = nsop;
+		total += nsop;
+	}
+
+	if (json) {
+		json_t *val;
+		char *s;
+
+		JSON_CPACK(val, "{ss,sI,si,sf,sf,sf}", "name", bench->name, "iters", iters,
+			   "repeat", repeat, "ns_per_op", best, "mean_ns_per_op", total / repeat,
+			   "ops_per_sec", 1000000000 / best);
+		if (bench->bytes)
+			json_set_double(val, "mb_per_sec", bench->bytes * 1000 / best);
+		s = json_dumps(val, JSON_COMPACT | JSON_EOL);
+		fputs(s, stdout);
+		free(s);
+		json_decref(val);
+	} else if (bench->bytes) {
+		printf("%-20s %12.1f ns/op %14.0f ops/s %10.1f MB/s\n", bench->name, best,
+		       1000000000 / best, bench->bytes * 1000 / best);
+	} else {
+		printf("%-20s %12.1f ns/op %14.0f ops/s\n", bench->name, best, 1000000000 / best);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, j, repeat = 3, runms = 200;
+	char *filter = NULL;
+	bool json = false;
+
+	while ((c = getopt_long(argc, argv, "f:hjl:n:T:t:", long_options, &i)) != -1) {
+		switch(c) {
+			case 'f':
+				filter = optarg;
+				break;
+			case 'h':
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					if (jopt->has_arg) {
+						char *upper = alloca(strlen(jopt->name) + 1);
+						int offset = 0;
+
+						do {
+							upper[offset] = toupper(jopt->name[offset]);
+						} while (upper[offset++] != '\0');
+						printf("-%c %s | --%s %s\n", jopt->val,
+						       upper, jopt->name, upper);
+					} else
+						printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'j':
+				json = true;
+				break;
+			case 'l':
+				msg_loglevel = atoi(optarg);
+				break;
+			case 'n':
+				repeat = atoi(optarg);
+				if (repeat < 1)
+					quit(1, "Invalid repeat count: %d", repeat);
+				break;
+			case 'T':
+				notxns = atoi(optarg);
+				if (notxns < 1 || notxns >= (1 << MAXMERKLES) - 1)
+					quit(1, "Invalid number of transactions: %d", notxns);
+				break;
+			case 't':
+				runms = atoi(optarg);
+				if (runms < 1)
+					quit(1, "Invalid run time: %d", runms);
+				break;
+		}
+	}
+
+	init_inputs();
+
+	if (json) {
+		json_t *val;
+		char *s;
+
+		JSON_CPACK(val, "{ss,ss,si,si,si}", "sha256_multi", sha256_multi_kernel(),
+			   "hex", hex_kernel(), "lanes", sha256_multi_lanes(),
+			   "txns", notxns, "merkles", merkles);
+		s = json_dumps(val, JSON_COMPACT | JSON_EOL);
+		fputs(s, stdout);
+		free(s);
+		json_decref(val);
+	} else {
+		printf("sha256 multi kernel %s with %d lanes, hex kernel %s, %d txns in %d merkles\n",
+		       sha256_multi_kernel(), sha256_multi_lanes(), hex_kernel(), notxns, merkles);
+	}
+
+	for (i = 0; benches[i].name; i++) {
+		if (filter && !strstr(benches[i].name, filter))
+			continue;
+		run_bench(&benches[i], (int64_t)runms * 1000000, repeat, json);
+	}
+	return 0;
+}
@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <ctype.h>
+#include <endian.h>
 #include <fenv.h>
 #include <getopt.h>
 #include <grp.h>
@@ -33,6 +34,7 @@
 #include "connector.h"
 
 ckpool_t *global_ckp;
+ckslab_t *ckmsg_slab;
 
 static bool open_logfile(ckpool_t *ckp)
 {
@@ -145,7 +147,183 @@ out:
 	free(buf);
 }
 
-/* Generic function for creating a message queue receiving and parsing thread */
+/* Log2 histogram bucket for val, 0 being for val < 1 */
+static inline int ckring_bucket(const int64_t val)
+{
+	int bucket;
+
+	if (val < 1)
+		return 0;
+	bucket = 64 - __builtin_clzll(val);
+	if (bucket >= CKRING_BUCKETS)
+		bucket = CKRING_BUCKETS - 1;
+	return bucket;
+}
+
+static ckring_t *create_ckring(void)
+{
+	ckring_t *ring;
+	int64_t i;
+
+	if (posix_memalign((void **)&ring, 64, sizeof(ckring_t)))
+		quit(1, "Failed to posix_memalign ckring in create_ckring");
+	memset(ring, 0, sizeof(ckring_t));
+	ring->cells = ckalloc(sizeof(ckring_cell_t) * CKRING_SIZE);
+	ring->mask = CKRING_SIZE - 1;
+	for (i = 0; i < CKRING_SIZE; i++)
+		ring->cells[i].seq = i;
+	mutex_init(&ring->lock);
+	cond_init(&ring->cond);
+	return ring;
+}
+
+/* Each cell's seq tells producers and consumers whose turn it is to use it, so
+ * claiming a position is the only contended operation. Returns false if the
+ * ring is full. */
+static bool ckring_push(ckring_t *ring, void *data)
+{
+	int64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	ckring_cell_t *cell;
+
+	while (42) {
+		int64_t dif;
+
+		cell = &ring->cells[pos & ring->mask];
+		dif = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos;
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+							__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+	cell->data = data;
+	cell->stamp = monotonic_ns();
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the consumer incrementing waiters before checking the
+	 * ring is empty so one of us will always see the other. */
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST)) {
+		mutex_lock(&ring->lock);
+		pthread_cond_signal(&ring->cond);
+		mutex_unlock(&ring->lock);
+	}
+	return true;
+}
+
+/* Take up to max messages off the ring, returning how many */
+static int ckring_pop(ckring_t *ring, void **data, const int max)
+{
+	int64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED), now = 0;
+	int count = 0;
+
+	while (count < max) {
+		ckring_cell_t *cell = &ring->cells[pos & ring->mask];
+		int64_t dif, depth;
+
+		dif = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1);
+		if (dif < 0)
+			break;
+		if (dif > 0) {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true,
+						 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			continue;
+		data[count++] = cell->data;
+		if (!now)
+			now = monotonic_ns();
+		__atomic_fetch_add(&ring->latency[ckring_bucket((now - cell->stamp) / 1000)], 1,
+				   __ATOMIC_RELAXED);
+		depth = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) - pos;
+		__atomic_fetch_add(&ring->depth[ckring_bucket(depth)], 1, __ATOMIC_RELAXED);
+		if (unlikely(depth > ring->maxdepth))
+			ring->maxdepth = depth;
+		__atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+		pos++;
+	}
+	return count;
+}
+
+static bool ckring_empty(ckring_t *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) ==
+		__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+}
+
+/* Sleep for up to a second if the ring is empty */
+static void ckring_wait(ckring_t *ring)
+{
+	tv_t now;
+	ts_t abs;
+
+	mutex_lock(&ring->lock);
+	__atomic_fetch_add(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	if (ckring_empty(ring)) {
+		tv_time(&now);
+		tv_to_ts(&abs, &now);
+		abs.tv_sec++;
+		cond_timedwait(&ring->cond, &ring->lock, &abs);
+	}
+	__atomic_fetch_sub(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	mutex_unlock(&ring->lock);
+}
+
+/* Ring consumed by this thread if it is a ring backed queue thread. A thread
+ * waiting for room on its own ring would never make any. */
+static __thread ckring_t *consumer_ring;
+
+/* Generic function for creating a message queue receiving and parsing thread
+ * for ring backed queues, passing messages one at a time to func or in
+ * batches to bfunc. */
+static void *ckmsg_ring_queue(void *arg)
+{
+	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
+	const int batch = ckmsgq->batch ? : 1;
+	ckring_t *ring = ckmsgq->ring;
+	ckpool_t *ckp = ckmsgq->ckp;
+	void *data[batch];
+
+	pthread_detach(pthread_self());
+	rename_proc(ckmsgq->name);
+	consumer_ring = ring;
+	if (ckmsgq->cpu >= 0) {
+		cpu_set_t cpuset;
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(ckmsgq->cpu, &cpuset);
+		if (unlikely(pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)))
+			LOGWARNING("Failed to pin %s to CPU %d", ckmsgq->name, ckmsgq->cpu);
+		else
+			LOGDEBUG("Pinned %s to CPU %d", ckmsgq->name, ckmsgq->cpu);
+	}
+	ckmsgq->active = true;
+
+	while (42) {
+		int i, count;
+
+		count = ckring_pop(ring, data, batch);
+		if (!count) {
+			ckring_wait(ring);
+			if (ckmsgq->idle && ckring_empty(ring))
+				ckmsgq->bfunc(ckp, data, 0);
+			continue;
+		}
+		if (ckmsgq->bfunc)
+			ckmsgq->bfunc(ckp, data, count);
+		else {
+			for (i = 0; i < count; i++)
+				ckmsgq->func(ckp, data[i]);
+		}
+	}
+	return NULL;
+}
+
+/* Generic function for creating a message queue receiving and parsing thread
+ * for list backed queues */
 static void *ckmsg_queue(void *arg)
 {
 	ckmsgq_t *ckmsgq = (ckmsgq_t *)arg;
@@ -174,28 +352,133 @@ static void *ckmsg_queue(void *arg)
 		if (!msg)
 			continue;
 		ckmsgq->func(ckp, msg->data);
-		free(msg);
+		ckslab_free(ckmsg_slab, msg);
 	}
 	return NULL;
 }
 
-ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
+/* Queues registered for the metrics endpoint. Slots are reserved atomically
+ * and only read once their ckmsgq is stored, so scrapes take no lock. Queues
+ * created beyond METRIC_QUEUES are not reported. */
+#define METRIC_QUEUES 64
+
+struct metric_queue {
+	const char *name;
+	ckmsgq_t *ckmsgq;
+};
+
+static struct metric_queue metric_queues[METRIC_QUEUES];
+static int metric_nqueues;
+
+static void register_ckmsgq(const char *name, ckmsgq_t *ckmsgq)
+{
+	int slot = __atomic_fetch_add(&metric_nqueues, 1, __ATOMIC_RELAXED);
+
+	if (unlikely(slot >= METRIC_QUEUES))
+		return;
+	metric_queues[slot].name = name;
+	__atomic_store_n(&metric_queues[slot].ckmsgq, ckmsgq, __ATOMIC_RELEASE);
+}
+
+/* The CPU to pin thread number i of an affine queue to, taken in turn from
+ * those we are allowed to run on. Same numbered threads of queues fed by the
+ * same keys, such as the sreceivers and sprocessors, share a CPU and its
+ * caches. Returns -1 if the affinity mask can't be read. */
+static int affine_cpu(const int i)
+{
+	int cpu, n, allowed;
+	cpu_set_t cpuset;
+
+	if (unlikely(sched_getaffinity(0, sizeof(cpuset), &cpuset)))
+		return -1;
+	allowed = CPU_COUNT(&cpuset);
+	if (unlikely(!allowed))
+		return -1;
+	n = i % allowed;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &cpuset) && !n--)
+			return cpu;
+	}
+	return -1;
+}
+
+/* Message queues are backed by a ring shared by all count threads, or one
+ * ring per thread when affine, with batched queues handing up to batch
+ * messages at once to func. Threads are numbered in their names unless
+ * created as a single queue. */
+static ckmsgq_t *__create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func,
+				  const int count, const int batch, const bool numbered,
+				  const bool affine, const bool idle)
 {
-	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
+	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
+	ckring_t *ring = create_ckring();
+	int i;
 
-	strncpy(ckmsgq->name, name, 15);
-	ckmsgq->func = func;
-	ckmsgq->ckp = ckp;
-	ckmsgq->lock = ckalloc(sizeof(mutex_t));
-	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(ckmsgq->lock);
-	cond_init(ckmsgq->cond);
-	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
+	for (i = 0; i < count; i++) {
+		if (affine && i)
+			ring = create_ckring();
+		ckmsgq[i].count = count;
+		ckmsgq[i].affine = affine;
+		if (affine && ckp->pincpus)
+			ckmsgq[i].cpu = affine_cpu(i);
+		else
+			ckmsgq[i].cpu = -1;
+		if (numbered)
+			snprintf(ckmsgq[i].name, 15, "%.6s%x", name, i);
+		else
+			strncpy(ckmsgq[i].name, name, 15);
+		if (batch)
+			ckmsgq[i].bfunc = func;
+		else
+			ckmsgq[i].func = func;
+		ckmsgq[i].batch = batch;
+		ckmsgq[i].idle = idle;
+		ckmsgq[i].ckp = ckp;
+		ckmsgq[i].ring = ring;
+		create_pthread(&ckmsgq[i].pth, ckmsg_ring_queue, &ckmsgq[i]);
+	}
+	register_ckmsgq(name, ckmsgq);
 
 	return ckmsgq;
 }
 
+ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
+{
+	return __create_ckmsgqs(ckp, name, func, 1, 0, false, false, false);
+}
+
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
+{
+	return __create_ckmsgqs(ckp, name, func, count, 0, true, false, false);
+}
+
+ckmsgq_t *create_ckmsgqs_batch(ckpool_t *ckp, const char *name, const void *func, const int count,
+			       const int batch)
+{
+	return __create_ckmsgqs(ckp, name, func, count, batch, true, false, false);
+}
+
+/* As create_ckmsgqs_batch but with func also called with a count of 0 after
+ * any second the queue was idle, for consumers with timed work to do such as
+ * flushing buffers. */
+ckmsgq_t *create_ckmsgqs_timed(ckpool_t *ckp, const char *name, const void *func, const int count,
+			       const int batch)
+{
+	return __create_ckmsgqs(ckp, name, func, count, batch, true, false, true);
+}
+
+/* As create_ckmsgqs_batch, or create_ckmsgqs when batch is 0, but with each
+ * thread having its own ring so messages added with ckmsgq_add_affine always
+ * go to the same thread for the same key. */
+ckmsgq_t *create_ckmsgqs_affine(ckpool_t *ckp, const char *name, const void *func, const int count,
+				const int batch)
+{
+	return __create_ckmsgqs(ckp, name, func, count, batch, true, true, false);
+}
+
+/* For queues that need their msgs list manipulated directly under lock, such
+ * as for bulk appending or prepending of messages */
+ckmsgq_t *create_ckmsgqs_list(ckpool_t *ckp, const char *name, const void *func, const int count)
 {
 	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
 	mutex_t *lock;
@@ -215,13 +498,18 @@ ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, cons
 		ckmsgq[i].cond = cond;
 		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
 	}
+	register_ckmsgq(name, ckmsgq);
 
 	return ckmsgq;
 }
 
-/* Generic function for adding messages to a ckmsgq linked list and signal the
- * ckmsgq parsing thread(s) to wake up and process it. */
-bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
+/* Generic function for adding messages to a ckmsgq and signal the ckmsgq
+ * parsing thread(s) to wake up and process it. Adding to a full ring waits
+ * for room unless wait is false or the ring is the caller's own, in which case
+ * the message is counted as dropped and false returned with data still owned
+ * by the caller. */
+static bool __ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const bool wait, const char *file,
+			 const char *func, const int line)
 {
 	ckmsg_t *msg;
 
@@ -235,7 +523,19 @@ bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *fun
 	while (unlikely(!ckmsgq->active))
 		cksleep_ms(10);
 
-	msg = ckalloc(sizeof(ckmsg_t));
+	if (ckmsgq->ring) {
+		while (unlikely(!ckring_push(ckmsgq->ring, data))) {
+			if (!wait || ckmsgq->ring == consumer_ring) {
+				__atomic_fetch_add(&ckmsgq->dropped, 1, __ATOMIC_RELAXED);
+				return false;
+			}
+			cksleep_us(100);
+		}
+		__atomic_fetch_add(&ckmsgq->messages, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	msg = ckslab_alloc(ckmsg_slab);
 	msg->data = data;
 
 	mutex_lock(ckmsgq->lock);
@@ -247,7 +547,33 @@ bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *fun
 	return true;
 }
 
-/* Return whether there are any messages queued in the ckmsgq linked list. */
+bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
+{
+	return __ckmsgq_add(ckmsgq, data, true, file, func, line);
+}
+
+/* For producers that must never wait, such as on hot paths feeding queues
+ * that may fall behind. Returns false if data was not queued. */
+bool _ckmsgq_tryadd(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
+{
+	return __ckmsgq_add(ckmsgq, data, false, file, func, line);
+}
+
+/* Add a message to the queue thread selected by key on affine queues, and as
+ * per ckmsgq_add on any other queue. */
+bool _ckmsgq_add_affine(ckmsgq_t *ckmsgq, void *data, const int64_t key, const char *file,
+			const char *func, const int line)
+{
+	if (ckmsgq && ckmsgq->affine) {
+		/* Fold in the high bits that distinguish subclients */
+		uint64_t hash = (uint64_t)key ^ ((uint64_t)key >> 32);
+
+		ckmsgq = &ckmsgq[hash % ckmsgq->count];
+	}
+	return _ckmsgq_add(ckmsgq, data, file, func, line);
+}
+
+/* Return whether there are any messages queued in the ckmsgq. */
 bool ckmsgq_empty(ckmsgq_t *ckmsgq)
 {
 	bool ret = true;
@@ -255,6 +581,10 @@ bool ckmsgq_empty(ckmsgq_t *ckmsgq)
 	if (unlikely(!ckmsgq || !ckmsgq->active))
 		goto out;
 
+	if (ckmsgq->ring) {
+		ret = ckring_empty(ckmsgq->ring);
+		goto out;
+	}
 	mutex_lock(ckmsgq->lock);
 	if (ckmsgq->msgs)
 		ret = (ckmsgq->msgs->next == ckmsgq->msgs->prev);
@@ -263,6 +593,263 @@ out:
 	return ret;
 }
 
+/* Create a shared message taking ownership of buf, holding one reference for
+ * the creator. Further references may be added without locking until it is
+ * handed out. */
+ckshared_t *create_ckshared(char *buf)
+{
+	ckshared_t *shared = ckalloc(sizeof(ckshared_t));
+
+	shared->buf = buf;
+	shared->len = strlen(buf);
+	shared->refs = 1;
+	mutex_init(&shared->lock);
+	return shared;
+}
+
+/* Add a reference to a shared message that may already be handed out */
+void get_ckshared(ckshared_t *shared)
+{
+	mutex_lock(&shared->lock);
+	shared->refs++;
+	mutex_unlock(&shared->lock);
+}
+
+/* Drop a reference to a shared message, freeing it with the last one */
+void put_ckshared(ckshared_t *shared)
+{
+	int refs;
+
+	mutex_lock(&shared->lock);
+	refs = --shared->refs;
+	mutex_unlock(&shared->lock);
+
+	if (refs)
+		return;
+	mutex_destroy(&shared->lock);
+	free(shared->buf);
+	free(shared);
+}
+
+static const char *share_stages[SHARE_STAGES] = {
+	"read", "srecv", "sshareq", "hash", "diff", "add", "ssend", "csend", "total"
+};
+
+/* Each thread's share stage histograms, on a list to be merged when read.
+ * Histograms older than the last reset are skipped until their thread clears
+ * them on its next add. */
+struct latthread {
+	cklatency_t stages[SHARE_STAGES];
+	struct latthread *prev;
+	struct latthread *next;
+	int resets;
+	bool registered;
+};
+
+static __thread struct latthread latthread;
+static struct latthread *latthreads;
+static cklatency_t latretired[SHARE_STAGES]; /* Of threads that have exited */
+static int latresets;
+static mutex_t latthreads_lock;
+static pthread_key_t latthread_key;
+static pthread_once_t latthread_once = PTHREAD_ONCE_INIT;
+
+static inline int cklatency_bucket(const int64_t ns)
+{
+	int msb, bucket;
+
+	if (ns < CKLAT_SUBS)
+		return ns < 0 ? 0 : ns;
+	msb = 63 - __builtin_clzll(ns);
+	bucket = (msb - CKLAT_SUBBITS + 1) * CKLAT_SUBS + ((ns >> (msb - CKLAT_SUBBITS)) & (CKLAT_SUBS - 1));
+	if (bucket >= CKLAT_BUCKETS)
+		bucket = CKLAT_BUCKETS - 1;
+	return bucket;
+}
+
+/* Upper bound in ns of values counted in bucket */
+static int64_t cklatency_bound(const int bucket)
+{
+	int octave = bucket / CKLAT_SUBS, sub = bucket % CKLAT_SUBS;
+
+	if (!octave)
+		return sub + 1;
+	return (int64_t)(CKLAT_SUBS + sub + 1) << (octave - 1);
+}
+
+/* Only ever added to by its own thread so no read-modify-write is needed,
+ * the stores being atomic for the readers merging it */
+static void cklatency_add(cklatency_t *lat, const int64_t ns)
+{
+	int bucket = cklatency_bucket(ns);
+
+	__atomic_store_n(&lat->buckets[bucket], lat->buckets[bucket] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&lat->count, lat->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&lat->sum, lat->sum + ns, __ATOMIC_RELAXED);
+	if (unlikely(ns > lat->max))
+		__atomic_store_n(&lat->max, ns, __ATOMIC_RELAXED);
+}
+
+static void cklatency_clear(cklatency_t *lat)
+{
+	int i;
+
+	for (i = 0; i < CKLAT_BUCKETS; i++)
+		__atomic_store_n(&lat->buckets[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&lat->count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&lat->sum, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&lat->max, 0, __ATOMIC_RELAXED);
+}
+
+static void cklatency_merge(cklatency_t *to, const cklatency_t *from)
+{
+	int64_t max;
+	int i;
+
+	for (i = 0; i < CKLAT_BUCKETS; i++)
+		to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+	to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	if (max > to->max)
+		to->max = max;
+}
+
+/* Keep the histograms of an exiting thread if they're still current */
+static void latthread_destroy(void *arg)
+{
+	struct latthread *thread = arg;
+	int i;
+
+	mutex_lock(&latthreads_lock);
+	DL_DELETE(latthreads, thread);
+	if (thread->resets == latresets) {
+		for (i = 0; i < SHARE_STAGES; i++)
+			cklatency_merge(&latretired[i], &thread->stages[i]);
+	}
+	mutex_unlock(&latthreads_lock);
+}
+
+static void latthread_init(void)
+{
+	mutex_init(&latthreads_lock);
+	pthread_key_create(&latthread_key, latthread_destroy);
+}
+
+static void latthread_register(void)
+{
+	pthread_once(&latthread_once, latthread_init);
+	mutex_lock(&latthreads_lock);
+	latthread.resets = latresets;
+	DL_APPEND(latthreads, &latthread);
+	mutex_unlock(&latthreads_lock);
+	pthread_setspecific(latthread_key, &latthread);
+	latthread.registered = true;
+}
+
+void share_latency_add(const enum share_stage stage, const int64_t ns)
+{
+	int resets;
+
+	if (unlikely(!latthread.registered))
+		latthread_register();
+	resets = __atomic_load_n(&latresets, __ATOMIC_ACQUIRE);
+	if (unlikely(latthread.resets != resets)) {
+		int i;
+
+		for (i = 0; i < SHARE_STAGES; i++)
+			cklatency_clear(&latthread.stages[i]);
+		__atomic_store_n(&latthread.resets, resets, __ATOMIC_RELEASE);
+	}
+	cklatency_add(&latthread.stages[stage], ns);
+}
+
+/* Merge every thread's current histograms into stages */
+static void share_latency_merge(cklatency_t *stages)
+{
+	struct latthread *thread;
+	int i;
+
+	memset(stages, 0, sizeof(cklatency_t) * SHARE_STAGES);
+	pthread_once(&latthread_once, latthread_init);
+	mutex_lock(&latthreads_lock);
+	for (i = 0; i < SHARE_STAGES; i++)
+		cklatency_merge(&stages[i], &latretired[i]);
+	DL_FOREACH(latthreads, thread) {
+		if (__atomic_load_n(&thread->resets, __ATOMIC_ACQUIRE) != latresets)
+			continue;
+		for (i = 0; i < SHARE_STAGES; i++)
+			cklatency_merge(&stages[i], &thread->stages[i]);
+	}
+	mutex_unlock(&latthreads_lock);
+}
+
+/* Percentiles in microseconds of a merged histogram */
+static json_t *cklatency_stats(const cklatency_t *lat)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+	static const char *names[] = { "p50_us", "p90_us", "p99_us", "p999_us" };
+	int64_t count = 0, seen = 0;
+	json_t *val;
+	int i, p;
+
+	for (i = 0; i < CKLAT_BUCKETS; i++)
+		count += lat->buckets[i];
+	JSON_CPACK(val, "{sI,sf,sf}", "count", count, "mean_us", count ? (double)lat->sum / count / 1000 : 0,
+		   "max_us", (double)lat->max / 1000);
+	for (i = 0, p = 0; p < 4; p++) {
+		int64_t target = count * pcts[p] / 100;
+
+		while (i < CKLAT_BUCKETS - 1 && seen + lat->buckets[i] <= target)
+			seen += lat->buckets[i++];
+		json_set_double(val, names[p], count ? (double)cklatency_bound(i) / 1000 : 0);
+	}
+	return val;
+}
+
+char *share_latency_stats(void)
+{
+	cklatency_t stages[SHARE_STAGES];
+	json_t *val = json_object();
+	char *buf;
+	int i;
+
+	share_latency_merge(stages);
+	for (i = 0; i < SHARE_STAGES; i++)
+		json_set_object(val, share_stages[i], cklatency_stats(&stages[i]));
+	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+	json_decref(val);
+	return buf;
+}
+
+/* Each thread clears its own histograms on its next add after a reset */
+void share_latency_reset(void)
+{
+	int i;
+
+	pthread_once(&latthread_once, latthread_init);
+	mutex_lock(&latthreads_lock);
+	for (i = 0; i < SHARE_STAGES; i++)
+		cklatency_clear(&latretired[i]);
+	__atomic_store_n(&latresets, latresets + 1, __ATOMIC_RELEASE);
+	mutex_unlock(&latthreads_lock);
+}
+
+/* Pending a full API, send responses as their json text, consuming val */
+void send_api_response(json_t *val, const int sockd)
+{
+	char *buf;
+
+	if (unlikely(!val)) {
+		send_unix_msg(sockd, "failed");
+		return;
+	}
+	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT);
+	json_decref(val);
+	send_unix_msg(sockd, buf);
+	free(buf);
+}
+
 /* Create a standalone thread that queues received unix messages for a proc
  * instance and adds them to linked list of received messages with their
  * associated receive socket, then signal the associated rmsg_cond for the
@@ -375,6 +962,24 @@ static void api_message(ckpool_t *ckp, char **buf, int *sockd)
 	ckmsgq_add(ckp->ckpapi, apimsg);
 }
 
+/* Hand the state of established clients followed by their fds over to a new
+ * instance, first stopping the connector reading from them. Only supported
+ * in plain pool mode. */
+static void handover_clients(ckpool_t *ckp, const int sockd)
+{
+	json_t *val;
+
+	if (ckp->proxy || ckp->passthrough || ckp->redirector || ckp->node || ckp->remote ||
+	    !ckp->stratifier_ready || !ckp->connector_ready) {
+		send_unix_msg(sockd, "unsupported");
+		return;
+	}
+	connector_freeze(ckp);
+	val = stratifier_handover(ckp);
+	connector_handover(ckp, val, sockd);
+	json_decref(val);
+}
+
 /* Listen for incoming global requests. Always returns a response if possible */
 static void *listener(void *arg)
 {
@@ -425,6 +1030,19 @@ retry:
 
 		sscanf(buf, "getxfd%d", &fdno);
 		connector_send_fd(ckp, fdno, sockd);
+	} else if (cmdmatch(buf, "getxclientfds")) {
+		if (ckp->connector_ready)
+			connector_handover_fds(ckp, sockd);
+	} else if (cmdmatch(buf, "getxclients")) {
+		LOGWARNING("Listener received request to hand over clients");
+		handover_clients(ckp, sockd);
+	} else if (cmdmatch(buf, "handback")) {
+		int fdno = -1;
+
+		sscanf(buf, "handback%d", &fdno);
+		if (ckp->connector_ready)
+			connector_handback(ckp, fdno);
+		send_unix_msg(sockd, "handedback");
 	} else if (cmdmatch(buf, "accept")) {
 		LOGWARNING("Listener received accept message, accepting clients");
 		send_proc(ckp->connector, "accept");
@@ -457,6 +1075,15 @@ retry:
 		msg = connector_stats(ckp->cdata, 0);
 		send_unix_msg(sockd, msg);
 		dealloc(msg);
+	} else if (cmdmatch(buf, "latencystats")) {
+		LOGDEBUG("Listener received latencystats request");
+		msg = share_latency_stats();
+		send_unix_msg(sockd, msg);
+		dealloc(msg);
+	} else if (cmdmatch(buf, "resetlatency")) {
+		LOGNOTICE("Resetting share latency histograms");
+		share_latency_reset();
+		send_unix_msg(sockd, "success");
 	} else if (cmdmatch(buf, "resetshares")) {
 		LOGWARNING("Resetting best shares");
 		send_proc(ckp->stratifier, buf);
@@ -473,6 +1100,178 @@ out:
 	return NULL;
 }
 
+/* Append a sample in prometheus text format, preceded by the TYPE line of its
+ * family when type is set, which should be on the first sample only. */
+void add_metric(char **buf, const char *type, const char *name, const char *labels,
+		const double val)
+{
+	char line[256];
+
+	if (type) {
+		snprintf(line, 255, "# TYPE ckpool_%s %s\n", name, type);
+		realloc_strcat(buf, line);
+	}
+	if (labels)
+		snprintf(line, 255, "ckpool_%s{%s} %.16g\n", name, labels, val);
+	else
+		snprintf(line, 255, "ckpool_%s %.16g\n", name, val);
+	realloc_strcat(buf, line);
+}
+
+/* Depths of ring backed queues are read unlocked and approximate, summing the
+ * rings of all registered queues sharing a name. List backed queues would
+ * need their lock and a list walk so only report their message count. */
+static void queue_metrics(char **buf)
+{
+	int64_t depth[METRIC_QUEUES], maxdepth[METRIC_QUEUES], messages[METRIC_QUEUES];
+	int64_t dropped[METRIC_QUEUES];
+	bool ring[METRIC_QUEUES], dup[METRIC_QUEUES];
+	int i, j, r, nqueues;
+	char labels[64];
+
+	nqueues = __atomic_load_n(&metric_nqueues, __ATOMIC_RELAXED);
+	if (nqueues > METRIC_QUEUES)
+		nqueues = METRIC_QUEUES;
+	for (i = 0; i < nqueues; i++) {
+		ckmsgq_t *ckmsgq = __atomic_load_n(&metric_queues[i].ckmsgq, __ATOMIC_ACQUIRE);
+
+		depth[i] = maxdepth[i] = messages[i] = dropped[i] = 0;
+		ring[i] = dup[i] = false;
+		if (!ckmsgq) {
+			dup[i] = true;
+			continue;
+		}
+		for (j = 0; j < i; j++) {
+			if (!dup[j] && !strcmp(metric_queues[i].name, metric_queues[j].name))
+				break;
+		}
+		if (j < i)
+			dup[i] = true;
+		else
+			j = i;
+		for (r = 0; r < ckmsgq->count; r++) {
+			messages[j] += ckmsgq[r].messages;
+			dropped[j] += ckmsgq[r].dropped;
+		}
+		if (!ckmsgq->ring)
+			continue;
+		ring[j] = true;
+		for (r = 0; r < (ckmsgq->affine ? ckmsgq->count : 1); r++) {
+			ckring_t *ckring = ckmsgq[r].ring;
+
+			depth[j] += ckring->head - ckring->tail;
+			if (ckring->maxdepth > maxdepth[j])
+				maxdepth[j] = ckring->maxdepth;
+		}
+	}
+
+	for (i = 0, j = 0; i < nqueues; i++) {
+		if (dup[i] || !ring[i])
+			continue;
+		snprintf(labels, 63, "queue=\"%s\"", metric_queues[i].name);
+		add_metric(buf, j++ ? NULL : "gauge", "queue_depth", labels, depth[i]);
+	}
+	for (i = 0, j = 0; i < nqueues; i++) {
+		if (dup[i] || !ring[i])
+			continue;
+		snprintf(labels, 63, "queue=\"%s\"", metric_queues[i].name);
+		add_metric(buf, j++ ? NULL : "gauge", "queue_maxdepth", labels, maxdepth[i]);
+	}
+	for (i = 0, j = 0; i < nqueues; i++) {
+		if (dup[i])
+			continue;
+		snprintf(labels, 63, "queue=\"%s\"", metric_queues[i].name);
+		add_metric(buf, j++ ? NULL : "counter", "queue_messages_total", labels, messages[i]);
+	}
+	for (i = 0, j = 0; i < nqueues; i++) {
+		if (dup[i] || !ring[i])
+			continue;
+		snprintf(labels, 63, "queue=\"%s\"", metric_queues[i].name);
+		add_metric(buf, j++ ? NULL : "counter", "queue_dropped_total", labels, dropped[i]);
+	}
+}
+
+static char *pool_metrics(ckpool_t *ckp)
+{
+	cklatency_t stages[SHARE_STAGES];
+	char *buf = NULL, labels[64];
+	int i;
+
+	add_metric(&buf, "gauge", "uptime_seconds", NULL, time(NULL) - ckp->starttime);
+	queue_metrics(&buf);
+	share_latency_merge(stages);
+	for (i = 0; i < SHARE_STAGES; i++) {
+		snprintf(labels, 63, "stage=\"%s\"", share_stages[i]);
+		add_metric(&buf, i ? NULL : "counter", "share_stage_count", labels, stages[i].count);
+	}
+	for (i = 0; i < SHARE_STAGES; i++) {
+		snprintf(labels, 63, "stage=\"%s\"", share_stages[i]);
+		add_metric(&buf, i ? NULL : "counter", "share_stage_seconds_total", labels,
+			   (double)stages[i].sum / 1000000000);
+	}
+	if (ckp->stratifier_ready)
+		stratifier_metrics(ckp, &buf);
+	if (ckp->connector_ready)
+		connector_metrics(ckp, &buf);
+	if (ckp->generator_ready)
+		generator_metrics(ckp, &buf);
+	return buf;
+}
+
+/* Serve metrics over plain HTTP for scrapers such as prometheus, answering
+ * any request with the metrics and closing the connection. Every counter is
+ * read unlocked so scraping never contends with the share path. */
+static void *metrics_listener(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	char *url = NULL, *port = NULL, *buf, header[256], request[1024];
+	int sockd, fd, len;
+
+	rename_proc("metrics");
+	if (!extract_sockaddr(ckp->metricsurl, &url, &port)) {
+		LOGWARNING("Failed to extract metrics address from %s", ckp->metricsurl);
+		goto out;
+	}
+	sockd = bind_socket(url, port);
+	if (sockd < 0) {
+		LOGWARNING("Failed to bind metrics socket to %s", ckp->metricsurl);
+		goto out;
+	}
+	if (listen(sockd, SOMAXCONN) < 0) {
+		LOGWARNING("Failed to listen on metrics socket %s", ckp->metricsurl);
+		Close(sockd);
+		goto out;
+	}
+	LOGNOTICE("Serving metrics on %s", ckp->metricsurl);
+
+	while (42) {
+		fd = accept(sockd, NULL, NULL);
+		if (unlikely(fd < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Failed to accept on metrics socket");
+			break;
+		}
+		if (wait_read_select(fd, 1) < 1 || read(fd, request, sizeof(request)) < 1) {
+			Close(fd);
+			continue;
+		}
+		buf = pool_metrics(ckp);
+		len = strlen(buf);
+		snprintf(header, 255, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			 "Content-Length: %d\r\nConnection: close\r\n\r\n", len);
+		if (write_socket(fd, header, strlen(header)) > 0)
+			write_socket(fd, buf, len);
+		dealloc(buf);
+		Close(fd);
+	}
+	Close(sockd);
+out:
+	dealloc(url);
+	dealloc(port);
+	return NULL;
+}
+
 void empty_buffer(connsock_t *cs)
 {
 	if (cs->buf)
@@ -606,15 +1405,71 @@ static int recv_available(ckpool_t *ckp, connsock_t *cs)
 	return len;
 }
 
-/* Read from a socket into cs->buf till we get an '\n', converting it to '\0'
- * and storing how much extra data we've received, to be moved to the beginning
- * of the buffer for use on the next receive. Returns length of the line if a
- * whole line is received, zero if none/some data is received without an EOL
- * and -1 on error. */
-int read_socket_line(connsock_t *cs, float *timeout)
+/* Largest message accepted in a relay envelope */
+#define RELAY_MAXMSG 0x1000000
+
+void relay_hdr(relay_hdr_t *hdr, const int64_t client_id, const int len)
+{
+	memset(hdr, 0, sizeof(relay_hdr_t));
+	hdr->magic = RELAY_MAGIC;
+	hdr->len = htole32(len);
+	hdr->client_id = htole64(client_id);
+}
+
+/* Returns the total length of the complete relay envelope and message at buf,
+ * storing its client_id, zero if it is not all in buf yet and -1 if buf does
+ * not start with a valid envelope. */
+int relay_msg(const char *buf, const int buflen, int64_t *client_id)
+{
+	relay_hdr_t hdr;
+	uint32_t len;
+
+	if (buflen < (int)sizeof(relay_hdr_t))
+		return (buflen && (uint8_t)buf[0] != RELAY_MAGIC) ? -1 : 0;
+	memcpy(&hdr, buf, sizeof(relay_hdr_t));
+	len = le32toh(hdr.len);
+	if (unlikely(hdr.magic != RELAY_MAGIC || !len || len > RELAY_MAXMSG))
+		return -1;
+	if (buflen < (int)(sizeof(relay_hdr_t) + len))
+		return 0;
+	*client_id = le64toh(hdr.client_id);
+	return sizeof(relay_hdr_t) + len;
+}
+
+/* Returns a heap allocated relay envelope holding msg of *len bytes, updating
+ * len to the total length */
+char *relay_frame(const int64_t client_id, const char *msg, int *len)
+{
+	char *buf = ckalloc(sizeof(relay_hdr_t) + *len + 1);
+
+	relay_hdr((relay_hdr_t *)buf, client_id, *len);
+	memcpy(buf + sizeof(relay_hdr_t), msg, *len);
+	*len += sizeof(relay_hdr_t);
+	buf[*len] = '\0';
+	return buf;
+}
+
+/* Find the last byte of the first complete message in cs->buf, a line or,
+ * when accepting them, a relay envelope. Sets invalid on a corrupt envelope */
+static char *msg_end(connsock_t *cs, const bool frames, bool *invalid)
+{
+	int64_t client_id;
+	int len;
+
+	if (frames && cs->bufofs && (uint8_t)cs->buf[0] == RELAY_MAGIC) {
+		len = relay_msg(cs->buf, cs->bufofs, &client_id);
+		if (unlikely(len < 0))
+			*invalid = true;
+		return len > 0 ? cs->buf + len - 1 : NULL;
+	}
+	return memchr(cs->buf, '\n', cs->bufofs);
+}
+
+static int read_socket(connsock_t *cs, float *timeout, const bool frames)
 {
 	ckpool_t *ckp = cs->ckp;
 	bool quiet = ckp->proxy | ckp->remote;
+	bool invalid = false;
 	char *eom = NULL;
 	tv_t start, now;
 	float diff;
@@ -622,12 +1477,14 @@ int read_socket_line(connsock_t *cs, float *timeout)
 
 	clear_bufline(cs);
 	recv_available(ckp, cs); // Intentionally ignore return value
-	eom = memchr(cs->buf, '\n', cs->bufofs);
+	eom = msg_end(cs, frames, &invalid);
 
 	tv_time(&start);
 
 	while (!eom) {
-		if (unlikely(cs->fd < 0)) {
+		if (unlikely(cs->fd < 0 || invalid)) {
+			if (invalid)
+				LOGWARNING("Invalid relay envelope in read_socket_msg");
 			ret = -1;
 			goto out;
 		}
@@ -660,7 +1517,7 @@ int read_socket_line(connsock_t *cs, float *timeout)
 			ret = -1;
 			goto out;
 		}
-		eom = memchr(cs->buf, '\n', cs->bufofs);
+		eom = msg_end(cs, frames, &invalid);
 		tv_time(&now);
 		diff = tvdiff(&now, &start);
 		copy_tv(&start, &now);
@@ -673,7 +1530,11 @@ int read_socket_line(connsock_t *cs, float *timeout)
 		cs->bufofs = eom - cs->buf + 1;
 	else
 		cs->bufofs = 0;
-	*eom = '\0';
+	/* Envelopes are returned whole, lines without their EOL */
+	if (frames && (uint8_t)cs->buf[0] == RELAY_MAGIC)
+		ret++;
+	else
+		*eom = '\0';
 out:
 	if (ret < 0) {
 		empty_buffer(cs);
@@ -682,6 +1543,23 @@ out:
 	return ret;
 }
 
+/* Read from a socket into cs->buf till we get an '\n', converting it to '\0'
+ * and storing how much extra data we've received, to be moved to the beginning
+ * of the buffer for use on the next receive. Returns length of the line if a
+ * whole line is received, zero if none/some data is received without an EOL
+ * and -1 on error. */
+int read_socket_line(connsock_t *cs, float *timeout)
+{
+	return read_socket(cs, timeout, false);
+}
+
+/* As read_socket_line but also accepting relay envelopes, which are left
+ * intact at the start of cs->buf with their total length returned. */
+int read_socket_msg(connsock_t *cs, float *timeout)
+{
+	return read_socket(cs, timeout, true);
+}
+
 /* We used to send messages between each proc_instance via unix sockets when
  * ckpool was a multi-process model but that is no longer required so we can
  * place the messages directly on the other proc_instance's queue until we
@@ -736,6 +1614,52 @@ out:
 	return buf;
 }
 
+/* Read exactly len bytes from a socket into the start of cs->buf, null
+ * terminating it. Returns the amount of data received, which is more than len
+ * if the server sent data beyond it, zero on timeout and -1 on error. */
+static int read_socket_len(connsock_t *cs, const int len, float *timeout)
+{
+	ckpool_t *ckp = cs->ckp;
+	tv_t start, now;
+	int ret;
+
+	clear_bufline(cs);
+	recv_available(ckp, cs); // Intentionally ignore return value
+
+	tv_time(&start);
+
+	while (cs->bufofs < len) {
+		if (unlikely(cs->fd < 0)) {
+			ret = -1;
+			goto out;
+		}
+		if (*timeout < 0) {
+			LOGERR("Timed out in read_socket_len");
+			ret = 0;
+			goto out;
+		}
+		ret = wait_read_select(cs->fd, *timeout);
+		if (ret < 1) {
+			LOGERR("Select %s in read_socket_len", !ret ? "timed out" : "failed");
+			goto out;
+		}
+		ret = recv_available(ckp, cs);
+		if (ret < 1) {
+			LOGERR("Failed to recv in read_socket_len");
+			ret = -1;
+			goto out;
+		}
+		tv_time(&now);
+		*timeout -= tvdiff(&now, &start);
+		copy_tv(&start, &now);
+	}
+	ret = cs->bufofs;
+	cs->buf[len] = '\0';
+	cs->buflen = cs->bufofs = 0;
+out:
+	return ret;
+}
+
 static const char *rpc_method(const char *rpc_req)
 {
 	const char *ptr = strchr(rpc_req, ':');
@@ -744,118 +1668,289 @@ static const char *rpc_method(const char *rpc_req)
 	return rpc_req;
 }
 
-/* All of these calls are made to bitcoind which prefers open/close instead
- * of persistent connections so cs->fd is always invalid. */
-static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool info_only)
+void init_rpc_conns(connsock_t *cs)
+{
+	mutex_init(&cs->rpc_lock);
+}
+
+static void free_rpc_conn(connsock_t *rcs)
+{
+	Close(rcs->fd);
+	empty_buffer(rcs);
+	dealloc(rcs->buf);
+	free(rcs);
+}
+
+/* Close all idle rpc connections to cs, such as when the server is killed */
+void close_rpc_conns(connsock_t *cs)
+{
+	connsock_t *rcs, *tmp, *conns;
+
+	mutex_lock(&cs->rpc_lock);
+	conns = cs->rpc_conns;
+	cs->rpc_conns = NULL;
+	cs->rpc_idle = 0;
+	mutex_unlock(&cs->rpc_lock);
+
+	DL_FOREACH_SAFE2(conns, rcs, tmp, rpc_next) {
+		DL_DELETE2(conns, rcs, rpc_prev, rpc_next);
+		free_rpc_conn(rcs);
+	}
+}
+
+/* Get the most recently used idle rpc connection to cs that is still usable,
+ * or a new unconnected one if there are none. */
+static connsock_t *get_rpc_conn(connsock_t *cs)
+{
+	connsock_t *rcs;
+
+	while (42) {
+		mutex_lock(&cs->rpc_lock);
+		rcs = cs->rpc_conns;
+		if (rcs) {
+			DL_DELETE2(cs->rpc_conns, rcs, rpc_prev, rpc_next);
+			cs->rpc_idle--;
+		}
+		mutex_unlock(&cs->rpc_lock);
+		if (!rcs)
+			break;
+		/* Anything readable on an idle connection means the server has
+		 * closed it */
+		if (rcs->rpc_used + RPC_IDLE_TIME > time(NULL) && !wait_read_select(rcs->fd, 0))
+			return rcs;
+		free_rpc_conn(rcs);
+	}
+	rcs = ckzalloc(sizeof(connsock_t));
+	rcs->fd = -1;
+	rcs->ckp = cs->ckp;
+	return rcs;
+}
+
+/* Return a still connected rpc connection to the idle list of cs if there is
+ * room, otherwise close it. */
+static void put_rpc_conn(connsock_t *cs, connsock_t *rcs)
+{
+	if (rcs->fd >= 0) {
+		rcs->rpc_used = time(NULL);
+		mutex_lock(&cs->rpc_lock);
+		if (cs->rpc_idle < RPC_IDLE_CONNS) {
+			DL_PREPEND2(cs->rpc_conns, rcs, rpc_prev, rpc_next);
+			cs->rpc_idle++;
+			rcs = NULL;
+		}
+		mutex_unlock(&cs->rpc_lock);
+	}
+	if (rcs)
+		free_rpc_conn(rcs);
+}
+
+/* Make one http request on the rpc connection rcs to the server of cs, leaving
+ * rcs->fd open if the server will keep the connection alive. Sets stale if a
+ * reused connection was found closed before any response was read so the
+ * request can be retried on a new connection. If raw is set the response body
+ * is handed over in it instead of being decoded. */
+static json_t *rpc_request(connsock_t *cs, connsock_t *rcs, const char *rpc_req,
+			   const struct iovec *iov, const int iovcnt, const bool reused,
+			   char **warning, bool *stale, char **raw)
 {
 	float timeout = RPC_TIMEOUT;
-	char *http_req = NULL;
+	bool ok, keepalive = true;
 	json_error_t err_val;
-	char *warning = NULL;
+	char *status = NULL;
 	json_t *val = NULL;
+	int i, len = 0, ret, clen = -1;
 	tv_t stt_tv, fin_tv;
 	double elapsed;
-	int len, ret;
 
-	/* Serialise all calls in case we use cs from multiple threads */
-	cksem_wait(&cs->sem);
-	cs->fd = connect_socket(cs->url, cs->port);
-	if (unlikely(cs->fd < 0)) {
-		ASPRINTF(&warning, "Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
-		goto out;
-	}
-	if (unlikely(!cs->url)) {
-		ASPRINTF(&warning, "No URL in %s", __func__);
-		goto out;
-	}
-	if (unlikely(!cs->port)) {
-		ASPRINTF(&warning, "No port in %s", __func__);
-		goto out;
-	}
-	if (unlikely(!cs->auth)) {
-		ASPRINTF(&warning, "No auth in %s", __func__);
-		goto out;
-	}
-	if (unlikely(!rpc_req)) {
-		ASPRINTF(&warning, "Null rpc_req passed to %s", __func__);
-		goto out;
-	}
-	len = strlen(rpc_req);
-	if (unlikely(!len)) {
-		ASPRINTF(&warning, "Zero length rpc_req passed to %s", __func__);
-		goto out;
+	*stale = false;
+	if (rcs->fd < 0) {
+		rcs->fd = connect_socket(cs->url, cs->port);
+		if (unlikely(rcs->fd < 0)) {
+			ASPRINTF(warning, "Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
+			goto out;
+		}
 	}
-	http_req = ckalloc(len + 256); // Leave room for headers
-	sprintf(http_req,
-		 "POST / HTTP/1.1\n"
-		 "Authorization: Basic %s\n"
-		 "Host: %s:%s\n"
-		 "Content-type: application/json\n"
-		 "Content-Length: %d\n\n%s",
-		 cs->auth, cs->url, cs->port, len, rpc_req);
 
-	len = strlen(http_req);
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
 	tv_time(&stt_tv);
-	ret = write_socket(cs->fd, http_req, len);
+	ret = write_socket_iov(rcs->fd, iov, iovcnt);
 	if (ret != len) {
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
-		ASPRINTF(&warning, "Failed to write to socket in %s (%.10s...) %.3fs",
+		ASPRINTF(warning, "Failed to write to socket in %s (%.10s...) %.3fs",
 			 __func__, rpc_method(rpc_req), elapsed);
-		goto out_empty;
+		*stale = reused;
+		goto out_close;
 	}
-	ret = read_socket_line(cs, &timeout);
+	ret = read_socket_line(rcs, &timeout);
 	if (ret < 1) {
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
-		ASPRINTF(&warning, "Failed to read socket line in %s (%.10s...) %.3fs",
+		ASPRINTF(warning, "Failed to read socket line in %s (%.10s...) %.3fs",
 			 __func__, rpc_method(rpc_req), elapsed);
-		goto out_empty;
-	}
-	if (strncasecmp(cs->buf, "HTTP/1.1 200 OK", 15)) {
-		tv_time(&fin_tv);
-		elapsed = tvdiff(&fin_tv, &stt_tv);
-		ASPRINTF(&warning, "HTTP response to (%.10s...) %.3fs not ok: %s",
-			 rpc_method(rpc_req), elapsed, cs->buf);
-		timeout = 0;
-		/* Look for a json response if there is one */
-		while (read_socket_line(cs, &timeout) > 0) {
-			timeout = 0;
-			if (*cs->buf != '{')
-				continue;
-			free(warning);
-			/* Replace the warning with the json response */
-			ASPRINTF(&warning, "JSON response to (%.10s...) %.3fs not ok: %s",
-				 rpc_method(rpc_req), elapsed, cs->buf);
-			break;
-		}
-		goto out_empty;
+		*stale = reused && ret < 0;
+		goto out_close;
 	}
-	do {
-		ret = read_socket_line(cs, &timeout);
+	ok = !strncasecmp(rcs->buf, "HTTP/1.1 200 OK", 15);
+	if (!ok)
+		status = strdup(rcs->buf);
+	/* HTTP/1.0 servers close the connection by default */
+	if (strncasecmp(rcs->buf, "HTTP/1.1", 8))
+		keepalive = false;
+
+	/* Parse the headers up to the empty line before the body */
+	while (42) {
+		ret = read_socket_line(rcs, &timeout);
 		if (ret < 1) {
 			tv_time(&fin_tv);
 			elapsed = tvdiff(&fin_tv, &stt_tv);
-			ASPRINTF(&warning, "Failed to read http socket lines in %s (%.10s...) %.3fs",
+			ASPRINTF(warning, "Failed to read http socket lines in %s (%.10s...) %.3fs",
 				 __func__, rpc_method(rpc_req), elapsed);
-			goto out_empty;
+			goto out_close;
 		}
-	} while (strncmp(cs->buf, "{", 1));
+		if (rcs->buf[ret - 1] == '\r')
+			rcs->buf[--ret] = '\0';
+		if (!ret)
+			break;
+		if (!strncasecmp(rcs->buf, "Content-Length:", 15))
+			clen = atoi(rcs->buf + 15);
+		else if (!strncasecmp(rcs->buf, "Connection:", 11)) {
+			if (strcasestr(rcs->buf + 11, "close"))
+				keepalive = false;
+			else if (strcasestr(rcs->buf + 11, "keep-alive"))
+				keepalive = true;
+		}
+	}
+
+	if (clen < 0) {
+		/* Without a content length we can only look for a json line
+		 * and can't reuse the connection */
+		keepalive = false;
+		if (!ok)
+			timeout = 0;
+		do {
+			ret = read_socket_line(rcs, &timeout);
+			if (ret < 1)
+				break;
+		} while (*rcs->buf != '{');
+	} else {
+		ret = read_socket_len(rcs, clen, &timeout);
+		if (ret > clen) {
+			/* Data beyond the response, don't reuse it */
+			keepalive = false;
+		} else if (ret < clen)
+			ret = -1;
+	}
 	tv_time(&fin_tv);
 	elapsed = tvdiff(&fin_tv, &stt_tv);
+
+	if (!ok) {
+		/* Report the json response if there is one */
+		if (ret > 0 && *rcs->buf == '{') {
+			ASPRINTF(warning, "JSON response to (%.10s...) %.3fs not ok: %s",
+				 rpc_method(rpc_req), elapsed, rcs->buf);
+		} else {
+			ASPRINTF(warning, "HTTP response to (%.10s...) %.3fs not ok: %s",
+				 rpc_method(rpc_req), elapsed, status);
+		}
+		if (ret < 0)
+			goto out_close;
+		goto out_empty;
+	}
+	if (ret < 1) {
+		ASPRINTF(warning, "Failed to read http socket lines in %s (%.10s...) %.3fs",
+			 __func__, rpc_method(rpc_req), elapsed);
+		goto out_close;
+	}
 	if (elapsed > 5.0) {
-		ASPRINTF(&warning, "HTTP socket read+write took %.3fs in %s (%.10s...)",
+		ASPRINTF(warning, "HTTP socket read+write took %.3fs in %s (%.10s...)",
 			 elapsed, __func__, rpc_method(rpc_req));
 	}
 
-	val = json_loads(cs->buf, 0, &err_val);
+	if (raw) {
+		/* Hand over the buffer, a new one is allocated on next use */
+		*raw = rcs->buf;
+		rcs->buf = NULL;
+		rcs->bufsize = 0;
+		goto out_empty;
+	}
+	val = json_loads(rcs->buf, 0, &err_val);
 	if (!val) {
-		ASPRINTF(&warning, "JSON decode (%.10s...) failed(%d): %s",
+		free(*warning);
+		ASPRINTF(warning, "JSON decode (%.10s...) failed(%d): %s",
 			 rpc_method(rpc_req), err_val.line, err_val.text);
 	}
 out_empty:
-	empty_socket(cs->fd);
-	empty_buffer(cs);
+	empty_buffer(rcs);
+	if (keepalive)
+		goto out;
+out_close:
+	empty_buffer(rcs);
+	Close(rcs->fd);
+out:
+	free(status);
+	return val;
+}
+
+/* All of these calls are made to bitcoind over a small pool of persistent
+ * keep-alive connections per server. Each call takes an idle connection or
+ * opens a new one so calls from multiple threads, such as a submitblock during
+ * a slow getblocktemplate, never wait on each other. */
+static json_t *rpc_call_iov(connsock_t *cs, const struct iovec *body, const int bodycnt,
+			    const bool info_only, char **raw)
+{
+	const char *rpc_req = body[0].iov_base;
+	struct iovec *iov = NULL;
+	char *http_req = NULL;
+	char *warning = NULL;
+	json_t *val = NULL;
+	bool reused, stale;
+	connsock_t *rcs;
+	int i, len = 0;
+
+	if (unlikely(!cs->url)) {
+		ASPRINTF(&warning, "No URL in %s", __func__);
+		goto out;
+	}
+	if (unlikely(!cs->port)) {
+		ASPRINTF(&warning, "No port in %s", __func__);
+		goto out;
+	}
+	if (unlikely(!cs->auth)) {
+		ASPRINTF(&warning, "No auth in %s", __func__);
+		goto out;
+	}
+	for (i = 0; i < bodycnt; i++)
+		len += body[i].iov_len;
+	if (unlikely(!len)) {
+		ASPRINTF(&warning, "Zero length rpc_req passed to %s", __func__);
+		goto out;
+	}
+	ASPRINTF(&http_req,
+		 "POST / HTTP/1.1\r\n"
+		 "Authorization: Basic %s\r\n"
+		 "Host: %s:%s\r\n"
+		 "Connection: keep-alive\r\n"
+		 "Content-type: application/json\r\n"
+		 "Content-Length: %d\r\n\r\n",
+		 cs->auth, cs->url, cs->port, len);
+	/* The request body is written straight from the caller's buffers */
+	iov = ckalloc(sizeof(struct iovec) * (bodycnt + 1));
+	iov[0].iov_base = http_req;
+	iov[0].iov_len = strlen(http_req);
+	memcpy(iov + 1, body, sizeof(struct iovec) * bodycnt);
+
+	rcs = get_rpc_conn(cs);
+	reused = rcs->fd >= 0;
+	val = rpc_request(cs, rcs, rpc_req, iov, bodycnt + 1, reused, &warning, &stale, raw);
+	if (stale) {
+		/* The server closed the idle connection, retry on a new one */
+		LOGDEBUG("Retrying on new connection after: %s", warning);
+		dealloc(warning);
+		val = rpc_request(cs, rcs, rpc_req, iov, bodycnt + 1, false, &warning, &stale, raw);
+	}
+	put_rpc_conn(cs, rcs);
 out:
 	if (warning) {
 		if (info_only)
@@ -864,28 +1959,58 @@ out:
 			LOGWARNING("%s", warning);
 		free(warning);
 	}
-	Close(cs->fd);
+	free(iov);
 	free(http_req);
-	dealloc(cs->buf);
-	cksem_post(&cs->sem);
 	return val;
 }
 
+static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool info_only,
+			      char **raw)
+{
+	struct iovec iov;
+
+	if (unlikely(!rpc_req)) {
+		LOGWARNING("Null rpc_req passed to %s", __func__);
+		return NULL;
+	}
+	iov.iov_base = (void *)rpc_req;
+	iov.iov_len = strlen(rpc_req);
+	return rpc_call_iov(cs, &iov, 1, info_only, raw);
+}
+
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 {
-	return _json_rpc_call(cs, rpc_req, false);
+	return _json_rpc_call(cs, rpc_req, false, NULL);
 }
 
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req)
 {
-	return _json_rpc_call(cs, rpc_req, true);
+	return _json_rpc_call(cs, rpc_req, true, NULL);
+}
+
+/* For callers that parse the response themselves, returning the raw response
+ * body which must be freed or NULL on failure. */
+char *json_rpc_raw(connsock_t *cs, const char *rpc_req)
+{
+	char *raw = NULL;
+
+	_json_rpc_call(cs, rpc_req, false, &raw);
+	return raw;
+}
+
+/* For requests made up of several buffers, such as a block with its
+ * transaction data, to avoid copying them into one. The first buffer needs to
+ * be a string starting with the method. */
+json_t *json_rpc_iov(connsock_t *cs, const struct iovec *iov, const int iovcnt)
+{
+	return rpc_call_iov(cs, iov, iovcnt, false, NULL);
 }
 
 /* For when we are submitting information that is not important and don't care
  * about the response. */
 void json_rpc_msg(connsock_t *cs, const char *rpc_req)
 {
-	json_t *val = _json_rpc_call(cs, rpc_req, true);
+	json_t *val = _json_rpc_call(cs, rpc_req, true, NULL);
 
 	/* We don't care about the result */
 	json_decref(val);
@@ -1063,8 +2188,10 @@ static void rm_namepid(const proc_instance_t *pi)
 
 static void launch_logger(ckpool_t *ckp)
 {
-	ckp->logger = create_ckmsgq(ckp, "logger", &proclog);
-	ckp->console_logger = create_ckmsgq(ckp, "conlog", &console_log);
+	/* Log queues are unbounded since the loggers log themselves and logging
+	 * must never wait on a full ring */
+	ckp->logger = create_ckmsgqs_list(ckp, "logger", &proclog, 1);
+	ckp->console_logger = create_ckmsgqs_list(ckp, "conlog", &console_log, 1);
 }
 
 static void clean_up(ckpool_t *ckp)
@@ -1091,6 +2218,7 @@ static void sighandler(const int sig)
 		   ckp->name, sig);
 
 	cancel_pthread(&ckp->pth_listener);
+	cancel_pthread(&ckp->pth_metrics);
 	exit(0);
 }
 
@@ -1380,6 +2508,38 @@ static void parse_trusted(ckpool_t *ckp, const json_t *arr_val)
 	ckp->serverurls = total_urls;
 }
 
+static void parse_sv2servers(ckpool_t *ckp, const json_t *arr_val)
+{
+	int arr_size, i, j, total_urls;
+
+	if (!arr_val)
+		return;
+	if (!json_is_array(arr_val)) {
+		LOGWARNING("Unable to parse sv2server entries as an array");
+		return;
+	}
+	arr_size = json_array_size(arr_val);
+	if (!arr_size) {
+		LOGWARNING("Sv2server array empty");
+		return;
+	}
+	total_urls = ckp->serverurls + arr_size;
+	ckp->serverurl = realloc(ckp->serverurl, sizeof(char *) * total_urls);
+	ckp->nodeserver = realloc(ckp->nodeserver, sizeof(bool) * total_urls);
+	ckp->trusted = realloc(ckp->trusted, sizeof(bool) * total_urls);
+	ckp->sv2server = ckzalloc(sizeof(bool) * total_urls);
+	for (i = 0, j = ckp->serverurls; j < total_urls; i++, j++) {
+		json_t *val = json_array_get(arr_val, i);
+
+		if (!_json_get_string(&ckp->serverurl[j], val, "sv2server"))
+			LOGWARNING("Invalid sv2server entry number %d", i);
+		ckp->nodeserver[j] = ckp->trusted[j] = false;
+		ckp->sv2server[j] = true;
+		ckp->sv2servers++;
+	}
+	ckp->serverurls = total_urls;
+}
+
 
 static bool parse_redirecturls(ckpool_t *ckp, const json_t *arr_val)
 {
@@ -1446,7 +2606,14 @@ static void parse_config(ckpool_t *ckp)
 	json_get_int(&ckp->blockpoll, json_conf, "blockpoll");
 	json_get_int(&ckp->nonce1length, json_conf, "nonce1length");
 	json_get_int(&ckp->nonce2length, json_conf, "nonce2length");
+	json_get_int(&ckp->clusterid, json_conf, "clusterid");
+	json_get_int(&ckp->clusterhosts, json_conf, "clusterhosts");
 	json_get_int(&ckp->update_interval, json_conf, "update_interval");
+	json_get_bool(&ckp->prefetch, json_conf, "prefetch");
+	json_get_int(&ckp->logsharesync, json_conf, "logsharesync");
+	json_get_bool(&ckp->logsharebin, json_conf, "logsharebin");
+	json_get_string(&ckp->capturefile, json_conf, "capturefile");
+	json_get_bool(&ckp->rawrelay, json_conf, "rawrelay");
 	json_get_string(&vmask, json_conf, "version_mask");
 	if (vmask && strlen(vmask) && validhex(vmask))
 		sscanf(vmask, "%x", &ckp->version_mask);
@@ -1465,6 +2632,8 @@ static void parse_config(ckpool_t *ckp)
 	parse_nodeservers(ckp, arr_val);
 	arr_val = json_object_get(json_conf, "trusted");
 	parse_trusted(ckp, arr_val);
+	arr_val = json_object_get(json_conf, "sv2server");
+	parse_sv2servers(ckp, arr_val);
 	json_get_string(&ckp->upstream, json_conf, "upstream");
 	json_get_int64(&ckp->mindiff, json_conf, "mindiff");
 	json_get_int64(&ckp->startdiff, json_conf, "startdiff");
@@ -1472,6 +2641,13 @@ static void parse_config(ckpool_t *ckp)
 	json_get_int64(&ckp->maxdiff, json_conf, "maxdiff");
 	json_get_string(&ckp->logdir, json_conf, "logdir");
 	json_get_int(&ckp->maxclients, json_conf, "maxclients");
+	json_get_int(&ckp->sessionexpiry, json_conf, "sessionexpiry");
+	json_get_int(&ckp->maxsessions, json_conf, "maxsessions");
+	json_get_int(&ckp->acceptrate, json_conf, "acceptrate");
+	json_get_int(&ckp->authrate, json_conf, "authrate");
+	json_get_int(&ckp->maxadmissions, json_conf, "maxadmissions");
+	json_get_bool(&ckp->affinity, json_conf, "affinity");
+	json_get_bool(&ckp->pincpus, json_conf, "pincpus");
 	json_get_double(&ckp->donation, json_conf, "donation");
 	/* Avoid dust-sized donations */
 	if (ckp->donation < 0.1)
@@ -1488,6 +2664,8 @@ static void parse_config(ckpool_t *ckp)
 	if (arr_val)
 		parse_redirecturls(ckp, arr_val);
 	json_get_string(&ckp->zmqblock, json_conf, "zmqblock");
+	json_get_string(&ckp->metricsurl, json_conf, "metricsurl");
+	json_get_bool(&ckp->zmqempty, json_conf, "zmqempty");
 
 	json_decref(json_conf);
 }
@@ -1570,6 +2748,64 @@ static bool send_recv_path(const char *path, const char *msg)
 	return ret;
 }
 
+/* Ask the running instance at path for its established clients, receiving
+ * their state and then all their fds batched on a second connection, to adopt
+ * once we have started. */
+static bool inherit_clients(ckpool_t *ckp, const char *path)
+{
+	json_t *val = NULL, *clients;
+	int sockd, i, nclients;
+	char *buf = NULL;
+	bool ret = false;
+
+	if (ckp->proxy || ckp->passthrough || ckp->redirector || ckp->node || ckp->remote)
+		return ret;
+	sockd = open_unix_client(path);
+	if (sockd < 0)
+		return ret;
+	if (!send_unix_msg(sockd, "getxclients"))
+		goto out;
+	buf = recv_unix_msg(sockd);
+	if (!buf || !(val = json_loads(buf, 0, NULL))) {
+		LOGWARNING("Old instance did not hand over clients: %s", buf ? buf : "no response");
+		goto out;
+	}
+	clients = json_object_get(val, "clients");
+	nclients = json_array_size(clients);
+	ckp->handover_fds = ckalloc(sizeof(int) * (nclients + 1));
+	Close(sockd);
+	i = 0;
+	if (nclients) {
+		sockd = open_unix_client(path);
+		if (sockd > 0 && send_unix_msg(sockd, "getxclientfds"))
+			i = get_fds(ckp->handover_fds, nclients, sockd);
+		Close(sockd);
+	}
+	/* Only keep the clients we have fds for, handing the rest back to the
+	 * old instance to be sent a reconnect. Those we did take are left alone
+	 * by it. */
+	if (i < nclients) {
+		char handback[24];
+
+		LOGWARNING("Received fds of only %d of %d inherited clients", i, nclients);
+		snprintf(handback, 23, "handback%d", i);
+		send_recv_path(path, handback);
+		send_recv_path(path, "reconnect");
+	}
+	while (nclients > i)
+		json_array_remove(clients, --nclients);
+	ckp->handover_clients = val;
+	val = NULL;
+	LOGWARNING("Inherited %d established clients", nclients);
+	ret = true;
+out:
+	if (val)
+		json_decref(val);
+	free(buf);
+	Close(sockd);
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	struct sigaction handler;
@@ -1581,6 +2817,8 @@ int main(int argc, char **argv)
 	/* Make significant floating point errors fatal to avoid subtle bugs being missed */
 	feenableexcept(FE_DIVBYZERO | FE_INVALID);
 	json_set_alloc_funcs(json_ckalloc, free);
+	json_set_ckslab_funcs();
+	ckmsg_slab = create_ckslab("ckmsg", sizeof(ckmsg_t));
 
 	global_ckp = &ckp;
 	memset(&ckp, 0, sizeof(ckp));
@@ -1769,6 +3007,15 @@ int main(int argc, char **argv)
 			ckp.nonce2length = 8;
 	} else if (ckp.nonce2length < 2 || ckp.nonce2length > 8)
 		quit(0, "Invalid nonce2length %d specified, must be 2~8", ckp.nonce2length);
+	if (ckp.clusterhosts < 0 || ckp.clusterhosts > 256)
+		quit(0, "Invalid clusterhosts %d specified, must be 0~256", ckp.clusterhosts);
+	if (ckp.clusterid < 0 || (ckp.clusterid && ckp.clusterid >= ckp.clusterhosts))
+		quit(0, "Invalid clusterid %d specified, must be less than clusterhosts", ckp.clusterid);
+	/* Proxies get their enonce1 space from the upstream pool */
+	if (ckp.clusterhosts > 1 && (ckp.proxy || ckp.passthrough || ckp.redirector)) {
+		LOGWARNING("Ignoring clusterhosts in proxy, passthrough and redirector modes");
+		ckp.clusterhosts = ckp.clusterid = 0;
+	}
 	if (!ckp.update_interval)
 		ckp.update_interval = 30;
 	if (!ckp.mindiff)
@@ -1777,6 +3024,16 @@ int main(int argc, char **argv)
 		ckp.startdiff = 42;
 	if (!ckp.highdiff)
 		ckp.highdiff = 1000000;
+	if (ckp.sessionexpiry <= 0)
+		ckp.sessionexpiry = 600;
+	if (ckp.maxsessions < 0)
+		ckp.maxsessions = 0;
+	if (ckp.acceptrate < 0)
+		ckp.acceptrate = 0;
+	if (ckp.authrate < 0)
+		ckp.authrate = 0;
+	if (ckp.maxadmissions <= 0)
+		ckp.maxadmissions = 1000;
 	if (!ckp.logdir)
 		ckp.logdir = strdup("logs");
 	if (!ckp.serverurls)
@@ -1785,6 +3042,15 @@ int main(int argc, char **argv)
 		quit(0, "No proxy entries found in config file %s", ckp.config);
 	if (ckp.redirector && !ckp.redirecturls)
 		quit(0, "No redirect entries found in config file %s", ckp.config);
+	/* Only a plain passthrough can relay without parsing client messages */
+	if (!ckp.passthrough || ckp.node || ckp.redirector)
+		ckp.rawrelay = false;
+	/* Stratum V2 clients are only translated for a local stratifier */
+	if (ckp.sv2servers && (ckp.passthrough || ckp.redirector)) {
+		LOGWARNING("Serving sv2server entries as V1 in passthrough and redirector modes");
+		dealloc(ckp.sv2server);
+		ckp.sv2servers = 0;
+	}
 	if (!ckp.zmqblock)
 		ckp.zmqblock = "tcp://127.0.0.1:28332";
 
@@ -1853,7 +3119,9 @@ int main(int argc, char **argv)
 				}
 			}
 			send_recv_path(path, "reject");
-			send_recv_path(path, "reconnect");
+			/* Clients we could not take over have to reconnect */
+			if (!inherit_clients(&ckp, path))
+				send_recv_path(path, "reconnect");
 			send_recv_path(path, "shutdown");
 		}
 	}
@@ -1888,6 +3156,8 @@ int main(int argc, char **argv)
 
 	// ckp.ckpapi = create_ckmsgq(&ckp, "api", &ckpool_api);
 	create_pthread(&ckp.pth_listener, listener, &ckp.main);
+	if (ckp.metricsurl && *ckp.metricsurl)
+		create_pthread(&ckp.pth_metrics, metrics_listener, &ckp);
 
 	handler.sa_handler = &sighandler;
 	handler.sa_flags = 0;
@@ -1895,6 +3165,12 @@ int main(int argc, char **argv)
 	sigaction(SIGTERM, &handler, NULL);
 	sigaction(SIGINT, &handler, NULL);
 
+	/* Capture from the start so the first template is recorded */
+	if (ckp.capturefile && !*ckp.capturefile)
+		dealloc(ckp.capturefile);
+	if (ckp.capturefile)
+		connector_open_capture(&ckp);
+
 	/* Launch separate processes from here */
 	prepare_child(&ckp, &ckp.generator, generator, "generator");
 	prepare_child(&ckp, &ckp.stratifier, stratifier, "stratifier");
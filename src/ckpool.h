@@ -20,6 +20,11 @@
 #include "uthash.h"
 
 #define RPC_TIMEOUT 60
+/* Most idle persistent rpc connections kept open per server */
+#define RPC_IDLE_CONNS 4
+/* Seconds an idle rpc connection is reused for, less than bitcoind's
+ * rpcservertimeout */
+#define RPC_IDLE_TIME 15
 
 struct ckpool_instance;
 typedef struct ckpool_instance ckpool_t;
@@ -32,6 +37,20 @@ struct ckmsg {
 
 typedef struct ckmsg ckmsg_t;
 
+/* Slab all ckmsgs of list backed ckmsgqs are allocated from */
+extern ckslab_t *ckmsg_slab;
+
+typedef struct ckshared ckshared_t;
+
+/* A message serialised once and sent unchanged to many clients. It is read
+ * only once handed out and freed when the last reference is put. */
+struct ckshared {
+	char *buf;
+	int len;
+	int refs;
+	mutex_t lock;
+};
+
 typedef struct unix_msg unix_msg_t;
 
 struct unix_msg {
@@ -41,6 +60,74 @@ struct unix_msg {
 	char *buf;
 };
 
+/* Number of messages each ring backed ckmsgq can hold, a power of 2 */
+#define CKRING_SIZE 16384
+/* Log2 buckets in the ring latency and depth histograms */
+#define CKRING_BUCKETS 24
+
+struct ckring_cell {
+	int64_t seq;
+	void *data;
+	int64_t stamp; /* Monotonic ns the message was added */
+};
+
+typedef struct ckring_cell ckring_cell_t;
+
+/* Bounded lock free multi producer, multi consumer ring of messages. The lock
+ * and cond are only used by consumers to sleep when it is empty. */
+struct ckring {
+	ckring_cell_t *cells;
+	int64_t mask;
+
+	/* Keep the producer and consumer positions on their own cache lines */
+	int64_t head __attribute__((aligned(64)));
+	int64_t tail __attribute__((aligned(64)));
+	int waiters __attribute__((aligned(64)));
+
+	mutex_t lock;
+	pthread_cond_t cond;
+
+	/* Histograms of log2 microseconds from add to removal, and of log2
+	 * queue depth seen on removal */
+	int64_t latency[CKRING_BUCKETS];
+	int64_t depth[CKRING_BUCKETS];
+	int64_t maxdepth;
+};
+
+typedef struct ckring ckring_t;
+
+/* Latency histogram buckets are log2 octaves of nanoseconds, each split into
+ * CKLAT_SUBS linear sub-buckets, giving values to within 1/CKLAT_SUBS */
+#define CKLAT_SUBBITS 3
+#define CKLAT_SUBS (1 << CKLAT_SUBBITS)
+#define CKLAT_BUCKETS (40 * CKLAT_SUBS)
+
+/* Cumulative latency histogram, kept per thread for share stages so adding
+ * to it needs no atomic read-modify-write, and merged when read */
+struct cklatency {
+	int64_t buckets[CKLAT_BUCKETS];
+	int64_t count;
+	int64_t sum;
+	int64_t max;
+};
+
+typedef struct cklatency cklatency_t;
+
+/* Stages of the share pipeline timed with share_latency_add. Only shares are
+ * timed, the stages from ssend on only for those tokenised by the connector. */
+enum share_stage {
+	STAGE_READ,	/* Connector read to hand off of a tokenised share */
+	STAGE_SRECV,	/* srecv_process of a json share */
+	STAGE_SSHAREQ,	/* Waiting on the sshareq */
+	STAGE_HASH,	/* Parsing and hashing the batch a share is in */
+	STAGE_DIFF,	/* submission_diff */
+	STAGE_ADD,	/* add_submit */
+	STAGE_SSEND,	/* Result waiting on the ssends */
+	STAGE_CSEND,	/* Connector serialising and writing the result */
+	STAGE_TOTAL,	/* Connector read to result written */
+	SHARE_STAGES
+};
+
 struct ckmsgq {
 	ckpool_t *ckp;
 	char name[16];
@@ -48,8 +135,23 @@ struct ckmsgq {
 	mutex_t *lock;
 	pthread_cond_t *cond;
 	ckmsg_t *msgs;
+	/* Ring shared by all threads of this queue, msgs is unused when set */
+	ckring_t *ring;
+	/* Number of threads in this array of queues */
+	int count;
+	/* Does each thread have its own ring, with messages routed by key */
+	bool affine;
+	/* CPU this thread is pinned to, or -1 */
+	int cpu;
 	void (*func)(ckpool_t *, void *);
+	/* Batched queues hand up to batch messages at once to bfunc */
+	void (*bfunc)(ckpool_t *, void **, int);
+	int batch;
+	/* Is bfunc also called with no messages each second the ring is idle */
+	bool idle;
 	int64_t messages;
+	/* Messages discarded because the ring was full */
+	int64_t dropped;
 	bool active;
 };
 
@@ -72,6 +174,22 @@ struct proc_instance {
 	pthread_cond_t rmsg_cond;
 };
 
+typedef struct connsock connsock_t;
+
+/* Binary envelope framing each message on a raw relaying passthrough
+ * connection instead of json wrapping. The magic byte can never start a json
+ * line or command so both can be mixed on one connection. Little endian. */
+#define RELAY_MAGIC 0xfe
+
+typedef struct relay_hdr relay_hdr_t;
+
+struct relay_hdr {
+	uint8_t magic;
+	uint8_t pad[3];
+	uint32_t len; /* Length of the message following the header */
+	int64_t client_id; /* Passthrough subclient, 0 for the passthrough itself */
+};
+
 struct connsock {
 	int fd;
 	char *url;
@@ -90,9 +208,18 @@ struct connsock {
 	sem_t sem;
 
 	bool alive;
-};
 
-typedef struct connsock connsock_t;
+	/* Idle persistent connections kept for json rpc calls to this
+	 * server, protected by rpc_lock */
+	mutex_t rpc_lock;
+	connsock_t *rpc_conns;
+	int rpc_idle;
+
+	/* List entries and last use of an idle rpc connection */
+	connsock_t *rpc_next;
+	connsock_t *rpc_prev;
+	time_t rpc_used;
+};
 
 typedef struct char_entry char_entry_t;
 
@@ -141,6 +268,12 @@ struct ckpool_instance {
 	bool killold;
 	/* Whether to log shares or not */
 	bool logshares;
+	/* Seconds between fsyncs of open share logs, 0 to never fsync */
+	int logsharesync;
+	/* Log shares in the binary share log format */
+	bool logsharebin;
+	/* File to capture client traffic and template updates to for replay */
+	char *capturefile;
 	/* Logging level */
 	int loglevel;
 	/* Main process name */
@@ -161,8 +294,28 @@ struct ckpool_instance {
 	int *oldconnfd;
 	/* Should we inherit a running instance's socket and shut it down */
 	bool handover;
+	/* State of established clients inherited on handover with their fds
+	 * in the same order, released once the clients are adopted */
+	json_t *handover_clients;
+	int *handover_fds;
 	/* How many clients maximum to accept before rejecting further */
 	int maxclients;
+	/* Seconds a disconnected session can be resumed for, default 600 */
+	int sessionexpiry;
+	/* How many disconnected sessions to keep, oldest dropped first, 0 for no limit */
+	int maxsessions;
+	/* New connections accepted per second, 0 for no limit */
+	int acceptrate;
+	/* New clients passed to the stratifier for authorising per second, 0
+	 * for no admission control */
+	int authrate;
+	/* How many new clients can wait for admission in each lane before
+	 * more are dropped, default 1000 */
+	int maxadmissions;
+	/* Should each client's receives and shares go to a fixed thread */
+	bool affinity;
+	/* Should those fixed threads be pinned to CPUs */
+	bool pincpus;
 
 	/* API message queue */
 	ckmsgq_t *ckpapi;
@@ -184,9 +337,15 @@ struct ckpool_instance {
 
 	/* Name of protocol used for ZMQ block notifications */
 	char *zmqblock;
+	/* Broadcast empty work as soon as ZMQ notifies us of a new block */
+	bool zmqempty;
+
+	/* host:port to serve pull based metrics over HTTP on, if any */
+	char *metricsurl;
 
 	/* Threads of main process */
 	pthread_t pth_listener;
+	pthread_t pth_metrics;
 	pthread_t pth_watchdog;
 
 	/* Are we running in trusted remote node mode */
@@ -198,6 +357,9 @@ struct ckpool_instance {
 	/* Are we running in passthrough mode */
 	bool passthrough;
 
+	/* Relay passthrough messages in raw envelopes if upstream accepts */
+	bool rawrelay;
+
 	/* Are we a redirecting passthrough */
 	bool redirector;
 
@@ -229,6 +391,8 @@ struct ckpool_instance {
 	int blockpoll; // How frequently in ms to poll bitcoind for block updates
 	int nonce1length; // Extranonce1 length
 	int nonce2length; // Extranonce2 length
+	int clusterid; // This host's partition of the enonce1 space
+	int clusterhosts; // Number of hosts sharing the enonce1 space
 
 	/* Difficulty settings */
 	int64_t mindiff; // Default 1
@@ -260,9 +424,12 @@ struct ckpool_instance {
 	bool *nodeserver; // If this server URL serves node information
 	int nodeservers; // If this server has remote node servers
 	bool *trusted; // If this server URL accepts trusted remote nodes
+	bool *sv2server; // If this server URL speaks Stratum V2
+	int sv2servers; // Number of Stratum V2 servers
 	char *upstream; // Upstream pool in trusted remote mode
 
 	int update_interval; // Seconds between stratum updates
+	bool prefetch; // Prefetch block templates ahead of stratum updates
 
 	uint32_t version_mask; // Bits which set to true means allow miner to modify those bits
 
@@ -307,6 +474,8 @@ enum stratum_msgtype {
 	SM_WORKERSTATS,
 	SM_REQTXNS,
 	SM_CONFIGURE,
+	SM_SHAREBATCH,
+	SM_REQWORKINFO,
 	SM_NONE
 };
 
@@ -334,6 +503,8 @@ static const char __maybe_unused *stratum_msgs[] = {
 	"workerstats",
 	"reqtxns",
 	"mining.configure",
+	"sharebatch",
+	"reqworkinfo",
 	""
 };
 
@@ -343,9 +514,38 @@ void get_timestamp(char *stamp);
 
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func);
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t *create_ckmsgqs_batch(ckpool_t *ckp, const char *name, const void *func, const int count,
+			       const int batch);
+ckmsgq_t *create_ckmsgqs_timed(ckpool_t *ckp, const char *name, const void *func, const int count,
+			       const int batch);
+ckmsgq_t *create_ckmsgqs_list(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t *create_ckmsgqs_affine(ckpool_t *ckp, const char *name, const void *func, const int count,
+				const int batch);
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
 #define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, __FILE__, __func__, __LINE__)
+bool _ckmsgq_tryadd(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
+#define ckmsgq_tryadd(ckmsgq, data) _ckmsgq_tryadd(ckmsgq, data, __FILE__, __func__, __LINE__)
+bool _ckmsgq_add_affine(ckmsgq_t *ckmsgq, void *data, const int64_t key, const char *file,
+			const char *func, const int line);
+#define ckmsgq_add_affine(ckmsgq, data, key) _ckmsgq_add_affine(ckmsgq, data, key, __FILE__, __func__, __LINE__)
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
+ckshared_t *create_ckshared(char *buf);
+void get_ckshared(ckshared_t *shared);
+void put_ckshared(ckshared_t *shared);
+void share_latency_add(const enum share_stage stage, const int64_t ns);
+char *share_latency_stats(void);
+void share_latency_reset(void);
+void add_metric(char **buf, const char *type, const char *name, const char *labels,
+		const double val);
+
+/* Time a share pipeline stage from start, returning the time now */
+static inline int64_t stage_latency(const enum share_stage stage, const int64_t start)
+{
+	int64_t now = monotonic_ns();
+
+	share_latency_add(stage, now - start);
+	return now;
+}
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
 
 bool ping_main(ckpool_t *ckp);
@@ -353,6 +553,10 @@ void empty_buffer(connsock_t *cs);
 int set_sendbufsize(ckpool_t *ckp, const int fd, const int len);
 int set_recvbufsize(ckpool_t *ckp, const int fd, const int len);
 int read_socket_line(connsock_t *cs, float *timeout);
+int read_socket_msg(connsock_t *cs, float *timeout);
+void relay_hdr(relay_hdr_t *hdr, const int64_t client_id, const int len);
+int relay_msg(const char *buf, const int buflen, int64_t *client_id);
+char *relay_frame(const int64_t client_id, const char *msg, int *len);
 void _queue_proc(proc_instance_t *pi, const char *msg, const char *file, const char *func, const int line);
 #define send_proc(pi, msg) _queue_proc(&(pi), msg, __FILE__, __func__, __LINE__)
 char *_send_recv_proc(const proc_instance_t *pi, const char *msg, int writetimeout, int readtimedout,
@@ -364,8 +568,12 @@ char *_ckdb_msg_call(const ckpool_t *ckp, const char *msg,  const char *file, co
 		     const int line);
 #define ckdb_msg_call(ckp, msg) _ckdb_msg_call(ckp, msg, __FILE__, __func__, __LINE__)
 
+void init_rpc_conns(connsock_t *cs);
+void close_rpc_conns(connsock_t *cs);
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req);
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req);
+char *json_rpc_raw(connsock_t *cs, const char *rpc_req);
+json_t *json_rpc_iov(connsock_t *cs, const struct iovec *iov, const int iovcnt);
 void json_rpc_msg(connsock_t *cs, const char *rpc_req);
 bool _send_json_msg(connsock_t *cs, const json_t *json_msg, const char *file, const char *func, const int line);
 #define send_json_msg(CS, JSON_MSG) _send_json_msg(CS, JSON_MSG, __FILE__, __func__, __LINE__)
@@ -392,7 +600,7 @@ struct apimsg {
 static inline void ckpool_api(ckpool_t __maybe_unused *ckp, apimsg_t __maybe_unused *apimsg) {};
 static inline json_t *json_encode_errormsg(json_error_t __maybe_unused *err_val) { return NULL; };
 static inline json_t *json_errormsg(const char __maybe_unused *fmt, ...) { return NULL; };
-static inline void send_api_response(json_t __maybe_unused *val, const int __maybe_unused sockd) {};
+void send_api_response(json_t *val, const int sockd);
 
 /* Subclients have client_ids in the high bits. Returns the value of the parent
  * client if one exists. */
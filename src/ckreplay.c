@@ -0,0 +1,1173 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Replays a traffic capture taken with the capturefile option against a pool.
+ * Every captured client is reconnected and its lines sent in the recorded
+ * order, at the recorded pace or a multiple of it, while a stub bitcoind
+ * serves the pool templates equivalent to the captured ones as their turn in
+ * the capture comes up. Shares have their job id replaced with the latest one
+ * the replayed client was sent, so they travel the whole submission path,
+ * though they are not real work on the replayed templates. Reports replay
+ * throughput and request to response latencies. */
+
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "sha2.h"
+#include "uthash.h"
+#include "capture.h"
+
+static int msg_loglevel = LOG_NOTICE;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= msg_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+enum replay_state {
+	REPLAY_CONNECTING,
+	REPLAY_CONNECTED,
+	REPLAY_CLOSED
+};
+
+enum replay_method {
+	METHOD_SUBSCRIBE,
+	METHOD_AUTHORISE,
+	METHOD_SUBMIT,
+	METHOD_OTHER,
+	METHODS
+};
+
+static const char *method_names[METHODS] = {
+	"Subscribe",
+	"Authorise",
+	"Submit",
+	"Other"
+};
+
+#define REPLAY_PENDING 64
+#define REPLAY_MAXBUF 1048576
+
+/* Largest request id kept to match its response against */
+#define REPLAY_IDLEN 32
+
+struct pending {
+	char id[REPLAY_IDLEN];
+	int method;
+	int64_t ns;
+};
+
+typedef struct replay_client {
+	UT_hash_handle hh;
+	int64_t clientid; /* Id in the capture */
+	int64_t id; /* Id in epoll */
+
+	int fd;
+	enum replay_state state;
+
+	char *buf;
+	int bufsize;
+	int bufofs;
+
+	char *outbuf;
+	int outsize;
+	int outlen;
+	bool wantout;
+
+	char job_id[64];
+	bool hasjob;
+
+	/* Captured lines waiting for the client's first job */
+	const struct capture_rec **held;
+	int nheld;
+	int heldsize;
+
+	/* Has the capture closed this client, which is held off until its
+	 * requests have been answered so unpaced replays still get them */
+	bool closing;
+
+	/* Ring of requests awaiting a response */
+	struct pending pending[REPLAY_PENDING];
+	int pendhead;
+	int pendcount;
+} replay_client_t;
+
+/* Growable array of latency samples in nanoseconds */
+struct latency {
+	int64_t *ns;
+	int64_t count;
+	int64_t size;
+};
+
+/* A captured template and the generation of synthetic transactions it is
+ * served with, which changes whenever the captured transaction set did */
+struct template {
+	json_t *val;
+	const char *prevhash;
+	int height;
+	int txns;
+	int gen;
+};
+
+static struct option long_options[] = {
+	{"bitcoind",	required_argument,	0,	'B'},
+	{"file",	required_argument,	0,	'f'},
+	{"help",	no_argument,		0,	'h'},
+	{"loglevel",	required_argument,	0,	'l'},
+	{"speed",	required_argument,	0,	's'},
+	{"url",		required_argument,	0,	'U'},
+	{0, 0, 0, 0}
+};
+
+static volatile sig_atomic_t stopping;
+
+static char *capture;
+static struct capture_rec **recs;
+static int64_t norecs, captured_clients;
+
+static struct template *templates;
+static int notemplates;
+
+/* Template currently served by the stub bitcoind, -1 before the first */
+static int curtemplate = -1;
+static int64_t templates_served, blocks_submitted;
+
+/* Synthetic transactions of the generation last served */
+static mutex_t txns_lock;
+static json_t *txns_val;
+static int txns_gen = -1, txns_count;
+
+static replay_client_t *clients;
+static replay_client_t **clientsbyid;
+static int64_t noclients, clientsize;
+static int epfd;
+
+static struct addrinfo *serveraddr;
+
+static int64_t connects, connfails, disconnects, lines, unmatched, unsent, overflows;
+static int64_t responses, notifies, accepted, rejected, blockchanges, tplchanges;
+static int connected;
+
+static struct latency latencies[METHODS];
+
+static void sighandler(const int __maybe_unused sig)
+{
+	stopping = 1;
+}
+
+static void add_latency(struct latency *lat, const int64_t ns)
+{
+	if (unlikely(lat->count >= lat->size)) {
+		lat->size = lat->size ? lat->size * 2 : 4096;
+		lat->ns = realloc(lat->ns, sizeof(int64_t) * lat->size);
+		if (unlikely(!lat->ns))
+			quit(1, "Failed to realloc latency samples in add_latency");
+	}
+	lat->ns[lat->count++] = ns;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+	const int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_ms(const struct latency *lat, const double pct)
+{
+	int64_t idx = (int64_t)(pct / 100 * (lat->count - 1) + 0.5);
+
+	return (double)lat->ns[idx] / 1000000;
+}
+
+static void report_latency(const char *name, struct latency *lat)
+{
+	if (!lat->count) {
+		printf("%-20s no samples\n", name);
+		return;
+	}
+	qsort(lat->ns, lat->count, sizeof(int64_t), cmp_int64);
+	printf("%-20s %8"PRId64" samples  p50 %.3fms  p90 %.3fms  p99 %.3fms  p99.9 %.3fms  max %.3fms\n",
+	       name, lat->count, percentile_ms(lat, 50), percentile_ms(lat, 90),
+	       percentile_ms(lat, 99), percentile_ms(lat, 99.9),
+	       (double)lat->ns[lat->count - 1] / 1000000);
+}
+
+/* Read the whole capture into memory and index its records */
+static void load_capture(const char *fname)
+{
+	const struct capture_version *version;
+	struct stat statbuf;
+	int64_t ofs, size = 0;
+	int fd, gen = 0;
+
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &statbuf))
+		quit(1, "Failed to open capture file %s", fname);
+	capture = ckalloc(statbuf.st_size + 1);
+	ofs = 0;
+	while (ofs < statbuf.st_size) {
+		int ret = read(fd, capture + ofs, statbuf.st_size - ofs);
+
+		if (ret < 1)
+			quit(1, "Failed to read capture file %s", fname);
+		ofs += ret;
+	}
+	close(fd);
+
+	version = (struct capture_version *)capture;
+	if (statbuf.st_size < (off_t)sizeof(*version) || version->rec.type != CAPTURE_REC_VERSION ||
+	    version->magic != CAPTURE_MAGIC)
+		quit(1, "%s is not a capture file", fname);
+	if (version->version != CAPTURE_VERSION)
+		quit(1, "Unsupported capture version %u in %s", version->version, fname);
+
+	for (ofs = version->rec.len; ofs + (int64_t)sizeof(struct capture_rec) <= statbuf.st_size; ) {
+		struct capture_rec *rec = (struct capture_rec *)(capture + ofs);
+
+		if (rec->len < sizeof(struct capture_rec) || ofs + rec->len > statbuf.st_size) {
+			LOGWARNING("Capture truncated at offset %"PRId64, ofs);
+			break;
+		}
+		ofs += rec->len;
+		if (norecs == size) {
+			size = size ? size * 2 : 65536;
+			recs = realloc(recs, sizeof(struct capture_rec *) * size);
+			if (unlikely(!recs))
+				quit(1, "Failed to realloc recs in load_capture");
+		}
+		recs[norecs++] = rec;
+		if (rec->type == CAPTURE_REC_CONNECT)
+			captured_clients++;
+
+		if (rec->type == CAPTURE_REC_WORKBASE) {
+			struct template *tpl;
+			json_t *val;
+
+			val = json_loadb((char *)(rec + 1), rec->len - sizeof(struct capture_rec), 0, NULL);
+			if (unlikely(!val)) {
+				LOGWARNING("Invalid template at offset %"PRId64, ofs - rec->len);
+				continue;
+			}
+			templates = realloc(templates, sizeof(struct template) * (notemplates + 1));
+			if (unlikely(!templates))
+				quit(1, "Failed to realloc templates in load_capture");
+			tpl = &templates[notemplates];
+			tpl->val = val;
+			tpl->prevhash = json_string_value(json_object_get(val, "previousblockhash"));
+			tpl->height = json_integer_value(json_object_get(val, "height"));
+			tpl->txns = json_integer_value(json_object_get(val, "txns"));
+			if (!json_is_true(json_object_get(val, "unchanged")))
+				gen++;
+			tpl->gen = gen;
+			if (unlikely(!tpl->prevhash))
+				quit(1, "Template without previousblockhash at offset %"PRId64, ofs - rec->len);
+			/* Mark the record as a loaded template, keeping its
+			 * index in the otherwise unused clientid */
+			rec->flags = 1;
+			rec->clientid = notemplates++;
+		}
+	}
+	if (!notemplates)
+		quit(1, "No templates found in capture %s", fname);
+}
+
+/* Deterministic transactions for generation gen. Their contents don't matter
+ * to the pool beyond being distinct for each set. */
+static json_t *synthetic_txns(const int gen, const int count)
+{
+	json_t *arr_val = json_array();
+	int i;
+
+	for (i = 0; i < count; i++) {
+		uchar data[64], hash[32];
+		char *hex, *txid;
+		uint32_t seed[2];
+		json_t *txn_val;
+
+		seed[0] = gen;
+		seed[1] = i;
+		sha256((uchar *)seed, sizeof(seed), data);
+		sha256(data, 32, data + 32);
+		gen_hash(data, hash, sizeof(data));
+		hex = bin2hex(data, sizeof(data));
+		txid = bin2hex(hash, 32);
+		JSON_CPACK(txn_val, "{ss,ss,ss,s[],si,si,si}", "data", hex, "txid", txid,
+			   "hash", txid, "depends", "fee", 1000, "sigops", 4, "weight", 256);
+		json_array_append_new(arr_val, txn_val);
+		free(hex);
+		free(txid);
+	}
+	return arr_val;
+}
+
+static json_t *template_result(const struct template *tpl)
+{
+	json_t *val = json_object(), *txns;
+
+	json_object_set(val, "previousblockhash", json_object_get(tpl->val, "previousblockhash"));
+	json_object_set(val, "target", json_object_get(tpl->val, "target"));
+	json_object_set(val, "bits", json_object_get(tpl->val, "bits"));
+	json_object_set(val, "version", json_object_get(tpl->val, "version"));
+	json_object_set(val, "curtime", json_object_get(tpl->val, "curtime"));
+	json_object_set(val, "height", json_object_get(tpl->val, "height"));
+	json_object_set(val, "coinbasevalue", json_object_get(tpl->val, "coinbasevalue"));
+	json_object_set_new(val, "coinbaseaux", json_pack("{sO}", "flags",
+			    json_object_get(tpl->val, "flags")));
+	json_object_set_new(val, "rules", json_pack("[ss]", "csv", "segwit"));
+	json_object_set_new(val, "mintime", json_integer(0));
+	json_object_set_new(val, "mutable", json_pack("[s]", "time"));
+
+	mutex_lock(&txns_lock);
+	if (txns_gen != tpl->gen || txns_count != tpl->txns) {
+		if (txns_val)
+			json_decref(txns_val);
+		txns_val = synthetic_txns(tpl->gen, tpl->txns);
+		txns_gen = tpl->gen;
+		txns_count = tpl->txns;
+	}
+	txns = json_incref(txns_val);
+	mutex_unlock(&txns_lock);
+	json_object_set_new(val, "transactions", txns);
+	return val;
+}
+
+static json_t *validate_result(const char *address)
+{
+	bool segwit = false, script = false;
+
+	if (!address)
+		return json_null();
+	if (!strncmp(address, "bc1", 3) || !strncmp(address, "tb1", 3) || !strncmp(address, "bcrt1", 5)) {
+		segwit = true;
+		/* Witness script hashes have the longer 32 byte program */
+		script = strlen(address) > 50;
+	} else if (address[0] == '3' || address[0] == '2')
+		script = true;
+	return json_pack("{sb,sb,sb}", "isvalid", true, "isscript", script, "iswitness", segwit);
+}
+
+/* Answer one json rpc request the way bitcoind would for the current template */
+static char *stub_response(const char *body, int *len)
+{
+	json_t *val, *res_val, *id_val, *params;
+	const struct template *tpl;
+	const char *method;
+	char *buf, *ret;
+	int cur;
+
+	val = json_loads(body, 0, NULL);
+	if (unlikely(!val)) {
+		LOGWARNING("Stub bitcoind received invalid json %s", body);
+		return NULL;
+	}
+	method = json_string_value(json_object_get(val, "method"));
+	params = json_object_get(val, "params");
+	id_val = json_object_get(val, "id");
+	cur = __atomic_load_n(&curtemplate, __ATOMIC_ACQUIRE);
+	tpl = &templates[cur < 0 ? 0 : cur];
+	if (!safecmp(method, "getblocktemplate")) {
+		res_val = template_result(tpl);
+		__atomic_add_fetch(&templates_served, 1, __ATOMIC_RELAXED);
+	} else if (!safecmp(method, "getbestblockhash") || !safecmp(method, "getblockhash"))
+		res_val = json_string(tpl->prevhash);
+	else if (!safecmp(method, "getblockcount"))
+		res_val = json_integer(tpl->height - 1);
+	else if (!safecmp(method, "validateaddress"))
+		res_val = validate_result(json_string_value(json_array_get(params, 0)));
+	else {
+		if (!safecmp(method, "submitblock"))
+			__atomic_add_fetch(&blocks_submitted, 1, __ATOMIC_RELAXED);
+		else
+			LOGINFO("Stub bitcoind answering %s with null", method ? method : "no method");
+		res_val = json_null();
+	}
+	JSON_CPACK(res_val, "{sosnsO?}", "result", res_val, "error", "id", id_val);
+	buf = json_dumps(res_val, JSON_COMPACT | JSON_PRESERVE_ORDER);
+	json_decref(res_val);
+	json_decref(val);
+	ASPRINTF(&ret, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+		 "Content-Length: %d\r\n\r\n%s\n", (int)strlen(buf) + 1, buf);
+	*len = strlen(ret);
+	free(buf);
+	return ret;
+}
+
+static bool write_all(const int fd, const char *buf, const int len)
+{
+	int ofs = 0;
+
+	while (ofs < len) {
+		int ret = write(fd, buf + ofs, len - ofs);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		ofs += ret;
+	}
+	return true;
+}
+
+/* Serve the pool's generator on one connection, reading a request's headers
+ * up to its blank line then its Content-Length body */
+static void *stub_client(void *arg)
+{
+	int fd = *(int *)arg, bufsize = 65536, bufofs = 0;
+	char *buf = ckalloc(bufsize);
+
+	free(arg);
+	pthread_detach(pthread_self());
+
+	while (42) {
+		char *eoh, *clen, *reply;
+		int ret, hlen, blen, len;
+
+		buf[bufofs] = '\0';
+		eoh = strstr(buf, "\r\n\r\n");
+		if (eoh) {
+			hlen = eoh + 4 - buf;
+			clen = strcasestr(buf, "content-length:");
+			blen = clen && clen < eoh ? atoi(clen + 15) : 0;
+			if (bufofs >= hlen + blen) {
+				char save = buf[hlen + blen];
+
+				buf[hlen + blen] = '\0';
+				reply = stub_response(buf + hlen, &len);
+				buf[hlen + blen] = save;
+				bufofs -= hlen + blen;
+				memmove(buf, buf + hlen + blen, bufofs);
+				if (!reply || !write_all(fd, reply, len)) {
+					free(reply);
+					break;
+				}
+				free(reply);
+				continue;
+			}
+		}
+		if (bufofs + 1 >= bufsize) {
+			bufsize *= 2;
+			buf = realloc(buf, bufsize);
+			if (unlikely(!buf))
+				quit(1, "Failed to realloc buf in stub_client");
+		}
+		ret = read(fd, buf + bufofs, bufsize - bufofs - 1);
+		if (ret < 1)
+			break;
+		bufofs += ret;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void *stub_bitcoind(void *arg)
+{
+	int sockd = *(int *)arg;
+
+	rename_proc("stubbitcoind");
+
+	while (42) {
+		pthread_t pth;
+		int *fd;
+
+		fd = ckalloc(sizeof(int));
+		*fd = accept(sockd, NULL, NULL);
+		if (*fd < 0) {
+			free(fd);
+			if (errno == EINTR)
+				continue;
+			LOGERR("Stub bitcoind failed to accept");
+			break;
+		}
+		create_pthread(&pth, stub_client, fd);
+	}
+	return NULL;
+}
+
+/* Raise the open file limit as far as allowed to fit every client */
+static void raise_nofile(const int64_t needed)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim))
+		return;
+	if (rlim.rlim_cur >= (rlim_t)needed + 64)
+		return;
+	rlim.rlim_cur = (rlim_t)needed + 64;
+	if (rlim.rlim_max != RLIM_INFINITY && rlim.rlim_cur > rlim.rlim_max)
+		rlim.rlim_cur = rlim.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rlim))
+		LOGWARNING("Failed to raise open file limit, clients may fail to connect");
+}
+
+static void close_client(replay_client_t *client)
+{
+	if (client->state == REPLAY_CLOSED)
+		return;
+	if (client->state == REPLAY_CONNECTED)
+		connected--;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	Close(client->fd);
+	client->state = REPLAY_CLOSED;
+	unmatched += client->pendcount;
+	client->pendcount = 0;
+	unsent += client->nheld;
+	client->nheld = 0;
+}
+
+static void set_events(replay_client_t *client, const bool wantout)
+{
+	struct epoll_event event;
+
+	if (client->wantout == wantout)
+		return;
+	client->wantout = wantout;
+	event.events = EPOLLIN | EPOLLRDHUP | (wantout ? EPOLLOUT : 0);
+	event.data.u64 = client->id;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+static void flush_client(replay_client_t *client)
+{
+	int ofs = 0, ret;
+
+	while (ofs < client->outlen) {
+		ret = write(client->fd, client->outbuf + ofs, client->outlen - ofs);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			disconnects++;
+			close_client(client);
+			return;
+		}
+		ofs += ret;
+	}
+	client->outlen -= ofs;
+	if (client->outlen)
+		memmove(client->outbuf, client->outbuf + ofs, client->outlen);
+	set_events(client, client->outlen > 0);
+}
+
+/* Queue a line for the client, sending it straight away once connected */
+static void send_client(replay_client_t *client, const char *msg, const int len)
+{
+	if (unlikely(client->outlen + len + 1 > client->outsize)) {
+		while (client->outlen + len + 1 > client->outsize)
+			client->outsize = client->outsize ? client->outsize * 2 : 1024;
+		client->outbuf = realloc(client->outbuf, client->outsize);
+		if (unlikely(!client->outbuf))
+			quit(1, "Failed to realloc outbuf in send_client");
+	}
+	memcpy(client->outbuf + client->outlen, msg, len);
+	client->outlen += len;
+	client->outbuf[client->outlen++] = '\n';
+	if (client->state == REPLAY_CONNECTED && !client->wantout)
+		flush_client(client);
+}
+
+static replay_client_t *client_by_clientid(const int64_t clientid)
+{
+	replay_client_t *client;
+
+	HASH_FIND_I64(clients, &clientid, client);
+	return client;
+}
+
+static void replay_connect(const struct capture_rec *rec)
+{
+	struct epoll_event event;
+	replay_client_t *client;
+	int fd;
+
+	client = client_by_clientid(rec->clientid);
+	if (unlikely(client)) {
+		/* Capture ids are unique so this only happens across restarts */
+		HASH_DEL(clients, client);
+		close_client(client);
+	}
+	if (noclients == clientsize) {
+		clientsize = clientsize ? clientsize * 2 : 1024;
+		clientsbyid = realloc(clientsbyid, sizeof(replay_client_t *) * clientsize);
+		if (unlikely(!clientsbyid))
+			quit(1, "Failed to realloc clientsbyid in replay_connect");
+	}
+	client = ckzalloc(sizeof(replay_client_t));
+	client->clientid = rec->clientid;
+	client->id = noclients;
+	client->state = REPLAY_CLOSED;
+	clientsbyid[noclients++] = client;
+	HASH_ADD_I64(clients, clientid, client);
+
+	fd = socket(serveraddr->ai_family, serveraddr->ai_socktype | SOCK_CLOEXEC,
+		    serveraddr->ai_protocol);
+	if (unlikely(fd < 0)) {
+		LOGDEBUG("Failed to open socket for client %"PRId64": %s", rec->clientid, strerror(errno));
+		connfails++;
+		return;
+	}
+	noblock_socket(fd);
+	if (connect(fd, serveraddr->ai_addr, serveraddr->ai_addrlen) && errno != EINPROGRESS) {
+		LOGDEBUG("Failed to connect client %"PRId64": %s", rec->clientid, strerror(errno));
+		connfails++;
+		close(fd);
+		return;
+	}
+	client->fd = fd;
+	client->state = REPLAY_CONNECTING;
+	client->wantout = true;
+	event.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+	event.data.u64 = client->id;
+	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event))) {
+		LOGWARNING("Failed to add client %"PRId64" to epoll: %s", rec->clientid, strerror(errno));
+		connfails++;
+		close(fd);
+		client->state = REPLAY_CLOSED;
+	}
+}
+
+/* Close a client the capture has closed once nothing is left to send to or
+ * hear back from the pool */
+static void check_closing(replay_client_t *client)
+{
+	if (client->closing && client->state == REPLAY_CONNECTED && !client->outlen &&
+	    !client->pendcount && !client->nheld)
+		close_client(client);
+}
+
+static void connect_complete(replay_client_t *client)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		LOGDEBUG("Failed to connect client %"PRId64": %s", client->clientid, strerror(err));
+		connfails++;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+		Close(client->fd);
+		client->state = REPLAY_CLOSED;
+		return;
+	}
+	connects++;
+	connected++;
+	client->state = REPLAY_CONNECTED;
+	client->wantout = true;
+	flush_client(client);
+	check_closing(client);
+}
+
+static int line_method(const char *method)
+{
+	if (!safecmp(method, "mining.subscribe"))
+		return METHOD_SUBSCRIBE;
+	if (!safecmp(method, "mining.authorize"))
+		return METHOD_AUTHORISE;
+	if (!safecmp(method, "mining.submit"))
+		return METHOD_SUBMIT;
+	return METHOD_OTHER;
+}
+
+static void add_pending(replay_client_t *client, const json_t *id_val, const int method)
+{
+	struct pending *pending;
+	char *id;
+
+	if (client->pendcount >= REPLAY_PENDING) {
+		/* Give up on the oldest request */
+		client->pendhead = (client->pendhead + 1) % REPLAY_PENDING;
+		client->pendcount--;
+		unmatched++;
+	}
+	id = json_dumps(id_val, JSON_COMPACT | JSON_ENCODE_ANY);
+	pending = &client->pending[(client->pendhead + client->pendcount) % REPLAY_PENDING];
+	snprintf(pending->id, REPLAY_IDLEN, "%s", id ? id : "");
+	pending->method = method;
+	pending->ns = monotonic_ns();
+	client->pendcount++;
+	free(id);
+}
+
+/* Send a captured line, taking ownership of its decoded json if it had any */
+static void send_line(replay_client_t *client, const struct capture_rec *rec, json_t *val)
+{
+	const char *line = (const char *)(rec + 1);
+	int len = rec->len - sizeof(struct capture_rec);
+	json_t *id_val;
+	int method;
+
+	lines++;
+	if (unlikely(!val)) {
+		/* Replay invalid lines verbatim as the pool saw them */
+		send_client(client, line, len);
+		return;
+	}
+	method = line_method(json_string_value(json_object_get(val, "method")));
+	id_val = json_object_get(val, "id");
+	if (id_val && !json_is_null(id_val))
+		add_pending(client, id_val, method);
+	if (method == METHOD_SUBMIT) {
+		json_t *params = json_object_get(val, "params");
+		char *buf;
+
+		if (json_is_array(params) && json_array_size(params) > 1) {
+			json_array_set_new(params, 1, json_string(client->job_id));
+			buf = json_dumps(val, JSON_COMPACT | JSON_PRESERVE_ORDER);
+			send_client(client, buf, strlen(buf));
+			free(buf);
+			json_decref(val);
+			return;
+		}
+	}
+	send_client(client, line, len);
+	json_decref(val);
+}
+
+/* Lines after a share that came before the replayed client has any job are
+ * held back in order until its first notify, as an unpaced replay easily
+ * overtakes the pool. */
+static void hold_line(replay_client_t *client, const struct capture_rec *rec)
+{
+	if (client->nheld == client->heldsize) {
+		client->heldsize = client->heldsize ? client->heldsize * 2 : 64;
+		client->held = realloc(client->held, sizeof(struct capture_rec *) * client->heldsize);
+		if (unlikely(!client->held))
+			quit(1, "Failed to realloc held in hold_line");
+	}
+	client->held[client->nheld++] = rec;
+}
+
+static void release_held(replay_client_t *client)
+{
+	int i;
+
+	for (i = 0; i < client->nheld && client->state != REPLAY_CLOSED; i++) {
+		const struct capture_rec *rec = client->held[i];
+
+		send_line(client, rec, json_loadb((const char *)(rec + 1),
+			  rec->len - sizeof(struct capture_rec), 0, NULL));
+	}
+	client->nheld = 0;
+}
+
+static void replay_line(const struct capture_rec *rec)
+{
+	replay_client_t *client;
+	json_t *val;
+
+	client = client_by_clientid(rec->clientid);
+	if (unlikely(!client || client->state == REPLAY_CLOSED || client->closing))
+		return;
+	val = json_loadb((const char *)(rec + 1), rec->len - sizeof(struct capture_rec), 0, NULL);
+	if (client->nheld || (val && !client->hasjob &&
+	    line_method(json_string_value(json_object_get(val, "method"))) == METHOD_SUBMIT)) {
+		hold_line(client, rec);
+		if (val)
+			json_decref(val);
+		return;
+	}
+	send_line(client, rec, val);
+}
+
+static void parse_response(replay_client_t *client, json_t *val)
+{
+	json_t *id_val = json_object_get(val, "id");
+	struct pending *pending = NULL;
+	int i, slot = 0;
+	char *id;
+
+	id = json_dumps(id_val, JSON_COMPACT | JSON_ENCODE_ANY);
+	for (i = 0; id && i < client->pendcount; i++) {
+		slot = (client->pendhead + i) % REPLAY_PENDING;
+		if (!strncmp(client->pending[slot].id, id, REPLAY_IDLEN - 1)) {
+			pending = &client->pending[slot];
+			break;
+		}
+	}
+	free(id);
+	if (unlikely(!pending)) {
+		LOGDEBUG("Client %"PRId64" got response to unknown id", client->clientid);
+		return;
+	}
+	responses++;
+	add_latency(&latencies[pending->method], monotonic_ns() - pending->ns);
+	if (pending->method == METHOD_SUBMIT) {
+		if (json_is_true(json_object_get(val, "result")))
+			accepted++;
+		else
+			rejected++;
+	}
+	/* Responses normally arrive in order so this is the head of the ring */
+	if (i)
+		*pending = client->pending[client->pendhead];
+	client->pendhead = (client->pendhead + 1) % REPLAY_PENDING;
+	client->pendcount--;
+}
+
+static void parse_line(replay_client_t *client, const char *line)
+{
+	const char *method, *job_id;
+	json_t *val;
+
+	val = json_loads(line, 0, NULL);
+	if (unlikely(!val)) {
+		LOGINFO("Client %"PRId64" received invalid json", client->clientid);
+		return;
+	}
+	method = json_string_value(json_object_get(val, "method"));
+	if (!method)
+		parse_response(client, val);
+	else if (!strcmp(method, "mining.notify")) {
+		job_id = json_string_value(json_array_get(json_object_get(val, "params"), 0));
+		if (likely(job_id)) {
+			snprintf(client->job_id, sizeof(client->job_id), "%s", job_id);
+			client->hasjob = true;
+			if (client->nheld)
+				release_held(client);
+		}
+		notifies++;
+	}
+	json_decref(val);
+}
+
+static void read_client(replay_client_t *client)
+{
+	char *eol, *line;
+	int ret;
+
+	while (42) {
+		if (client->bufsize - client->bufofs < 1024) {
+			if (unlikely(client->bufsize >= REPLAY_MAXBUF)) {
+				LOGWARNING("Client %"PRId64" overflowed its receive buffer", client->clientid);
+				overflows++;
+				close_client(client);
+				return;
+			}
+			client->bufsize = client->bufsize ? client->bufsize * 2 : 4096;
+			client->buf = realloc(client->buf, client->bufsize);
+			if (unlikely(!client->buf))
+				quit(1, "Failed to realloc buf in read_client");
+		}
+		ret = read(client->fd, client->buf + client->bufofs, client->bufsize - client->bufofs - 1);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			ret = 0;
+		}
+		if (!ret) {
+			LOGDEBUG("Client %"PRId64" disconnected", client->clientid);
+			disconnects++;
+			close_client(client);
+			return;
+		}
+		client->bufofs += ret;
+		client->buf[client->bufofs] = '\0';
+		line = client->buf;
+		while ((eol = strchr(line, '\n'))) {
+			*eol = '\0';
+			parse_line(client, line);
+			if (client->state == REPLAY_CLOSED)
+				return;
+			line = eol + 1;
+		}
+		client->bufofs -= line - client->buf;
+		memmove(client->buf, line, client->bufofs + 1);
+		if (client->closing && !client->pendcount) {
+			check_closing(client);
+			return;
+		}
+	}
+}
+
+static void handle_event(const struct epoll_event *event)
+{
+	replay_client_t *client = clientsbyid[event->data.u64];
+
+	if (client->state == REPLAY_CLOSED)
+		return;
+	if (client->state == REPLAY_CONNECTING) {
+		if (event->events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			connect_complete(client);
+		return;
+	}
+	if (event->events & EPOLLOUT) {
+		flush_client(client);
+		check_closing(client);
+	}
+	if (client->state == REPLAY_CLOSED)
+		return;
+	if (event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		read_client(client);
+}
+
+/* Move the stub bitcoind on to a captured template, counting block changes
+ * the pool will see through getbestblockhash */
+static void replay_template(const struct capture_rec *rec)
+{
+	int cur = __atomic_load_n(&curtemplate, __ATOMIC_ACQUIRE), next = rec->clientid;
+
+	if (strcmp(templates[cur].prevhash, templates[next].prevhash))
+		blockchanges++;
+	tplchanges++;
+	__atomic_store_n(&curtemplate, next, __ATOMIC_RELEASE);
+}
+
+static void replay_record(const struct capture_rec *rec)
+{
+	replay_client_t *client;
+
+	switch (rec->type) {
+		case CAPTURE_REC_CONNECT:
+			replay_connect(rec);
+			break;
+		case CAPTURE_REC_LINE:
+			replay_line(rec);
+			break;
+		case CAPTURE_REC_CLOSE:
+			client = client_by_clientid(rec->clientid);
+			if (client) {
+				client->closing = true;
+				check_closing(client);
+			}
+			break;
+		case CAPTURE_REC_WORKBASE:
+			if (rec->flags)
+				replay_template(rec);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Wait for the pool to take its first template from the stub and accept
+ * connections before starting the clock */
+static void wait_for_pool(void)
+{
+	int tries = 0, fd;
+
+	LOGWARNING("Waiting for the pool to fetch a template from the stub bitcoind");
+	while (!stopping && !__atomic_load_n(&templates_served, __ATOMIC_RELAXED))
+		cksleep_ms(100);
+	while (!stopping) {
+		fd = socket(serveraddr->ai_family, serveraddr->ai_socktype | SOCK_CLOEXEC,
+			    serveraddr->ai_protocol);
+		if (fd >= 0 && !connect(fd, serveraddr->ai_addr, serveraddr->ai_addrlen)) {
+			close(fd);
+			break;
+		}
+		if (fd >= 0)
+			close(fd);
+		if (++tries > 300)
+			quit(1, "Pool is not accepting connections");
+		cksleep_ms(100);
+	}
+	/* Let the pool finish setting up work from the template */
+	cksleep_ms(1000);
+}
+
+static void report(const double elapsed, const double captured)
+{
+	int i;
+
+	printf("\nReplayed %"PRId64" records spanning %.1fs of capture in %.1fs\n",
+	       norecs, captured, elapsed);
+	printf("Connections: %"PRId64" established  %"PRId64" failed  %"PRId64" disconnected"
+	       "  %"PRId64" overflowed\n", connects, connfails, disconnects, overflows);
+	printf("Lines: %"PRId64" sent  %.1f/s  %"PRId64" responses  %"PRId64" unanswered"
+	       "  %"PRId64" never sent  %"PRId64" notifies\n", lines, elapsed > 0 ? lines / elapsed : 0,
+	       responses, unmatched, unsent, notifies);
+	printf("Shares: %"PRId64" accepted  %"PRId64" rejected\n", accepted, rejected);
+	printf("Templates: %"PRId64" replayed  %"PRId64" block changes  %"PRId64" served"
+	       "  %"PRId64" blocks submitted\n", tplchanges, blockchanges, templates_served,
+	       blocks_submitted);
+	for (i = 0; i < METHODS; i++)
+		report_latency(method_names[i], &latencies[i]);
+}
+
+int main(int argc, char **argv)
+{
+	char *url = "127.0.0.1:3333", *bitcoind = "127.0.0.1:8332", *fname = NULL;
+	char *sockaddr_url, *sockaddr_port;
+	int c, i, j, nfds, sockd, firsttpl = 0;
+	int64_t start, now, lastsec, next = 0, drainuntil = 0, inflight;
+	struct epoll_event *events;
+	struct sigaction handler;
+	struct addrinfo hints;
+	double speed = 1;
+	pthread_t pth;
+
+	while ((c = getopt_long(argc, argv, "B:f:hl:s:U:", long_options, &i)) != -1) {
+		switch(c) {
+			case 'B':
+				bitcoind = strdup(optarg);
+				break;
+			case 'f':
+				fname = strdup(optarg);
+				break;
+			case 'h':
+				for (j = 0; long_options[j].val; j++) {
+					struct option *jopt = &long_options[j];
+
+					if (jopt->has_arg) {
+						char *upper = alloca(strlen(jopt->name) + 1);
+						int offset = 0;
+
+						do {
+							upper[offset] = toupper(jopt->name[offset]);
+						} while (upper[offset++] != '\0');
+						printf("-%c %s | --%s %s\n", jopt->val,
+						       upper, jopt->name, upper);
+					} else
+						printf("-%c | --%s\n", jopt->val, jopt->name);
+				}
+				exit(0);
+			case 'l':
+				msg_loglevel = atoi(optarg);
+				if (msg_loglevel < LOG_EMERG ||
+				    msg_loglevel > LOG_DEBUG) {
+					quit(1, "Invalid loglevel: %d (range %d"
+						" - %d)",
+						msg_loglevel,
+						LOG_EMERG,
+						LOG_DEBUG);
+				}
+				break;
+			case 's':
+				speed = atof(optarg);
+				if (speed < 0)
+					quit(1, "Invalid speed: %s", optarg);
+				break;
+			case 'U':
+				url = strdup(optarg);
+				break;
+		}
+	}
+	if (!fname)
+		quit(1, "No capture file specified with -f");
+
+	load_capture(fname);
+	/* Serve the template current at the first client's arrival until
+	 * the replay starts */
+	for (i = 0; i < norecs && recs[i]->type != CAPTURE_REC_CONNECT; i++) {
+		if (recs[i]->type == CAPTURE_REC_WORKBASE && recs[i]->flags)
+			firsttpl = recs[i]->clientid;
+	}
+	curtemplate = firsttpl;
+
+	if (!extract_sockaddr(url, &sockaddr_url, &sockaddr_port))
+		quit(1, "Failed to extract server address from %s", url);
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(sockaddr_url, sockaddr_port, &hints, &serveraddr))
+		quit(1, "Failed to resolve %s:%s", sockaddr_url, sockaddr_port);
+
+	if (!extract_sockaddr(bitcoind, &sockaddr_url, &sockaddr_port))
+		quit(1, "Failed to extract stub bitcoind address from %s", bitcoind);
+	sockd = bind_socket(sockaddr_url, sockaddr_port);
+	if (sockd < 0 || listen(sockd, 64) < 0)
+		quit(1, "Failed to listen for the pool on %s", bitcoind);
+	mutex_init(&txns_lock);
+	create_pthread(&pth, stub_bitcoind, &sockd);
+
+	raise_nofile(captured_clients);
+	events = ckalloc(sizeof(struct epoll_event) * 1024);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		quit(1, "Failed to create epoll");
+
+	handler.sa_handler = &sighandler;
+	handler.sa_flags = 0;
+	sigemptyset(&handler.sa_mask);
+	sigaction(SIGTERM, &handler, NULL);
+	sigaction(SIGINT, &handler, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (speed > 0) {
+		LOGWARNING("Replaying %"PRId64" records with %d templates from %s to %s at %gx speed",
+			   norecs, notemplates, fname, url, speed);
+	} else {
+		LOGWARNING("Replaying %"PRId64" records with %d templates from %s to %s unpaced",
+			   norecs, notemplates, fname, url);
+	}
+	wait_for_pool();
+
+	start = lastsec = monotonic_ns();
+	while (42) {
+		int timeout = 100;
+
+		now = monotonic_ns();
+		if (!drainuntil && (stopping || next >= norecs)) {
+			/* Give outstanding requests a moment to be answered */
+			drainuntil = now + 2000000000ll;
+		}
+		if (drainuntil) {
+			inflight = 0;
+			for (i = 0; i < noclients; i++)
+				inflight += clientsbyid[i]->pendcount;
+			if (now >= drainuntil || !inflight)
+				break;
+		}
+
+		/* Feed every record that has come due, a batch at a time when
+		 * unpaced so responses are still read */
+		for (j = 0; !drainuntil && next < norecs && j < 1024; j++) {
+			int64_t due = speed > 0 ? (int64_t)(recs[next]->ns / speed) : 0;
+
+			if (start + due > now) {
+				timeout = MIN(timeout, (start + due - now) / 1000000);
+				break;
+			}
+			replay_record(recs[next++]);
+		}
+		if (!drainuntil && next < norecs && j == 1024)
+			timeout = 0;
+
+		nfds = epoll_wait(epfd, events, 1024, timeout);
+		for (i = 0; i < nfds; i++)
+			handle_event(&events[i]);
+
+		now = monotonic_ns();
+		if (now - lastsec >= 1000000000ll) {
+			LOGNOTICE("%ds: %"PRId64"/%"PRId64" records  %d connected  %"PRId64" lines"
+				  "  %"PRId64" responses", (int)((now - start) / 1000000000), next,
+				  norecs, connected, lines, responses);
+			lastsec = now;
+		}
+	}
+	for (i = 0; i < noclients; i++)
+		close_client(clientsbyid[i]);
+
+	report((double)(now - start) / 1000000000,
+	       norecs ? (double)recs[norecs - 1]->ns / 1000000000 : 0);
+	freeaddrinfo(serveraddr);
+	return 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Streams binary .sharebin share logs back out as the json share log entries
+ * they replace, one per line. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "sharelog.h"
+
+static int msg_loglevel = LOG_WARNING;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= msg_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+/* String ids of the file currently being decoded */
+static char **strings;
+static uint32_t nostrings;
+
+static void free_strings(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < nostrings; i++)
+		free(strings[i]);
+	dealloc(strings);
+	nostrings = 0;
+}
+
+static void add_string(const struct sharelog_string *string, const char *str, const int len)
+{
+	uint32_t id = string->id;
+
+	if (id >= nostrings) {
+		uint32_t newsize = id + 1024;
+
+		strings = realloc(strings, sizeof(char *) * newsize);
+		if (unlikely(!strings))
+			quit(1, "Failed to realloc strings in add_string");
+		memset(strings + nostrings, 0, sizeof(char *) * (newsize - nostrings));
+		nostrings = newsize;
+	}
+	free(strings[id]);
+	strings[id] = ckalloc(len + 1);
+	memcpy(strings[id], str, len);
+	strings[id][len] = '\0';
+}
+
+static const char *get_string(const uint32_t id)
+{
+	if (!id)
+		return NULL;
+	if (unlikely(id >= nostrings || !strings[id])) {
+		LOGWARNING("Undefined string id %u", id);
+		return NULL;
+	}
+	return strings[id];
+}
+
+static void set_string(json_t *val, const char *key, const char *str)
+{
+	/* Absent strings were never set in the json share log either */
+	if (str)
+		json_set_string(val, key, str);
+}
+
+static void decode_share(const struct sharelog_share *share, const char *tail, int taillen)
+{
+	char *inlined[SHARELOG_INLINE] = {}, cdfield[64];
+	json_t *val;
+	char *s;
+	int i;
+
+	for (i = 0; i < SHARELOG_INLINE; i++) {
+		int len = share->inlinelen[i];
+
+		if (len == SHARELOG_ABSENT)
+			continue;
+		if (unlikely(len > taillen)) {
+			LOGWARNING("Truncated share record");
+			goto out;
+		}
+		inlined[i] = ckalloc(len + 1);
+		memcpy(inlined[i], tail, len);
+		inlined[i][len] = '\0';
+		tail += len;
+		taillen -= len;
+	}
+	if (share->rec.flags & SHARELOG_HASHBIN) {
+		free(inlined[SHARELOG_HASH]);
+		inlined[SHARELOG_HASH] = bin2hex(share->hash, 32);
+	}
+
+	/* Must match the order the json share log entry is built in */
+	val = json_object();
+	json_set_int(val, "workinfoid", share->workinfoid);
+	json_set_int64(val, "clientid", share->clientid);
+	set_string(val, "enonce1", get_string(share->ids[SHARELOG_ENONCE1]));
+	set_string(val, "nonce2", inlined[SHARELOG_NONCE2]);
+	set_string(val, "nonce", inlined[SHARELOG_NONCE]);
+	set_string(val, "ntime", inlined[SHARELOG_NTIME]);
+	json_set_double(val, "diff", share->diff);
+	json_set_double(val, "sdiff", share->sdiff);
+	set_string(val, "hash", inlined[SHARELOG_HASH]);
+	json_set_bool(val, "result", share->rec.flags & SHARELOG_RESULT);
+	set_string(val, "reject-reason", get_string(share->ids[SHARELOG_REJECT]));
+	set_string(val, "error", get_string(share->ids[SHARELOG_ERROR]));
+	json_set_int(val, "errn", share->errn);
+	sprintf(cdfield, "%lu,%lu", (unsigned long)share->createsec, (unsigned long)share->creatensec);
+	json_set_string(val, "createdate", cdfield);
+	json_set_string(val, "createby", "code");
+	json_set_string(val, "createcode", "parse_submit");
+	set_string(val, "createinet", get_string(share->ids[SHARELOG_CREATEINET]));
+	set_string(val, "workername", get_string(share->ids[SHARELOG_WORKERNAME]));
+	set_string(val, "username", get_string(share->ids[SHARELOG_USERNAME]));
+	set_string(val, "address", get_string(share->ids[SHARELOG_ADDRESS]));
+	set_string(val, "agent", get_string(share->ids[SHARELOG_AGENT]));
+
+	s = json_dumps(val, JSON_EOL);
+	fputs(s, stdout);
+	free(s);
+	json_decref(val);
+out:
+	for (i = 0; i < SHARELOG_INLINE; i++)
+		free(inlined[i]);
+}
+
+/* Decode every record in fp, returning false on a corrupt file */
+static bool decode_file(FILE *fp, const char *fname)
+{
+	char buf[65536];
+	bool ret = false;
+
+	while (42) {
+		struct sharelog_rec *rec = (struct sharelog_rec *)buf;
+		int len;
+
+		len = fread(buf, 1, sizeof(struct sharelog_rec), fp);
+		if (!len) {
+			ret = true;
+			break;
+		}
+		if (unlikely(len != sizeof(struct sharelog_rec) || rec->len < len)) {
+			LOGERR("Corrupt record header in %s", fname);
+			break;
+		}
+		len = rec->len - sizeof(struct sharelog_rec);
+		if (unlikely(fread(buf + sizeof(struct sharelog_rec), 1, len, fp) != (size_t)len)) {
+			LOGERR("Truncated record in %s", fname);
+			break;
+		}
+		switch (rec->type) {
+			case SHARELOG_REC_VERSION: {
+				struct sharelog_version *version = (struct sharelog_version *)buf;
+
+				if (unlikely(rec->len < sizeof(*version) || version->magic != SHARELOG_MAGIC)) {
+					LOGERR("%s is not a binary share log", fname);
+					goto out;
+				}
+				if (unlikely(version->version > SHARELOG_VERSION)) {
+					LOGERR("Unsupported binary share log version %u in %s",
+					       version->version, fname);
+					goto out;
+				}
+				/* Ids are reused when a share log is reopened */
+				free_strings();
+				break;
+			}
+			case SHARELOG_REC_STRING:
+				if (unlikely(rec->len < sizeof(struct sharelog_string)))
+					goto corrupt;
+				add_string((struct sharelog_string *)buf, buf + sizeof(struct sharelog_string),
+					   rec->len - sizeof(struct sharelog_string));
+				break;
+			case SHARELOG_REC_SHARE:
+				if (unlikely(rec->len < sizeof(struct sharelog_share)))
+					goto corrupt;
+				decode_share((struct sharelog_share *)buf, buf + sizeof(struct sharelog_share),
+					     rec->len - sizeof(struct sharelog_share));
+				break;
+			default:
+				LOGWARNING("Skipping unknown record type %d in %s", rec->type, fname);
+				break;
+		}
+	}
+out:
+	return ret;
+corrupt:
+	LOGERR("Corrupt record type %d in %s", buf[0], fname);
+	goto out;
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, ret = 0;
+
+	while ((c = getopt(argc, argv, "l:")) != -1) {
+		switch(c) {
+			case 'l':
+				msg_loglevel = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-l loglevel] [file.sharebin ...]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	/* Read from stdin if no files are given */
+	if (optind >= argc) {
+		if (!decode_file(stdin, "stdin"))
+			ret = 1;
+	}
+	for (i = optind; i < argc; i++) {
+		FILE *fp = fopen(argv[i], "re");
+
+		if (unlikely(!fp)) {
+			LOGERR("Failed to open %s", argv[i]);
+			ret = 1;
+			continue;
+		}
+		if (!decode_file(fp, argv[i]))
+			ret = 1;
+		fclose(fp);
+		free_strings();
+	}
+	return ret;
+}
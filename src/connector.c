@@ -10,9 +10,13 @@
 #include "config.h"
 
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -21,14 +25,43 @@
 #include "uthash.h"
 #include "utlist.h"
 #include "stratifier.h"
+#include "stratumv2.h"
 #include "generator.h"
+#include "capture.h"
 
 #define MAX_MSGSIZE 1024
 
+/* Maximum number of epoll events each receiver services per epoll_wait */
+#define RECEIVER_EVENTS 64
+
+/* Maximum number of sends coalesced into each writev to a client */
+#define SENDER_IOVS 64
+
+/* Maximum number of writable clients the sender services per epoll_wait */
+#define SENDER_EVENTS 64
+
+/* Size of the buffer of the capture file */
+#define CAPTURE_BUFSIZE 262144
+/* Maximum number of records the capturer takes at once */
+#define CAPTURE_BATCH 256
+
+/* Lanes of messages from clients waiting for admission, served in order */
+#define ADMIT_RESUME 0
+#define ADMIT_NEW 1
+#define ADMISSION_LANES 2
+
 typedef struct client_instance client_instance_t;
 typedef struct sender_send sender_send_t;
 typedef struct share share_t;
 typedef struct redirect redirect_t;
+typedef struct cmsg cmsg_t;
+typedef struct receiver_instance receiver_t;
+typedef struct admission admission_t;
+typedef struct token_bucket token_bucket_t;
+
+/* All sender_sends are allocated from this slab */
+static ckslab_t *sender_slab;
+typedef struct connector_data cdata_t;
 
 struct client_instance {
 	/* For clients hashtable */
@@ -60,11 +93,22 @@ struct client_instance {
 	/* Which serverurl is this instance connected to */
 	int server;
 
+	/* Which receiver's epoll this instance is sharded to */
+	int receiver;
+
 	char *buf;
 	unsigned long bufofs;
 
-	/* Are we currently sending a blocked message from this client */
-	sender_send_t *sending;
+	/* Linked list of pending sends to this client, only accessed by the
+	 * sender thread */
+	sender_send_t *sends;
+
+	/* For the sender's lists of clients ready to send and waiting */
+	client_instance_t *sender_next;
+	client_instance_t *sender_prev;
+
+	/* Is this client waiting on EPOLLOUT in the sender's epoll */
+	bool sender_waiting;
 
 	/* Is this a trusted remote server */
 	bool remote;
@@ -72,6 +116,16 @@ struct client_instance {
 	/* Is this the parent passthrough client */
 	bool passthrough;
 
+	/* Does this passthrough relay its messages in raw envelopes */
+	bool raw;
+
+	/* Has the upstream seen a json message with this client's address so
+	 * its messages can be relayed raw */
+	bool relayed;
+
+	/* Channel state of a client on a Stratum V2 server */
+	sv2_client_t *sv2;
+
 	/* Linked list of shares in redirector mode.*/
 	share_t *shares;
 
@@ -85,6 +139,24 @@ struct client_instance {
 
 	/* The size of the socket send buffer */
 	int sendbufsize;
+
+	/* Admission control state protected by the admission_lock. Has an
+	 * authorise or other message been passed to the stratifier, is it in
+	 * the resuming lane and how many messages are waiting. */
+	bool admitted;
+	bool priority;
+	int admissions;
+	/* Set once admitted with nothing waiting, after which its messages
+	 * are passed on directly. Never cleared so can be read unlocked. */
+	bool admission_clear;
+
+	/* Has this client's fd been handed over to a new instance, after
+	 * which we must neither read from nor write to it */
+	bool handedover;
+	/* Is this client to be marked handed over by the sender, which keeps
+	 * the hex of any data it had yet to write in sendtail */
+	bool handingover;
+	char *sendtail;
 };
 
 struct sender_send {
@@ -95,6 +167,27 @@ struct sender_send {
 	char *buf;
 	int len;
 	int ofs;
+
+	/* Set when buf belongs to a message shared by many sends */
+	ckshared_t *shared;
+
+	/* Has this send been counted in sends_delayed */
+	bool delayed;
+
+	/* Monotonic ns of the connector read and of queueing to the connector
+	 * for share results being timed, otherwise 0 */
+	int64_t stamp;
+	int64_t queued;
+};
+
+/* Client message for the cmpq, either json to be serialised for the client or
+ * a message already serialised and shared with other clients */
+struct cmsg {
+	json_t *json_msg;
+	ckshared_t *shared;
+	int64_t client_id;
+	int64_t stamp;
+	int64_t queued;
 };
 
 struct share {
@@ -112,6 +205,36 @@ struct redirect {
 	int redirect_no;
 };
 
+/* A message from a client waiting for admission */
+struct admission {
+	admission_t *next;
+	admission_t *prev;
+
+	int64_t client_id;
+	json_t *val;
+	/* Will passing this on admit the client */
+	bool admits;
+};
+
+/* Tokens are added at rate per second up to one second's worth */
+struct token_bucket {
+	double rate;
+	double tokens;
+	int64_t last;
+};
+
+/* Each receiver thread has its own epoll instance with all the server fds and
+ * the clients it accepted */
+struct receiver_instance {
+	cdata_t *cdata;
+	pthread_t pth;
+	int id;
+	int epfd;
+	/* Monotonic ns until which the server fds are out of this epoll
+	 * while accepting is paced, 0 when accepting */
+	int64_t paused_until;
+};
+
 /* Private data for the connector */
 struct connector_data {
 	ckpool_t *ckp;
@@ -124,12 +247,13 @@ struct connector_data {
 	int *serverfd;
 	/* All time count of clients connected */
 	int nfds;
-	/* The epoll fd */
-	int epfd;
+
+	/* Array of receivers, each with its own epoll fd */
+	receiver_t *receivers;
+	int receiver_count;
 
 	bool accept;
 	pthread_t pth_sender;
-	pthread_t pth_receiver;
 
 	/* For the hashtable of all clients */
 	client_instance_t *clients;
@@ -140,15 +264,14 @@ struct connector_data {
 
 	int clients_generated;
 	int dead_generated;
+	/* Clients in the hashtable, kept to read without walking it */
+	int nclients;
 
 	int64_t client_ids;
 
 	/* client message process queue */
 	ckmsgq_t *cmpq;
 
-	/* client message event process queue */
-	ckmsgq_t *cevents;
-
 	/* For the linked list of pending sends */
 	sender_send_t *sender_sends;
 
@@ -159,7 +282,14 @@ struct connector_data {
 
 	/* For protecting the pending sends list */
 	mutex_t sender_lock;
-	pthread_cond_t sender_cond;
+
+	/* eventfd to wake the sender when new sends are added */
+	int sender_wakefd;
+
+	/* Set until the sender has marked the clients handing over as handed
+	 * over, signalled on handover_cond under the sender_lock */
+	bool handover_request;
+	pthread_cond_t handover_cond;
 
 	/* Hash list of all redirected IP address in redirector mode */
 	redirect_t *redirects;
@@ -172,9 +302,27 @@ struct connector_data {
 
 	/* Have we given the warning about inability to raise sendbuf size */
 	bool wmem_warn;
-};
 
-typedef struct connector_data cdata_t;
+	/* Admission control of new clients */
+	mutex_t admission_lock;
+	pthread_cond_t admission_cond;
+	pthread_t pth_admitter;
+	token_bucket_t accept_bucket;
+	token_bucket_t auth_bucket;
+	/* Lists of messages waiting for admission in each lane */
+	admission_t *admissions[ADMISSION_LANES];
+	int admissions_queued[ADMISSION_LANES];
+
+	/* fds and ids of the clients handed over to a new instance */
+	int *handover_fds;
+	int64_t *handover_ids;
+	int handover_nfds;
+
+	int64_t accepts_deferred;
+	int64_t clients_admitted;
+	int64_t clients_resumed;
+	int64_t admissions_shed;
+};
 
 void connector_upstream_msg(ckpool_t *ckp, char *msg)
 {
@@ -238,6 +386,7 @@ static client_instance_t *recruit_client(cdata_t *cdata)
 static void __recycle_client(cdata_t *cdata, client_instance_t *client)
 {
 	dealloc(client->buf);
+	sv2_free_client(client->sv2);
 	memset(client, 0, sizeof(client_instance_t));
 	client->id = -1;
 	DL_APPEND2(cdata->recycled_clients, client, recycled_prev, recycled_next);
@@ -264,10 +413,181 @@ int64_t connector_newclientid(ckpool_t *ckp)
 	return ret;
 }
 
+/* Capture file of client traffic and template updates, set up before any of
+ * the processes start and only written to by the capturer thread. */
+struct capture {
+	ckmsgq_t *q;
+	char *fname;
+	int fd;
+
+	char *buf;
+	int len;
+
+	int64_t start;
+
+	/* Set once a write fails, after which nothing more is captured */
+	bool failed;
+	time_t last_warn;
+};
+
+static struct capture *capture;
+
+static void capture_write(const char *buf, const int len)
+{
+	int ofs = 0;
+
+	if (unlikely(capture->failed))
+		return;
+	while (ofs < len) {
+		int ret = write(capture->fd, buf + ofs, len - ofs);
+
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Failed to write to capture file %s, no longer capturing",
+			       capture->fname);
+			__atomic_store_n(&capture->failed, true, __ATOMIC_RELAXED);
+			close(capture->fd);
+			capture->fd = -1;
+			break;
+		}
+		ofs += ret;
+	}
+}
+
+static void capture_append(const char *buf, const int len)
+{
+	if (capture->len + len > CAPTURE_BUFSIZE) {
+		capture_write(capture->buf, capture->len);
+		capture->len = 0;
+	}
+	/* Unbuffered for records larger than the buffer */
+	if (unlikely(len > CAPTURE_BUFSIZE))
+		capture_write(buf, len);
+	else {
+		memcpy(capture->buf + capture->len, buf, len);
+		capture->len += len;
+	}
+}
+
+/* Records are taken in batches and flushed to the file after each batch so
+ * the capture is complete whenever the queue runs dry */
+static void capture_process(ckpool_t __maybe_unused *ckp, void **data, const int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct capture_rec *rec = data[i];
+
+		capture_append((char *)rec, rec->len);
+		free(rec);
+	}
+	if (capture->len)
+		capture_write(capture->buf, capture->len);
+	capture->len = 0;
+}
+
+/* Start capturing to ckp->capturefile, truncating any old capture there */
+void connector_open_capture(ckpool_t *ckp)
+{
+	struct capture_version version;
+	ts_t now;
+
+	capture = ckzalloc(sizeof(struct capture));
+	capture->fname = ckp->capturefile;
+	capture->fd = open(capture->fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (unlikely(capture->fd < 0)) {
+		LOGWARNING("Failed to open capture file %s, not capturing", capture->fname);
+		dealloc(capture);
+		dealloc(ckp->capturefile);
+		return;
+	}
+	capture->buf = ckalloc(CAPTURE_BUFSIZE);
+	capture->start = monotonic_ns();
+	ts_realtime(&now);
+
+	memset(&version, 0, sizeof(version));
+	version.rec.type = CAPTURE_REC_VERSION;
+	version.rec.len = sizeof(version);
+	version.magic = CAPTURE_MAGIC;
+	version.version = CAPTURE_VERSION;
+	version.startsec = now.tv_sec;
+	version.startnsec = now.tv_nsec;
+	capture_write((char *)&version, sizeof(version));
+
+	capture->q = create_ckmsgqs_batch(ckp, "capturer", &capture_process, 1, CAPTURE_BATCH);
+	LOGWARNING("Capturing client traffic to %s", capture->fname);
+}
+
+/* Queue a record of type to the capture file, if there is one */
+void connector_capture(const int type, const int64_t id, const int server, const char *buf,
+		       const int len)
+{
+	struct capture_rec *rec;
+	time_t now_t;
+
+	if (likely(!capture) || unlikely(__atomic_load_n(&capture->failed, __ATOMIC_RELAXED)))
+		return;
+	rec = ckalloc(sizeof(struct capture_rec) + len);
+	rec->type = type;
+	rec->flags = 0;
+	rec->server = server;
+	rec->len = sizeof(struct capture_rec) + len;
+	rec->ns = monotonic_ns() - capture->start;
+	rec->clientid = id;
+	if (len)
+		memcpy(rec + 1, buf, len);
+	/* Capturing must never stall clients so drop records if the capturer
+	 * falls behind, warning at most once a minute */
+	if (likely(ckmsgq_tryadd(capture->q, rec)))
+		return;
+	free(rec);
+	now_t = time(NULL);
+	if (now_t - __atomic_load_n(&capture->last_warn, __ATOMIC_RELAXED) >= 60) {
+		__atomic_store_n(&capture->last_warn, now_t, __ATOMIC_RELAXED);
+		LOGWARNING("Capturer falling behind, dropped %"PRId64" capture records",
+			   __atomic_load_n(&capture->q->dropped, __ATOMIC_RELAXED));
+	}
+}
+
+/* Takes a token from tb if one is available returning 0, otherwise returns
+ * the ns until one will be. */
+static int64_t take_token(token_bucket_t *tb, const int64_t now)
+{
+	if (tb->last) {
+		tb->tokens += (double)(now - tb->last) * tb->rate / 1000000000;
+		if (tb->tokens > tb->rate)
+			tb->tokens = tb->rate;
+	} else
+		tb->tokens = tb->rate;
+	tb->last = now;
+	if (tb->tokens >= 1) {
+		tb->tokens -= 1;
+		return 0;
+	}
+	return (1 - tb->tokens) * 1000000000 / tb->rate + 1;
+}
+
+/* Returns 0 if a new connection can be accepted now under acceptrate,
+ * otherwise the ns to wait. */
+static int64_t accept_wait(cdata_t *cdata)
+{
+	int64_t ret;
+
+	mutex_lock(&cdata->admission_lock);
+	ret = take_token(&cdata->accept_bucket, monotonic_ns());
+	if (ret)
+		cdata->accepts_deferred++;
+	mutex_unlock(&cdata->admission_lock);
+
+	return ret;
+}
+
 /* Accepts incoming connections on the server socket and generates client
  * instances */
-static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
+static int accept_client(receiver_t *receiver, const uint64_t server)
 {
+	cdata_t *cdata = receiver->cdata;
 	int fd, port, no_clients, sockd;
 	ckpool_t *ckp = cdata->ckp;
 	client_instance_t *client;
@@ -291,10 +611,11 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	address_len = sizeof(client->address_storage);
 	fd = accept(sockd, client->address, &address_len);
 	if (unlikely(fd < 0)) {
-		/* Handle these errors gracefully should we ever share this
-		 * socket */
+		/* The listening socket is shared by all receivers so another
+		 * one may have accepted this connection already */
 		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
-			LOGERR("Recoverable error on accept in accept_client");
+			LOGDEBUG("Recoverable error on accept in accept_client");
+			recycle_client(cdata, client);
 			return 0;
 		}
 		LOGERR("Failed to accept on socket %d in acceptor", sockd);
@@ -330,24 +651,37 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	LOGINFO("Connected new client %d on socket %d to %d active clients from %s:%d",
 		cdata->nfds, fd, no_clients, client->address_name, port);
 
+	/* Without admission control all messages are passed on directly */
+	client->admission_clear = !ckp->authrate || ckp->passthrough || ckp->redirector;
+	if (ckp->sv2server && ckp->sv2server[server])
+		client->sv2 = sv2_new_client();
+
 	ck_wlock(&cdata->lock);
 	client->id = cdata->client_ids++;
 	HASH_ADD_I64(cdata->clients, id, client);
+	cdata->nclients++;
 	cdata->nfds++;
 	ck_wunlock(&cdata->lock);
 
+	if (!client->sv2)
+		connector_capture(CAPTURE_REC_CONNECT, client->id, server, client->address_name,
+				  strlen(client->address_name));
+
 	/* We increase the ref count on this client as epoll creates a pointer
 	 * to it. We drop that reference when the socket is closed which
 	 * removes it automatically from the epoll list. */
 	__inc_instance_ref(client);
 	client->fd = fd;
+	client->receiver = receiver->id;
 	optlen = sizeof(client->sendbufsize);
 	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
 	LOGDEBUG("Client sendbufsize detected as %d", client->sendbufsize);
 
+	/* Each client is only ever serviced by its receiver's thread so it is
+	 * registered level triggered once for its lifetime */
 	event.data.u64 = client->id;
-	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+	event.events = EPOLLIN | EPOLLRDHUP;
+	if (unlikely(epoll_ctl(receiver->epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
 		LOGERR("Failed to epoll_ctl add in accept_client");
 		dec_instance_ref(cdata, client);
 		return 0;
@@ -367,6 +701,7 @@ static int __drop_client(cdata_t *cdata, client_instance_t *client)
 	/* Closing the fd will automatically remove it from the epoll list */
 	Close(client->fd);
 	HASH_DEL(cdata->clients, client);
+	cdata->nclients--;
 	DL_APPEND2(cdata->dead_clients, client, dead_prev, dead_next);
 	/* This is the reference to this client's presence in the
 	 * epoll list. */
@@ -407,6 +742,8 @@ static int drop_client(cdata_t *cdata, client_instance_t *client)
 		}
 		LOGDEBUG("Connector dropped fd %d", fd);
 		stratifier_drop_id(cdata->ckp, client_id);
+		if (!client->sv2)
+			connector_capture(CAPTURE_REC_CLOSE, client_id, client->server, NULL, 0);
 	}
 
 	return fd;
@@ -475,6 +812,7 @@ static void drop_all_clients(cdata_t *cdata)
 }
 
 static void send_client(ckpool_t *ckp, cdata_t *cdata, int64_t id, char *buf);
+static void send_client_frame(cdata_t *cdata, client_instance_t *client, char *buf, const int len);
 
 /* Look for shares being submitted via a redirector and add them to a linked
  * list for looking up the responses. */
@@ -510,17 +848,331 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 	ck_wunlock(&cdata->lock);
 }
 
+/* A minimal tokeniser for mining.submit, the bulk of all messages received,
+ * which fills in a stratum_submit_t without any allocation. Anything it does
+ * not recognise, including escaped strings and any other method, returns
+ * false to be parsed as json instead, so errors are handled as before. */
+static inline const char *submit_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r')
+		p++;
+	return p;
+}
+
+/* Copies the string at p into buf of size len, returning the position after
+ * its closing quote or NULL. Control chars including the EOL are refused so
+ * we never parse beyond the current message. */
+static const char *submit_string(const char *p, char *buf, const int len)
+{
+	const char *end;
+
+	if (*p++ != '"')
+		return NULL;
+	for (end = p; *end != '"'; end++) {
+		if (unlikely(*end == '\\' || (uchar)*end < 0x20))
+			return NULL;
+	}
+	if (unlikely(end - p >= len))
+		return NULL;
+	memcpy(buf, p, end - p);
+	buf[end - p] = '\0';
+	return end + 1;
+}
+
+static const char *submit_idval(const char *p, stratum_submit_t *submit)
+{
+	const char *end;
+
+	if (*p == '"') {
+		submit->idtype = SUBMIT_ID_STR;
+		return submit_string(p, submit->strid, sizeof(submit->strid));
+	}
+	if (!strncmp(p, "null", 4)) {
+		submit->idtype = SUBMIT_ID_NULL;
+		return p + 4;
+	}
+	end = p;
+	if (*end == '-')
+		end++;
+	/* Leave leading zeroes, floats and overflow to json */
+	if (*end == '0' && isdigit((uchar)end[1]))
+		return NULL;
+	while (isdigit((uchar)*end))
+		end++;
+	if (end - p < 1 || end - p > 18 || !isdigit((uchar)end[-1]))
+		return NULL;
+	if (*end != ',' && *end != '}' && submit_ws(end) == end)
+		return NULL;
+	submit->intid = strtoll(p, NULL, 10);
+	submit->idtype = SUBMIT_ID_INT;
+	return end;
+}
+
+static const char *submit_params(const char *p, stratum_submit_t *submit)
+{
+	char *fields[] = { submit->workername, submit->job_id, submit->nonce2,
+			   submit->ntime, submit->nonce, submit->version_mask };
+	const int lens[] = { sizeof(submit->workername), sizeof(submit->job_id),
+			     sizeof(submit->nonce2), sizeof(submit->ntime),
+			     sizeof(submit->nonce), sizeof(submit->version_mask) };
+	int n = 0;
+
+	if (*p++ != '[')
+		return NULL;
+	p = submit_ws(p);
+	while (42) {
+		if (n >= 6 || !(p = submit_string(p, fields[n], lens[n])))
+			return NULL;
+		n++;
+		p = submit_ws(p);
+		if (*p == ']')
+			break;
+		if (*p++ != ',')
+			return NULL;
+		p = submit_ws(p);
+	}
+	if (n < 5)
+		return NULL;
+	submit->nparams = n;
+	return p + 1;
+}
+
+static bool parse_fast_submit(const char *p, stratum_submit_t *submit)
+{
+	bool method = false, params = false;
+	char key[8], buf[16];
+
+	submit->idtype = SUBMIT_ID_NONE;
+	p = submit_ws(p);
+	if (*p++ != '{')
+		return false;
+	while (42) {
+		p = submit_ws(p);
+		if (!(p = submit_string(p, key, sizeof(key))))
+			return false;
+		p = submit_ws(p);
+		if (*p++ != ':')
+			return false;
+		p = submit_ws(p);
+		if (!strcmp(key, "method")) {
+			if (method || !(p = submit_string(p, buf, sizeof(buf))) ||
+			    strcmp(buf, "mining.submit"))
+				return false;
+			method = true;
+		} else if (!strcmp(key, "params")) {
+			if (params || !(p = submit_params(p, submit)))
+				return false;
+			params = true;
+		} else if (!strcmp(key, "id")) {
+			if (submit->idtype != SUBMIT_ID_NONE || !(p = submit_idval(p, submit)))
+				return false;
+		} else
+			return false;
+		p = submit_ws(p);
+		if (*p == '}')
+			break;
+		if (*p++ != ',')
+			return false;
+	}
+	p = submit_ws(p + 1);
+	return method && params && *p == '\n';
+}
+
+/* Pass a message received from a client on to where it is processed */
+static void recv_client_msg(ckpool_t *ckp, json_t *val)
+{
+	if (!ckp->passthrough)
+		stratifier_add_recv(ckp, val);
+	if (ckp->node)
+		stratifier_add_recv(ckp, json_deep_copy(val));
+	if (ckp->passthrough)
+		generator_add_send(ckp, val);
+}
+
+/* Is this a subscribe asking to resume a session the stratifier still holds */
+static bool resuming_session(ckpool_t *ckp, const char *method, const json_t *val)
+{
+	const char *session;
+
+	if (!method || strcmp(method, "mining.subscribe"))
+		return false;
+	session = json_string_value(json_array_get(json_object_get(val, "params"), 1));
+	return session && *session && stratifier_session_resumable(ckp, session);
+}
+
+/* Queue a message from a client not yet admitted in its lane for the
+ * admitter, or pass it on if the client has been admitted since. Returns
+ * false if the lane is full and the client is to be dropped. */
+static bool queue_admission(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client, json_t *val)
+{
+	const char *method = json_string_value(json_object_get(val, "method"));
+	/* Looked up before taking admission_lock to not nest instance_lock */
+	bool resume = resuming_session(ckp, method, val);
+	admission_t *admission;
+	int lane;
+
+	mutex_lock(&cdata->admission_lock);
+	if (client->admitted && !client->admissions) {
+		client->admission_clear = true;
+		mutex_unlock(&cdata->admission_lock);
+		recv_client_msg(ckp, val);
+		return true;
+	}
+	/* Only choose a lane when nothing is waiting to keep messages in
+	 * order */
+	if (!client->admissions)
+		client->priority = resume;
+	lane = client->priority ? ADMIT_RESUME : ADMIT_NEW;
+	if (unlikely(cdata->admissions_queued[lane] >= ckp->maxadmissions)) {
+		cdata->admissions_shed++;
+		mutex_unlock(&cdata->admission_lock);
+		LOGINFO("Admission queue full, dropping client %"PRId64" %s", client->id,
+			client->address_name);
+		json_decref(val);
+		return false;
+	}
+	admission = ckalloc(sizeof(admission_t));
+	admission->client_id = client->id;
+	admission->val = val;
+	admission->admits = !method || (strcmp(method, "mining.subscribe") &&
+					strcmp(method, "mining.configure"));
+	DL_APPEND(cdata->admissions[lane], admission);
+	cdata->admissions_queued[lane]++;
+	client->admissions++;
+	pthread_cond_signal(&cdata->admission_cond);
+	mutex_unlock(&cdata->admission_lock);
+
+	return true;
+}
+
+/* Pass on a parsed message from client to where it is processed. Returns
+ * false if the client should be dropped. */
+static bool pass_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client, json_t *val)
+{
+	json_object_set_new_nocheck(val, "server", json_integer(client->server));
+
+	/* Do not send messages of clients we've already dropped. We do this
+	 * unlocked as the occasional false negative can be filtered by the
+	 * stratifier. */
+	if (likely(!client->invalid)) {
+		if (likely(client->admission_clear || client->passthrough))
+			recv_client_msg(ckp, val);
+		else if (!queue_admission(ckp, cdata, client, val))
+			return false;
+	} else
+		json_decref(val);
+	return true;
+}
+
+/* Parse a relay envelope at the start of a raw passthrough's buffer, storing
+ * its length in buflen or zero if it is incomplete. Returns false if the
+ * passthrough should be dropped. */
+static bool parse_relay_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client, int *buflen)
+{
+	int64_t client_id;
+	relay_hdr_t hdr;
+	json_t *val;
+
+	*buflen = relay_msg(client->buf, client->bufofs, &client_id);
+	if (unlikely(*buflen < 0)) {
+		LOGNOTICE("Passthrough id %"PRId64" fd %d sent invalid relay envelope, disconnecting",
+			  client->id, client->fd);
+		return false;
+	}
+	/* Each envelope carries one line of a subclient, held to the same size
+	 * as any other client's line as soon as its header has arrived */
+	if (client->bufofs >= sizeof(relay_hdr_t) && !client->remote) {
+		memcpy(&hdr, client->buf, sizeof(relay_hdr_t));
+		if (unlikely(le32toh(hdr.len) > MAX_MSGSIZE)) {
+			LOGNOTICE("Passthrough id %"PRId64" fd %d relayed oversize message, disconnecting",
+				  client->id, client->fd);
+			return false;
+		}
+	}
+	if (!*buflen)
+		return true;
+	val = json_loadb(client->buf + sizeof(relay_hdr_t), *buflen - sizeof(relay_hdr_t),
+			 JSON_DISABLE_EOF_CHECK, NULL);
+	if (unlikely(!val)) {
+		LOGINFO("Passthrough id %"PRId64" subclient %"PRId64" relayed invalid json",
+			client->id, client_id);
+		return true;
+	}
+	json_object_set_new_nocheck(val, "client_id", json_integer((client->id << 32) | client_id));
+	/* Only the first message relayed for a subclient carries its address */
+	if (!json_object_get(val, "address"))
+		json_object_set_new_nocheck(val, "address", json_string(client->address_name));
+	return pass_client_msg(ckp, cdata, client, val);
+}
+
+/* Parse a Stratum V2 frame at the start of a client's buffer, storing its
+ * length in buflen or zero if it is incomplete. Its shares go straight to the
+ * stratifier like those of parse_fast_submit. Returns false if the client
+ * should be dropped. */
+static bool parse_sv2_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client, int *buflen,
+			  const int64_t rstamp)
+{
+	stratum_submit_t *submit;
+	sv2_recv_t recv;
+	int i;
+
+	*buflen = sv2_frame(client->buf, client->bufofs);
+	if (unlikely(*buflen < 0)) {
+		LOGNOTICE("Client id %"PRId64" fd %d sent oversize stratum v2 frame, disconnecting",
+			  client->id, client->fd);
+		return false;
+	}
+	if (!*buflen)
+		return true;
+	sv2_recv_frame(ckp, client->sv2, client->buf, *buflen, &recv);
+	if (recv.reply)
+		send_client_frame(cdata, client, recv.reply, recv.replylen);
+	for (i = 0; i < recv.nmsgs; i++) {
+		json_t *val = recv.msgs[i];
+
+		json_object_set_new_nocheck(val, "client_id", json_integer(client->id));
+		json_object_set_new_nocheck(val, "address", json_string(client->address_name));
+		if (!recv.drop && !pass_client_msg(ckp, cdata, client, val))
+			recv.drop = true;
+		else if (recv.drop)
+			json_decref(val);
+	}
+	if (!recv.submitted || recv.drop || unlikely(client->invalid))
+		return !recv.drop;
+
+	submit = &recv.submit;
+	if (likely(client->admission_clear)) {
+		submit->client_id = client->id;
+		submit->stamp = rstamp;
+		stratifier_add_submit(ckp, submit);
+		stage_latency(STAGE_READ, rstamp);
+	} else {
+		json_t *val;
+
+		/* Not admitted yet so queue it as json behind the authorise */
+		JSON_CPACK(val, "{sI,ss,s[ssssss],sI,ss}", "id", submit->intid,
+			   "method", "mining.submit", "params", submit->workername,
+			   submit->job_id, submit->nonce2, submit->ntime, submit->nonce,
+			   submit->version_mask, "client_id", client->id,
+			   "address", client->address_name);
+		return pass_client_msg(ckp, cdata, client, val);
+	}
+	return true;
+}
+
 /* Client is holding a reference count from being on the epoll list. Returns
  * true if we will still be receiving messages from this client. */
 static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
 {
+	stratum_submit_t submit;
+	int64_t rstamp = 0;
 	int buflen, ret;
 	json_t *val;
 	char *eol;
 
 retry:
 	if (unlikely(client->bufofs > MAX_MSGSIZE)) {
-		if (!client->remote) {
+		if (!client->remote && !client->raw && !client->sv2) {
 			LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
 				client->id, client->fd);
 			return false;
@@ -537,7 +1189,22 @@ retry:
 		return false;
 	}
 	client->bufofs += ret;
+	rstamp = monotonic_ns();
 reparse:
+	if (client->sv2) {
+		if (!parse_sv2_msg(ckp, cdata, client, &buflen, rstamp))
+			return false;
+		if (!buflen)
+			goto retry;
+		goto next;
+	}
+	if (client->raw && (uint8_t)client->buf[0] == RELAY_MAGIC) {
+		if (!parse_relay_msg(ckp, cdata, client, &buflen))
+			return false;
+		if (!buflen)
+			goto retry;
+		goto next;
+	}
 	eol = memchr(client->buf, '\n', client->bufofs);
 	if (!eol)
 		goto retry;
@@ -548,7 +1215,25 @@ reparse:
 		LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
 		return false;
 	}
-
+	if (!client->remote && !client->passthrough)
+		connector_capture(CAPTURE_REC_LINE, client->id, client->server, client->buf, buflen - 1);
+
+	/* Relay lines verbatim upstream once it has seen this client */
+	if (client->relayed && (client->invalid ||
+	    generator_relay(ckp, client->id, client->buf, buflen)))
+		goto next;
+
+	if (!client->passthrough && !client->remote && !ckp->passthrough && !ckp->redirector &&
+	    client->admission_clear && parse_fast_submit(client->buf, &submit)) {
+		submit.client_id = client->id;
+		submit.stamp = rstamp;
+		/* As below we can drop shares of clients already dropped */
+		if (likely(!client->invalid)) {
+			stratifier_add_submit(ckp, &submit);
+			stage_latency(STAGE_READ, rstamp);
+		}
+		goto next;
+	}
 	if (!(val = json_loads(client->buf, JSON_DISABLE_EOF_CHECK, NULL))) {
 		char *buf = strdup("Invalid JSON, disconnecting\n");
 
@@ -567,22 +1252,12 @@ reparse:
 				parse_redirector_share(cdata, client, val);
 			json_object_set_new_nocheck(val, "client_id", json_integer(client->id));
 			json_object_set_new_nocheck(val, "address", json_string(client->address_name));
+			client->relayed = ckp->rawrelay;
 		}
-		json_object_set_new_nocheck(val, "server", json_integer(client->server));
-
-		/* Do not send messages of clients we've already dropped. We
-		 * do this unlocked as the occasional false negative can be
-		 * filtered by the stratifier. */
-		if (likely(!client->invalid)) {
-			if (!ckp->passthrough)
-				stratifier_add_recv(ckp, val);
-			if (ckp->node)
-				stratifier_add_recv(ckp, json_deep_copy(val));
-			if (ckp->passthrough)
-				generator_add_send(ckp, val);
-		} else
-			json_decref(val);
+		if (!pass_client_msg(ckp, cdata, client, val))
+			return false;
 	}
+next:
 	client->bufofs -= buflen;
 	if (client->bufofs)
 		memmove(client->buf, client->buf + buflen, client->bufofs);
@@ -623,6 +1298,7 @@ static bool redirect_matches(cdata_t *cdata, client_instance_t *client)
 	return redirect;
 }
 
+/* Service an epoll event of a client in the receiver it's registered in */
 static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
 {
 	const uint32_t events = event->events;
@@ -633,13 +1309,17 @@ static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
 	client = ref_client_by_id(cdata, id);
 	if (unlikely(!client)) {
 		LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
-		goto outnoclient;
+		return;
+	}
+	/* Leave it to the new instance, no longer polling it */
+	if (unlikely(client->handedover)) {
+		epoll_ctl(cdata->receivers[client->receiver].epfd, EPOLL_CTL_DEL, client->fd, NULL);
+		dec_instance_ref(cdata, client);
+		return;
 	}
 	/* We can have both messages and read hang ups so process the
 	 * message first. */
 	if (likely(events & EPOLLIN)) {
-		/* Rearm the client for epoll events if we have successfully
-		 * parsed a message from it */
 		if (unlikely(!parse_client_msg(ckp, cdata, client))) {
 			invalidate_client(ckp, cdata, client);
 			goto out;
@@ -670,116 +1350,240 @@ static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
 		invalidate_client(cdata->pi->ckp, cdata, client);
 	}
 out:
-	if (likely(!client->invalid)) {
-		/* Rearm the fd in the epoll list if it's still active */
-		event->data.u64 = id;
-		event->events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-		epoll_ctl(cdata->epfd, EPOLL_CTL_MOD, client->fd, event);
-	}
 	dec_instance_ref(cdata, client);
-outnoclient:
-	free(event);
+}
+
+/* Add or remove all the serverfds in a receiver's epoll */
+static bool receiver_serverfds(receiver_t *receiver, const bool add)
+{
+	cdata_t *cdata = receiver->cdata;
+	struct epoll_event event;
+	uint64_t i;
+
+	for (i = 0; i < (uint64_t)cdata->ckp->serverurls; i++) {
+		/* The small values will be less than the first client ids */
+		event.data.u64 = i;
+		/* The server fds are shared by every receiver's epoll so only
+		 * wake one of them for each new connection where supported */
+#ifdef EPOLLEXCLUSIVE
+		event.events = EPOLLIN | EPOLLEXCLUSIVE;
+#else
+		event.events = EPOLLIN;
+#endif
+		if (epoll_ctl(receiver->epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+			      cdata->serverfd[i], &event) < 0) {
+			LOGEMERG("FATAL: Failed to %s server fd in epoll %d", add ? "add" : "remove",
+				 receiver->epfd);
+			return false;
+		}
+	}
+	return true;
 }
 
 /* Waits on fds ready to read on from the list stored in conn_instance and
- * handles the incoming messages */
+ * handles the incoming messages in place, servicing up to RECEIVER_EVENTS per
+ * wakeup. */
 static void *receiver(void *arg)
 {
-	cdata_t *cdata = (cdata_t *)arg;
-	struct epoll_event *event = ckzalloc(sizeof(struct epoll_event));
+	receiver_t *receiver = (receiver_t *)arg;
+	struct epoll_event *events = ckalloc(sizeof(struct epoll_event) * RECEIVER_EVENTS);
+	cdata_t *cdata = receiver->cdata;
 	ckpool_t *ckp = cdata->ckp;
-	uint64_t serverfds, i;
+	uint64_t serverfds;
+	char name[16];
 	int ret, epfd;
 
-	rename_proc("creceiver");
+	snprintf(name, 15, "creceiver%x", receiver->id);
+	rename_proc(name);
 
-	epfd = cdata->epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0) {
-		LOGEMERG("FATAL: Failed to create epoll in receiver");
-		goto out;
-	}
+	epfd = receiver->epfd;
 	serverfds = ckp->serverurls;
-	/* Add all the serverfds to the epoll */
-	for (i = 0; i < serverfds; i++) {
-		/* The small values will be less than the first client ids */
-		event->data.u64 = i;
-		event->events = EPOLLIN | EPOLLRDHUP;
-		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], event);
-		if (ret < 0) {
-			LOGEMERG("FATAL: Failed to add epfd %d to epoll_ctl", epfd);
-			goto out;
-		}
-	}
+	if (!receiver_serverfds(receiver, true))
+		goto out;
 
 	/* Wait for the stratifier to be ready for us */
 	while (!ckp->stratifier_ready)
 		cksleep_ms(10);
 
 	while (42) {
-		uint64_t edu64;
+		int nevents, timeout = 1000;
 
 		while (unlikely(!cdata->accept))
 			cksleep_ms(10);
-		ret = epoll_wait(epfd, event, 1, 1000);
-		if (unlikely(ret < 1)) {
-			if (unlikely(ret == -1)) {
+		if (unlikely(receiver->paused_until)) {
+			int64_t wait = receiver->paused_until - monotonic_ns();
+
+			if (wait <= 0) {
+				receiver->paused_until = 0;
+				if (!receiver_serverfds(receiver, true))
+					goto out;
+			} else if (wait < 1000000000)
+				timeout = wait / 1000000 + 1;
+		}
+		nevents = epoll_wait(epfd, events, RECEIVER_EVENTS, timeout);
+		if (unlikely(nevents < 1)) {
+			if (unlikely(nevents == -1)) {
+				if (errno == EINTR)
+					continue;
 				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
 				break;
 			}
 			/* Nothing to service, still very unlikely */
 			continue;
 		}
-		edu64 = event->data.u64;
-		if (edu64 < serverfds) {
-			ret = accept_client(cdata, epfd, edu64);
-			if (unlikely(ret < 0)) {
-				LOGEMERG("FATAL: Failed to accept_client in receiver");
-				break;
+		for (ret = 0; ret < nevents; ret++) {
+			uint64_t edu64 = events[ret].data.u64;
+
+			if (edu64 < serverfds) {
+				int64_t wait;
+
+				/* Already paused by an earlier event */
+				if (receiver->paused_until)
+					continue;
+				/* Leave new connections in the listen backlog
+				 * until we can accept them again */
+				if (ckp->acceptrate && (wait = accept_wait(cdata))) {
+					receiver->paused_until = monotonic_ns() + wait;
+					if (!receiver_serverfds(receiver, false))
+						goto out;
+					continue;
+				}
+				if (unlikely(accept_client(receiver, edu64) < 0)) {
+					LOGEMERG("FATAL: Failed to accept_client in receiver");
+					goto out;
+				}
+				continue;
 			}
-			continue;
+			client_event_processor(ckp, &events[ret]);
 		}
-		/* Event structure is handed off to client_event_processor
-		 * here to be freed so we need to allocate a new one */
-		ckmsgq_add(cdata->cevents, event);
-		event = ckzalloc(sizeof(struct epoll_event));
 	}
 out:
 	/* We shouldn't get here unless there's an error */
+	free(events);
 	return NULL;
 }
 
-/* Send a sender_send message and return true if we've finished sending it or
- * are unable to send any more. */
-static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send)
+/* Returns the first message at the head of a lane that can be passed on now,
+ * resuming sessions first, taking a token for one that admits a client.
+ * Otherwise returns NULL with the ns to wait for a token. Lanes are only
+ * paced by their admitting messages so one waiting for a token does not
+ * hold up messages such as subscribes in the other lane. Called with
+ * admission_lock held. */
+static admission_t *__next_admission(cdata_t *cdata, int *lane, int64_t *wait)
 {
-	client_instance_t *client = sender_send->client;
-	time_t now_t;
+	admission_t *admission;
 
-	if (unlikely(client->invalid))
-		goto out_true;
+	*wait = 0;
+	for (*lane = 0; *lane < ADMISSION_LANES; (*lane)++) {
+		admission = cdata->admissions[*lane];
+		if (!admission)
+			continue;
+		if (!admission->admits)
+			return admission;
+		if (!*wait && !(*wait = take_token(&cdata->auth_bucket, monotonic_ns())))
+			return admission;
+	}
+	return NULL;
+}
 
-	/* Make sure we only send one message at a time to each client */
-	if (unlikely(client->sending && client->sending != sender_send))
-		return false;
+/* Passes messages of clients waiting for admission on to the stratifier,
+ * resuming sessions first, with at most authrate per second of those that
+ * admit a client. Messages before that such as subscribes are not paced. */
+static void *admitter(void *arg)
+{
+	cdata_t *cdata = (cdata_t *)arg;
+	ckpool_t *ckp = cdata->ckp;
 
-	client->sending = sender_send;
-	now_t = time(NULL);
+	rename_proc("cadmitter");
+
+	while (42) {
+		admission_t *admission;
+		client_instance_t *client;
+		int64_t wait;
+		int lane;
+
+		mutex_lock(&cdata->admission_lock);
+		while (!(admission = __next_admission(cdata, &lane, &wait))) {
+			if (wait) {
+				ts_t abs, rel;
+
+				/* Woken early by new messages that may not
+				 * need a token */
+				ts_realtime(&abs);
+				us_to_ts(&rel, wait / 1000 + 1);
+				timeraddspec(&abs, &rel);
+				cond_timedwait(&cdata->admission_cond, &cdata->admission_lock, &abs);
+			} else
+				cond_wait(&cdata->admission_cond, &cdata->admission_lock);
+		}
+		DL_DELETE(cdata->admissions[lane], admission);
+		cdata->admissions_queued[lane]--;
+		mutex_unlock(&cdata->admission_lock);
 
-	/* Increase sendbufsize to match large messages sent to clients - this
-	 * usually only applies to clients as mining nodes. */
-	if (unlikely(!ckp->wmem_warn && sender_send->len > client->sendbufsize))
-		client->sendbufsize = set_sendbufsize(ckp, client->fd, sender_send->len);
+		client = ref_client_by_id(cdata, admission->client_id);
+		if (unlikely(!client)) {
+			json_decref(admission->val);
+			free(admission);
+			continue;
+		}
+		/* Pass it on before anything can bypass the queue */
+		recv_client_msg(ckp, admission->val);
+
+		mutex_lock(&cdata->admission_lock);
+		client->admissions--;
+		if (admission->admits && !client->admitted) {
+			client->admitted = true;
+			cdata->clients_admitted++;
+			if (lane == ADMIT_RESUME)
+				cdata->clients_resumed++;
+		}
+		if (client->admitted && !client->admissions)
+			client->admission_clear = true;
+		mutex_unlock(&cdata->admission_lock);
 
-	while (sender_send->len) {
-		int ret = write(client->fd, sender_send->buf + sender_send->ofs, sender_send->len);
+		dec_instance_ref(cdata, client);
+		free(admission);
+	}
+	return NULL;
+}
+
+/* Write out as many of a client's pending sends as possible, coalescing them
+ * into one writev, moving completed sends to the done list and subtracting
+ * what was written from sends_size. Returns false if the client would block
+ * with sends still pending. */
+static bool send_client_sends(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			      sender_send_t **done, int64_t *sends_size, const time_t now_t)
+{
+	struct iovec iov[SENDER_IOVS];
+	sender_send_t *sending, *tmp;
+
+	while (client->sends) {
+		int iovcnt = 0;
+		ssize_t ret;
+
+		if (unlikely(client->invalid || client->handedover))
+			return true;
 
+		DL_FOREACH(client->sends, sending) {
+			/* Increase sendbufsize to match large messages sent to
+			 * clients - this usually only applies to clients as
+			 * mining nodes. */
+			if (unlikely(!ckp->wmem_warn && sending->len > client->sendbufsize))
+				client->sendbufsize = set_sendbufsize(ckp, client->fd, sending->len);
+			iov[iovcnt].iov_base = sending->buf + sending->ofs;
+			iov[iovcnt].iov_len = sending->len;
+			if (++iovcnt >= SENDER_IOVS)
+				break;
+		}
+
+		ret = writev(client->fd, iov, iovcnt);
 		if (ret < 1) {
 			/* Invalidate clients that block for more than 60 seconds */
 			if (unlikely(client->blocked_time && now_t - client->blocked_time >= 60)) {
 				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
 					  client->id, client->fd);
 				invalidate_client(ckp, cdata, client);
-				goto out_true;
+				return true;
 			}
 			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret) {
 				if (!client->blocked_time)
@@ -789,70 +1593,278 @@ static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sende
 			LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
 				client->id, client->fd, errno, strerror(errno));
 			invalidate_client(ckp, cdata, client);
-			goto out_true;
+			return true;
 		}
-		sender_send->ofs += ret;
-		sender_send->len -= ret;
 		client->blocked_time = 0;
+		*sends_size -= ret;
+
+		DL_FOREACH_SAFE(client->sends, sending, tmp) {
+			if (ret < sending->len) {
+				sending->ofs += ret;
+				sending->len -= ret;
+				break;
+			}
+			ret -= sending->len;
+			sending->len = 0;
+			DL_DELETE(client->sends, sending);
+			DL_APPEND(*done, sending);
+			if (!ret)
+				break;
+		}
 	}
-out_true:
-	client->sending = NULL;
 	return true;
 }
 
-static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
+static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
+{
+	dec_instance_ref(cdata, sender_send->client);
+	if (sender_send->shared)
+		put_ckshared(sender_send->shared);
+	else
+		free(sender_send->buf);
+	ckslab_free(sender_slab, sender_send);
+}
+
+/* Wait for the client's socket to be writable again */
+static void arm_sender_client(cdata_t *cdata, const int epfd, client_instance_t *client)
+{
+	struct epoll_event event;
+
+	event.data.ptr = client;
+	event.events = EPOLLOUT;
+	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, client->fd, &event) < 0)) {
+		LOGINFO("Failed to epoll_ctl client id %"PRId64" fd %d in sender",
+			client->id, client->fd);
+		invalidate_client(cdata->ckp, cdata, client);
+	}
+}
+
+/* Take a client off the waiting list, removing it from the sender's epoll
+ * before its reference may be dropped. Its fd is already closed and gone from
+ * the epoll if it was invalidated. */
+static void disarm_sender_client(const int epfd, client_instance_t **waiting,
+				 client_instance_t *client)
+{
+	client->sender_waiting = false;
+	DL_DELETE2(*waiting, client, sender_prev, sender_next);
+	if (!client->invalid)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+}
+
+static void wake_sender(cdata_t *cdata)
+{
+	uint64_t val = 1;
+
+	if (unlikely(write(cdata->sender_wakefd, &val, sizeof(val)) < 0 && errno != EAGAIN))
+		LOGERR("Failed to write to sender wakefd");
+}
+
+/* Add a send to the sender's pending sends, waking the sender if it may have
+ * already taken all the previous ones. */
+static void queue_sender_send(cdata_t *cdata, sender_send_t *sender_send)
+{
+	bool wake;
+
+	mutex_lock(&cdata->sender_lock);
+	cdata->sends_generated++;
+	wake = !cdata->sender_sends;
+	DL_APPEND(cdata->sender_sends, sender_send);
+	mutex_unlock(&cdata->sender_lock);
+
+	if (wake)
+		wake_sender(cdata);
+}
+
+/* Mark the clients handing over as handed over from the sender thread, where
+ * none of their sends can be partly written behind the new instance's back,
+ * keeping what was still unsent of their pending sends for the new instance
+ * to write first. */
+static void handover_sends(cdata_t *cdata, const int epfd, client_instance_t **ready,
+			   client_instance_t **waiting, sender_send_t **done)
 {
-	dec_instance_ref(cdata, sender_send->client);
-	free(sender_send->buf);
-	free(sender_send);
+	client_instance_t *client, *tmp;
+	sender_send_t *sending;
+
+	ck_wlock(&cdata->lock);
+	HASH_ITER(hh, cdata->clients, client, tmp) {
+		char *tail, *s;
+		size_t len = 0;
+
+		if (!client->handingover)
+			continue;
+		client->handingover = false;
+		client->handedover = true;
+		if (!client->sends)
+			continue;
+		DL_FOREACH(client->sends, sending)
+			len += sending->len;
+		tail = s = ckalloc(len);
+		DL_FOREACH(client->sends, sending) {
+			memcpy(s, sending->buf + sending->ofs, sending->len);
+			s += sending->len;
+		}
+		client->sendtail = bin2hex(tail, len);
+		free(tail);
+		if (client->sender_waiting)
+			disarm_sender_client(epfd, waiting, client);
+		else
+			DL_DELETE2(*ready, client, sender_prev, sender_next);
+		DL_CONCAT(*done, client->sends);
+		client->sends = NULL;
+	}
+	ck_wunlock(&cdata->lock);
+
+	mutex_lock(&cdata->sender_lock);
+	cdata->handover_request = false;
+	pthread_cond_signal(&cdata->handover_cond);
+	mutex_unlock(&cdata->sender_lock);
 }
 
-/* Use a thread to send queued messages, appending them to the sends list and
- * iterating over all of them, attempting to send them all non-blocking to
- * only send to those clients ready to receive data. */
+/* Use a thread to send queued messages, grouping them per client and writing
+ * each client's sends out together non-blocking. Clients that would block are
+ * only tried again once epoll reports their socket writable. */
 static void *sender(void *arg)
 {
+	client_instance_t *ready = NULL, *waiting = NULL;
 	cdata_t *cdata = (cdata_t *)arg;
-	sender_send_t *sends = NULL;
+	int64_t sends_queued = 0, sends_size = 0, sends_delayed = 0;
+	struct epoll_event *events;
 	ckpool_t *ckp = cdata->ckp;
+	struct epoll_event event;
+	time_t last_check = 0;
+	int epfd;
 
 	rename_proc("csender");
 
+	events = ckalloc(sizeof(struct epoll_event) * SENDER_EVENTS);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (unlikely(epfd < 0)) {
+		LOGEMERG("FATAL: Failed to create epoll in sender");
+		goto out;
+	}
+	/* The wakefd is the only event with a NULL ptr */
+	event.data.ptr = NULL;
+	event.events = EPOLLIN;
+	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->sender_wakefd, &event) < 0)) {
+		LOGEMERG("FATAL: Failed to add sender wakefd to epoll");
+		goto out;
+	}
+
 	while (42) {
-		int64_t sends_queued = 0, sends_size = 0;
-		sender_send_t *sending, *tmp;
+		sender_send_t *sends = NULL, *done = NULL, *sending, *tmp;
+		client_instance_t *client, *tmpclient;
+		bool handover;
+		int nevents, i;
+		time_t now_t;
+
+		nevents = epoll_wait(epfd, events, SENDER_EVENTS, 1000);
+		if (unlikely(nevents < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGEMERG("FATAL: Failed to epoll_wait in sender");
+			break;
+		}
+		for (i = 0; i < nevents; i++) {
+			client = events[i].data.ptr;
+			if (!client) {
+				uint64_t val;
+
+				/* Clear the wakeup before taking the sends */
+				if (unlikely(read(cdata->sender_wakefd, &val, sizeof(val)) < 0 && errno != EAGAIN))
+					LOGERR("Failed to read sender wakefd");
+				continue;
+			}
+			/* We hold a ref on this client with its pending sends */
+			if (likely(client->sender_waiting)) {
+				disarm_sender_client(epfd, &waiting, client);
+				DL_APPEND2(ready, client, sender_prev, sender_next);
+			}
+		}
+
+		mutex_lock(&cdata->sender_lock);
+		sends = cdata->sender_sends;
+		cdata->sender_sends = NULL;
+		handover = cdata->handover_request;
+		mutex_unlock(&cdata->sender_lock);
 
-		/* Check all sends to see if they can be written out */
+		/* Group the new sends by client, in order */
 		DL_FOREACH_SAFE(sends, sending, tmp) {
-			if (send_sender_send(ckp, cdata, sending)) {
-				DL_DELETE(sends, sending);
-				clear_sender_send(sending, cdata);
-			} else {
-				sends_queued++;
-				sends_size += sizeof(sender_send_t) + sending->len + 1;
+			client = sending->client;
+			DL_DELETE(sends, sending);
+			if (!client->sends && !client->sender_waiting)
+				DL_APPEND2(ready, client, sender_prev, sender_next);
+			DL_APPEND(client->sends, sending);
+			sends_queued++;
+			sends_size += sizeof(sender_send_t) + sending->len + 1;
+		}
+
+		if (unlikely(handover))
+			handover_sends(cdata, epfd, &ready, &waiting, &done);
+
+		now_t = time(NULL);
+		DL_FOREACH_SAFE2(ready, client, tmpclient, sender_next) {
+			if (!send_client_sends(ckp, cdata, client, &done, &sends_size, now_t)) {
+				DL_DELETE2(ready, client, sender_prev, sender_next);
+				DL_APPEND2(waiting, client, sender_prev, sender_next);
+				client->sender_waiting = true;
+				DL_FOREACH(client->sends, sending) {
+					if (!sending->delayed) {
+						sending->delayed = true;
+						sends_delayed++;
+					}
+				}
+				arm_sender_client(cdata, epfd, client);
+				continue;
+			}
+			/* Finished with this client or it's invalid; drop any
+			 * remaining sends only after we're done with it as the
+			 * last one may hold the last reference. */
+			DL_DELETE2(ready, client, sender_prev, sender_next);
+			DL_CONCAT(done, client->sends);
+			client->sends = NULL;
+		}
+
+		/* Once a second drop clients that have been invalidated or
+		 * blocked for too long while waiting */
+		if (now_t != last_check) {
+			last_check = now_t;
+			DL_FOREACH_SAFE2(waiting, client, tmpclient, sender_next) {
+				if (!client->invalid && now_t - client->blocked_time < 60)
+					continue;
+				if (!client->invalid) {
+					LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
+						  client->id, client->fd);
+					invalidate_client(ckp, cdata, client);
+				}
+				disarm_sender_client(epfd, &waiting, client);
+				DL_CONCAT(done, client->sends);
+				client->sends = NULL;
+			}
+		}
+
+		/* Sends that were written have no len left, otherwise account
+		 * for all their unsent data */
+		DL_FOREACH_SAFE(done, sending, tmp) {
+			DL_DELETE(done, sending);
+			if (sending->queued && !sending->len) {
+				int64_t now = stage_latency(STAGE_CSEND, sending->queued);
+
+				share_latency_add(STAGE_TOTAL, now - sending->stamp);
 			}
+			sends_queued--;
+			sends_size -= sizeof(sender_send_t) + sending->len + 1;
+			clear_sender_send(sending, cdata);
 		}
 
 		mutex_lock(&cdata->sender_lock);
-		cdata->sends_delayed += sends_queued;
+		cdata->sends_delayed = sends_delayed;
 		cdata->sends_queued = sends_queued;
 		cdata->sends_size = sends_size;
-		/* Poll every 10ms if there are no new sends. */
-		if (!cdata->sender_sends) {
-			const ts_t polltime = {0, 10000000};
-			ts_t timeout_ts;
-
-			ts_realtime(&timeout_ts);
-			timeraddspec(&timeout_ts, &polltime);
-			cond_timedwait(&cdata->sender_cond, &cdata->sender_lock, &timeout_ts);
-		}
-		if (cdata->sender_sends) {
-			DL_CONCAT(sends, cdata->sender_sends);
-			cdata->sender_sends = NULL;
-		}
 		mutex_unlock(&cdata->sender_lock);
 	}
+out:
 	/* We shouldn't get here unless there's an error */
+	free(events);
 	return NULL;
 }
 
@@ -897,17 +1909,13 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	buf = json_dumps(val, JSON_EOL | JSON_COMPACT);
 	json_decref(val);
 
-	sender_send = ckzalloc(sizeof(sender_send_t));
+	sender_send = ckslab_zalloc(sender_slab);
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = strlen(buf);
 	inc_instance_ref(cdata, client);
 
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_sender_send(cdata, sender_send);
 }
 
 /* Look for accepted shares in redirector mode to know we can redirect this
@@ -973,8 +1981,9 @@ out:
 }
 
 /* Send a client by id a heap allocated buffer, allowing this function to
- * free the ram. */
-static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf)
+ * free the ram. Share results carry the stamps they are timed from. */
+static void send_client_timed(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf,
+			      const int64_t stamp, const int64_t queued)
 {
 	sender_send_t *sender_send;
 	client_instance_t *client;
@@ -1039,23 +2048,118 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 		}
 	}
 
-	sender_send = ckzalloc(sizeof(sender_send_t));
+	/* Wrap messages to a raw passthrough in a relay envelope */
+	if (client->raw) {
+		char *frame = relay_frame(pass_id ? id & 0xffffffffll : 0, buf, &len);
+
+		free(buf);
+		buf = frame;
+	}
+
+	sender_send = ckslab_zalloc(sender_slab);
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = len;
+	sender_send->stamp = stamp;
+	sender_send->queued = queued;
 
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_sender_send(cdata, sender_send);
 
 	/* Redirect after sending response to shares and authorise */
 	if (unlikely(redirect))
 		redirect_client(ckp, client);
 }
 
-static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, json_t *json_msg)
+static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf)
+{
+	send_client_timed(ckp, cdata, id, buf, 0, 0);
+}
+
+/* Send a client we hold a reference to a heap allocated binary buffer of
+ * len, the send taking its own reference */
+static void send_client_frame(cdata_t *cdata, client_instance_t *client, char *buf, const int len)
+{
+	sender_send_t *sender_send;
+
+	inc_instance_ref(cdata, client);
+	sender_send = ckslab_zalloc(sender_slab);
+	sender_send->client = client;
+	sender_send->buf = buf;
+	sender_send->len = len;
+
+	queue_sender_send(cdata, sender_send);
+}
+
+/* Translate a message for a Stratum V2 client into its frames. Client must
+ * hold a reference count which is passed on to the send. */
+static void send_sv2_json(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client, const json_t *val,
+			  const int64_t stamp, const int64_t queued)
+{
+	sender_send_t *sender_send;
+	char *buf;
+	int len;
+
+	buf = sv2_send_json(ckp, client->sv2, val, &len);
+	if (!buf) {
+		dec_instance_ref(cdata, client);
+		return;
+	}
+	sender_send = ckslab_zalloc(sender_slab);
+	sender_send->client = client;
+	sender_send->buf = buf;
+	sender_send->len = len;
+	sender_send->stamp = stamp;
+	sender_send->queued = queued;
+
+	queue_sender_send(cdata, sender_send);
+}
+
+/* Send a client by id a reference to a shared message already holding a
+ * reference for this send. Shared messages are never sent to passthrough
+ * subclients. */
+static void send_client_shared(ckpool_t *ckp, cdata_t *cdata, const int64_t id, ckshared_t *shared)
+{
+	sender_send_t *sender_send;
+	client_instance_t *client;
+	bool redirect = false;
+
+	client = ref_client_by_id(cdata, id);
+	if (unlikely(!client)) {
+		LOGINFO("Connector failed to find client id %"PRId64" to send shared to", id);
+		stratifier_drop_id(ckp, id);
+		put_ckshared(shared);
+		return;
+	}
+	if (unlikely(client->sv2)) {
+		json_t *val = json_loadb(shared->buf, shared->len, 0, NULL);
+
+		put_ckshared(shared);
+		if (likely(val)) {
+			send_sv2_json(ckp, cdata, client, val, 0, 0);
+			json_decref(val);
+		} else
+			dec_instance_ref(cdata, client);
+		return;
+	}
+	/* Shared messages are never share responses so only look for clients
+	 * matching the IP of already whitelisted ones. */
+	if (ckp->redirector && !client->redirected && client->authorised)
+		redirect = redirect_matches(cdata, client);
+
+	sender_send = ckslab_zalloc(sender_slab);
+	sender_send->client = client;
+	sender_send->buf = shared->buf;
+	sender_send->len = shared->len;
+	sender_send->shared = shared;
+
+	queue_sender_send(cdata, sender_send);
+
+	if (unlikely(redirect))
+		redirect_client(ckp, client);
+}
+
+static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, json_t *json_msg,
+			     const int64_t stamp, const int64_t queued)
 {
 	client_instance_t *client;
 	char *msg;
@@ -1073,7 +2177,7 @@ static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, j
 		json_object_del(json_msg, "node.method");
 
 	msg = json_dumps(json_msg, JSON_EOL | JSON_COMPACT);
-	send_client(ckp, cdata, client_id, msg);
+	send_client_timed(ckp, cdata, client_id, msg, stamp, queued);
 	json_decref(json_msg);
 }
 
@@ -1094,20 +2198,38 @@ static bool client_exists(cdata_t *cdata, int64_t id)
 	return !!client;
 }
 
-static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			       const bool raw)
 {
 	json_t *val;
 
-	LOGINFO("Connector adding passthrough client %"PRId64, client->id);
+	LOGINFO("Connector adding %spassthrough client %"PRId64, raw ? "raw " : "", client->id);
 	client->passthrough = true;
-	JSON_CPACK(val, "{sb}", "result", true);
-	send_client_json(ckp, cdata, client->id, val);
+	JSON_CPACK(val, "{sbsb}", "result", true, "raw", raw);
+	send_client_json(ckp, cdata, client->id, val, 0, 0);
+	/* Everything sent after the result goes in relay envelopes. Envelopes
+	 * are recognised on receipt so there's no race with the passthrough
+	 * switching over. */
+	client->raw = raw;
 	if (!ckp->rmem_warn)
 		set_recvbufsize(ckp, client->fd, 1048576);
 	if (!ckp->wmem_warn)
 		client->sendbufsize = set_sendbufsize(ckp, client->fd, 1048576);
 }
 
+/* The stratifier accepts the remote trusted server itself so it gets the
+ * result before any other messages */
+static void remote_server(ckpool_t *ckp, client_instance_t *client)
+{
+	LOGWARNING("Connector adding client %"PRId64" %s as remote trusted server",
+		   client->id, client->address_name);
+	client->remote = true;
+	if (!ckp->rmem_warn)
+		set_recvbufsize(ckp, client->fd, 2097152);
+	if (!ckp->wmem_warn)
+		client->sendbufsize = set_sendbufsize(ckp, client->fd, 2097152);
+}
+
 static bool connect_upstream(ckpool_t *ckp, connsock_t *cs)
 {
 	json_t *req, *val = NULL, *res_val, *err_val;
@@ -1128,9 +2250,10 @@ static bool connect_upstream(ckpool_t *ckp, connsock_t *cs)
 	if (!ckp->wmem_warn)
 		cs->sendbufsiz = set_sendbufsize(ckp, cs->fd, 2097152);
 
-	JSON_CPACK(req, "{ss,s[s]}",
+	/* Advertise that we can decode delta encoded workinfos */
+	JSON_CPACK(req, "{ss,s[ss]}",
 			"method", "mining.remote",
-			"params", PACKAGE"/"VERSION);
+			"params", PACKAGE"/"VERSION, "txndelta");
 	res = send_json_msg(cs, req);
 	json_decref(req);
 	if (!res) {
@@ -1294,19 +2417,70 @@ out:
 	return ret;
 }
 
-static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
+/* Does the passthrough of subclient id relay raw */
+static bool raw_passthrough(cdata_t *cdata, const int64_t id)
+{
+	int64_t pass_id = subclient(id);
+	client_instance_t *client;
+	bool ret = false;
+
+	ck_rlock(&cdata->lock);
+	HASH_FIND_I64(cdata->clients, &pass_id, client);
+	if (client)
+		ret = client->raw;
+	ck_runlock(&cdata->lock);
+
+	return ret;
+}
+
+/* Is client id a Stratum V2 client, looked up under the read lock so V1
+ * clients never need the write lock to take a reference */
+static bool sv2_client(cdata_t *cdata, const int64_t id)
+{
+	client_instance_t *client;
+	bool ret = false;
+
+	ck_rlock(&cdata->lock);
+	HASH_FIND_I64(cdata->clients, &id, client);
+	if (client)
+		ret = client->sv2;
+	ck_runlock(&cdata->lock);
+
+	return ret;
+}
+
+static void client_message_processor(ckpool_t *ckp, cmsg_t *cmsg)
 {
+	int64_t stamp = cmsg->stamp, queued = cmsg->queued;
+	json_t *json_msg = cmsg->json_msg;
 	cdata_t *cdata = ckp->cdata;
 	client_instance_t *client;
 	int64_t client_id;
 
+	if (cmsg->shared) {
+		send_client_shared(ckp, cdata, cmsg->client_id, cmsg->shared);
+		free(cmsg);
+		return;
+	}
+	free(cmsg);
+
 	/* Extract the client id from the json message and remove its entry */
 	client_id = json_integer_value(json_object_get(json_msg, "client_id"));
 	json_object_del(json_msg, "client_id");
 	/* Put client_id back in for a passthrough subclient, passing its
-	 * upstream client_id instead of the passthrough's. */
-	if (subclient(client_id))
-		json_object_set_new_nocheck(json_msg, "client_id", json_integer(client_id & 0xffffffffll));
+	 * upstream client_id instead of the passthrough's. A raw passthrough
+	 * gets it in the relay envelope and passes the message on verbatim. */
+	if (subclient(client_id)) {
+		if (raw_passthrough(cdata, client_id))
+			json_object_del(json_msg, "node.method");
+		else
+			json_object_set_new_nocheck(json_msg, "client_id", json_integer(client_id & 0xffffffffll));
+	} else if (ckp->sv2servers && sv2_client(cdata, client_id)) {
+		if ((client = ref_client_by_id(cdata, client_id)))
+			send_sv2_json(ckp, cdata, client, json_msg, stamp, queued);
+		json_decref(json_msg);
+		return;
+	}
 
 	/* Flag redirector clients once they've been authorised */
 	if (ckp->redirector && (client = ref_client_by_id(cdata, client_id))) {
@@ -1319,14 +2493,48 @@ static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 		}
 		dec_instance_ref(cdata, client);
 	}
-	send_client_json(ckp, cdata, client_id, json_msg);
+	send_client_json(ckp, cdata, client_id, json_msg, stamp, queued);
+}
+
+/* Send a client a message relayed verbatim from a raw passthrough upstream */
+void connector_relay(ckpool_t *ckp, const int64_t client_id, char *buf)
+{
+	send_client(ckp, ckp->cdata, client_id, buf);
+}
+
+static void add_cmsg(cdata_t *cdata, json_t *val, ckshared_t *shared, const int64_t client_id,
+		     const int64_t stamp)
+{
+	cmsg_t *cmsg = ckalloc(sizeof(cmsg_t));
+
+	cmsg->json_msg = val;
+	cmsg->shared = shared;
+	cmsg->client_id = client_id;
+	cmsg->stamp = stamp;
+	if (stamp)
+		cmsg->queued = monotonic_ns();
+	else
+		cmsg->queued = 0;
+	ckmsgq_add(cdata->cmpq, cmsg);
 }
 
 void connector_add_message(ckpool_t *ckp, json_t *val)
 {
-	cdata_t *cdata = ckp->cdata;
+	add_cmsg(ckp->cdata, val, NULL, 0, 0);
+}
 
-	ckmsgq_add(cdata->cmpq, val);
+/* As connector_add_message for a share result timed from the connector read
+ * at stamp */
+void connector_add_result(ckpool_t *ckp, json_t *val, const int64_t stamp)
+{
+	add_cmsg(ckp->cdata, val, NULL, 0, stamp);
+}
+
+/* Queue a send of a shared message to client_id, the caller passing on a
+ * reference to it */
+void connector_add_shared(ckpool_t *ckp, ckshared_t *shared, const int64_t client_id)
+{
+	add_cmsg(ckp->cdata, NULL, shared, client_id, 0);
 }
 
 /* Send the passthrough the terminate node.method */
@@ -1391,6 +2599,14 @@ char *connector_stats(void *data, const int runtime)
 
 	json_set_object(val, "delays", subval);
 
+	mutex_lock(&cdata->admission_lock);
+	JSON_CPACK(subval, "{si,si,si,sI,sI,sI,sI}", "resuming", cdata->admissions_queued[ADMIT_RESUME],
+		   "new", cdata->admissions_queued[ADMIT_NEW], "max", cdata->ckp->maxadmissions,
+		   "admitted", cdata->clients_admitted, "resumed", cdata->clients_resumed,
+		   "shed", cdata->admissions_shed, "deferred", cdata->accepts_deferred);
+	mutex_unlock(&cdata->admission_lock);
+	json_set_object(val, "admission", subval);
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	if (runtime)
@@ -1400,6 +2616,27 @@ char *connector_stats(void *data, const int runtime)
 	return buf;
 }
 
+/* Counters are read unlocked and only approximate */
+void connector_metrics(ckpool_t *ckp, char **buf)
+{
+	cdata_t *cdata = ckp->cdata;
+
+	add_metric(buf, "gauge", "clients", NULL, cdata->nclients);
+	add_metric(buf, "counter", "clients_generated_total", NULL, cdata->clients_generated);
+	add_metric(buf, "counter", "clients_dropped_total", NULL, cdata->dead_generated);
+	add_metric(buf, "gauge", "accepting", NULL, cdata->accept);
+	add_metric(buf, "counter", "sends_total", NULL, cdata->sends_generated);
+	add_metric(buf, "counter", "sends_delayed_total", NULL, cdata->sends_delayed);
+	add_metric(buf, "gauge", "sends_queued", NULL, cdata->sends_queued);
+	add_metric(buf, "gauge", "sends_queued_bytes", NULL, cdata->sends_size);
+	add_metric(buf, "gauge", "admission_queue", "lane=\"resume\"", cdata->admissions_queued[ADMIT_RESUME]);
+	add_metric(buf, NULL, "admission_queue", "lane=\"new\"", cdata->admissions_queued[ADMIT_NEW]);
+	add_metric(buf, "counter", "clients_admitted_total", NULL, cdata->clients_admitted);
+	add_metric(buf, "counter", "clients_resumed_total", NULL, cdata->clients_resumed);
+	add_metric(buf, "counter", "admissions_shed_total", NULL, cdata->admissions_shed);
+	add_metric(buf, "counter", "accepts_deferred_total", NULL, cdata->accepts_deferred);
+}
+
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd)
 {
 	cdata_t *cdata = ckp->cdata;
@@ -1410,6 +2647,236 @@ void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd)
 		LOGWARNING("Connector asked to send invalid fd %d", fdno);
 }
 
+/* Stop reading from clients ahead of handing them over, giving messages
+ * already read time to reach the stratifier */
+void connector_freeze(ckpool_t *ckp)
+{
+	cdata_t *cdata = ckp->cdata;
+
+	cdata->accept = false;
+	cksleep_ms(250);
+}
+
+/* Send the clients in val that we still have, with their server, any partial
+ * message they have sent and anything we had yet to write to them, keeping
+ * their fds in the same order to be sent by connector_handover_fds. The sender
+ * marks them handed over between writes so no send is left partly written,
+ * and they are left for the new instance from then on. */
+void connector_handover(ckpool_t *ckp, json_t *val, const int sockd)
+{
+	json_t *clients = json_object_get(val, "clients"), *handed, *entry;
+	cdata_t *cdata = ckp->cdata;
+	int *fds, nfds = 0, ret = 0;
+	int64_t *ids;
+	size_t index;
+	tv_t now;
+	ts_t abs;
+	char *buf;
+
+	fds = ckalloc(sizeof(int) * (json_array_size(clients) + 1));
+	ids = ckalloc(sizeof(int64_t) * (json_array_size(clients) + 1));
+	handed = json_array();
+
+	ck_wlock(&cdata->lock);
+	json_array_foreach(clients, index, entry) {
+		client_instance_t *client;
+		int64_t id;
+
+		if (!json_get_int64(&id, entry, "id"))
+			continue;
+		HASH_FIND_I64(cdata->clients, &id, client);
+		if (!client || client->invalid || client->passthrough || client->remote ||
+		    client->sv2)
+			continue;
+		client->handingover = true;
+		json_set_int(entry, "server", client->server);
+		json_array_append(handed, entry);
+		ids[nfds] = id;
+		fds[nfds++] = client->fd;
+	}
+	ck_wunlock(&cdata->lock);
+
+	tv_time(&now);
+	tv_to_ts(&abs, &now);
+	abs.tv_sec += 5;
+	mutex_lock(&cdata->sender_lock);
+	cdata->handover_request = true;
+	wake_sender(cdata);
+	while (cdata->handover_request && ret != ETIMEDOUT)
+		ret = cond_timedwait(&cdata->handover_cond, &cdata->sender_lock, &abs);
+	cdata->handover_request = false;
+	mutex_unlock(&cdata->sender_lock);
+	if (unlikely(ret == ETIMEDOUT))
+		LOGWARNING("Connector sender failed to stop writing to clients handing over");
+
+	ck_wlock(&cdata->lock);
+	json_array_foreach(handed, index, entry) {
+		client_instance_t *client;
+
+		HASH_FIND_I64(cdata->clients, &ids[index], client);
+		if (!client)
+			continue;
+		client->handingover = false;
+		client->handedover = true;
+		if (client->bufofs)
+			json_object_set_new_nocheck(entry, "buf", json_stringn(client->buf, client->bufofs));
+		if (client->sendtail) {
+			json_set_string(entry, "sendbuf", client->sendtail);
+			dealloc(client->sendtail);
+		}
+	}
+	ck_wunlock(&cdata->lock);
+
+	free(cdata->handover_fds);
+	free(cdata->handover_ids);
+	cdata->handover_fds = fds;
+	cdata->handover_ids = ids;
+	cdata->handover_nfds = nfds;
+	LOGWARNING("Connector handing over %d established clients", nfds);
+
+	json_object_set_new_nocheck(val, "clients", handed);
+	buf = json_dumps(val, JSON_COMPACT);
+	send_unix_msg(sockd, buf);
+	dealloc(buf);
+}
+
+/* Send the fds of the clients last handed over, batched over sockd */
+void connector_handover_fds(ckpool_t *ckp, const int sockd)
+{
+	cdata_t *cdata = ckp->cdata;
+	int sent;
+
+	sent = send_fds(cdata->handover_fds, cdata->handover_nfds, sockd);
+	if (sent < cdata->handover_nfds)
+		LOGWARNING("Connector sent only %d of %d client fds", sent, cdata->handover_nfds);
+}
+
+/* Take back the clients from number fdno on of those last handed over, which
+ * the new instance failed to receive, so they can still be sent a reconnect */
+void connector_handback(ckpool_t *ckp, const int fdno)
+{
+	cdata_t *cdata = ckp->cdata;
+	client_instance_t *client;
+	int i, taken = 0;
+
+	ck_wlock(&cdata->lock);
+	for (i = MAX(fdno, 0); i < cdata->handover_nfds; i++) {
+		HASH_FIND_I64(cdata->clients, &cdata->handover_ids[i], client);
+		if (!client || !client->handedover)
+			continue;
+		client->handedover = false;
+		taken++;
+	}
+	ck_wunlock(&cdata->lock);
+
+	LOGWARNING("Connector took back %d clients not taken over", taken);
+}
+
+/* Create instances for the clients inherited on handover before any other
+ * clients, keeping their ids. They are only added to the epolls once the
+ * stratifier has adopted them. */
+static void inherit_clients(cdata_t *cdata)
+{
+	ckpool_t *ckp = cdata->ckp;
+	json_t *entry;
+	size_t index;
+
+	json_array_foreach(json_object_get(ckp->handover_clients, "clients"), index, entry) {
+		const char *address = json_string_value(json_object_get(entry, "address"));
+		const char *buf = json_string_value(json_object_get(entry, "buf"));
+		const char *sendbuf = json_string_value(json_object_get(entry, "sendbuf"));
+		int fd = ckp->handover_fds[index];
+		client_instance_t *client;
+		socklen_t address_len;
+		socklen_t optlen;
+
+		client = recruit_client(cdata);
+		json_get_int64(&client->id, entry, "id");
+		json_get_int(&client->server, entry, "server");
+		if (client->server < 0 || client->server >= ckp->serverurls)
+			client->server = 0;
+		client->address = (struct sockaddr *)&client->address_storage;
+		address_len = sizeof(client->address_storage);
+		if (unlikely(!address || getpeername(fd, client->address, &address_len))) {
+			LOGNOTICE("Inherited client %"PRId64" fd %d no longer connected",
+				  client->id, fd);
+			json_set_bool(entry, "failed", true);
+			Close(fd);
+			recycle_client(cdata, client);
+			continue;
+		}
+		snprintf(client->address_name, INET6_ADDRSTRLEN, "%s", address);
+		if (buf) {
+			client->bufofs = strnlen(buf, MAX_MSGSIZE);
+			memcpy(client->buf, buf, client->bufofs);
+		}
+		keep_sockalive(fd);
+		noblock_socket(fd);
+		client->fd = fd;
+		client->receiver = index % cdata->receiver_count;
+		optlen = sizeof(client->sendbufsize);
+		getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
+		client->admitted = client->admission_clear = true;
+
+		ck_wlock(&cdata->lock);
+		HASH_ADD_I64(cdata->clients, id, client);
+		cdata->nclients++;
+		cdata->nfds++;
+		if (client->id >= cdata->client_ids)
+			cdata->client_ids = client->id + 1;
+		ck_wunlock(&cdata->lock);
+
+		/* As in accept_client, the reference for the epoll */
+		__inc_instance_ref(client);
+
+		/* Finish writing what the old instance had yet to send ahead
+		 * of anything we send */
+		if (sendbuf && strlen(sendbuf) > 1) {
+			sender_send_t *sender_send = ckslab_zalloc(sender_slab);
+			int len = strlen(sendbuf) / 2;
+
+			sender_send->client = client;
+			sender_send->buf = ckalloc(len + 1);
+			sender_send->len = len;
+			hex2bin(sender_send->buf, sendbuf, len);
+			inc_instance_ref(cdata, client);
+			queue_sender_send(cdata, sender_send);
+		}
+	}
+}
+
+/* Start receiving from the inherited clients the stratifier has adopted */
+void connector_adopt_clients(ckpool_t *ckp)
+{
+	cdata_t *cdata = ckp->cdata;
+	struct epoll_event event;
+	int adopted = 0;
+	json_t *entry;
+	size_t index;
+
+	json_array_foreach(json_object_get(ckp->handover_clients, "clients"), index, entry) {
+		client_instance_t *client;
+		int64_t id;
+
+		if (json_is_true(json_object_get(entry, "failed")) ||
+		    !json_get_int64(&id, entry, "id"))
+			continue;
+		client = ref_client_by_id(cdata, id);
+		if (!client)
+			continue;
+		event.data.u64 = client->id;
+		event.events = EPOLLIN | EPOLLRDHUP;
+		if (unlikely(epoll_ctl(cdata->receivers[client->receiver].epfd, EPOLL_CTL_ADD,
+				       client->fd, &event) < 0)) {
+			LOGERR("Failed to epoll_ctl add inherited client %"PRId64, client->id);
+			invalidate_client(ckp, cdata, client);
+		} else
+			adopted++;
+		dec_instance_ref(cdata, client);
+	}
+	LOGWARNING("Connector adopted %d inherited clients", adopted);
+}
+
 static void connector_loop(proc_instance_t *pi, cdata_t *cdata)
 {
 	unix_msg_t *umsg = NULL;
@@ -1450,7 +2917,7 @@ retry:
 	if (likely(buf[0] == '{')) {
 		json_t *val = json_loads(buf, JSON_DISABLE_EOF_CHECK, NULL);
 
-		ckmsgq_add(cdata->cmpq, val);
+		add_cmsg(cdata, val, NULL, 0, 0);
 	} else if (cmdmatch(buf, "dropclient")) {
 		client_instance_t *client;
 
@@ -1515,7 +2982,23 @@ retry:
 			LOGINFO("Connector failed to find client id %"PRId64" to pass through", client_id);
 			goto retry;
 		}
-		passthrough_client(ckp, cdata, client);
+		/* A passthrough relaying raw is flagged passthrough=id:raw */
+		passthrough_client(ckp, cdata, client, !!strstr(buf, ":raw"));
+		dec_instance_ref(cdata, client);
+	} else if (cmdmatch(buf, "remote")) {
+		client_instance_t *client;
+
+		ret = sscanf(buf, "remote=%"PRId64, &client_id);
+		if (ret < 0) {
+			LOGDEBUG("Connector failed to parse remote command: %s", buf);
+			goto retry;
+		}
+		client = ref_client_by_id(cdata, client_id);
+		if (unlikely(!client)) {
+			LOGINFO("Connector failed to find client id %"PRId64" to add as remote", client_id);
+			goto retry;
+		}
+		remote_server(ckp, client);
 		dec_instance_ref(cdata, client);
 	} else if (cmdmatch(buf, "getxfd")) {
 		int fdno = -1;
@@ -1539,6 +3022,7 @@ void *connector(void *arg)
 
 	rename_proc(pi->processname);
 	LOGWARNING("%s connector starting", ckp->name);
+	sender_slab = create_ckslab("sender", sizeof(sender_send_t));
 	ckp->cdata = cdata;
 	cdata->ckp = ckp;
 
@@ -1648,11 +3132,43 @@ void *connector(void *arg)
 	 * them from the server fds in epoll. */
 	cdata->client_ids = ckp->serverurls;
 	mutex_init(&cdata->sender_lock);
-	cond_init(&cdata->sender_cond);
+	cond_init(&cdata->handover_cond);
+	cdata->sender_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(cdata->sender_wakefd < 0)) {
+		LOGEMERG("FATAL: Failed to create sender eventfd");
+		goto out;
+	}
 	create_pthread(&cdata->pth_sender, sender, cdata);
+	mutex_init(&cdata->admission_lock);
+	cond_init(&cdata->admission_cond);
+	cdata->accept_bucket.rate = ckp->acceptrate;
+	cdata->auth_bucket.rate = ckp->authrate;
+	if (ckp->authrate && !ckp->passthrough && !ckp->redirector)
+		create_pthread(&cdata->pth_admitter, admitter, cdata);
 	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
-	cdata->cevents = create_ckmsgqs(ckp, "cevent", &client_event_processor, threads);
-	create_pthread(&cdata->pth_receiver, receiver, cdata);
+
+	/* Receivers share the server fds so they must not block on accept */
+	for (i = 0; i < ckp->serverurls; i++)
+		noblock_socket(cdata->serverfd[i]);
+	cdata->receiver_count = threads;
+	cdata->receivers = ckzalloc(sizeof(receiver_t) * threads);
+	for (i = 0; i < threads; i++) {
+		receiver_t *receiver = &cdata->receivers[i];
+
+		receiver->cdata = cdata;
+		receiver->id = i;
+		/* Create the epolls before any receiver can accept clients
+		 * that are rearmed by their receiver id */
+		receiver->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (unlikely(receiver->epfd < 0)) {
+			LOGEMERG("FATAL: Failed to create epoll in receiver");
+			goto out;
+		}
+	}
+	if (ckp->handover_clients)
+		inherit_clients(cdata);
+	for (i = 0; i < threads; i++)
+		create_pthread(&cdata->receivers[i].pth, receiver, &cdata->receivers[i]);
 	cdata->start_time = time(NULL);
 
 	ckp->connector_ready = true;
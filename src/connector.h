@@ -13,8 +13,20 @@
 int64_t connector_newclientid(ckpool_t *ckp);
 void connector_upstream_msg(ckpool_t *ckp, char *msg);
 void connector_add_message(ckpool_t *ckp, json_t *val);
+void connector_add_result(ckpool_t *ckp, json_t *val, const int64_t stamp);
+void connector_add_shared(ckpool_t *ckp, ckshared_t *shared, const int64_t client_id);
+void connector_open_capture(ckpool_t *ckp);
+void connector_capture(const int type, const int64_t id, const int server, const char *buf,
+		       const int len);
+void connector_relay(ckpool_t *ckp, const int64_t client_id, char *buf);
 char *connector_stats(void *data, const int runtime);
+void connector_metrics(ckpool_t *ckp, char **buf);
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd);
+void connector_freeze(ckpool_t *ckp);
+void connector_handover(ckpool_t *ckp, json_t *val, const int sockd);
+void connector_handover_fds(ckpool_t *ckp, const int sockd);
+void connector_handback(ckpool_t *ckp, const int fdno);
+void connector_adopt_clients(ckpool_t *ckp);
 void *connector(void *arg);
 
 #endif /* CONNECTOR_H */
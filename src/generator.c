@@ -19,6 +19,7 @@
 #include "libckpool.h"
 #include "generator.h"
 #include "stratifier.h"
+#include "connector.h"
 #include "bitcoin.h"
 #include "uthash.h"
 #include "utlist.h"
@@ -47,15 +48,27 @@ typedef struct notify_instance notify_instance_t;
 
 typedef struct proxy_instance proxy_instance_t;
 
+/* Slot in the ring of shares awaiting a result from upstream */
 struct share_msg {
-	UT_hash_handle hh;
 	int64_t id64; // Our own id for submitting upstream
 
 	int64_t client_id;
 	time_t submit_time;
+	int64_t stamp; // monotonic_ns at submission for result latency
 	double diff;
+	bool pending;
 };
 
+/* Shares awaiting results are kept in a ring indexed by their id, so a share
+ * older than this many later ones has its result accounted at the current
+ * proxy diff. */
+#define SHARE_RING 65536
+
+/* Most submits sent to a subproxy without a result before further shares are
+ * held back, unless it hasn't returned a result for PROXY_STALL seconds */
+#define PROXY_OUTSTANDING 4096
+#define PROXY_STALL 30
+
 typedef struct share_msg share_msg_t;
 
 struct stratum_msg {
@@ -100,6 +113,7 @@ struct proxy_instance {
 	ckpool_t *ckp;
 	connsock_t cs;
 	bool passthrough;
+	bool raw; /* Upstream accepted raw relaying of our passthrough */
 	bool node;
 	int id; /* Proxy server id*/
 	int subid; /* Subproxy id */
@@ -160,11 +174,28 @@ struct proxy_instance {
 
 	 /* Are we in the middle of a blocked write of this message? */
 	cs_msg_t *sending;
+	/* Queued message not yet being written that further submits are
+	 * appended to, coalescing them into a single write */
+	cs_msg_t *pending;
+
+	int outstanding; /* Submits sent without a result yet */
+	time_t last_result;
+	double latency_avg; /* Rolling average share result latency in ms */
+	double latency_max;
+	int64_t results;
 
 	pthread_t pth_precv;
 
 	ckmsgq_t *passsends;	// passthrough sends
 
+	/* Relay envelopes waiting to be written upstream in raw mode */
+	mutex_t relay_lock;
+	pthread_cond_t relay_cond;
+	char *relaybuf;
+	int relaylen;
+	int relaysize;
+	pthread_t pth_relay;
+
 	char_entry_t *recvd_lines; /* Linked list of unprocessed messages */
 
 	int epfd; /* Epoll fd used by the parent proxy */
@@ -199,11 +230,24 @@ struct generator_data {
 	notify_instance_t *notify_instances;
 
 	mutex_t share_lock;
-	share_msg_t *shares;
+	share_msg_t *share_ring;
+	int64_t shares_pending; // Ring slots awaiting a result
+	int64_t shares_lost; // Overwritten before getting a result
 	int64_t share_id;
+	int64_t shares_accepted; // Upstream results over all proxies
+	int64_t shares_rejected;
 
 	server_instance_t *current_si; // Current server instance
 
+	/* Block template prefetched ahead of the stratifier needing it */
+	mutex_t prefetch_lock;
+	pthread_cond_t prefetch_cond;
+	gbtbase_t *prefetch;
+	int64_t prefetch_req; // Id of the last template requested
+	int64_t prefetch_done; // Id of the last request fulfilled
+	ts_t prefetch_at; // When to next refresh the template
+	int prefetch_lead; // ms ahead of the due time to start fetching
+
 	proxy_instance_t *current_proxy;
 };
 
@@ -330,11 +374,31 @@ static void kill_server(server_instance_t *si)
 	cs = &si->cs;
 	Close(cs->fd);
 	empty_buffer(cs);
+	close_rpc_conns(cs);
 	dealloc(cs->url);
 	dealloc(cs->port);
 	dealloc(cs->auth);
 }
 
+/* The getblocktemplate is no longer kept as json so summarise what was
+ * decoded from it */
+static char *gbtbase_summary(const gbtbase_t *gbt)
+{
+	json_t *val;
+	char *s;
+
+	JSON_CPACK(val, "{ss,ss,sf,si,ss,ss,ss,sI,si,ss,si,ss}",
+		   "previousblockhash", gbt->prevhash, "target", gbt->target,
+		   "diff", gbt->diff, "version", gbt->version,
+		   "ntime", gbt->ntime, "bbversion", gbt->bbversion, "nbit", gbt->nbit,
+		   "coinbasevalue", gbt->coinbasevalue, "height", gbt->height,
+		   "flags", gbt->flags, "transactions", gbt->txns,
+		   "default_witness_commitment", gbt->witness_commitment);
+	s = json_dumps(val, JSON_NO_UTF8);
+	json_decref(val);
+	return s;
+}
+
 static void clear_unix_msg(unix_msg_t **umsg)
 {
 	if (*umsg) {
@@ -345,12 +409,64 @@ static void clear_unix_msg(unix_msg_t **umsg)
 	}
 }
 
-bool generator_submitblock(ckpool_t *ckp, const char *buf)
+/* A block's data shared by the threads submitting it to the other servers,
+ * freed by the last one to finish */
+struct blockdata {
+	char *data;
+	char *txn_data;
+	int txn_len;
+	int refs;
+};
+
+struct blocksubmit {
+	server_instance_t *si;
+	pthread_t pth;
+	struct blockdata *bd;
+};
+
+static void put_blockdata(struct blockdata *bd)
+{
+	if (__atomic_sub_fetch(&bd->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(bd->data);
+	free(bd->txn_data);
+	free(bd);
+}
+
+/* Submit a block to one of the other servers alongside the current one,
+ * detached so the submitter need not wait on slower servers */
+static void *submit_other(void *arg)
+{
+	struct blocksubmit *bs = (struct blocksubmit *)arg;
+	struct blockdata *bd = bs->bd;
+	connsock_t *cs = &bs->si->cs;
+
+	pthread_detach(pthread_self());
+	rename_proc("blocksubmit");
+	LOGNOTICE("Submitting block data to %s:%s", cs->url, cs->port);
+	if (submit_block_data(cs, bd->data, bd->txn_data, bd->txn_len))
+		LOGNOTICE("Block accepted by %s:%s", cs->url, cs->port);
+	else
+		LOGWARNING("Block rejected by %s:%s", cs->url, cs->port);
+	put_blockdata(bd);
+	free(bs);
+	return NULL;
+}
+
+/* Submit a block's header and coinbase data followed by its binary txn_data
+ * to every live server at once since they may not all be connected to each
+ * other, returning the result from the current server without waiting on the
+ * others, which log their own results. The txn_data is hex encoded once here
+ * and shared by every submission. */
+bool generator_submitblock(ckpool_t *ckp, const char *data, const char *txn_data, const int txn_len)
 {
+	struct blockdata *bd = NULL;
 	gdata_t *gdata = ckp->gdata;
 	server_instance_t *si;
-	bool warn = false;
+	char *txn_hex = NULL;
+	bool warn = false, ret;
 	connsock_t *cs;
+	int i;
 
 	while (unlikely(!(si = gdata->current_si))) {
 		if (!warn)
@@ -358,9 +474,35 @@ bool generator_submitblock(ckpool_t *ckp, const char *buf)
 		warn = true;
 		cksleep_ms(10);
 	}
+	if (txn_len)
+		txn_hex = bin2hex(txn_data, txn_len);
+	for (i = 0; i < ckp->btcds; i++) {
+		struct blocksubmit *bs;
+
+		if (ckp->servers[i] == si || !ckp->servers[i]->alive)
+			continue;
+		if (!bd) {
+			bd = ckalloc(sizeof(struct blockdata));
+			bd->data = strdup(data);
+			bd->txn_data = txn_hex;
+			bd->txn_len = txn_len * 2;
+			/* Held by us until we have submitted it too */
+			bd->refs = 1;
+		}
+		bs = ckalloc(sizeof(struct blocksubmit));
+		bs->si = ckp->servers[i];
+		bs->bd = bd;
+		__atomic_add_fetch(&bd->refs, 1, __ATOMIC_RELAXED);
+		create_pthread(&bs->pth, submit_other, bs);
+	}
 	cs = &si->cs;
 	LOGNOTICE("Submitting block data!");
-	return submit_block(cs, buf);
+	ret = submit_block_data(cs, data, txn_hex, txn_len * 2);
+	if (bd)
+		put_blockdata(bd);
+	else
+		free(txn_hex);
+	return ret;
 }
 
 void generator_preciousblock(ckpool_t *ckp, const char *hash)
@@ -391,6 +533,24 @@ bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash)
 	return get_blockhash(cs, height, hash);
 }
 
+/* Counters are read unlocked and only approximate */
+void generator_metrics(ckpool_t *ckp, char **buf)
+{
+	gdata_t *gdata = ckp->gdata;
+
+	add_metric(buf, "gauge", "bitcoind_alive", NULL, gdata->current_si != NULL);
+	add_metric(buf, "counter", "template_requests_total", NULL, gdata->prefetch_req);
+	add_metric(buf, "counter", "template_requests_fulfilled_total", NULL, gdata->prefetch_done);
+	add_metric(buf, "counter", "proxies_generated_total", NULL, gdata->proxies_generated);
+	add_metric(buf, "counter", "subproxies_generated_total", NULL, gdata->subproxies_generated);
+	add_metric(buf, "counter", "proxy_sends_total", NULL, gdata->psends_generated);
+	add_metric(buf, "counter", "proxy_shares_total", NULL, gdata->share_id);
+	add_metric(buf, "counter", "proxy_results_total", "result=\"accepted\"",
+		   __atomic_load_n(&gdata->shares_accepted, __ATOMIC_RELAXED));
+	add_metric(buf, NULL, "proxy_results_total", "result=\"rejected\"",
+		   __atomic_load_n(&gdata->shares_rejected, __ATOMIC_RELAXED));
+}
+
 static void gen_loop(proc_instance_t *pi)
 {
 	server_instance_t *si = NULL, *old_si;
@@ -440,7 +600,7 @@ retry:
 			send_unix_msg(umsg->sockd, "Failed");
 			goto reconnect;
 		} else {
-			char *s = json_dumps(gbt.json, JSON_NO_UTF8);
+			char *s = gbtbase_summary(&gbt);
 
 			send_unix_msg(umsg->sockd, s);
 			free(s);
@@ -776,9 +936,13 @@ static bool passthrough_stratum(connsock_t *cs, proxy_instance_t *proxi)
 	bool res, ret = false;
 	float timeout = 10;
 
+	proxi->raw = false;
 	JSON_CPACK(req, "{ss,s[s]}",
 			"method", "mining.passthrough",
 			"params", PACKAGE"/"VERSION);
+	/* Ask to relay messages in raw envelopes */
+	if (proxi->ckp->rawrelay)
+		json_array_append_new(json_object_get(req, "params"), json_string("raw"));
 	res = send_json_msg(cs, req);
 	json_decref(req);
 	if (!res) {
@@ -803,6 +967,10 @@ static bool passthrough_stratum(connsock_t *cs, proxy_instance_t *proxi)
 		goto out;
 	}
 	proxi->passthrough = true;
+	if (proxi->ckp->rawrelay) {
+		proxi->raw = json_is_true(json_object_get(val, "raw"));
+		LOGNOTICE("Upstream %s raw relaying of passthrough", proxi->raw ? "accepted" : "declined");
+	}
 out:
 	if (val)
 		json_decref(val);
@@ -861,7 +1029,7 @@ static void reconnect_generator(ckpool_t *ckp)
 	send_proc(ckp->generator, "reconnect");
 }
 
-struct genwork *generator_getbase(ckpool_t *ckp)
+static gbtbase_t *fetch_gbtbase(ckpool_t *ckp)
 {
 	gdata_t *gdata = ckp->gdata;
 	gbtbase_t *gbt = NULL;
@@ -886,6 +1054,104 @@ out:
 	return gbt;
 }
 
+/* Set the next refresh of the prefetched template to ms from now */
+static void __prefetch_in(gdata_t *gdata, int64_t ms)
+{
+	ts_t delay;
+
+	ts_realtime(&gdata->prefetch_at);
+	ms_to_ts(&delay, MAX(ms, 0));
+	timeraddspec(&gdata->prefetch_at, &delay);
+}
+
+/* Keeps a decoded block template ready for the stratifier, fetching it just
+ * before the next routine update is due, or immediately when one is
+ * requested. */
+static void *prefetcher(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	gdata_t *gdata = ckp->gdata;
+
+	rename_proc("prefetcher");
+
+	pthread_detach(pthread_self());
+
+	while (42) {
+		gbtbase_t *gbt, *old;
+		tv_t start, end;
+		int64_t req;
+
+		mutex_lock(&gdata->prefetch_lock);
+		while (gdata->prefetch_req == gdata->prefetch_done) {
+			if (cond_timedwait(&gdata->prefetch_cond, &gdata->prefetch_lock,
+					   &gdata->prefetch_at) == ETIMEDOUT)
+				break;
+		}
+		req = gdata->prefetch_req;
+		mutex_unlock(&gdata->prefetch_lock);
+
+		tv_time(&start);
+		gbt = fetch_gbtbase(ckp);
+		tv_time(&end);
+
+		mutex_lock(&gdata->prefetch_lock);
+		old = gdata->prefetch;
+		gdata->prefetch = gbt;
+		gdata->prefetch_done = req;
+		/* Allow for the template taking twice as long next time */
+		gdata->prefetch_lead = MAX(ms_tvdiff(&end, &start) * 2, 1000);
+		/* Refresh it anyway if it goes unused for an update interval */
+		__prefetch_in(gdata, ckp->update_interval * 1000);
+		pthread_cond_broadcast(&gdata->prefetch_cond);
+		mutex_unlock(&gdata->prefetch_lock);
+
+		if (old) {
+			clear_gbtbase(old);
+			free(old);
+		}
+	}
+	return NULL;
+}
+
+/* Get a block template, taking the prefetched one unless fresh is set or
+ * there is none ready, in which case wait for a new one to be fetched. */
+struct genwork *generator_getbase(ckpool_t *ckp, const bool fresh)
+{
+	gdata_t *gdata = ckp->gdata;
+	gbtbase_t *gbt;
+	int64_t req;
+
+	if (!ckp->prefetch)
+		return fetch_gbtbase(ckp);
+
+	mutex_lock(&gdata->prefetch_lock);
+	if (fresh || !gdata->prefetch) {
+		req = ++gdata->prefetch_req;
+		pthread_cond_broadcast(&gdata->prefetch_cond);
+		while (gdata->prefetch_done < req)
+			cond_wait(&gdata->prefetch_cond, &gdata->prefetch_lock);
+	}
+	gbt = gdata->prefetch;
+	gdata->prefetch = NULL;
+	mutex_unlock(&gdata->prefetch_lock);
+
+	return gbt;
+}
+
+/* Tell the prefetcher when the stratifier next expects to need a template */
+void generator_prefetch(ckpool_t *ckp, const time_t due)
+{
+	gdata_t *gdata = ckp->gdata;
+
+	if (!ckp->prefetch)
+		return;
+
+	mutex_lock(&gdata->prefetch_lock);
+	__prefetch_in(gdata, (int64_t)(due - time(NULL)) * 1000 - gdata->prefetch_lead);
+	pthread_cond_broadcast(&gdata->prefetch_cond);
+	mutex_unlock(&gdata->prefetch_lock);
+}
+
 int generator_getbest(ckpool_t *ckp, char *hash)
 {
 	gdata_t *gdata = ckp->gdata;
@@ -1608,27 +1874,25 @@ static void stratifier_reconnect_client(ckpool_t *ckp, const int64_t id)
 	send_proc(ckp->stratifier, buf);
 }
 
-/* Add a share to the gdata share hashlist. Returns the share id */
-static int add_share(gdata_t *gdata, const int64_t client_id, const double diff)
+/* Add a share to the gdata share ring. Returns the share id */
+static int64_t add_share(gdata_t *gdata, const int64_t client_id, const double diff)
 {
-	share_msg_t *share = ckzalloc(sizeof(share_msg_t)), *tmpshare;
-	time_t now;
-	int ret;
+	share_msg_t *share;
+	int64_t ret;
 
-	share->submit_time = now = time(NULL);
+	mutex_lock(&gdata->share_lock);
+	ret = gdata->share_id++;
+	share = &gdata->share_ring[ret & (SHARE_RING - 1)];
+	if (share->pending)
+		gdata->shares_lost++;
+	else
+		gdata->shares_pending++;
+	share->id64 = ret;
 	share->client_id = client_id;
+	share->submit_time = time(NULL);
+	share->stamp = monotonic_ns();
 	share->diff = diff;
-
-	/* Add new share entry to the share hashtable. Age old shares */
-	mutex_lock(&gdata->share_lock);
-	ret = share->id64 = gdata->share_id++;
-	HASH_ADD_I64(gdata->shares, id64, share);
-	HASH_ITER(hh, gdata->shares, share, tmpshare) {
-		if (share->submit_time < now - 120) {
-			HASH_DEL(gdata->shares, share);
-			free(share);
-		}
-	}
+	share->pending = true;
 	mutex_unlock(&gdata->share_lock);
 
 	return ret;
@@ -1638,8 +1902,9 @@ static void submit_share(gdata_t *gdata, json_t *val)
 {
 	proxy_instance_t *proxy, *proxi;
 	ckpool_t *ckp = gdata->ckp;
-	int id, subid, share_id;
 	bool success = false;
+	int64_t share_id;
+	int id, subid;
 	stratum_msg_t *msg;
 	int64_t client_id;
 
@@ -1682,7 +1947,7 @@ static void submit_share(gdata_t *gdata, json_t *val)
 	msg = ckzalloc(sizeof(stratum_msg_t));
 	msg->json_msg = val;
 	share_id = add_share(gdata, client_id, proxi->diff);
-	json_set_int(val, "id", share_id);
+	json_set_int64(val, "id", share_id);
 
 	/* Add the new message to the psend list */
 	mutex_lock(&gdata->psend_lock);
@@ -1727,10 +1992,14 @@ static void __decay_proxy(proxy_instance_t *proxy, proxy_instance_t * parent, co
 	copy_tv(&parent->total_last_decay, &now_t);
 }
 
-static void account_shares(proxy_instance_t *proxy, const double diff, const bool result)
+static void account_shares(gdata_t *gdata, proxy_instance_t *proxy, const double diff,
+			   const bool result)
 {
 	proxy_instance_t *parent = proxy->parent;
 
+	__atomic_fetch_add(result ? &gdata->shares_accepted : &gdata->shares_rejected, 1,
+			   __ATOMIC_RELAXED);
+
 	mutex_lock(&parent->proxy_lock);
 	if (result) {
 		proxy->diff_accepted += diff;
@@ -1744,13 +2013,28 @@ static void account_shares(proxy_instance_t *proxy, const double diff, const boo
 	mutex_unlock(&parent->proxy_lock);
 }
 
+static void account_latency(proxy_instance_t *proxy, const double latency)
+{
+	proxy_instance_t *parent = proxy->parent;
+
+	mutex_lock(&parent->proxy_lock);
+	if (!proxy->results++)
+		proxy->latency_avg = latency;
+	else
+		proxy->latency_avg += (latency - proxy->latency_avg) / 64;
+	if (latency > proxy->latency_max)
+		proxy->latency_max = latency;
+	mutex_unlock(&parent->proxy_lock);
+}
+
 /* Returns zero if it is not recognised as a share, 1 if it is a valid share
  * and -1 if it is recognised as a share but invalid. */
 static int parse_share(gdata_t *gdata, proxy_instance_t *proxi, const char *buf)
 {
 	json_t *val = NULL, *idval;
+	share_msg_t *slot, share;
 	bool result = false;
-	share_msg_t *share;
+	bool found = false;
 	int ret = 0;
 	int64_t id;
 
@@ -1771,27 +2055,33 @@ static int parse_share(gdata_t *gdata, proxy_instance_t *proxi, const char *buf)
 	}
 
 	mutex_lock(&gdata->share_lock);
-	HASH_FIND_I64(gdata->shares, &id, share);
-	if (share) {
-		HASH_DEL(gdata->shares, share);
-		free(share);
+	slot = &gdata->share_ring[id & (SHARE_RING - 1)];
+	if (id >= 0 && slot->pending && slot->id64 == id) {
+		share = *slot;
+		slot->pending = false;
+		gdata->shares_pending--;
+		found = true;
 	}
 	mutex_unlock(&gdata->share_lock);
 
-	if (!share) {
+	if (proxi->outstanding > 0)
+		__atomic_fetch_sub(&proxi->outstanding, 1, __ATOMIC_RELAXED);
+	proxi->last_result = time(NULL);
+
+	if (!found) {
 		LOGINFO("Proxy %d:%d failed to find matching share to result: %s",
 			proxi->id, proxi->subid, buf);
 		/* We don't know what diff these shares are so assume the
 		 * current proxy diff. */
-		account_shares(proxi, proxi->diff, result);
+		account_shares(gdata, proxi, proxi->diff, result);
 		ret = -1;
 		goto out;
 	}
 	ret = 1;
-	account_shares(proxi, share->diff, result);
+	account_shares(gdata, proxi, share.diff, result);
+	account_latency(proxi, (double)(monotonic_ns() - share.stamp) / 1000000);
 	LOGINFO("Proxy %d:%d share result %s from client %"PRId64, proxi->id, proxi->subid,
-		buf, share->client_id);
-	free(share);
+		buf, share.client_id);
 out:
 	if (val)
 		json_decref(val);
@@ -1831,6 +2121,8 @@ static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgq)
 				break;
 			}
 			proxy->sending = csmsg;
+			if (proxy->pending == csmsg)
+				proxy->pending = NULL;
 			fd = proxy->cs.fd;
 			ret = send(fd, csmsg->buf + csmsg->ofs, csmsg->len, MSG_DONTWAIT);
 			if (ret < 1) {
@@ -1849,6 +2141,8 @@ static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgq)
 		}
 		if (csmsg->len < 1) {
 			proxy->sending = NULL;
+			if (proxy->pending == csmsg)
+				proxy->pending = NULL;
 			DL_DELETE(*csmsgq, csmsg);
 			free(csmsg->buf);
 			free(csmsg);
@@ -1856,20 +2150,57 @@ static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgq)
 	}
 }
 
+/* Largest message we'll keep coalescing further submits into */
+#define MSGQ_COALESCE 65536
+
 static void add_json_msgq(cs_msg_t **csmsgq, proxy_instance_t *proxy, json_t **val)
 {
-	cs_msg_t *csmsg = ckzalloc(sizeof(cs_msg_t));
+	cs_msg_t *csmsg;
+	char *buf;
+	int len;
 
-	csmsg->buf = json_dumps(*val, JSON_ESCAPE_SLASH | JSON_EOL);
+	buf = json_dumps(*val, JSON_ESCAPE_SLASH | JSON_EOL);
 	json_decref(*val);
 	*val = NULL;
-	if (unlikely(!csmsg->buf)) {
+	if (unlikely(!buf)) {
 		LOGWARNING("Failed to create json dump in add_json_msgq");
 		return;
 	}
-	csmsg->len = strlen(csmsg->buf);
+	len = strlen(buf);
+
+	/* Append to a message for this proxy that we haven't started writing
+	 * yet so a burst of submits goes out in as few writes as possible */
+	csmsg = proxy->pending;
+	if (csmsg && csmsg->len + len <= MSGQ_COALESCE) {
+		csmsg->buf = realloc(csmsg->buf, csmsg->len + len + 1);
+		if (unlikely(!csmsg->buf))
+			quit(1, "Failed to realloc in add_json_msgq");
+		memcpy(csmsg->buf + csmsg->len, buf, len + 1);
+		csmsg->len += len;
+		free(buf);
+		return;
+	}
+	csmsg = ckzalloc(sizeof(cs_msg_t));
+	csmsg->buf = buf;
+	csmsg->len = len;
 	csmsg->proxy = proxy;
 	DL_APPEND(*csmsgq, csmsg);
+	proxy->pending = csmsg;
+}
+
+/* Is this subproxy at its limit of submits awaiting results? Reset the count
+ * if it has stopped returning results altogether. */
+static bool proxy_saturated(proxy_instance_t *proxy, const time_t now)
+{
+	if (__atomic_load_n(&proxy->outstanding, __ATOMIC_RELAXED) < PROXY_OUTSTANDING)
+		return false;
+	if (now - proxy->last_result > PROXY_STALL) {
+		LOGNOTICE("Proxy %d:%d %s returned no share results for %ds with %d outstanding",
+			  proxy->id, proxy->subid, proxy->url, PROXY_STALL, proxy->outstanding);
+		__atomic_store_n(&proxy->outstanding, 0, __ATOMIC_RELAXED);
+		return false;
+	}
+	return true;
 }
 
 /* For processing and sending shares. proxy refers to parent proxy here */
@@ -1877,7 +2208,7 @@ static void *proxy_send(void *arg)
 {
 	ckpool_t *ckp = (ckpool_t *)arg;
 	gdata_t *gdata = ckp->gdata;
-	stratum_msg_t *msg = NULL;
+	stratum_msg_t *msgs = NULL, *held = NULL, *msg, *tmp;
 	cs_msg_t *csmsgq = NULL;
 
 	rename_proc("proxysend");
@@ -1885,18 +2216,10 @@ static void *proxy_send(void *arg)
 	pthread_detach(pthread_self());
 
 	while (42) {
-		proxy_instance_t *proxy, *subproxy;
-		int proxyid = 0, subid = 0;
-		int64_t client_id = 0, id;
-		notify_instance_t *ni;
-		json_t *jobid = NULL;
-		json_t *val;
-
-		if (unlikely(msg)) {
-			json_decref(msg->json_msg);
-			free(msg);
-		}
+		time_t now;
 
+		/* Take every queued submit at once and only wait when there is
+		 * nothing left to write or retry */
 		mutex_lock(&gdata->psend_lock);
 		if (!gdata->psends) {
 			/* Poll every 10ms */
@@ -1907,65 +2230,87 @@ static void *proxy_send(void *arg)
 			timeraddspec(&timeout_ts, &polltime);
 			cond_timedwait(&gdata->psend_cond, &gdata->psend_lock, &timeout_ts);
 		}
-		msg = gdata->psends;
-		if (likely(msg))
-			DL_DELETE(gdata->psends, msg);
+		msgs = gdata->psends;
+		gdata->psends = NULL;
 		mutex_unlock(&gdata->psend_lock);
 
-		if (!msg) {
-			send_json_msgq(gdata, &csmsgq);
-			continue;
+		/* Retry shares held for saturated subproxies first to keep
+		 * them in order */
+		if (held) {
+			DL_CONCAT(held, msgs);
+			msgs = held;
+			held = NULL;
 		}
 
-		if (unlikely(!json_get_int(&subid, msg->json_msg, "subproxy"))) {
-			LOGWARNING("Failed to find subproxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&id, msg->json_msg, "jobid"))) {
-			LOGWARNING("Failed to find jobid in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int(&proxyid, msg->json_msg, "proxy"))) {
-			LOGWARNING("Failed to find proxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&client_id, msg->json_msg, "client_id"))) {
-			LOGWARNING("Failed to find client_id in proxy_send msg");
-			continue;
-		}
-		proxy = proxy_by_id(gdata, proxyid);
-		if (unlikely(!proxy)) {
-			LOGWARNING("Proxysend for got message for non-existent proxy %d",
-				   proxyid);
-			continue;
-		}
-		subproxy = subproxy_by_id(proxy, subid);
-		if (unlikely(!subproxy)) {
-			LOGWARNING("Proxysend for got message for non-existent subproxy %d:%d",
-				   proxyid, subid);
-			continue;
-		}
+		now = time(NULL);
+		DL_FOREACH_SAFE(msgs, msg, tmp) {
+			proxy_instance_t *proxy, *subproxy;
+			int proxyid = 0, subid = 0;
+			int64_t client_id = 0, id;
+			notify_instance_t *ni;
+			json_t *jobid = NULL;
+			json_t *val;
+
+			DL_DELETE(msgs, msg);
+
+			if (unlikely(!json_get_int(&subid, msg->json_msg, "subproxy"))) {
+				LOGWARNING("Failed to find subproxy in proxy_send msg");
+				goto free_msg;
+			}
+			if (unlikely(!json_get_int64(&id, msg->json_msg, "jobid"))) {
+				LOGWARNING("Failed to find jobid in proxy_send msg");
+				goto free_msg;
+			}
+			if (unlikely(!json_get_int(&proxyid, msg->json_msg, "proxy"))) {
+				LOGWARNING("Failed to find proxy in proxy_send msg");
+				goto free_msg;
+			}
+			if (unlikely(!json_get_int64(&client_id, msg->json_msg, "client_id"))) {
+				LOGWARNING("Failed to find client_id in proxy_send msg");
+				goto free_msg;
+			}
+			proxy = proxy_by_id(gdata, proxyid);
+			if (unlikely(!proxy)) {
+				LOGWARNING("Proxysend for got message for non-existent proxy %d",
+					   proxyid);
+				goto free_msg;
+			}
+			subproxy = subproxy_by_id(proxy, subid);
+			if (unlikely(!subproxy)) {
+				LOGWARNING("Proxysend for got message for non-existent subproxy %d:%d",
+					   proxyid, subid);
+				goto free_msg;
+			}
+			if (subproxy->alive && proxy_saturated(subproxy, now)) {
+				DL_APPEND(held, msg);
+				continue;
+			}
 
-		mutex_lock(&gdata->notify_lock);
-		HASH_FIND_INT(gdata->notify_instances, &id, ni);
-		if (ni)
-			jobid = json_copy(ni->jobid);
-		mutex_unlock(&gdata->notify_lock);
+			mutex_lock(&gdata->notify_lock);
+			HASH_FIND_I64(gdata->notify_instances, &id, ni);
+			if (ni)
+				jobid = json_copy(ni->jobid);
+			mutex_unlock(&gdata->notify_lock);
+
+			if (unlikely(!jobid)) {
+				stratifier_reconnect_client(ckp, client_id);
+				LOGNOTICE("Proxy %d:%s failed to find matching jobid in proxysend",
+					  subproxy->id, subproxy->url);
+				goto free_msg;
+			}
 
-		if (unlikely(!jobid)) {
-			stratifier_reconnect_client(ckp, client_id);
-			LOGNOTICE("Proxy %d:%s failed to find matching jobid in proxysend",
-				  subproxy->id, subproxy->url);
-			continue;
+			JSON_CPACK(val, "{s[soooo]soss}", "params", subproxy->auth, jobid,
+					json_object_dup(msg->json_msg, "nonce2"),
+					json_object_dup(msg->json_msg, "ntime"),
+					json_object_dup(msg->json_msg, "nonce"),
+					"id", json_object_dup(msg->json_msg, "id"),
+					"method", "mining.submit");
+			add_json_msgq(&csmsgq, subproxy, &val);
+			__atomic_add_fetch(&subproxy->outstanding, 1, __ATOMIC_RELAXED);
+free_msg:
+			json_decref(msg->json_msg);
+			free(msg);
 		}
-
-		JSON_CPACK(val, "{s[soooo]soss}", "params", subproxy->auth, jobid,
-				json_object_dup(msg->json_msg, "nonce2"),
-				json_object_dup(msg->json_msg, "ntime"),
-				json_object_dup(msg->json_msg, "nonce"),
-				"id", json_object_dup(msg->json_msg, "id"),
-				"method", "mining.submit");
-		add_json_msgq(&csmsgq, subproxy, &val);
 		send_json_msgq(gdata, &csmsgq);
 	}
 	return NULL;
@@ -1996,6 +2341,120 @@ out:
 	free(pm);
 }
 
+/* Largest backlog of relay envelopes we'll buffer for upstream */
+#define RELAY_BACKLOG 0x4000000
+
+/* Append a message from client_id in a relay envelope to the proxy's buffer
+ * for the relay sender to write upstream */
+static void relay_add(proxy_instance_t *proxy, const int64_t client_id, const char *msg,
+		      const int len)
+{
+	int need = proxy->relaylen + sizeof(relay_hdr_t) + len;
+	relay_hdr_t hdr;
+
+	relay_hdr(&hdr, client_id, len);
+
+	mutex_lock(&proxy->relay_lock);
+	if (unlikely(need > RELAY_BACKLOG)) {
+		LOGWARNING("Passthrough relay backlog full, dropping message from client %"PRId64,
+			   client_id);
+		goto out;
+	}
+	if (need > proxy->relaysize) {
+		proxy->relaysize = round_up_page(need);
+		proxy->relaybuf = realloc(proxy->relaybuf, proxy->relaysize);
+		if (unlikely(!proxy->relaybuf))
+			quit(1, "Failed to realloc relaybuf in relay_add");
+	}
+	memcpy(proxy->relaybuf + proxy->relaylen, &hdr, sizeof(relay_hdr_t));
+	memcpy(proxy->relaybuf + proxy->relaylen + sizeof(relay_hdr_t), msg, len);
+	proxy->relaylen = need;
+	pthread_cond_signal(&proxy->relay_cond);
+out:
+	mutex_unlock(&proxy->relay_lock);
+}
+
+/* Writes everything appended to the relay buffer upstream in one go, swapping
+ * between two buffers so senders keep appending during the write. */
+static void *relay_send(void *arg)
+{
+	proxy_instance_t *proxy = (proxy_instance_t *)arg;
+	ckpool_t *ckp = proxy->ckp;
+	connsock_t *cs = &proxy->cs;
+	char *buf = NULL;
+	int len, size = 0;
+
+	rename_proc("relaysend");
+	pthread_detach(pthread_self());
+
+	while (42) {
+		char *tmpbuf;
+		int tmpsize, sent;
+
+		mutex_lock(&proxy->relay_lock);
+		while (!proxy->relaylen)
+			cond_wait(&proxy->relay_cond, &proxy->relay_lock);
+		tmpbuf = proxy->relaybuf;
+		tmpsize = proxy->relaysize;
+		len = proxy->relaylen;
+		proxy->relaybuf = buf;
+		proxy->relaysize = size;
+		proxy->relaylen = 0;
+		mutex_unlock(&proxy->relay_lock);
+		buf = tmpbuf;
+		size = tmpsize;
+
+		if (unlikely(!proxy->alive || cs->fd < 0)) {
+			LOGDEBUG("Dropping %d bytes of relay to dead proxy", len);
+			continue;
+		}
+		sent = write_socket(cs->fd, buf, len);
+		if (unlikely(sent != len)) {
+			LOGWARNING("Failed to relay %d bytes upstream, attempting reconnect", len);
+			Close(cs->fd);
+			proxy->alive = false;
+			reconnect_generator(ckp);
+		}
+	}
+	return NULL;
+}
+
+/* Relay a line received from a passthrough client verbatim upstream if it
+ * accepted raw relaying, returning false if it should be sent as json */
+bool generator_relay(ckpool_t *ckp, const int64_t client_id, const char *buf, const int len)
+{
+	gdata_t *gdata = ckp->gdata;
+	proxy_instance_t *proxy = gdata->current_proxy;
+
+	if (unlikely(!proxy || !proxy->raw))
+		return false;
+	relay_add(proxy, client_id, buf, len);
+	return true;
+}
+
+/* Pass a relay envelope from upstream straight to the client it belongs to,
+ * or to the connector to process when meant for the passthrough itself */
+static void relay_recv(ckpool_t *ckp, const char *buf, int len)
+{
+	int64_t client_id = 0;
+	char *msg;
+
+	relay_msg(buf, len, &client_id);
+	len -= sizeof(relay_hdr_t);
+	msg = ckalloc(len + 1);
+	memcpy(msg, buf + sizeof(relay_hdr_t), len);
+	msg[len] = '\0';
+	if (likely(client_id)) {
+		connector_relay(ckp, client_id, msg);
+		return;
+	}
+	if (len && msg[len - 1] == '\n')
+		msg[len - 1] = '\0';
+	LOGDEBUG("Passthrough recv received upstream relay msg: %s", msg);
+	send_proc(ckp->connector, msg);
+	free(msg);
+}
+
 static void passthrough_add_send(proxy_instance_t *proxy, char *msg)
 {
 	pass_msg_t *pm = ckzalloc(sizeof(pass_msg_t));
@@ -2009,22 +2468,32 @@ static void passthrough_add_send(proxy_instance_t *proxy, char *msg)
 void generator_add_send(ckpool_t *ckp, json_t *val)
 {
 	gdata_t *gdata = ckp->gdata;
+	proxy_instance_t *proxy;
+	int64_t client_id = 0;
 	char *buf;
 
 	if (!ckp->passthrough) {
 		submit_share(gdata, val);
 		return;
 	}
-	if (unlikely(!gdata->current_proxy)) {
+	proxy = gdata->current_proxy;
+	if (unlikely(!proxy)) {
 		LOGWARNING("No current proxy to send passthrough data to");
 		goto out;
 	}
+	/* Keep json messages in order with raw relayed ones */
+	if (proxy->raw)
+		json_getdel_int64(&client_id, val, "client_id");
 	buf = json_dumps(val, JSON_COMPACT | JSON_EOL);
 	if (unlikely(!buf)) {
 		LOGWARNING("Unable to decode json in generator_add_send");
 		goto out;
 	}
-	passthrough_add_send(gdata->current_proxy, buf);
+	if (proxy->raw) {
+		relay_add(proxy, client_id, buf, strlen(buf));
+		free(buf);
+	} else
+		passthrough_add_send(proxy, buf);
 out:
 	json_decref(val);
 }
@@ -2147,6 +2616,10 @@ out:
 		/* Close and invalidate the file handle */
 		Close(cs->fd);
 	}
+	if (ret) {
+		__atomic_store_n(&proxi->outstanding, 0, __ATOMIC_RELAXED);
+		proxi->last_result = time(NULL);
+	}
 	proxi->alive = ret;
 	cksem_post(&cs->sem);
 
@@ -2291,13 +2764,17 @@ static void *passthrough_recv(void *arg)
 		}
 
 		cksem_wait(&cs->sem);
-		ret = read_socket_line(cs, &timeout);
+		ret = proxi->raw ? read_socket_msg(cs, &timeout) : read_socket_line(cs, &timeout);
 		/* Simply forward the message on, as is, to the connector to
 		 * process. Possibly parse parameters sent by upstream pool
 		 * here */
 		if (likely(ret > 0)) {
-			LOGDEBUG("Passthrough recv received upstream msg: %s", cs->buf);
-			send_proc(ckp->connector, cs->buf);
+			if (proxi->raw && (uint8_t)cs->buf[0] == RELAY_MAGIC)
+				relay_recv(ckp, cs->buf, ret);
+			else {
+				LOGDEBUG("Passthrough recv received upstream msg: %s", cs->buf);
+				send_proc(ckp->connector, cs->buf);
+			}
 		} else if (ret < 0) {
 			/* Read failure */
 			LOGWARNING("Passthrough %d:%s failed to read_socket_line in passthrough_recv, attempting reconnect",
@@ -2358,7 +2835,6 @@ static void *proxy_recv(void *arg)
 
 	while (42) {
 		bool message = false, hup = false;
-		share_msg_t *share, *tmpshare;
 		notify_instance_t *ni, *tmp;
 		float timeout;
 		time_t now;
@@ -2398,16 +2874,6 @@ static void *proxy_recv(void *arg)
 		}
 		mutex_unlock(&gdata->notify_lock);
 
-		/* Similary with shares older than 2 mins without response */
-		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-				free(share);
-			}
-		}
-		mutex_unlock(&gdata->share_lock);
-
 		cs = NULL;
 		/* If we don't get an update within 10 minutes the upstream pool
 		 * has likely stopped responding. */
@@ -2499,7 +2965,6 @@ static void *userproxy_recv(void *arg)
 	while (42) {
 		proxy_instance_t *proxy, *tmpproxy;
 		bool message = false, hup = false;
-		share_msg_t *share, *tmpshare;
 		notify_instance_t *ni, *tmp;
 		connsock_t *cs;
 		float timeout;
@@ -2541,16 +3006,6 @@ static void *userproxy_recv(void *arg)
 		}
 		mutex_unlock(&gdata->notify_lock);
 
-		/* Similary with shares older than 2 mins without response */
-		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-				free(share);
-			}
-		}
-		mutex_unlock(&gdata->share_lock);
-
 		cs = &proxy->cs;
 
 #if 0
@@ -2918,7 +3373,7 @@ static void send_stats(gdata_t *gdata, const int sockd)
 {
 	json_t *val = json_object(), *subval;
 	int total_objects, objects;
-	int64_t generated, memsize;
+	int64_t generated, memsize, lost;
 	proxy_instance_t *proxy;
 	stratum_msg_t *msg;
 
@@ -2957,12 +3412,14 @@ static void send_stats(gdata_t *gdata, const int sockd)
 	json_set_object(val, "notifies", subval);
 
 	mutex_lock(&gdata->share_lock);
-	objects = HASH_COUNT(gdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(gdata->shares) + sizeof(share_msg_t) * objects;
+	objects = gdata->shares_pending;
+	memsize = gdata->share_ring ? sizeof(share_msg_t) * SHARE_RING : 0;
 	generated = gdata->share_id;
+	lost = gdata->shares_lost;
 	mutex_unlock(&gdata->share_lock);
 
-	JSON_CPACK(subval, "{si,sI,sI}", "count", objects, "memory", memsize, "generated", generated);
+	JSON_CPACK(subval, "{si,sI,sI,sI}", "count", objects, "memory", memsize, "generated", generated,
+		   "lost", lost);
 	json_set_object(val, "shares", subval);
 
 	mutex_lock(&gdata->psend_lock);
@@ -3022,6 +3479,10 @@ static json_t *__proxystats(proxy_instance_t *proxy, proxy_instance_t *parent, b
 	json_set_bool(val, "disabled", proxy->disabled);
 	json_set_bool(val, "alive", proxy->alive);
 	json_set_int(val, "maxclients", proxy->clients_per_proxy);
+	json_set_int(val, "outstanding", __atomic_load_n(&proxy->outstanding, __ATOMIC_RELAXED));
+	json_set_int64(val, "results", proxy->results);
+	json_set_double(val, "latency_avg", proxy->latency_avg);
+	json_set_double(val, "latency_max", proxy->latency_max);
 
 	return val;
 }
@@ -3301,6 +3762,7 @@ static void *server_watchdog(void *arg)
 
 static void setup_servers(ckpool_t *ckp)
 {
+	gdata_t *gdata = ckp->gdata;
 	pthread_t pth_watchdog;
 	int i;
 
@@ -3320,9 +3782,23 @@ static void setup_servers(ckpool_t *ckp)
 		cs->ckp = ckp;
 		cksem_init(&cs->sem);
 		cksem_post(&cs->sem);
+		init_rpc_conns(cs);
 	}
 
 	create_pthread(&pth_watchdog, server_watchdog, ckp);
+
+	/* Nodes don't generate their own templates */
+	if (ckp->proxy)
+		ckp->prefetch = false;
+	if (ckp->prefetch) {
+		pthread_t pth_prefetcher;
+
+		mutex_init(&gdata->prefetch_lock);
+		cond_init(&gdata->prefetch_cond);
+		gdata->prefetch_lead = 1000;
+		__prefetch_in(gdata, ckp->update_interval * 1000);
+		create_pthread(&pth_prefetcher, prefetcher, ckp);
+	}
 }
 
 static void server_mode(ckpool_t *ckp, proc_instance_t *pi)
@@ -3373,23 +3849,36 @@ static void proxy_mode(ckpool_t *ckp, proc_instance_t *pi)
 	mutex_init(&gdata->lock);
 	mutex_init(&gdata->notify_lock);
 	mutex_init(&gdata->share_lock);
+	gdata->share_ring = ckzalloc(sizeof(share_msg_t) * SHARE_RING);
 
 	if (ckp->node)
 		setup_servers(ckp);
 
+	if (!ckp->passthrough) {
+		mutex_init(&gdata->psend_lock);
+		cond_init(&gdata->psend_cond);
+	}
+
 	/* Create all our proxy structures and pointers */
 	for (i = 0; i < ckp->proxies; i++) {
 		proxy = __add_proxy(ckp, gdata, i);
 		if (ckp->passthrough) {
+			proxy->parent = proxy;
 			create_pthread(&proxy->pth_precv, passthrough_recv, proxy);
 			proxy->passsends = create_ckmsgq(ckp, "passsend", &passthrough_send);
-		} else {
-			mutex_init(&gdata->psend_lock);
-			cond_init(&gdata->psend_cond);
+			if (ckp->rawrelay) {
+				mutex_init(&proxy->relay_lock);
+				cond_init(&proxy->relay_cond);
+				create_pthread(&proxy->pth_relay, relay_send, proxy);
+			}
+		} else
 			prepare_proxy(proxy);
-			create_pthread(&gdata->pth_uprecv, userproxy_recv, ckp);
-			create_pthread(&gdata->pth_psend, proxy_send, ckp);
-		}
+	}
+
+	/* A single sender owns all partially written and coalesced messages */
+	if (!ckp->passthrough) {
+		create_pthread(&gdata->pth_uprecv, userproxy_recv, ckp);
+		create_pthread(&gdata->pth_psend, proxy_send, ckp);
 	}
 
 	proxy_loop(pi);
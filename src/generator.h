@@ -17,13 +17,16 @@
 #define GETBEST_SUCCESS 1
 
 void generator_add_send(ckpool_t *ckp, json_t *val);
-struct genwork *generator_getbase(ckpool_t *ckp);
+bool generator_relay(ckpool_t *ckp, const int64_t client_id, const char *buf, const int len);
+struct genwork *generator_getbase(ckpool_t *ckp, const bool fresh);
+void generator_prefetch(ckpool_t *ckp, const time_t due);
 int generator_getbest(ckpool_t *ckp, char *hash);
 bool generator_checkaddr(ckpool_t *ckp, const char *addr, bool *script, bool *segwit);
 bool generator_checktxn(const ckpool_t *ckp, const char *txn, json_t **val);
 char *generator_get_txn(ckpool_t *ckp, const char *hash);
-bool generator_submitblock(ckpool_t *ckp, const char *buf);
+bool generator_submitblock(ckpool_t *ckp, const char *data, const char *txn_data, const int txn_len);
 void generator_preciousblock(ckpool_t *ckp, const char *hash);
+void generator_metrics(ckpool_t *ckp, char **buf);
 bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash);
 void *generator(void *arg);
 
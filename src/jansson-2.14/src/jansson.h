@@ -410,6 +410,13 @@ typedef void (*json_free_t)(void *);
 void json_set_alloc_funcs(json_malloc_t malloc_fn, json_free_t free_fn);
 void json_get_alloc_funcs(json_malloc_t *malloc_fn, json_free_t *free_fn);
 
+/* Allocator for the fixed size structs of json values, which are never
+ * returned to the caller so need not be compatible with json_free_t */
+typedef void *(*json_node_malloc_t)(size_t);
+typedef void (*json_node_free_t)(void *, size_t);
+
+void json_set_node_alloc_funcs(json_node_malloc_t malloc_fn, json_node_free_t free_fn);
+
 /* runtime version checking */
 
 const char *jansson_version_str(void);
@@ -86,6 +86,8 @@ int jsonp_dtostr(char *buffer, size_t size, double value, int prec);
 void *jsonp_malloc(size_t size) JANSSON_ATTRS((warn_unused_result));
 void _jsonp_free(void **ptr);
 #define jsonp_free(ptr) _jsonp_free((void *)&(ptr))
+void *jsonp_node_malloc(size_t size) JANSSON_ATTRS((warn_unused_result));
+void jsonp_node_free(void *ptr, size_t size);
 
 char *jsonp_strndup(const char *str, size_t length) JANSSON_ATTRS((warn_unused_result));
 char *jsonp_strdup(const char *str) JANSSON_ATTRS((warn_unused_result));
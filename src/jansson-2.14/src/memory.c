@@ -21,6 +21,17 @@
 static json_malloc_t do_malloc = malloc;
 static json_free_t do_free = free;
 
+/* Value structs are never handed out so they can come from a separate
+ * allocator, defaulting to the general one */
+static void *node_malloc(size_t size) { return jsonp_malloc(size); }
+static void node_free(void *ptr, size_t size) {
+    (void)size;
+    jsonp_free(ptr);
+}
+
+static json_node_malloc_t do_node_malloc = node_malloc;
+static json_node_free_t do_node_free = node_free;
+
 void *jsonp_malloc(size_t size) {
     if (!size)
         return NULL;
@@ -36,6 +47,13 @@ void _jsonp_free(void **ptr) {
     *ptr = NULL;
 }
 
+void *jsonp_node_malloc(size_t size) { return (*do_node_malloc)(size); }
+
+void jsonp_node_free(void *ptr, size_t size) {
+    if (ptr)
+        (*do_node_free)(ptr, size);
+}
+
 char *jsonp_strdup(const char *str) { return jsonp_strndup(str, strlen(str)); }
 
 char *jsonp_strndup(const char *str, size_t len) {
@@ -73,6 +91,11 @@ void json_set_alloc_funcs(json_malloc_t malloc_fn, json_free_t free_fn) {
     do_free = free_fn;
 }
 
+void json_set_node_alloc_funcs(json_node_malloc_t malloc_fn, json_node_free_t free_fn) {
+    do_node_malloc = malloc_fn;
+    do_node_free = free_fn;
+}
+
 void json_get_alloc_funcs(json_malloc_t *malloc_fn, json_free_t *free_fn) {
     if (malloc_fn)
         *malloc_fn = do_malloc;
@@ -62,7 +62,7 @@ int jsonp_loop_check(hashtable_t *parents, const json_t *json, char *key, size_t
 extern volatile uint32_t hashtable_seed;
 
 json_t *json_object(void) {
-    json_object_t *object = jsonp_malloc(sizeof(json_object_t));
+    json_object_t *object = jsonp_node_malloc(sizeof(json_object_t));
     if (!object)
         return NULL;
 
@@ -74,7 +74,7 @@ json_t *json_object(void) {
     json_init(&object->json, JSON_OBJECT);
 
     if (hashtable_init(&object->hashtable)) {
-        jsonp_free(object);
+        jsonp_node_free(object, sizeof(json_object_t));
         return NULL;
     }
 
@@ -83,7 +83,7 @@ json_t *json_object(void) {
 
 static void json_delete_object(json_object_t *object) {
     hashtable_close(&object->hashtable);
-    jsonp_free(object);
+    jsonp_node_free(object, sizeof(json_object_t));
 }
 
 size_t json_object_size(const json_t *json) {
@@ -421,7 +421,7 @@ out:
 /*** array ***/
 
 json_t *json_array(void) {
-    json_array_t *array = jsonp_malloc(sizeof(json_array_t));
+    json_array_t *array = jsonp_node_malloc(sizeof(json_array_t));
     if (!array)
         return NULL;
     json_init(&array->json, JSON_ARRAY);
@@ -431,7 +431,7 @@ json_t *json_array(void) {
 
     array->table = jsonp_malloc(array->size * sizeof(json_t *));
     if (!array->table) {
-        jsonp_free(array);
+        jsonp_node_free(array, sizeof(json_array_t));
         return NULL;
     }
 
@@ -445,7 +445,7 @@ static void json_delete_array(json_array_t *array) {
         json_decref(array->table[i]);
 
     jsonp_free(array->table);
-    jsonp_free(array);
+    jsonp_node_free(array, sizeof(json_array_t));
 }
 
 size_t json_array_size(const json_t *json) {
@@ -721,7 +721,7 @@ static json_t *string_create(const char *value, size_t len, int own) {
             return NULL;
     }
 
-    string = jsonp_malloc(sizeof(json_string_t));
+    string = jsonp_node_malloc(sizeof(json_string_t));
     if (!string) {
         jsonp_free(v);
         return NULL;
@@ -819,7 +819,7 @@ int json_string_setn(json_t *json, const char *value, size_t len) {
 
 static void json_delete_string(json_string_t *string) {
     jsonp_free(string->value);
-    jsonp_free(string);
+    jsonp_node_free(string, sizeof(json_string_t));
 }
 
 static int json_string_equal(const json_t *string1, const json_t *string2) {
@@ -883,7 +883,7 @@ json_t *json_sprintf(const char *fmt, ...) {
 /*** integer ***/
 
 json_t *json_integer(json_int_t value) {
-    json_integer_t *integer = jsonp_malloc(sizeof(json_integer_t));
+    json_integer_t *integer = jsonp_node_malloc(sizeof(json_integer_t));
     if (!integer)
         return NULL;
     json_init(&integer->json, JSON_INTEGER);
@@ -908,7 +908,9 @@ int json_integer_set(json_t *json, json_int_t value) {
     return 0;
 }
 
-static void json_delete_integer(json_integer_t *integer) { jsonp_free(integer); }
+static void json_delete_integer(json_integer_t *integer) {
+    jsonp_node_free(integer, sizeof(json_integer_t));
+}
 
 static int json_integer_equal(const json_t *integer1, const json_t *integer2) {
     return json_integer_value(integer1) == json_integer_value(integer2);
@@ -926,7 +928,7 @@ json_t *json_real(double value) {
     if (isnan(value) || isinf(value))
         return NULL;
 
-    real = jsonp_malloc(sizeof(json_real_t));
+    real = jsonp_node_malloc(sizeof(json_real_t));
     if (!real)
         return NULL;
     json_init(&real->json, JSON_REAL);
@@ -951,7 +953,7 @@ int json_real_set(json_t *json, double value) {
     return 0;
 }
 
-static void json_delete_real(json_real_t *real) { jsonp_free(real); }
+static void json_delete_real(json_real_t *real) { jsonp_node_free(real, sizeof(json_real_t)); }
 
 static int json_real_equal(const json_t *real1, const json_t *real2) {
     return json_real_value(real1) == json_real_value(real2);
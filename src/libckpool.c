@@ -32,6 +32,9 @@
 #include <math.h>
 #include <poll.h>
 #include <arpa/inet.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #include "libckpool.h"
 #include "sha2.h"
@@ -851,6 +854,44 @@ out:
 	return ret;
 }
 
+/* As write_socket but gathering the buffers in iov, returning the total
+ * written */
+int write_socket_iov(int fd, const struct iovec *iov, const int iovcnt)
+{
+	struct iovec *wiov = alloca(sizeof(struct iovec) * iovcnt);
+	int ret, i, cnt = iovcnt, ofs = 0;
+
+	memcpy(wiov, iov, sizeof(struct iovec) * iovcnt);
+	ret = wait_write_select(fd, 5);
+	if (ret < 1) {
+		if (!ret)
+			LOGNOTICE("Select timed out in write_socket_iov");
+		else
+			LOGNOTICE("Select failed in write_socket_iov");
+		goto out;
+	}
+	while (cnt) {
+		ret = writev(fd, wiov, cnt);
+		if (unlikely(ret < 0)) {
+			LOGNOTICE("Failed to write in write_socket_iov");
+			goto out;
+		}
+		ofs += ret;
+		/* Skip past what was written */
+		for (i = 0; i < cnt && (size_t)ret >= wiov[i].iov_len; i++)
+			ret -= wiov[i].iov_len;
+		wiov += i;
+		cnt -= i;
+		if (cnt) {
+			wiov->iov_base += ret;
+			wiov->iov_len -= ret;
+		}
+	}
+	ret = ofs;
+out:
+	return ret;
+}
+
 void empty_socket(int fd)
 {
 	char buf[PAGESIZE];
@@ -1291,6 +1332,97 @@ out:
 	return newfd;
 }
 
+/* Send nfds fds via the unix socket sockd in as few msghdrs as possible, each
+ * carrying up to SCM_MAX_FD fds with their count as its data. Returns how many
+ * fds were sent. */
+int _send_fds(const int *fds, const int nfds, int sockd, const char *file, const char *func, const int line)
+{
+	struct cmsghdr *cmptr = ckzalloc(CMSG_SPACE(sizeof(int) * SCM_MAX_FD));
+	int sent = 0;
+
+	while (sent < nfds) {
+		int count = MIN(nfds - sent, SCM_MAX_FD);
+		struct iovec iov[1];
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(struct msghdr));
+		iov[0].iov_base = &count;
+		iov[0].iov_len = sizeof(count);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmptr;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		cmptr->cmsg_level = SOL_SOCKET;
+		cmptr->cmsg_type = SCM_RIGHTS;
+		cmptr->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmptr), fds + sent, sizeof(int) * count);
+		if (unlikely(wait_write_select(sockd, UNIX_WRITE_TIMEOUT) < 1 ||
+			     sendmsg(sockd, &msg, 0) != sizeof(count))) {
+			LOGERR("Failed to send fds %d of %d in send_fds from %s %s:%d",
+			       sent, nfds, file, func, line);
+			break;
+		}
+		sent += count;
+	}
+	shutdown(sockd, SHUT_WR);
+	free(cmptr);
+	return sent;
+}
+
+/* Receive up to nfds fds sent by send_fds from the unix socket sockd into
+ * fds, returning how many were received. */
+int _get_fds(int *fds, const int nfds, int sockd, const char *file, const char *func, const int line)
+{
+	struct cmsghdr *cmptr = ckzalloc(CMSG_SPACE(sizeof(int) * SCM_MAX_FD));
+	int got = 0;
+
+	while (got < nfds) {
+		struct cmsghdr *cmsg;
+		struct iovec iov[1];
+		struct msghdr msg;
+		int count = 0, n, i;
+
+		memset(&msg, 0, sizeof(struct msghdr));
+		iov[0].iov_base = &count;
+		iov[0].iov_len = sizeof(count);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmptr;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * SCM_MAX_FD);
+		if (unlikely(wait_read_select(sockd, UNIX_READ_TIMEOUT) < 1 ||
+			     recvmsg(sockd, &msg, MSG_WAITALL) != sizeof(count))) {
+			LOGERR("Failed to recv fds %d of %d in get_fds from %s %s:%d",
+			       got, nfds, file, func, line);
+			break;
+		}
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (unlikely(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)) {
+			LOGERR("No fds in msghdr %d of %d in get_fds from %s %s:%d",
+			       got, nfds, file, func, line);
+			break;
+		}
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++) {
+			int fd;
+
+			memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+			if (got < nfds)
+				fds[got++] = fd;
+			else
+				Close(fd);
+		}
+		/* Some fds did not make it, so none after them can be used */
+		if (unlikely(n != count || msg.msg_flags & MSG_CTRUNC)) {
+			LOGERR("Received %d of %d fds in msghdr in get_fds from %s %s:%d",
+			       n, count, file, func, line);
+			break;
+		}
+	}
+	shutdown(sockd, SHUT_RD);
+	free(cmptr);
+	return got;
+}
+
 
 void _json_check(json_t *val, json_error_t *err, const char *file, const char *func, const int line)
 {
@@ -1493,7 +1625,441 @@ size_t round_up_page(size_t len)
 	return len;
 }
 
+/* Each thread's cache of free objects of a slab, linked through their first
+ * word, and counts of objects it has allocated and freed */
+struct slabcache {
+	void *head;
+	void *tail;
+	int count;
+	int64_t allocs;
+	int64_t frees;
+};
+
+/* Every thread's caches are on a list for collecting stats */
+struct slabthread {
+	struct slabcache caches[CKSLAB_MAX];
+	struct slabthread *prev;
+	struct slabthread *next;
+	bool registered;
+};
+
+static ckslab_t *ckslabs[CKSLAB_MAX];
+static int ckslab_ids;
+static __thread struct slabthread slabthread;
+static struct slabthread *slabthreads;
+static mutex_t slabthreads_lock;
+static pthread_key_t slabthread_key;
+static pthread_once_t slabthread_once = PTHREAD_ONCE_INIT;
+
+/* Return all of an exiting thread's cached objects to their depots, keeping
+ * its counts in their slabs */
+static void slabthread_destroy(void *arg)
+{
+	struct slabthread *thread = arg;
+	int i;
+
+	mutex_lock(&slabthreads_lock);
+	DL_DELETE(slabthreads, thread);
+	mutex_unlock(&slabthreads_lock);
+
+	for (i = 0; i < CKSLAB_MAX; i++) {
+		ckslab_t *slab = __atomic_load_n(&ckslabs[i], __ATOMIC_ACQUIRE);
+		struct slabcache *cache = &thread->caches[i];
+
+		if (!slab)
+			continue;
+		mutex_lock(&slab->lock);
+		slab->allocs += cache->allocs;
+		slab->frees += cache->frees;
+		if (cache->count) {
+			*(void **)cache->tail = slab->depot;
+			slab->depot = cache->head;
+			slab->depotcount += cache->count;
+		}
+		mutex_unlock(&slab->lock);
+		memset(cache, 0, sizeof(struct slabcache));
+	}
+}
+
+static void slabthread_init(void)
+{
+	mutex_init(&slabthreads_lock);
+	pthread_key_create(&slabthread_key, slabthread_destroy);
+}
+
+/* Add this thread's caches to the list, to be emptied when it exits */
+static void slabthread_register(void)
+{
+	if (likely(slabthread.registered))
+		return;
+	pthread_once(&slabthread_once, slabthread_init);
+	mutex_lock(&slabthreads_lock);
+	DL_APPEND(slabthreads, &slabthread);
+	mutex_unlock(&slabthreads_lock);
+	pthread_setspecific(slabthread_key, &slabthread);
+	slabthread.registered = true;
+}
+
+ckslab_t *create_ckslab(const char *name, size_t size)
+{
+	ckslab_t *slab = ckzalloc(sizeof(ckslab_t));
+	int id = __atomic_fetch_add(&ckslab_ids, 1, __ATOMIC_RELAXED);
+
+	if (unlikely(id >= CKSLAB_MAX))
+		quit(1, "Too many slabs to create slab %s", name);
+	strncpy(slab->name, name, 15);
+	/* Keep objects 16 byte aligned as malloc would */
+	size = MAX(size, sizeof(void *));
+	slab->size = (size + 15) & ~(size_t)15;
+	slab->id = id;
+	mutex_init(&slab->lock);
+	__atomic_store_n(&ckslabs[id], slab, __ATOMIC_RELEASE);
+	return slab;
+}
+
+/* Refill an empty cache with a batch from the depot, or a new chunk if the
+ * depot is empty */
+static void slabcache_refill(ckslab_t *slab, struct slabcache *cache)
+{
+	void **obj = NULL;
+	int count = 0;
+
+	slabthread_register();
+	mutex_lock(&slab->lock);
+	slab->exchanges++;
+	if (slab->depot) {
+		cache->head = obj = slab->depot;
+		count = 1;
+		while (count < CKSLAB_BATCH && *obj) {
+			obj = *obj;
+			count++;
+		}
+		slab->depot = *obj;
+		slab->depotcount -= count;
+		*obj = NULL;
+	} else
+		slab->chunks++;
+	mutex_unlock(&slab->lock);
+
+	if (!count) {
+		char *chunk = ckalloc(slab->size * CKSLAB_BATCH);
+		int i;
+
+		for (i = 0; i < CKSLAB_BATCH - 1; i++)
+			*(void **)(chunk + slab->size * i) = chunk + slab->size * (i + 1);
+		obj = (void **)(chunk + slab->size * i);
+		*obj = NULL;
+		cache->head = chunk;
+		count = CKSLAB_BATCH;
+	}
+	cache->tail = obj;
+	cache->count = count;
+}
 
+/* Keep the most recently freed, and most likely cache hot, batch of an
+ * overflowing cache and return the rest to the depot */
+static void slabcache_drain(ckslab_t *slab, struct slabcache *cache)
+{
+	void **obj = cache->head, *rest;
+	int i;
+
+	for (i = 1; i < CKSLAB_BATCH; i++)
+		obj = *obj;
+	rest = *obj;
+	*obj = NULL;
+
+	mutex_lock(&slab->lock);
+	slab->exchanges++;
+	*(void **)cache->tail = slab->depot;
+	slab->depot = rest;
+	slab->depotcount += cache->count - CKSLAB_BATCH;
+	mutex_unlock(&slab->lock);
+
+	cache->tail = obj;
+	cache->count = CKSLAB_BATCH;
+}
+
+void *ckslab_alloc(ckslab_t *slab)
+{
+	struct slabcache *cache = &slabthread.caches[slab->id];
+	void **obj;
+
+	if (unlikely(!cache->count))
+		slabcache_refill(slab, cache);
+	obj = cache->head;
+	cache->head = *obj;
+	cache->count--;
+	cache->allocs++;
+	return obj;
+}
+
+void *ckslab_zalloc(ckslab_t *slab)
+{
+	void *ptr = ckslab_alloc(slab);
+
+	memset(ptr, 0, slab->size);
+	return ptr;
+}
+
+void ckslab_free(ckslab_t *slab, void *ptr)
+{
+	struct slabcache *cache;
+	void **obj = ptr;
+
+	if (unlikely(!ptr))
+		return;
+	cache = &slabthread.caches[slab->id];
+	if (!cache->count) {
+		/* Threads may only ever free objects of a slab */
+		slabthread_register();
+		cache->tail = obj;
+	}
+	*obj = cache->head;
+	cache->head = obj;
+	cache->count++;
+	cache->frees++;
+	if (unlikely(cache->count >= CKSLAB_BATCH * 2))
+		slabcache_drain(slab, cache);
+}
+
+/* Stats of every slab in use, summing the unlocked counts of each thread's
+ * cache so they are only approximate */
+json_t *ckslab_stats(void)
+{
+	json_t *val = json_object(), *subval;
+	int i;
+
+	pthread_once(&slabthread_once, slabthread_init);
+	for (i = 0; i < CKSLAB_MAX; i++) {
+		ckslab_t *slab = __atomic_load_n(&ckslabs[i], __ATOMIC_ACQUIRE);
+		int64_t chunks, depotcount, cached = 0, allocs, frees, exchanges;
+		struct slabthread *thread;
+
+		if (!slab)
+			continue;
+		/* Copy the stats out since json may itself use a slab */
+		mutex_lock(&slab->lock);
+		chunks = slab->chunks;
+		depotcount = slab->depotcount;
+		allocs = slab->allocs;
+		frees = slab->frees;
+		exchanges = slab->exchanges;
+		mutex_unlock(&slab->lock);
+		if (!chunks)
+			continue;
+
+		mutex_lock(&slabthreads_lock);
+		DL_FOREACH(slabthreads, thread) {
+			struct slabcache *cache = &thread->caches[i];
+
+			cached += __atomic_load_n(&cache->count, __ATOMIC_RELAXED);
+			allocs += __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED);
+			frees += __atomic_load_n(&cache->frees, __ATOMIC_RELAXED);
+		}
+		mutex_unlock(&slabthreads_lock);
+
+		JSON_CPACK(subval, "{sI,sI,sI,sI,sI,sI,sI,sI}", "size", (json_int_t)slab->size,
+			   "memory", (json_int_t)(chunks * CKSLAB_BATCH * slab->size),
+			   "inuse", chunks * CKSLAB_BATCH - depotcount - cached,
+			   "cached", cached, "free", depotcount, "allocs", allocs,
+			   "frees", frees, "exchanges", exchanges);
+		json_set_object(val, slab->name, subval);
+	}
+	return val;
+}
+
+/* Slabs for the json value structs in steps of 16 bytes */
+#define JSON_SLABS 8
+static ckslab_t *json_slabs[JSON_SLABS];
+
+static void *json_slab_alloc(size_t size)
+{
+	size_t i = (size - 1) / 16;
+
+	if (unlikely(i >= JSON_SLABS))
+		return json_ckalloc(size);
+	return ckslab_alloc(json_slabs[i]);
+}
+
+static void json_slab_free(void *ptr, size_t size)
+{
+	size_t i = (size - 1) / 16;
+
+	if (unlikely(i >= JSON_SLABS))
+		free(ptr);
+	else
+		ckslab_free(json_slabs[i], ptr);
+}
+
+/* Allocate json value structs from slabs. This must be set before any json
+ * is created. */
+void json_set_ckslab_funcs(void)
+{
+	char name[16];
+	int i;
+
+	for (i = 0; i < JSON_SLABS; i++) {
+		sprintf(name, "json%d", (i + 1) * 16);
+		json_slabs[i] = create_ckslab(name, (i + 1) * 16);
+	}
+	json_set_node_alloc_funcs(json_slab_alloc, json_slab_free);
+}
+
+
+/* Vectorised hex kernels handle whole chunks only, returning how many bytes of
+ * binary they covered and leaving the remainder, or any chunk containing
+ * invalid hex, to the scalar code so error handling is unchanged. Decoding with
+ * a NULL p only validates the hex. */
+typedef size_t (*hexenc_fn)(uchar *s, const uchar *p, size_t len);
+typedef size_t (*hexdec_fn)(uchar *p, const uchar *s, size_t len);
+
+static hexenc_fn hexenc_kernel;
+static hexdec_fn hexdec_kernel;
+static const char *hexkernel_name = "scalar";
+
+/* Minimum binary length worth handing to the vector kernels */
+#define HEX_SIMD_MIN 16
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static __attribute__ ((target ("ssse3")))
+size_t hexenc_ssse3(uchar *s, const uchar *p, size_t len)
+{
+	const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+					     '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+		__m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(in, mask));
+
+		_mm_storeu_si128((__m128i *)(s + i * 2), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(s + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+	return i;
+}
+
+/* Converts hex chars to nibble values, clearing valid for any non hex char */
+static inline __attribute__ ((target ("ssse3")))
+__m128i hexnibbles_ssse3(const __m128i c, __m128i *valid)
+{
+	const __m128i lc = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	const __m128i isdig = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+					    _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+	const __m128i isalpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)),
+					      _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), lc));
+
+	*valid = _mm_and_si128(*valid, _mm_or_si128(isdig, isalpha));
+	return _mm_or_si128(_mm_and_si128(isdig, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+			    _mm_and_si128(isalpha, _mm_sub_epi8(lc, _mm_set1_epi8('a' - 10))));
+}
+
+static __attribute__ ((target ("ssse3")))
+size_t hexdec_ssse3(uchar *p, const uchar *s, size_t len)
+{
+	const __m128i weights = _mm_set1_epi16(0x0110);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i valid = _mm_set1_epi8(-1), lo, hi;
+
+		lo = hexnibbles_ssse3(_mm_loadu_si128((const __m128i *)(s + i * 2)), &valid);
+		hi = hexnibbles_ssse3(_mm_loadu_si128((const __m128i *)(s + i * 2 + 16)), &valid);
+		if (_mm_movemask_epi8(valid) != 0xffff)
+			break;
+		if (!p)
+			continue;
+		/* Each pair of nibbles becomes high * 16 + low */
+		lo = _mm_maddubs_epi16(lo, weights);
+		hi = _mm_maddubs_epi16(hi, weights);
+		_mm_storeu_si128((__m128i *)(p + i), _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+static __attribute__ ((target ("avx2")))
+size_t hexenc_avx2(uchar *s, const uchar *p, size_t len)
+{
+	const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+						'8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+						'0', '1', '2', '3', '4', '5', '6', '7',
+						'8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(in, 4), mask));
+		__m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(in, mask));
+		__m256i a = _mm256_unpacklo_epi8(hi, lo), b = _mm256_unpackhi_epi8(hi, lo);
+
+		/* Unpacking works within 128 bit lanes so put them back in order */
+		_mm256_storeu_si256((__m256i *)(s + i * 2), _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i *)(s + i * 2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+	}
+	return i + hexenc_ssse3(s + i * 2, p + i, len - i);
+}
+
+static inline __attribute__ ((target ("avx2")))
+__m256i hexnibbles_avx2(const __m256i c, __m256i *valid)
+{
+	const __m256i lc = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+	const __m256i isdig = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+					       _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+	const __m256i isalpha = _mm256_and_si256(_mm256_cmpgt_epi8(lc, _mm256_set1_epi8('a' - 1)),
+						 _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lc));
+
+	*valid = _mm256_and_si256(*valid, _mm256_or_si256(isdig, isalpha));
+	return _mm256_or_si256(_mm256_and_si256(isdig, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+			       _mm256_and_si256(isalpha, _mm256_sub_epi8(lc, _mm256_set1_epi8('a' - 10))));
+}
+
+static __attribute__ ((target ("avx2")))
+size_t hexdec_avx2(uchar *p, const uchar *s, size_t len)
+{
+	const __m256i weights = _mm256_set1_epi16(0x0110);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i valid = _mm256_set1_epi8(-1), lo, hi;
+
+		lo = hexnibbles_avx2(_mm256_loadu_si256((const __m256i *)(s + i * 2)), &valid);
+		hi = hexnibbles_avx2(_mm256_loadu_si256((const __m256i *)(s + i * 2 + 32)), &valid);
+		if (_mm256_movemask_epi8(valid) != -1)
+			return i;
+		if (!p)
+			continue;
+		lo = _mm256_maddubs_epi16(lo, weights);
+		hi = _mm256_maddubs_epi16(hi, weights);
+		/* Packing also works within lanes, leaving 64 bit quarters out of order */
+		_mm256_storeu_si256((__m256i *)(p + i),
+				    _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+	}
+	return i + hexdec_ssse3(p ? p + i : NULL, s + i * 2, len - i);
+}
+#endif
+
+static void __attribute__ ((constructor)) hex_kernel_init(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		hexenc_kernel = hexenc_avx2;
+		hexdec_kernel = hexdec_avx2;
+		hexkernel_name = "avx2";
+	} else if (__builtin_cpu_supports("ssse3")) {
+		hexenc_kernel = hexenc_ssse3;
+		hexdec_kernel = hexdec_ssse3;
+		hexkernel_name = "ssse3";
+	}
+#endif
+}
+
+const char *hex_kernel(void)
+{
+	return hexkernel_name;
+}
 
 /* Adequate size s==len*2 + 1 must be alloced to use this variant */
 void __bin2hex(void *vs, const void *vp, size_t len)
@@ -1501,9 +2067,13 @@ void __bin2hex(void *vs, const void *vp, size_t len)
 	static const char hex[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
 	const uchar *p = vp;
 	uchar *s = vs;
-	int i;
+	size_t i = 0;
 
-	for (i = 0; i < (int)len; i++) {
+	if (len >= HEX_SIMD_MIN && hexenc_kernel) {
+		i = hexenc_kernel(s, p, len);
+		s += i * 2;
+	}
+	for (; i < len; i++) {
 		*s++ = hex[p[i] >> 4];
 		*s++ = hex[p[i] & 0xF];
 	}
@@ -1555,7 +2125,10 @@ bool _validhex(const char *buf, const char *file, const char *func, const int li
 		LOGDEBUG("Invalid hex due to length %u from %s %s:%d", slen, file, func, line);
 		goto out;
 	}
-	for (i = 0; i < slen; i++) {
+	i = 0;
+	if (slen >= HEX_SIMD_MIN * 2 && hexdec_kernel)
+		i = hexdec_kernel(NULL, (const uchar *)buf, slen / 2) * 2;
+	for (; i < slen; i++) {
 		uchar idx = buf[i];
 
 		if (hex2bin_tbl[idx] == -1) {
@@ -1578,6 +2151,14 @@ bool _hex2bin(void *vp, const void *vhexstr, size_t len, const char *file, const
 	uchar *p = vp;
 	uchar idx;
 
+	/* Only vectorise exact length strings, leaving errors to the scalar code */
+	if (len >= HEX_SIMD_MIN && hexdec_kernel && strlen((const char *)hexstr) == len * 2) {
+		size_t done = hexdec_kernel(p, hexstr, len);
+
+		p += done;
+		hexstr += done * 2;
+		len -= done;
+	}
 	while (*hexstr && len) {
 		if (unlikely(!hexstr[1])) {
 			LOGWARNING("Early end of string in hex2bin from %s %s:%d", file, func, line);
@@ -1605,6 +2186,37 @@ bool _hex2bin(void *vp, const void *vhexstr, size_t len, const char *file, const
 	return ret;
 }
 
+/* As hex2bin for the first len bytes of a hex string which may continue
+ * beyond them, such as one of many concatenated transactions */
+bool _hex2bin_n(void *vp, const void *vhexstr, size_t len, const char *file, const char *func, const int line)
+{
+	const uchar *hexstr = vhexstr;
+	int nibble1, nibble2;
+	uchar *p = vp;
+
+	/* The vector kernels must not read beyond the end of a short string */
+	if (len >= HEX_SIMD_MIN && hexdec_kernel && strnlen((const char *)hexstr, len * 2) == len * 2) {
+		size_t done = hexdec_kernel(p, hexstr, len);
+
+		p += done;
+		hexstr += done * 2;
+		len -= done;
+	}
+	while (len--) {
+		nibble1 = hex2bin_tbl[*hexstr++];
+		if (unlikely(nibble1 < 0))
+			goto err;
+		nibble2 = hex2bin_tbl[*hexstr++];
+		if (unlikely(nibble2 < 0))
+			goto err;
+		*p++ = (((uchar)nibble1) << 4) | ((uchar)nibble2);
+	}
+	return true;
+err:
+	LOGWARNING("Invalid binary encoding in hex2bin_n from %s %s:%d", file, func, line);
+	return false;
+}
+
 static const int b58tobin_tbl[] = {
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -2256,3 +2868,71 @@ void gen_hash(uchar *data, uchar *hash, int len)
 	sha256(data, len, hash1);
 	sha256(hash1, 32, hash);
 }
+
+/* Distill the txns transaction hashes following the 32 byte coinbase slot in
+ * hashbin into the merkle branches of the coinbase, storing each 32 byte
+ * branch in turn in merklebin and returning how many there are. hashbin is
+ * overwritten and needs room for one more hash. */
+int merkle_branches(uchar *hashbin, const int txns, uchar *merklebin)
+{
+	int i, j, binleft = txns + 1, binlen = binleft * 32, merkles = 0;
+
+	while (binleft > 1) {
+		memcpy(merklebin + 32 * merkles++, hashbin + 32, 32);
+		if (binleft % 2) {
+			memcpy(hashbin + binlen, hashbin + binlen - 32, 32);
+			binlen += 32;
+			binleft++;
+		}
+		for (i = 32, j = 64; j < binlen; i += 32, j += 64)
+			gen_hash(hashbin + j, hashbin + i, 64);
+		binleft /= 2;
+		binlen = binleft * 32;
+	}
+	return merkles;
+}
+
+/* Hash a coinbase's hash up its merkle branches in merklebin, storing the
+ * merkle root in the byte order of a block header */
+void merkle_root(uchar *root, const uchar *cbhash, const uchar *merklebin, const int merkles)
+{
+	uchar merkle_sha[64];
+	int i;
+
+	memcpy(merkle_sha, cbhash, 32);
+	for (i = 0; i < merkles; i++) {
+		memcpy(merkle_sha + 32, merklebin + 32 * i, 32);
+		gen_hash(merkle_sha, merkle_sha, 64);
+	}
+	flip_32(root, merkle_sha);
+}
+
+/* Build a share's header from the cached binary header of its work with its
+ * merkle root, version mask, hex nonce and ntime inserted, storing it byte
+ * swapped in swap ready for hashing */
+void share_header(uchar *swap, const uchar *headerbin, const uchar *root, const uint32_t version_mask,
+		  const char *nonce, const uint32_t ntime32)
+{
+	uint32_t *data32, benonce32;
+	uchar data[80];
+
+	memcpy(data, headerbin, 80);
+	memcpy(data + 36, root, 32);
+
+	/* Update nVersion when version_mask is in use */
+	if (version_mask) {
+		data32 = (uint32_t *)data;
+		*data32 |= htobe32(version_mask);
+	}
+
+	/* Insert the nonce value into the data */
+	hex2bin(&benonce32, nonce, 4);
+	data32 = (uint32_t *)(data + 64 + 12);
+	*data32 = benonce32;
+
+	/* Insert the ntime value into the data */
+	data32 = (uint32_t *)(data + 68);
+	*data32 = htobe32(ntime32);
+
+	flip_80(swap, data);
+}
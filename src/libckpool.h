@@ -36,6 +36,7 @@
 #endif
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 
 #include "utlist.h"
@@ -99,6 +100,14 @@ typedef unsigned char uchar;
 typedef struct timeval tv_t;
 typedef struct timespec ts_t;
 
+static inline int64_t monotonic_ns(void)
+{
+	ts_t ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
 static inline void swap_256(void *dest_p, const void *src_p)
 {
 	uint32_t *dest = dest_p;
@@ -209,7 +218,7 @@ void logmsg(int loglevel, const char *fmt, ...);
 		memcpy(tmp42, BUF + OFFSET, CPY); \
 		logmsg(__lvl, "%s", tmp42);\
 		OFFSET += CPY; \
-		LEN -= OFFSET; \
+		LEN -= CPY; \
 	} \
 	free(BUF); \
 } while(0)
@@ -253,6 +262,11 @@ void logmsg(int loglevel, const char *fmt, ...);
 #define UNIX_READ_TIMEOUT 5
 #define UNIX_WRITE_TIMEOUT 10
 
+/* The most fds the kernel will pass in one SCM_RIGHTS message */
+#ifndef SCM_MAX_FD
+#define SCM_MAX_FD 253
+#endif
+
 #define MIN1	60
 #define MIN5	300
 #define MIN15	900
@@ -339,6 +353,35 @@ struct unixsock {
 
 typedef struct unixsock unixsock_t;
 
+/* Objects moved between a thread's slab cache and the shared depot at once */
+#define CKSLAB_BATCH 64
+/* Maximum number of slabs that can be created */
+#define CKSLAB_MAX 32
+
+/* Allocator of fixed size objects. Each thread caches free objects of each
+ * slab locally, only taking the lock to exchange batches of them with the
+ * shared depot, so objects freed by a different thread than allocated them
+ * are simply reused by the freeing thread. Chunks are never returned. */
+struct ckslab {
+	char name[16];
+	size_t size;
+	int id;
+
+	/* Protects the depot and the stats below */
+	mutex_t lock;
+	void *depot;
+	int64_t depotcount;
+	int64_t chunks;
+
+	/* Counts kept from the caches of exited threads */
+	int64_t allocs;
+	int64_t frees;
+	/* Number of times the lock was taken to exchange objects */
+	int64_t exchanges;
+};
+
+typedef struct ckslab ckslab_t;
+
 void _json_check(json_t *val, json_error_t *err, const char *file, const char *func, const int line);
 #define json_check(VAL, ERR) _json_check(VAL, ERR,  __FILE__, __func__, __LINE__)
 
@@ -516,6 +559,7 @@ int bind_socket(char *url, char *port);
 int connect_socket(char *url, char *port);
 int round_trip(char *url);
 int write_socket(int fd, const void *buf, size_t nbyte);
+int write_socket_iov(int fd, const struct iovec *iov, const int iovcnt);
 void empty_socket(int fd);
 void _close_unix_socket(int *sockd, const char *server_path);
 #define close_unix_socket(sockd, server_path) _close_unix_socket(&sockd, server_path)
@@ -545,6 +589,10 @@ bool _send_fd(int fd, int sockd, const char *file, const char *func, const int l
 #define send_fd(fd, sockd) _send_fd(fd, sockd, __FILE__, __func__, __LINE__)
 int _get_fd(int sockd, const char *file, const char *func, const int line);
 #define get_fd(sockd) _get_fd(sockd, __FILE__, __func__, __LINE__)
+int _send_fds(const int *fds, const int nfds, int sockd, const char *file, const char *func, const int line);
+#define send_fds(fds, nfds, sockd) _send_fds(fds, nfds, sockd, __FILE__, __func__, __LINE__)
+int _get_fds(int *fds, const int nfds, int sockd, const char *file, const char *func, const int line);
+#define get_fds(fds, nfds, sockd) _get_fds(fds, nfds, sockd, __FILE__, __func__, __LINE__)
 
 const char *__json_array_string(json_t *val, unsigned int entry);
 char *json_array_string(json_t *val, unsigned int entry);
@@ -560,14 +608,23 @@ void *_ckalloc(size_t len, const char *file, const char *func, const int line);
 void *json_ckalloc(size_t size);
 void *_ckzalloc(size_t len, const char *file, const char *func, const int line);
 size_t round_up_page(size_t len);
+ckslab_t *create_ckslab(const char *name, size_t size);
+void *ckslab_alloc(ckslab_t *slab);
+void *ckslab_zalloc(ckslab_t *slab);
+void ckslab_free(ckslab_t *slab, void *ptr);
+json_t *ckslab_stats(void);
+void json_set_ckslab_funcs(void);
 
 extern const int hex2bin_tbl[];
+const char *hex_kernel(void);
 void __bin2hex(void *vs, const void *vp, size_t len);
 void *bin2hex(const void *vp, size_t len);
 bool _validhex(const char *buf, const char *file, const char *func, const int line);
 #define validhex(buf) _validhex(buf, __FILE__, __func__, __LINE__)
 bool _hex2bin(void *p, const void *vhexstr, size_t len, const char *file, const char *func, const int line);
 #define hex2bin(p, vhexstr, len) _hex2bin(p, vhexstr, len, __FILE__, __func__, __LINE__)
+bool _hex2bin_n(void *p, const void *vhexstr, size_t len, const char *file, const char *func, const int line);
+#define hex2bin_n(p, vhexstr, len) _hex2bin_n(p, vhexstr, len, __FILE__, __func__, __LINE__)
 char *http_base64(const char *src);
 void b58tobin(char *b58bin, const char *b58);
 int safecmp(const char *a, const char *b);
@@ -612,5 +669,9 @@ double diff_from_nbits(char *nbits);
 void target_from_diff(uchar *target, double diff);
 
 void gen_hash(uchar *data, uchar *hash, int len);
+int merkle_branches(uchar *hashbin, const int txns, uchar *merklebin);
+void merkle_root(uchar *root, const uchar *cbhash, const uchar *merklebin, const int merkles);
+void share_header(uchar *swap, const uchar *headerbin, const uchar *root, const uint32_t version_mask,
+		  const char *nonce, const uint32_t ntime32);
 
 #endif /* LIBCKPOOL_H */
@@ -156,6 +156,186 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
     }
 }
 #endif
+
+/* Multi-buffer double SHA-256 of 80 byte block headers. Each lane of a vector
+ * holds the same word of a different header so the rounds for LANES headers
+ * are done with one instruction stream. The kernels are written with GCC
+ * vector extensions and compiled for each target, with the widest one the
+ * CPU supports selected at runtime. */
+#define VROTR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define VCH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define VMAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+#define VSHA256_F1(x) (VROTR(x,  2) ^ VROTR(x, 13) ^ VROTR(x, 22))
+#define VSHA256_F2(x) (VROTR(x,  6) ^ VROTR(x, 11) ^ VROTR(x, 25))
+#define VSHA256_F3(x) (VROTR(x,  7) ^ VROTR(x, 18) ^ ((x) >>  3))
+#define VSHA256_F4(x) (VROTR(x, 17) ^ VROTR(x, 19) ^ ((x) >> 10))
+
+#define SHA256D_80_KERNEL(NAME, LANES, TARGET)                              \
+typedef uint32_t NAME##_vec __attribute__ ((vector_size (LANES * 4)));      \
+                                                                            \
+static TARGET void NAME##_transf(NAME##_vec *s, const NAME##_vec *m)        \
+{                                                                           \
+    NAME##_vec w[64], wv[8], t1, t2;                                        \
+    int j;                                                                  \
+                                                                            \
+    for (j = 0; j < 16; j++)                                                \
+        w[j] = m[j];                                                        \
+    for (j = 16; j < 64; j++)                                               \
+        w[j] = VSHA256_F4(w[j - 2]) + w[j - 7]                              \
+             + VSHA256_F3(w[j - 15]) + w[j - 16];                           \
+    for (j = 0; j < 8; j++)                                                 \
+        wv[j] = s[j];                                                       \
+    for (j = 0; j < 64; j++) {                                              \
+        t1 = wv[7] + VSHA256_F2(wv[4]) + VCH(wv[4], wv[5], wv[6])           \
+            + sha256_k[j] + w[j];                                           \
+        t2 = VSHA256_F1(wv[0]) + VMAJ(wv[0], wv[1], wv[2]);                 \
+        wv[7] = wv[6];                                                      \
+        wv[6] = wv[5];                                                      \
+        wv[5] = wv[4];                                                      \
+        wv[4] = wv[3] + t1;                                                 \
+        wv[3] = wv[2];                                                      \
+        wv[2] = wv[1];                                                      \
+        wv[1] = wv[0];                                                      \
+        wv[0] = t1 + t2;                                                    \
+    }                                                                       \
+    for (j = 0; j < 8; j++)                                                 \
+        s[j] += wv[j];                                                      \
+}                                                                           \
+                                                                            \
+static TARGET void NAME(const unsigned char **data, unsigned char **digest) \
+{                                                                           \
+    NAME##_vec s[8], m[16];                                                 \
+    uint32_t x;                                                             \
+    int i, j;                                                               \
+                                                                            \
+    for (i = 0; i < LANES; i++) {                                           \
+        for (j = 0; j < 16; j++) {                                          \
+            PACK32(data[i] + (j << 2), &x);                                 \
+            m[j][i] = x;                                                    \
+        }                                                                   \
+    }                                                                       \
+    for (j = 0; j < 8; j++)                                                 \
+        s[j] = (NAME##_vec){} + sha256_h0[j];                               \
+    NAME##_transf(s, m);                                                    \
+                                                                            \
+    /* Tail of the header plus padding for 640 bits */                      \
+    for (i = 0; i < LANES; i++) {                                           \
+        for (j = 0; j < 4; j++) {                                           \
+            PACK32(data[i] + 64 + (j << 2), &x);                            \
+            m[j][i] = x;                                                    \
+        }                                                                   \
+    }                                                                       \
+    m[4] = (NAME##_vec){} + 0x80000000;                                     \
+    for (j = 5; j < 15; j++)                                                \
+        m[j] = (NAME##_vec){};                                              \
+    m[15] = (NAME##_vec){} + 640;                                           \
+    NAME##_transf(s, m);                                                    \
+                                                                            \
+    /* Second hash of the 256 bit digest */                                 \
+    for (j = 0; j < 8; j++) {                                               \
+        m[j] = s[j];                                                        \
+        s[j] = (NAME##_vec){} + sha256_h0[j];                               \
+    }                                                                       \
+    m[8] = (NAME##_vec){} + 0x80000000;                                     \
+    for (j = 9; j < 15; j++)                                                \
+        m[j] = (NAME##_vec){};                                              \
+    m[15] = (NAME##_vec){} + 256;                                           \
+    NAME##_transf(s, m);                                                    \
+                                                                            \
+    for (i = 0; i < LANES; i++) {                                           \
+        for (j = 0; j < 8; j++)                                             \
+            UNPACK32(s[j][i], digest[i] + (j << 2));                        \
+    }                                                                       \
+}
+
+/* Scalar fallback which uses whichever single buffer transform was built */
+static void sha256d_80_x1(const unsigned char **data, unsigned char **digest)
+{
+    unsigned char hash1[SHA256_DIGEST_SIZE];
+
+    sha256(data[0], 80, hash1);
+    sha256(hash1, SHA256_DIGEST_SIZE, digest[0]);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+SHA256D_80_KERNEL(sha256d_80_sse2, 4, )
+SHA256D_80_KERNEL(sha256d_80_avx2, 8, __attribute__ ((target ("avx2"))))
+SHA256D_80_KERNEL(sha256d_80_avx512, 16, __attribute__ ((target ("avx512f"))))
+#endif
+
+typedef void (*sha256d_80_fn)(const unsigned char **, unsigned char **);
+
+static sha256d_80_fn sha256d_80_kernel = sha256d_80_x1;
+static const char *sha256d_80_name = "scalar";
+static int sha256d_80_lanes = 1;
+
+static void __attribute__ ((constructor)) sha256_multi_init(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        sha256d_80_kernel = sha256d_80_avx512;
+        sha256d_80_name = "avx512";
+        sha256d_80_lanes = 16;
+    } else if (__builtin_cpu_supports("avx2")) {
+        sha256d_80_kernel = sha256d_80_avx2;
+        sha256d_80_name = "avx2";
+        sha256d_80_lanes = 8;
+    } else {
+        sha256d_80_kernel = sha256d_80_sse2;
+        sha256d_80_name = "sse2";
+        sha256d_80_lanes = 4;
+    }
+#endif
+}
+
+const char *sha256_multi_kernel(void)
+{
+    return sha256d_80_name;
+}
+
+int sha256_multi_lanes(void)
+{
+    return sha256d_80_lanes;
+}
+
+/* Double hash count 80 byte headers from data into digest. Whole vectors go
+ * through the multi-buffer kernel, a remainder of at least half a vector is
+ * padded out by repeating the last header and anything smaller is done one at
+ * a time. */
+void sha256d_80_multi(const unsigned char **data, unsigned char **digest, int count)
+{
+    const unsigned char *pdata[SHA256_MAX_LANES];
+    unsigned char *pdigest[SHA256_MAX_LANES];
+    unsigned char pad[SHA256_DIGEST_SIZE];
+    int lanes = sha256d_80_lanes, i;
+
+    while (count >= lanes) {
+        sha256d_80_kernel(data, digest);
+        data += lanes;
+        digest += lanes;
+        count -= lanes;
+    }
+    if (!count)
+        return;
+    if (count * 2 < lanes) {
+        for (i = 0; i < count; i++)
+            sha256d_80_x1(&data[i], &digest[i]);
+        return;
+    }
+    for (i = 0; i < lanes; i++) {
+        if (i < count) {
+            pdata[i] = data[i];
+            pdigest[i] = digest[i];
+        } else {
+            pdata[i] = data[count - 1];
+            pdigest[i] = pad;
+        }
+    }
+    sha256d_80_kernel(pdata, pdigest);
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -176,6 +356,20 @@ void sha256_init(sha256_ctx *ctx)
     ctx->tot_len = 0;
 }
 
+/* Resume hashing from a saved midstate covering the first len bytes of a
+ * message, which must be a multiple of the block size */
+void sha256_resume(sha256_ctx *ctx, const uint32_t *midstate,
+                   unsigned int len)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        ctx->h[i] = midstate[i];
+    }
+
+    ctx->len = 0;
+    ctx->tot_len = len;
+}
+
 void sha256_update(sha256_ctx *ctx, const unsigned char *message,
                    unsigned int len)
 {
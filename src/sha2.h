@@ -63,7 +63,17 @@ void sha256_init(sha256_ctx * ctx);
 void sha256_update(sha256_ctx *ctx, const unsigned char *message,
                    unsigned int len);
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
+void sha256_resume(sha256_ctx *ctx, const uint32_t *midstate,
+                   unsigned int len);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
 
+/* Widest number of headers hashed in one pass by sha256d_80_multi */
+#define SHA256_MAX_LANES 16
+
+void sha256d_80_multi(const unsigned char **data, unsigned char **digest,
+                      int count);
+const char *sha256_multi_kernel(void);
+int sha256_multi_lanes(void);
+
 #endif /* !SHA2_H */
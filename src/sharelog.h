@@ -0,0 +1,94 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef SHARELOG_H
+#define SHARELOG_H
+
+#include <stdint.h>
+
+/* Binary share logs are a stream of records in host byte order, each starting
+ * with a sharelog_rec header. A file starts with a version record, then
+ * string records define ids for all share records after them in the file,
+ * ids being reused from 1 whenever the file is reopened. */
+
+#define SHARELOG_MAGIC 0x4c53434b /* "CKSL" */
+#define SHARELOG_VERSION 1
+
+enum sharelog_type {
+	SHARELOG_REC_VERSION = 1,
+	SHARELOG_REC_STRING,
+	SHARELOG_REC_SHARE,
+};
+
+/* Strings interned per file, stored as ids into the string records */
+enum sharelog_interned {
+	SHARELOG_ENONCE1,
+	SHARELOG_REJECT,
+	SHARELOG_ERROR,
+	SHARELOG_CREATEINET,
+	SHARELOG_WORKERNAME,
+	SHARELOG_USERNAME,
+	SHARELOG_ADDRESS,
+	SHARELOG_AGENT,
+	SHARELOG_INTERNED
+};
+
+/* Strings unique to each share, stored inline after the share record */
+enum sharelog_inline {
+	SHARELOG_NONCE2,
+	SHARELOG_NONCE,
+	SHARELOG_NTIME,
+	SHARELOG_HASH,
+	SHARELOG_INLINE
+};
+
+/* Longest string stored, longer ones being truncated */
+#define SHARELOG_MAXSTR 1024
+/* Inline string length of strings that were absent */
+#define SHARELOG_ABSENT 0xffff
+
+/* Share record flags */
+#define SHARELOG_RESULT 0x1 /* Share was accepted */
+#define SHARELOG_HASHBIN 0x2 /* Hash is stored as binary, not inline */
+
+struct sharelog_rec {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t len; /* Including this header */
+} __attribute__((packed));
+
+struct sharelog_version {
+	struct sharelog_rec rec;
+	uint32_t magic;
+	uint32_t version;
+} __attribute__((packed));
+
+/* Followed by the string, not null terminated */
+struct sharelog_string {
+	struct sharelog_rec rec;
+	uint32_t id;
+} __attribute__((packed));
+
+/* Followed by the inline strings in order, not null terminated. Interned ids
+ * of 0 are strings that were absent. */
+struct sharelog_share {
+	struct sharelog_rec rec;
+	int64_t workinfoid;
+	int64_t clientid;
+	double diff;
+	double sdiff;
+	uint64_t createsec;
+	uint64_t creatensec;
+	int32_t errn;
+	uint32_t ids[SHARELOG_INTERNED];
+	uint16_t inlinelen[SHARELOG_INLINE];
+	uint8_t hash[32];
+} __attribute__((packed));
+
+#endif /* SHARELOG_H */
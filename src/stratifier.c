@@ -16,7 +16,9 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -33,6 +35,8 @@
 #include "utlist.h"
 #include "connector.h"
 #include "generator.h"
+#include "sharelog.h"
+#include "capture.h"
 
 /* Consistent across all pool instances */
 static const char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
@@ -94,6 +98,13 @@ struct json_params {
 	json_t *params;
 	json_t *id_val;
 	int64_t client_id;
+
+	/* Shares tokenised by the connector have no json and carry their
+	 * fields here instead, stored after the json_params */
+	stratum_submit_t *submit;
+
+	/* Monotonic ns this was created for timing the sshareq wait */
+	int64_t queued;
 };
 
 typedef struct json_params json_params_t;
@@ -102,10 +113,75 @@ typedef struct json_params json_params_t;
 struct smsg {
 	json_t *json_msg;
 	int64_t client_id;
+
+	/* Message serialised once and shared by a broadcast, used instead of
+	 * json_msg when set */
+	ckshared_t *shared;
+
+	/* Connector read and queueing stamps of timed share results */
+	int64_t stamp;
+	int64_t queued;
 };
 
 typedef struct smsg smsg_t;
 
+/* All smsgs are allocated from this slab */
+static ckslab_t *smsg_slab;
+
+/* Share log record queued to the share logger, owning fname and buf. Binary
+ * records are a struct sharelog_share with ids set to 1 for each interned
+ * string present, followed by those strings null terminated then the inline
+ * strings. */
+struct sharelog {
+	char *fname;
+	char *buf;
+	int len;
+	bool binary;
+
+	/* For the list of records spilled when the share logger's queue is full */
+	struct sharelog *next;
+	struct sharelog *prev;
+};
+
+typedef struct sharelog sharelog_t;
+
+/* Size of the buffer for each share log file held open by the share logger */
+#define SHARELOG_BUFSIZE 65536
+/* Maximum number of records the share logger takes at once */
+#define SHARELOG_BATCH 256
+/* Seconds without any shares before a share log file is closed */
+#define SHARELOG_IDLE 120
+/* Extension of the per workbase share log files */
+#define SHARELOG_EXT(ckp) ((ckp)->logsharebin ? "sharebin" : "sharelog")
+
+/* Share log files held open by the share logger, only accessed by it */
+struct sharelog_file {
+	UT_hash_handle hh;
+	char *fname;
+	int fd;
+
+	char *buf;
+	int len;
+
+	time_t last_write;
+	time_t last_sync;
+	bool unsynced;
+
+	/* Hashtable of strings interned in a binary share log */
+	struct sharelog_str *strings;
+	uint32_t string_ids;
+};
+
+typedef struct sharelog_file sharelog_file_t;
+
+struct sharelog_str {
+	UT_hash_handle hh;
+	uint32_t id;
+	char str[];
+};
+
+typedef struct sharelog_str sharelog_str_t;
+
 struct userwb {
 	UT_hash_handle hh;
 	int64_t id;
@@ -159,6 +235,13 @@ struct user_instance {
 	tv_t last_share;
 	tv_t last_decay;
 
+	/* Queued on dirty_users for the next statsupdate, protected by
+	 * dirty_lock */
+	user_instance_t *dirty_next;
+	user_instance_t *dirty_prev;
+	bool dirty;
+	int64_t stored_pass; /* Last statsupdate pass it was queued for */
+
 	bool authorised; /* Has this username ever been authorised? */
 	time_t auth_time;
 	time_t failed_authtime; /* Last time this username failed to authorise */
@@ -194,7 +277,6 @@ struct worker_instance {
 	int64_t best_ever; /* Best share ever found by this worker */
 	int mindiff; /* User chosen mindiff */
 
-	bool idle;
 	bool notified_idle;
 };
 
@@ -267,6 +349,8 @@ struct stratum_instance {
 			 * this is set to 2 */
 
 	int latency; /* Latency when on a mining node */
+	int64_t last_workinfo; /* jobid of the last workinfo sent to a node or remote */
+	bool txndelta; /* Does this remote decode delta encoded workinfos */
 
 	bool reconnect; /* This client really needs to reconnect */
 	time_t reconnect_request; /* The time we sent a reconnect message */
@@ -297,16 +381,50 @@ struct stratum_instance {
 	bool passthrough; /* Is this a passthrough */
 	bool trusted; /* Is this a trusted remote server */
 	bool remote; /* Is this a remote client on a trusted remote server */
+
+	/* Idle wheel linkage protected by instance_lock, see IDLE_SLOTS */
+	stratum_instance_t *idle_next;
+	stratum_instance_t *idle_prev;
+	int idle_slot;
+	bool idle_counted; /* Counted in idle_clients */
 };
 
 struct share {
 	UT_hash_handle hh;
 	uchar hash[32];
-	int64_t workbase_id;
 };
 
 typedef struct share share_t;
 
+#define SHARE_SLAB_SHARES	1024
+#define SHARE_SLABS_FREE	32
+
+typedef struct share_slab share_slab_t;
+
+/* Block of share entries handed out in order to a share partition */
+struct share_slab {
+	share_slab_t *next;
+	share_slab_t *prev;
+	int used;
+	share_t shares[SHARE_SLAB_SHARES];
+};
+
+typedef struct share_partition share_partition_t;
+
+/* Duplicate share hashtable for all the shares of one workbase */
+struct share_partition {
+	UT_hash_handle hh;
+	int64_t workbase_id;
+	share_partition_t *next; /* For retiring partitions */
+
+	/* Protects shares and slabs */
+	mutex_t lock;
+	share_t *shares;
+	share_slab_t *slabs;
+	int count;
+	int64_t generated;
+};
+
 struct proxy_base {
 	UT_hash_handle hh;
 	UT_hash_handle sh; /* For subproxy hashlist */
@@ -353,10 +471,39 @@ struct proxy_base {
 	bool deleted;
 };
 
+/* Shares of one worker accumulated by a remote trusted server before being
+ * sent upstream in a single sharebatch */
+struct sharebatch {
+	UT_hash_handle hh;
+	char *workername;
+	int shares;
+	double diff;
+	double sdiff; /* Best share diff */
+};
+
+typedef struct sharebatch sharebatch_t;
+
+/* Shares batched before sending upstream, and the longest they wait */
+#define SHAREBATCH_SHARES 1000
+#define SHAREBATCH_MS 500
+
+/* Read only snapshot of the workbases sorted by id, republished whenever the
+ * workbases hashtable changes so shares can look up their workbase without
+ * taking the workbase_lock */
+struct wbindex {
+	int count;
+	workbase_t *wbs[];
+};
+
+typedef struct wbindex wbindex_t;
+
 typedef struct session session_t;
 
 struct session {
 	UT_hash_handle hh;
+	/* Oldest first list for expiry */
+	session_t *prev;
+	session_t *next;
 	int session_id;
 	uint64_t enonce1_64;
 	int64_t client_id;
@@ -365,17 +512,58 @@ struct session {
 	char address[INET6_ADDRSTRLEN];
 };
 
+typedef struct txnarena txnarena_t;
+
+/* Raw data of transactions in the transaction table, being either the whole
+ * txn_data of a local workbase or a batch of remote transactions decoded
+ * together, freed when the last transaction and workbase using it are. Its
+ * references are atomic so they can be held and put outside txn_lock. */
+struct txnarena {
+	uchar *buf;
+	int len;
+	int size;
+	int refs;
+};
+
 typedef struct txntable txntable_t;
 
 struct txntable {
 	UT_hash_handle hh;
 	int id;
-	char hash[68];
-	char *data;
+	uchar hash[32]; /* Binary wtxid, the hashtable key */
+	txnarena_t *arena;
+	int ofs; /* Offset and length of the raw data in arena */
+	int len;
 	int refcount;
 	bool seen;
 };
 
+typedef struct txnsetid txnsetid_t;
+
+/* A transaction of the last local workbase keyed by its binary txid */
+struct txnsetid {
+	UT_hash_handle hh;
+	uchar txid[32];
+	uchar hash[32];
+};
+
+typedef struct txnset txnset_t;
+
+/* The ordered transactions of the last local workbase, kept so a template
+ * with an unchanged set can reuse their data and merkle branches, and one
+ * with a changed set need only add its new transactions */
+struct txnset {
+	int txns;
+	uchar *ids; /* Binary txid then wtxid of each transaction */
+	txnsetid_t *txids; /* The same transactions hashed by txid */
+	txnarena_t *txn_arena;
+	int merkles;
+	char merklehash[16][68];
+	char merklebin[16][32];
+	bool insert_witness;
+	char witnessdata[80];
+};
+
 #define ID_AUTH 0
 #define ID_WORKINFO 1
 #define ID_AGEWORKINFO 2
@@ -387,6 +575,94 @@ struct txntable {
 #define ID_ADDRAUTH 8
 #define ID_HEARTBEAT 9
 
+/* Flat copies of the user, worker and client fields listed by the API, taken
+ * under instance_lock so queries can build their json and filter without it.
+ * Users and workers are never freed so they are referenced directly, while
+ * strings owned by clients are copied into the snapshot's strings arena. */
+typedef struct api_user {
+	const user_instance_t *user;
+	int workers;
+	double best_diff;
+	double dsps1;
+	double dsps5;
+	double dsps60;
+	double dsps1440;
+	double dsps10080;
+	time_t last_share;
+} api_user_t;
+
+typedef struct api_worker {
+	const user_instance_t *user;
+	const worker_instance_t *worker;
+	double dsps1;
+	double dsps5;
+	double dsps60;
+	double dsps1440;
+	time_t last_share;
+	double best_diff;
+	int mindiff;
+	bool idle;
+} api_worker_t;
+
+typedef struct api_client {
+	const user_instance_t *user;
+	const worker_instance_t *worker;
+	int64_t id;
+	char enonce1[36];
+	char enonce1var[20];
+	uint64_t enonce1_64;
+	int64_t diff;
+	double dsps1;
+	double dsps5;
+	double dsps60;
+	double dsps1440;
+	double dsps10080;
+	time_t last_share;
+	time_t start_time;
+	char address[INET6_ADDRSTRLEN];
+	bool subscribed;
+	bool authorised;
+	bool idle;
+	int useragent; /* Offsets into the strings arena */
+	int workername;
+	int user_id;
+	int server;
+	double best_diff;
+	int proxyid;
+	int subproxyid;
+} api_client_t;
+
+typedef struct api_snapshot api_snapshot_t;
+
+/* Clients sit in a timer wheel of one minute slots by when they next need
+ * checking for being idle or unauthorised. A client's idle_slot is 0 when
+ * not in the wheel, 1 to IDLE_SLOTS for the wheel slot before it, IDLE_DUE
+ * when on the list of those due a check, and IDLE_BUSY while being checked.
+ * Checks are at most IDLE_HORIZON minutes apart. */
+#define IDLE_SLOTS 16
+#define IDLE_DUE (IDLE_SLOTS + 1)
+#define IDLE_BUSY (IDLE_SLOTS + 2)
+#define IDLE_HORIZON 10
+
+struct api_snapshot {
+	time_t stamp; /* When taken, zero if never */
+
+	/* Arrays keep their allocated size between snapshots */
+	api_user_t *users;
+	int nusers;
+	int maxusers;
+	api_worker_t *workers;
+	int nworkers;
+	int maxworkers;
+	api_client_t *clients;
+	int nclients;
+	int maxclients;
+
+	char *strings;
+	int strlen;
+	int strsize;
+};
+
 struct stratifier_data {
 	ckpool_t *ckp;
 
@@ -401,6 +677,10 @@ struct stratifier_data {
 	/* Protects changes to unaccounted pool stats */
 	mutex_t uastats_lock;
 
+	/* Users with new stats since the last statsupdate */
+	mutex_t dirty_lock;
+	user_instance_t *dirty_users;
+
 	bool verbose;
 
 	uint64_t enonce1_64;
@@ -415,8 +695,20 @@ struct stratifier_data {
 	workbase_t *workbases;
 	workbase_t *current_workbase;
 	int workbases_generated;
+
+	/* Lock free index of the workbases, with the count of readers inside
+	 * each of the two grace periods of wbepoch. Workbases dropped from the
+	 * index wait in retired_workbases until their last reader is done */
+	wbindex_t *wbindex;
+	int wbreaders[2];
+	int wbepoch;
+	mutex_t wbsync_lock;
+	workbase_t *retired_workbases;
 	txntable_t *txns;
 	int64_t txns_generated;
+	int64_t txns_datalen; /* Raw data referenced by txns */
+	/* Only accessed by the serialised block_update */
+	txnset_t txnset;
 
 	/* Workbases from remote trusted servers */
 	workbase_t *remote_workbases;
@@ -424,6 +716,25 @@ struct stratifier_data {
 	/* Is this a node and unable to rebuild workinfos due to lack of txns */
 	bool wbincomplete;
 
+	/* Transactions of the last workinfo sent to nodes and remotes, that
+	 * the next one is delta encoded against, and that workinfo in full to
+	 * resend to remotes asking for it */
+	mutex_t txnbase_lock;
+	char *txnbase;
+	int txnbase_txns;
+	int64_t txnbase_id;
+	json_t *txnbase_val;
+
+	/* Shares waiting to be sent upstream by a remote trusted server */
+	mutex_t sharebatch_lock;
+	sharebatch_t *sharebatch;
+	int sharebatch_shares;
+
+	/* Transactions of the last workinfo received from upstream */
+	char *txnparent;
+	int txnparent_txns;
+	int64_t txnparent_id;
+
 	/* Semaphore to serialise calls to add_base */
 	sem_t update_sem;
 	/* Time we last sent out a stratum update */
@@ -438,9 +749,24 @@ struct stratifier_data {
 	ckmsgq_t *updateq;	// Generator base work updates
 	ckmsgq_t *ssends;	// Stratum sends
 	ckmsgq_t *srecvs;	// Stratum receives
+	ckmsgq_t *snotifyq;	// Per user notify building in btcsolo
+
+	/* For waiting on snotifier jobs to complete */
+	mutex_t notify_lock;
+	pthread_cond_t notify_cond;
 	ckmsgq_t *sshareq;	// Stratum share sends
 	ckmsgq_t *sauthq;	// Stratum authorisations
 	ckmsgq_t *stxnq;	// Transaction requests
+	ckmsgq_t *sharelogq;	// Share log records
+
+	/* Records spilled in order when the sharelogq is full, written by the
+	 * share logger once it has emptied the sharelogq */
+	mutex_t sharelog_lock;
+	sharelog_t *sharelog_overflow;
+	int64_t sharelogs_spilled;
+
+	/* Hashtable of open share log files by name */
+	sharelog_file_t *sharelog_files;
 
 	int user_instance_id;
 
@@ -453,15 +779,38 @@ struct stratifier_data {
 	int64_t disconnected_generated;
 	int64_t userwbs_generated;
 	session_t *disconnected_sessions;
+	/* The same sessions in the order they were added, oldest first */
+	session_t *session_list;
+	int64_t session_hits;
+	int64_t session_misses;
+	int64_t sessions_expired;
+	int64_t sessions_evicted; /* Dropped early to stay under maxsessions */
 
 	user_instance_t *user_instances;
 
 	/* Protects both stratum and user instances */
 	cklock_t instance_lock;
 
-	share_t *shares;
-	mutex_t share_lock;
+	/* Snapshot of instances the API lists from, only used by the thread
+	 * handling API commands */
+	api_snapshot_t api_snapshot;
+
+	/* Idle wheel slots with the due list last, protected by instance_lock */
+	stratum_instance_t *idle_wheel[IDLE_SLOTS + 1];
+	int64_t idle_minute; /* Last minute of the wheel made due */
+	int idle_clients; /* Authorised clients without shares for a minute */
+
+	/* Duplicate share hashtables, one per workbase id. The share_lock
+	 * write lock is only taken to add or remove partitions. */
+	share_partition_t *share_partitions;
+	cklock_t share_lock;
 
+	/* Pool of free share slabs */
+	share_slab_t *share_slabs;
+	int free_share_slabs;
+	mutex_t share_slab_lock;
+
+	/* Shares generated by retired partitions */
 	int64_t shares_generated;
 
 	int proxy_count; /* Total proxies generated (not necessarily still alive) */
@@ -524,6 +873,31 @@ static void info_msg_entries(char_entry_t **entries)
 
 static const int witnessdata_size = 36; // commitment header + hash
 
+/* Store the sha256 midstate of the full blocks of coinb1 since they're the
+ * same for every share, leaving only the tail to hash per share. */
+static void coinb1_midstate(workbase_t *wb)
+{
+	sha256_ctx ctx;
+
+	wb->coinb1midlen = wb->coinb1len & ~(SHA256_BLOCK_SIZE - 1);
+	sha256_init(&ctx);
+	sha256_update(&ctx, wb->coinb1bin, wb->coinb1midlen);
+	memcpy(wb->coinb1mid, ctx.h, sizeof(wb->coinb1mid));
+}
+
+/* Double sha256 a coinbase starting with coinb1, resuming from the coinb1
+ * midstate */
+static void coinbase_hash(const workbase_t *wb, const uchar *coinbase, const int cblen, uchar *hash)
+{
+	uchar hash1[32];
+	sha256_ctx ctx;
+
+	sha256_resume(&ctx, wb->coinb1mid, wb->coinb1midlen);
+	sha256_update(&ctx, coinbase + wb->coinb1midlen, cblen - wb->coinb1midlen);
+	sha256_final(&ctx, hash1);
+	sha256(hash1, 32, hash);
+}
+
 static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 {
 	uint64_t *u64, g64, d64 = 0;
@@ -590,6 +964,7 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 
 	wb->coinb1bin[41] = len - 1; /* Set the length now */
 	__bin2hex(wb->coinb1, wb->coinb1bin, wb->coinb1len);
+	coinb1_midstate(wb);
 	LOGDEBUG("Coinb1: %s", wb->coinb1);
 	/* Coinbase 1 complete */
 
@@ -747,6 +1122,14 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 
 static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, bool clean);
 static void stratum_broadcast_updates(sdata_t *sdata, bool clean);
+static void put_txnarena(txnarena_t *arena);
+
+static void free_userwb(struct userwb *userwb)
+{
+	free(userwb->coinb2bin);
+	free(userwb->coinb2);
+	free(userwb);
+}
 
 static void clear_userwb(sdata_t *sdata, int64_t id)
 {
@@ -760,9 +1143,7 @@ static void clear_userwb(sdata_t *sdata, int64_t id)
 		if (!userwb)
 			continue;
 		HASH_DEL(instance->userwbs, userwb);
-		free(userwb->coinb2bin);
-		free(userwb->coinb2);
-		free(userwb);
+		free_userwb(userwb);
 	}
 	ck_wunlock(&sdata->instance_lock);
 }
@@ -772,7 +1153,10 @@ static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 	if (ckp->btcsolo)
 		clear_userwb(ckp->sdata, wb->id);
 	free(wb->flags);
-	free(wb->txn_data);
+	if (wb->txn_arena)
+		put_txnarena(wb->txn_arena);
+	else
+		free(wb->txn_data);
 	free(wb->txn_hashes);
 	free(wb->logdir);
 	free(wb->coinb1bin);
@@ -781,47 +1165,88 @@ static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 	free(wb->coinb2);
 	free(wb->coinb3bin);
 	json_decref(wb->merkle_array);
-	if (wb->json)
-		json_decref(wb->json);
+	free(wb->gbttxns);
 	free(wb);
 }
 
-/* Remove all shares with a workbase id less than wb_id for block changes */
+/* Return all of a partition's slabs to the slab pool and free it. The
+ * partition must already have been removed from share_partitions. Returns how
+ * many shares were in it. */
+static int free_share_partition(sdata_t *sdata, share_partition_t *part)
+{
+	share_slab_t *slab, *tmp;
+	int count = part->count;
+
+	HASH_CLEAR(hh, part->shares);
+	mutex_lock(&sdata->share_slab_lock);
+	DL_FOREACH_SAFE(part->slabs, slab, tmp) {
+		DL_DELETE(part->slabs, slab);
+		if (sdata->free_share_slabs < SHARE_SLABS_FREE) {
+			slab->used = 0;
+			DL_APPEND(sdata->share_slabs, slab);
+			sdata->free_share_slabs++;
+		} else
+			free(slab);
+	}
+	mutex_unlock(&sdata->share_slab_lock);
+	mutex_destroy(&part->lock);
+	free(part);
+
+	return count;
+}
+
+/* Free a list of partitions removed from share_partitions */
+static int free_share_partitions(sdata_t *sdata, share_partition_t *parts)
+{
+	share_partition_t *part;
+	int freed = 0;
+
+	while ((part = parts)) {
+		parts = part->next;
+		freed += free_share_partition(sdata, part);
+	}
+	return freed;
+}
+
+/* Remove the share partitions of all workbases with an id less than wb_id for
+ * block changes */
 static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
 {
-	share_t *share, *tmp;
-	int purged = 0;
+	share_partition_t *part, *tmp, *parts = NULL;
+	int purged;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id < wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			purged++;
+	ck_wlock(&sdata->share_lock);
+	HASH_ITER(hh, sdata->share_partitions, part, tmp) {
+		if (part->workbase_id < wb_id) {
+			HASH_DEL(sdata->share_partitions, part);
+			sdata->shares_generated += part->generated;
+			part->next = parts;
+			parts = part;
 		}
 	}
-	mutex_unlock(&sdata->share_lock);
+	ck_wunlock(&sdata->share_lock);
 
+	purged = free_share_partitions(sdata, parts);
 	if (purged)
 		LOGINFO("Cleared %d shares from share hashtable", purged);
 }
 
-/* Remove all shares with a workbase id == wb_id being discarded */
+/* Remove the share partition of the workbase wb_id being discarded */
 static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
 {
-	share_t *share, *tmp;
+	share_partition_t *part;
 	int aged = 0;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id == wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			aged++;
-		}
+	ck_wlock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_partitions, &wb_id, part);
+	if (part) {
+		HASH_DEL(sdata->share_partitions, part);
+		sdata->shares_generated += part->generated;
 	}
-	mutex_unlock(&sdata->share_lock);
+	ck_wunlock(&sdata->share_lock);
 
+	if (part)
+		aged = free_share_partition(sdata, part);
 	if (aged)
 		LOGINFO("Aged %d shares from share hashtable", aged);
 }
@@ -871,6 +1296,84 @@ static void upstream_json_msgtype(ckpool_t *ckp, json_t *val, const int msg_type
 	upstream_json(ckp, val);
 }
 
+/* Entered with sharebatch_lock held. Take the batched shares as an array of
+ * [workername, shares, diff, sdiff] per worker */
+static json_t *__sharebatch_msg(sdata_t *sdata)
+{
+	sharebatch_t *batch, *tmp;
+	json_t *val, *workers;
+
+	workers = json_array();
+	HASH_ITER(hh, sdata->sharebatch, batch, tmp) {
+		json_t *worker;
+
+		HASH_DEL(sdata->sharebatch, batch);
+		JSON_CPACK(worker, "[siff]", batch->workername, batch->shares,
+			   batch->diff, batch->sdiff);
+		json_array_append_new(workers, worker);
+		free(batch->workername);
+		free(batch);
+	}
+	sdata->sharebatch_shares = 0;
+	JSON_CPACK(val, "{so}", "workers", workers);
+	return val;
+}
+
+/* Add a share to the batch for upstream, sending the batch once full */
+static void batch_remote_share(ckpool_t *ckp, sdata_t *sdata, const char *workername,
+			       const double diff, const double sdiff)
+{
+	sharebatch_t *batch;
+	json_t *val = NULL;
+
+	mutex_lock(&sdata->sharebatch_lock);
+	HASH_FIND_STR(sdata->sharebatch, workername, batch);
+	if (!batch) {
+		batch = ckzalloc(sizeof(sharebatch_t));
+		batch->workername = strdup(workername);
+		HASH_ADD_KEYPTR(hh, sdata->sharebatch, batch->workername,
+				strlen(batch->workername), batch);
+	}
+	batch->shares++;
+	batch->diff += diff;
+	if (sdiff > batch->sdiff)
+		batch->sdiff = sdiff;
+	if (++sdata->sharebatch_shares >= SHAREBATCH_SHARES)
+		val = __sharebatch_msg(sdata);
+	mutex_unlock(&sdata->sharebatch_lock);
+
+	if (val) {
+		upstream_json_msgtype(ckp, val, SM_SHAREBATCH);
+		json_decref(val);
+	}
+}
+
+/* Send any shares that have been batched within SHAREBATCH_MS upstream */
+static void *sharebatcher(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->sdata;
+
+	pthread_detach(pthread_self());
+	rename_proc("sharebatcher");
+
+	while (42) {
+		json_t *val = NULL;
+
+		cksleep_ms(SHAREBATCH_MS);
+		mutex_lock(&sdata->sharebatch_lock);
+		if (sdata->sharebatch_shares)
+			val = __sharebatch_msg(sdata);
+		mutex_unlock(&sdata->sharebatch_lock);
+
+		if (val) {
+			upstream_json_msgtype(ckp, val, SM_SHAREBATCH);
+			json_decref(val);
+		}
+	}
+	return NULL;
+}
+
 /* Upstream a json msgtype, duplicating the json */
 static void upstream_msgtype(ckpool_t *ckp, const json_t *val, const int msg_type)
 {
@@ -881,12 +1384,110 @@ static void upstream_msgtype(ckpool_t *ckp, const json_t *val, const int msg_typ
 	json_decref(json_msg);
 }
 
+/* Position of a transaction in the txnbase */
+typedef struct txnpos {
+	UT_hash_handle hh;
+	int pos;
+} txnpos_t;
+
+static void append_txnrun(json_t *delta, const int start, const int count)
+{
+	json_t *run;
+
+	JSON_CPACK(run, "[ii]", start, count);
+	json_array_append_new(delta, run);
+}
+
+/* Entered with txnbase_lock held. Returns a copy of workinfo val with its
+ * txn_hashes replaced by txndelta, an array of [start, count] runs of
+ * transactions from the txnbase workinfo and the hashes of transactions that
+ * are new, or NULL if there is no txnbase to work from. */
+static json_t *__workinfo_delta(sdata_t *sdata, const workbase_t *wb, const json_t *val)
+{
+	const char *parent = sdata->txnbase, *hashes = wb->txn_hashes;
+	txnpos_t *positions, *table = NULL, *found;
+	int i, start = 0, count = 0;
+	json_t *delta, *delta_val;
+
+	if (!parent || !hashes || (int)strlen(hashes) < wb->txns * 65)
+		return NULL;
+
+	positions = ckalloc(sizeof(txnpos_t) * (sdata->txnbase_txns + 1));
+	for (i = 0; i < sdata->txnbase_txns; i++) {
+		positions[i].pos = i;
+		HASH_ADD_KEYPTR(hh, table, parent + i * 65, 64, &positions[i]);
+	}
+
+	delta = json_array();
+	for (i = 0; i < wb->txns; i++) {
+		const char *hash = hashes + i * 65;
+
+		/* Transactions mostly stay in the same order */
+		if (count && start + count < sdata->txnbase_txns &&
+		    !memcmp(hash, parent + (start + count) * 65, 64)) {
+			count++;
+			continue;
+		}
+		if (count)
+			append_txnrun(delta, start, count);
+		count = 0;
+		HASH_FIND(hh, table, hash, 64, found);
+		if (found) {
+			start = found->pos;
+			count = 1;
+		} else
+			json_array_append_new(delta, json_stringn(hash, 64));
+	}
+	if (count)
+		append_txnrun(delta, start, count);
+	HASH_CLEAR(hh, table);
+	free(positions);
+
+	delta_val = json_deep_copy(val);
+	json_object_del(delta_val, "txn_hashes");
+	json_set_int64(delta_val, "parentid", sdata->txnbase_id);
+	json_object_set_new_nocheck(delta_val, "txndelta", delta);
+	return delta_val;
+}
+
+/* Entered with txnbase_lock held. Returns the message to send client for
+ * workinfo wb, delta encoded only if the client advertised it can decode
+ * them and was last sent the txnbase workinfo. Anyone else, including on
+ * their first workinfo, gets the full txn_hashes. A remote that misses or
+ * fails to decode one asks for the full workinfo with reqworkinfo. */
+static json_t *__client_workinfo(sdata_t *sdata, stratum_instance_t *client, const workbase_t *wb,
+				 json_t *val, json_t *delta_val)
+{
+	json_t *json_msg;
+
+	if (delta_val && client->txndelta && client->last_workinfo &&
+	    client->last_workinfo == sdata->txnbase_id)
+		json_msg = json_deep_copy(delta_val);
+	else
+		json_msg = json_deep_copy(val);
+	client->last_workinfo = wb->mapped_id;
+	return json_msg;
+}
+
+/* Entered with txnbase_lock held. Make wb, sent in full as val, the txnbase
+ * for the next workinfo */
+static void __set_txnbase(sdata_t *sdata, const workbase_t *wb, json_t *val)
+{
+	free(sdata->txnbase);
+	sdata->txnbase = wb->txn_hashes ? strdup(wb->txn_hashes) : NULL;
+	sdata->txnbase_txns = wb->txns;
+	sdata->txnbase_id = wb->mapped_id;
+	if (sdata->txnbase_val)
+		json_decref(sdata->txnbase_val);
+	sdata->txnbase_val = json_incref(val);
+}
+
 static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *wb)
 {
 	stratum_instance_t *client;
 	ckmsg_t *bulk_send = NULL;
+	json_t *wb_val, *delta_val;
 	int messages = 0;
-	json_t *wb_val;
 
 	wb_val = json_object();
 
@@ -913,15 +1514,17 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 	json_set_int(wb_val, "coinb2len", wb->coinb2len);
 	json_set_string(wb_val, "coinb2", wb->coinb2);
 
+	mutex_lock(&sdata->txnbase_lock);
+	delta_val = __workinfo_delta(sdata, wb, wb_val);
 	ck_rlock(&sdata->instance_lock);
 	DL_FOREACH2(sdata->node_instances, client, node_next) {
 		ckmsg_t *client_msg;
 		smsg_t *msg;
-		json_t *json_msg = json_deep_copy(wb_val);
+		json_t *json_msg = __client_workinfo(sdata, client, wb, wb_val, delta_val);
 
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckmsg_slab);
+		msg = ckslab_zalloc(smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -931,11 +1534,11 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
 		ckmsg_t *client_msg;
 		smsg_t *msg;
-		json_t *json_msg = json_deep_copy(wb_val);
+		json_t *json_msg = __client_workinfo(sdata, client, wb, wb_val, delta_val);
 
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckmsg_slab);
+		msg = ckslab_zalloc(smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -943,16 +1546,22 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		messages++;
 	}
 	ck_runlock(&sdata->instance_lock);
+	__set_txnbase(sdata, wb, wb_val);
+	/* Queue them in the order they were delta encoded */
+	if (bulk_send) {
+		LOGINFO("Sending workinfo to mining nodes");
+		ssend_bulk_append(sdata, bulk_send, messages);
+	}
+	mutex_unlock(&sdata->txnbase_lock);
 
+	if (delta_val)
+		json_decref(delta_val);
+
+	/* The upstream pool always gets the full workinfo */
 	if (ckp->remote)
 		upstream_msgtype(ckp, wb_val, SM_WORKINFO);
 
 	json_decref(wb_val);
-
-	if (bulk_send) {
-		LOGINFO("Sending workinfo to mining nodes");
-		ssend_bulk_append(sdata, bulk_send, messages);
-	}
 }
 
 static json_t *generate_workinfo(ckpool_t *ckp, const workbase_t *wb, const char *func)
@@ -987,20 +1596,14 @@ static void send_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *wb)
 		send_node_workinfo(ckp, sdata, wb);
 }
 
-/* Entered with instance_lock held, make sure wb can't be pulled from us */
-static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *user)
+/* Create a userwb with a coinb2 paying user for wb without adding it to the
+ * user's userwbs. Make sure wb can't be pulled from us */
+static struct userwb *new_userwb(const workbase_t *wb, const user_instance_t *user)
 {
 	struct userwb *userwb;
-	int64_t id = wb->id;
-
-	/* Make sure this user doesn't have this userwb already */
-	HASH_FIND_I64(user->userwbs, &id, userwb);
-	if (unlikely(userwb))
-		return;
 
-	sdata->userwbs_generated++;
 	userwb = ckzalloc(sizeof(struct userwb));
-	userwb->id = id;
+	userwb->id = wb->id;
 	userwb->coinb2bin = ckalloc(wb->coinb2len + 1 + user->txnlen + wb->coinb3len);
 	memcpy(userwb->coinb2bin, wb->coinb2bin, wb->coinb2len);
 	userwb->coinb2len = wb->coinb2len;
@@ -1010,20 +1613,144 @@ static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *u
 	memcpy(userwb->coinb2bin + userwb->coinb2len, wb->coinb3bin, wb->coinb3len);
 	userwb->coinb2len += wb->coinb3len;
 	userwb->coinb2 = bin2hex(userwb->coinb2bin, userwb->coinb2len);
+	return userwb;
+}
+
+/* Add userwb to user unless they already have one for its workbase, returning
+ * the one they end up with. Entered with instance_lock held. */
+static struct userwb *__add_userwb(sdata_t *sdata, user_instance_t *user, struct userwb *userwb)
+{
+	struct userwb *found;
+	int64_t id = userwb->id;
+
+	HASH_FIND_I64(user->userwbs, &id, found);
+	if (unlikely(found)) {
+		free_userwb(userwb);
+		return found;
+	}
+	sdata->userwbs_generated++;
 	HASH_ADD_I64(user->userwbs, id, userwb);
+	return userwb;
 }
 
-static void generate_userwbs(sdata_t *sdata, workbase_t *wb)
+/* Entered with instance_lock held, make sure wb can't be pulled from us */
+static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *user)
 {
-	user_instance_t *instance, *tmp;
+	struct userwb *userwb;
+	int64_t id = wb->id;
 
-	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->user_instances, instance, tmp) {
-		if (!instance->btcaddress)
+	/* Make sure this user doesn't have this userwb already */
+	HASH_FIND_I64(user->userwbs, &id, userwb);
+	if (unlikely(userwb))
+		return;
+	__add_userwb(sdata, user, new_userwb(wb, user));
+}
+
+/* Pre-serialise the block following its coinbase, being the transaction count
+ * and data, so only the header and coinbase are left to add on a block solve */
+static void wb_block_body(workbase_t *wb)
+{
+	int txns = wb->txns + 1;
+
+	if (txns < 0xfd) {
+		uint8_t val8 = txns;
+
+		__bin2hex(wb->txncount, (const unsigned char *)&val8, 1);
+	} else if (txns <= 0xffff) {
+		uint16_t val16 = htole16(txns);
+
+		strcpy(wb->txncount, "fd");
+		__bin2hex(wb->txncount + 2, (const unsigned char *)&val16, 2);
+	} else {
+		uint32_t val32 = htole32(txns);
+
+		strcpy(wb->txncount, "fe");
+		__bin2hex(wb->txncount + 2, (const unsigned char *)&val32, 4);
+	}
+}
+
+static int wb_id_cmp(const void *a, const void *b)
+{
+	const workbase_t *wba = *(workbase_t * const *)a, *wbb = *(workbase_t * const *)b;
+
+	return wba->id < wbb->id ? -1 : wba->id > wbb->id;
+}
+
+/* Rebuild the wbindex from the workbases hashtable and publish it. Must be
+ * entered with workbase_lock held for writing and returns the old index which
+ * may only be freed after wbindex_sync */
+static wbindex_t *__publish_wbindex(sdata_t *sdata)
+{
+	int count = HASH_COUNT(sdata->workbases), i = 0;
+	wbindex_t *index, *old;
+	workbase_t *wb, *tmp;
+
+	index = ckalloc(sizeof(wbindex_t) + sizeof(workbase_t *) * count);
+	HASH_ITER(hh, sdata->workbases, wb, tmp)
+		index->wbs[i++] = wb;
+	index->count = count;
+	qsort(index->wbs, count, sizeof(workbase_t *), wb_id_cmp);
+	old = sdata->wbindex;
+	__atomic_store_n(&sdata->wbindex, index, __ATOMIC_RELEASE);
+	return old;
+}
+
+/* Enter a grace period for reading the wbindex, returning the slot to be
+ * passed to wbindex_exit. Never blocks, retrying only if wbindex_sync ended
+ * the grace period under us */
+static int wbindex_enter(sdata_t *sdata)
+{
+	int epoch;
+
+	while (42) {
+		epoch = __atomic_load_n(&sdata->wbepoch, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&sdata->wbreaders[epoch & 1], 1, __ATOMIC_SEQ_CST);
+		if (likely(__atomic_load_n(&sdata->wbepoch, __ATOMIC_SEQ_CST) == epoch))
+			return epoch & 1;
+		__atomic_fetch_sub(&sdata->wbreaders[epoch & 1], 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void wbindex_exit(sdata_t *sdata, const int slot)
+{
+	__atomic_fetch_sub(&sdata->wbreaders[slot], 1, __ATOMIC_RELEASE);
+}
+
+/* Wait until every reader that may have seen an unpublished wbindex has left
+ * its grace period. Readers only hold it for a bsearch so we just yield */
+static void wbindex_sync(sdata_t *sdata)
+{
+	int epoch;
+
+	mutex_lock(&sdata->wbsync_lock);
+	epoch = __atomic_fetch_add(&sdata->wbepoch, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&sdata->wbreaders[epoch & 1], __ATOMIC_ACQUIRE))
+		sched_yield();
+	mutex_unlock(&sdata->wbsync_lock);
+}
+
+/* Free the retired workbases no longer held by any reader. Must only be called
+ * after a wbindex_sync following their removal from the index so no new
+ * reader can find them */
+static void reap_workbases(ckpool_t *ckp, sdata_t *sdata)
+{
+	workbase_t *wb, *tmp, *reaped = NULL;
+
+	ck_wlock(&sdata->workbase_lock);
+	HASH_ITER(hh, sdata->retired_workbases, wb, tmp) {
+		if (__atomic_load_n(&wb->readcount, __ATOMIC_ACQUIRE))
 			continue;
-		__generate_userwb(sdata, wb, instance);
+		HASH_DEL(sdata->retired_workbases, wb);
+		HASH_ADD_I64(reaped, id, wb);
+	}
+	ck_wunlock(&sdata->workbase_lock);
+
+	/* Drop lock to avoid recursive locks */
+	HASH_ITER(hh, reaped, wb, tmp) {
+		HASH_DEL(reaped, wb);
+		age_share_hashtable(sdata, wb->id);
+		clear_workbase(ckp, wb);
 	}
-	ck_wunlock(&sdata->instance_lock);
 }
 
 /* Add a new workbase to the table of workbases. Sdata is the global data in
@@ -1034,8 +1761,10 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	pool_stats_t *stats = &sdata->stats;
 	double old_diff = stats->network_diff;
 	workbase_t *tmp, *tmpa;
+	wbindex_t *oldindex;
 	int len, ret;
 
+	wb_block_body(wb);
 	ts_realtime(&wb->gentime);
 	/* Stats network_diff is not protected by lock but is not a critical
 	 * value */
@@ -1090,27 +1819,24 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 			break;
 		if (wb == tmp)
 			continue;
-		if (tmp->readcount)
+		if (__atomic_load_n(&tmp->readcount, __ATOMIC_RELAXED))
 			continue;
-		/*  Age old workbases older than 10 minutes old */
+		/*  Age old workbases older than 10 minutes old, retiring them
+		 * until any share still looking them up is done */
 		if (tmp->gentime.tv_sec < wb->gentime.tv_sec - 600) {
 			HASH_DEL(sdata->workbases, tmp);
-			ck_wunlock(&sdata->workbase_lock);
-
-			/* Drop lock to avoid recursive locks */
-			age_share_hashtable(sdata, tmp->id);
-			clear_workbase(ckp, tmp);
-
-			ck_wlock(&sdata->workbase_lock);
+			HASH_ADD_I64(sdata->retired_workbases, id, tmp);
 		}
 	}
+	oldindex = __publish_wbindex(sdata);
 	ck_wunlock(&sdata->workbase_lock);
 
-	/* This wb can't be pulled out from under us so no workbase lock is
-	 * required to generate_userwbs */
-	if (ckp->btcsolo)
-		generate_userwbs(sdata, wb);
+	wbindex_sync(sdata);
+	free(oldindex);
+	reap_workbases(ckp, sdata);
 
+	/* In btcsolo mode userwbs are generated lazily for users with clients
+	 * when the workbase is broadcast */
 	if (*new_block)
 		purge_share_hashtable(sdata, wb->id);
 
@@ -1137,18 +1863,109 @@ static void submit_transaction(ckpool_t *ckp, const char *hash)
 	free(buf);
 }
 
-/* Build a hashlist of all transactions, allowing us to compare with the list of
- * existing transactions to determine which need to be propagated */
-static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char *hash,
-		    const char *data, bool local)
+/* Create an arena owning the binary data buf of len bytes, with a reference
+ * held by its creator */
+static txnarena_t *create_txnarena(void *buf, const int len)
+{
+	txnarena_t *arena = ckzalloc(sizeof(txnarena_t));
+
+	arena->buf = buf;
+	arena->len = arena->size = len;
+	arena->refs = 1;
+	return arena;
+}
+
+static void get_txnarena(txnarena_t *arena)
+{
+	__atomic_add_fetch(&arena->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void put_txnarena(txnarena_t *arena)
+{
+	if (__atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(arena->buf);
+	free(arena);
+}
+
+/* Append the raw data of a remote transaction decoded from hex to a batch
+ * arena, creating it on first use with a reference held by its creator until
+ * it is put in update_txns. Returns the decoded data, only valid until the
+ * next append, or NULL if it would not decode. */
+static uchar *txn_arena_append(txnarena_t **arena, const char *data, const int hexlen)
+{
+	txnarena_t *ta = *arena;
+	int len = hexlen / 2;
+	uchar *ret;
+
+	if (!ta)
+		ta = *arena = create_txnarena(NULL, 0);
+	if (ta->len + len > ta->size) {
+		ta->size = round_up_page(MAX(ta->size * 2, ta->len + len));
+		ta->buf = realloc(ta->buf, ta->size);
+		if (unlikely(!ta->buf))
+			quit(1, "Failed to realloc arena in txn_arena_append");
+	}
+	ret = ta->buf + ta->len;
+	if (unlikely(hexlen % 2 || !hex2bin_n(ret, data, len)))
+		return NULL;
+	ta->len += len;
+	return ret;
+}
+
+/* Only hex encode transaction data where it's actually asked for, and never
+ * under txn_lock */
+static json_t *txn_json(const uchar *hash, const uchar *data, const int len)
+{
+	char hexhash[68], *hex;
+	json_t *val;
+
+	__bin2hex(hexhash, hash, 32);
+	hex = bin2hex(data, len);
+	JSON_CPACK(val, "{ss,ss}", "hash", hexhash, "data", hex);
+	free(hex);
+	return val;
+}
+
+typedef struct txnref txnref_t;
+
+/* A reference to a transaction's data taken under txn_lock for it to be
+ * encoded once the lock is dropped */
+struct txnref {
+	uchar hash[32];
+	txnarena_t *arena;
+	int ofs;
+	int len;
+};
+
+/* Must hold txn_lock */
+static void __ref_txn(txnref_t *ref, const txntable_t *txn)
+{
+	memcpy(ref->hash, txn->hash, 32);
+	ref->arena = txn->arena;
+	ref->ofs = txn->ofs;
+	ref->len = txn->len;
+	get_txnarena(ref->arena);
+}
+
+/* Encode a referenced transaction, dropping the reference */
+static json_t *txnref_json(txnref_t *ref)
+{
+	json_t *val = txn_json(ref->hash, ref->arena->buf + ref->ofs, ref->len);
+
+	put_txnarena(ref->arena);
+	return val;
+}
+
+/* Look up a transaction we may already know about and increment its refcount
+ * if we're still using it. Returns true if it need not be added. */
+static bool txn_known(sdata_t *sdata, const uchar *hash, const bool local)
 {
 	bool found = false;
 	txntable_t *txn;
 
-	/* Look for transactions we already know about and increment their
-	 * refcount if we're still using them. */
 	ck_wlock(&sdata->txn_lock);
-	HASH_FIND_STR(sdata->txns, hash, txn);
+	HASH_FIND(hh, sdata->txns, hash, 32, txn);
 	if (txn) {
 		/* If we already have this in our transaction table but haven't
 		 * seen it in a while, it is reappearing in work and we should
@@ -1163,23 +1980,36 @@ static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char
 	}
 	ck_wunlock(&sdata->txn_lock);
 
-	if (found)
-		return false;
+	return found;
+}
+
+/* Build a hashlist of the new transactions, allowing us to compare with the
+ * list of existing transactions to determine which need to be propagated.
+ * The binary data of each is len bytes at data within arena, which it takes
+ * a reference on. */
+static void add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, txnarena_t *arena,
+		    const uchar *hash, const uchar *data, const int len, bool local)
+{
+	txntable_t *txn;
 
 	txn = ckzalloc(sizeof(txntable_t));
-	memcpy(txn->hash, hash, 65);
-	if (local)
-		txn->data = strdup(data);
-	else {
-		/* Get the data from our local bitcoind as a way of confirming it
-		 * already knows about this transaction. */
-		txn->data = generator_get_txn(ckp, hash);
-		if (!txn->data) {
-			/* If our local bitcoind hasn't seen this transaction,
-			 * submit it for mempools to be ~synchronised */
-			submit_transaction(ckp, data);
-			txn->data = strdup(data);
+	memcpy(txn->hash, hash, 32);
+	txn->arena = arena;
+	txn->ofs = data - arena->buf;
+	txn->len = len;
+	get_txnarena(arena);
+	if (!local) {
+		char hashhex[68], *txndata;
+
+		/* Check our local bitcoind knows about this transaction and if
+		 * not submit it for mempools to be ~synchronised */
+		__bin2hex(hashhex, hash, 32);
+		txndata = generator_get_txn(ckp, hashhex);
+		if (!txndata) {
+			txndata = bin2hex(data, len);
+			submit_transaction(ckp, txndata);
 		}
+		free(txndata);
 	}
 
 	txn->seen = true;
@@ -1187,9 +2017,21 @@ static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char
 		txn->refcount = REFCOUNT_REMOTE;
 	else
 		txn->refcount = REFCOUNT_LOCAL;
-	HASH_ADD_STR(*txns, hash, txn);
+	HASH_ADD(hh, *txns, hash, 32, txn);
+}
 
-	return true;
+/* Are there any nodes, remote servers or upstream pools to propagate
+ * transactions to */
+static bool txn_receivers(ckpool_t *ckp, sdata_t *sdata)
+{
+	bool ret;
+
+	if (ckp->remote)
+		return true;
+	ck_rlock(&sdata->instance_lock);
+	ret = sdata->node_instances || sdata->remote_instances;
+	ck_runlock(&sdata->instance_lock);
+	return ret;
 }
 
 static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *txn_val)
@@ -1205,8 +2047,8 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 	DL_FOREACH2(sdata->node_instances, client, node_next) {
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_TRANSACTIONS]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckmsg_slab);
+		msg = ckslab_zalloc(smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1216,8 +2058,8 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_TRANSACTIONS]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckmsg_slab);
+		msg = ckslab_zalloc(smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1247,22 +2089,42 @@ static void submit_transaction_array(ckpool_t *ckp, const json_t *arr)
 
 static void clear_txn(txntable_t *txn)
 {
-	free(txn->data);
+	put_txnarena(txn->arena);
 	free(txn);
 }
 
-static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool local)
+/* Move the new transactions in txns to the transaction table, purging any no
+ * longer in use, and drop the creator's reference to any batch arena they
+ * were added to. */
+static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, txnarena_t *arena,
+			bool local)
 {
-	json_t *val, *txn_array = json_array(), *purged_txns = json_array();
+	json_t *val, *txn_array = NULL, *purged_txns = NULL;
+	txntable_t *tmp, *tmpa, *purgelist = NULL;
 	int added = 0, purged = 0;
-	txntable_t *tmp, *tmpa;
+
+	/* Any unused space can be released before the arena is shared */
+	if (arena && arena->len < arena->size) {
+		uchar *buf = realloc(arena->buf, MAX(arena->len, 1));
+
+		if (likely(buf)) {
+			arena->buf = buf;
+			arena->size = MAX(arena->len, 1);
+		}
+	}
+
+	/* Build the propagation message from the new transactions which are
+	 * only visible to us before taking txn_lock */
+	if (txns && txn_receivers(ckp, sdata)) {
+		txn_array = json_array();
+		HASH_ITER(hh, txns, tmp, tmpa)
+			json_array_append_new(txn_array, txn_json(tmp->hash, tmp->arena->buf + tmp->ofs, tmp->len));
+	}
 
 	/* Find which transactions have their refcount decremented to zero
-	 * and remove them. */
+	 * and remove them, encoding and freeing them after dropping the lock */
 	ck_wlock(&sdata->txn_lock);
 	HASH_ITER(hh, sdata->txns, tmp, tmpa) {
-		json_t *txn_val;
-
 		if (tmp->seen) {
 			tmp->seen = false;
 			continue;
@@ -1270,51 +2132,63 @@ static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool lo
 		if (tmp->refcount-- > 0)
 			continue;
 		HASH_DEL(sdata->txns, tmp);
-		txn_val = json_string(tmp->data);
-		json_array_append_new(purged_txns, txn_val);
-		clear_txn(tmp);
+		HASH_ADD(hh, purgelist, hash, 32, tmp);
+		sdata->txns_datalen -= tmp->len;
 		purged++;
 	}
 	/* Add the new transactions to the transaction table */
 	HASH_ITER(hh, txns, tmp, tmpa) {
 		txntable_t *found;
-		json_t *txn_val;
 
 		HASH_DEL(txns, tmp);
-		/* Propagate transaction here */
-		JSON_CPACK(txn_val, "{ss,ss}", "hash", tmp->hash, "data", tmp->data);
-		json_array_append_new(txn_array, txn_val);
 
 		/* Check one last time this txn hasn't already been added in the
 		 * interim. This can happen in add_txn intentionally for a
 		 * transaction that has reappeared. */
-		HASH_FIND_STR(sdata->txns, tmp->hash, found);
+		HASH_FIND(hh, sdata->txns, tmp->hash, 32, found);
 		if (found) {
 			clear_txn(tmp);
 			continue;
 		}
 
 		/* Move to the sdata transaction table */
-		HASH_ADD_STR(sdata->txns, hash, tmp);
+		HASH_ADD(hh, sdata->txns, hash, 32, tmp);
+		sdata->txns_datalen += tmp->len;
 		sdata->txns_generated++;
 		added++;
 	}
 	ck_wunlock(&sdata->txn_lock);
 
-	if (added) {
+	if (purged && ckp->nodeservers)
+		purged_txns = json_array();
+	HASH_ITER(hh, purgelist, tmp, tmpa) {
+		HASH_DEL(purgelist, tmp);
+		if (purged_txns) {
+			char *data = bin2hex(tmp->arena->buf + tmp->ofs, tmp->len);
+
+			json_array_append_new(purged_txns, json_string_nocheck(data));
+			free(data);
+		}
+		clear_txn(tmp);
+	}
+	if (arena)
+		put_txnarena(arena);
+
+	if (added && txn_array) {
 		JSON_CPACK(val, "{so}", "transaction", txn_array);
 		send_node_transactions(ckp, sdata, val);
 		json_decref(val);
-	} else
+	} else if (txn_array)
 		json_decref(txn_array);
 
 	/* Submit transactions to bitcoind again when we're purging them in
 	 * case they've been removed from its mempool as well and we need them
 	 * again in the future for a remote workinfo that hasn't forgotten
 	 * about them. */
-	if (purged && ckp->nodeservers)
+	if (purged_txns) {
 		submit_transaction_array(ckp, purged_txns);
-	json_decref(purged_txns);
+		json_decref(purged_txns);
+	}
 
 	if (added || purged) {
 		LOGINFO("Stratifier added %d %stransactions and purged %d", added,
@@ -1322,93 +2196,77 @@ static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool lo
 	}
 }
 
+/* Mark which transactions of a changed local workbase were also in the last
+ * one, keeping them in use in the transaction table under one lock so only
+ * new transactions need adding individually. Returns NULL if none were. */
+static bool *txnset_known(sdata_t *sdata, const workbase_t *wb)
+{
+	const txnset_t *txnset = &sdata->txnset;
+	bool *known = NULL;
+	txnsetid_t *id;
+	txntable_t *txn;
+	int i;
+
+	if (!txnset->txids)
+		return NULL;
+	ck_wlock(&sdata->txn_lock);
+	for (i = 0; i < wb->txns; i++) {
+		const gbttxn_t *gbttxn = &wb->gbttxns[i];
+
+		HASH_FIND(hh, txnset->txids, gbttxn->txid, 32, id);
+		if (!id || memcmp(id->hash, gbttxn->hash, 32))
+			continue;
+		HASH_FIND(hh, sdata->txns, gbttxn->hash, 32, txn);
+		if (unlikely(!txn))
+			continue;
+		if (txn->refcount < REFCOUNT_LOCAL)
+			txn->refcount = REFCOUNT_LOCAL;
+		txn->seen = true;
+		if (!known)
+			known = ckzalloc(wb->txns);
+		known[i] = true;
+	}
+	ck_wunlock(&sdata->txn_lock);
+	return known;
+}
+
 /* Distill down a set of transactions into an efficient tree arrangement for
  * stratum messages and fast work assembly. */
-static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb,
-				      json_t *txn_array, bool local)
+static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool local)
 {
-	int i, j, binleft, binlen;
 	txntable_t *txns = NULL;
-	json_t *arr_val;
+	bool *known = NULL;
+	int i, added = 0;
 	uchar *hashbin;
 
-	wb->txns = json_array_size(txn_array);
-	wb->merkles = 0;
-	binlen = wb->txns * 32 + 32;
-	hashbin = alloca(binlen + 32);
+	hashbin = alloca(wb->txns * 32 + 64);
 	memset(hashbin, 0, 32);
-	binleft = binlen / 32;
-	if (wb->txns) {
-		int len = 1, ofs = 0;
-		const char *txn;
-
-		for (i = 0; i < wb->txns; i++) {
-			arr_val = json_array_get(txn_array, i);
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			if (!txn) {
-				LOGWARNING("json_string_value fail - cannot find transaction data");
-				goto out;
-			}
-			len += strlen(txn);
-		}
-
-		wb->txn_data = ckzalloc(len + 1);
-		wb->txn_hashes = ckzalloc(wb->txns * 65 + 1);
-		memset(wb->txn_hashes, 0x20, wb->txns * 65); // Spaces
-
-		for (i = 0; i < wb->txns; i++) {
-			const char *txid, *hash;
-			char binswap[32];
-
-			arr_val = json_array_get(txn_array, i);
+	/* The transaction table shares the workbase's binary transaction data
+	 * for any new transactions */
+	if (wb->txns && !wb->txn_arena)
+		wb->txn_arena = create_txnarena(wb->txn_data, wb->txn_datalen);
+	if (local)
+		known = txnset_known(sdata, wb);
+	for (i = 0; i < wb->txns; i++) {
+		const gbttxn_t *txn = &wb->gbttxns[i];
 
-			// Post-segwit, txid returns the tx hash without witness data
-			txid = json_string_value(json_object_get(arr_val, "txid"));
-			hash = json_string_value(json_object_get(arr_val, "hash"));
-			if (!txid)
-				txid = hash;
-			if (unlikely(!txid)) {
-				LOGERR("Missing txid for transaction in wb_merkle_bins");
-				goto out;
-			}
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			add_txn(ckp, sdata, &txns, hash, txn, local);
-			len = strlen(txn);
-			memcpy(wb->txn_data + ofs, txn, len);
-			ofs += len;
-			if (!hex2bin(binswap, txid, 32)) {
-				LOGERR("Failed to hex2bin hash in gbt_merkle_bins");
-				goto out;
-			}
-			memcpy(wb->txn_hashes + i * 65, txid, 64);
-			bswap_256(hashbin + 32 + 32 * i, binswap);
+		if ((!known || !known[i]) && !txn_known(sdata, txn->hash, local)) {
+			add_txn(ckp, sdata, &txns, wb->txn_arena, txn->hash,
+				wb->txn_arena->buf + txn->ofs, txn->len, local);
+			added++;
 		}
-	} else
-		wb->txn_hashes = ckzalloc(1);
+		bswap_256(hashbin + 32 + 32 * i, txn->txid);
+	}
+	free(known);
+	wb->merkles = merkle_branches(hashbin, wb->txns, (uchar *)wb->merklebin);
 	wb->merkle_array = json_array();
-	if (binleft > 1) {
-		while (42) {
-			if (binleft == 1)
-				break;
-			memcpy(&wb->merklebin[wb->merkles][0], hashbin + 32, 32);
-			__bin2hex(&wb->merklehash[wb->merkles][0], &wb->merklebin[wb->merkles][0], 32);
-			json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[wb->merkles][0]));
-			LOGDEBUG("MerkleHash %d %s",wb->merkles, &wb->merklehash[wb->merkles][0]);
-			wb->merkles++;
-			if (binleft % 2) {
-				memcpy(hashbin + binlen, hashbin + binlen - 32, 32);
-				binlen += 32;
-				binleft++;
-			}
-			for (i = 32, j = 64; j < binlen; i += 32, j += 64)
-				gen_hash(hashbin + j, hashbin + i, 64);
-			binleft /= 2;
-			binlen = binleft * 32;
-		}
+	for (i = 0; i < wb->merkles; i++) {
+		__bin2hex(&wb->merklehash[i][0], &wb->merklebin[i][0], 32);
+		json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[i][0]));
+		LOGDEBUG("MerkleHash %d %s", i, &wb->merklehash[i][0]);
 	}
-	LOGNOTICE("Stored %s workbase with %d transactions", local ? "local" : "remote",
-		  wb->txns);
-out:
+	LOGNOTICE("Stored %s workbase with %d transactions, %d new",
+		  local ? "local" : "remote", wb->txns, added);
 	return txns;
 }
 
@@ -1417,32 +2275,17 @@ static const int witness_nonce_size = sizeof(witness_nonce);
 static const unsigned char witness_header[] = {0xaa, 0x21, 0xa9, 0xed};
 static const int witness_header_size = sizeof(witness_header);
 
-static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
+static void gbt_witness_data(workbase_t *wb)
 {
-	int i, binlen, txncount = json_array_size(txn_array);
-	const char* hash;
-	json_t *arr_val;
+	int i, binlen, txncount = wb->txns;
 	uchar *hashbin;
 
 	binlen = txncount * 32 + 32;
 	hashbin = alloca(binlen + 32);
 	memset(hashbin, 0, 32);
 
-	for (i = 0; i < txncount; i++) {
-		char binswap[32];
-
-		arr_val = json_array_get(txn_array, i);
-		hash = json_string_value(json_object_get(arr_val, "hash"));
-		if (unlikely(!hash)) {
-			LOGERR("Hash missing for transaction");
-			return;
-		}
-		if (!hex2bin(binswap, hash, 32)) {
-			LOGERR("Failed to hex2bin hash in gbt_witness_data");
-			return;
-		}
-		bswap_256(hashbin + 32 + 32 * i, binswap);
-	}
+	for (i = 0; i < txncount; i++)
+		bswap_256(hashbin + 32 + 32 * i, wb->gbttxns[i].hash);
 
 	// Build merkle root (copied from libblkmaker)
 	for (txncount++ ; txncount > 1 ; txncount /= 2) {
@@ -1464,22 +2307,142 @@ static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
 	wb->insert_witness = true;
 }
 
+static void clear_txnset(txnset_t *txnset)
+{
+	txnsetid_t *id, *tmp;
+
+	if (txnset->txn_arena)
+		put_txnarena(txnset->txn_arena);
+	HASH_ITER(hh, txnset->txids, id, tmp) {
+		HASH_DEL(txnset->txids, id);
+		free(id);
+	}
+	free(txnset->ids);
+	memset(txnset, 0, sizeof(txnset_t));
+}
+
+/* Check if the ordered transactions of wb are the same as those of the last
+ * local workbase. Matching wtxids commit to all the transaction data. */
+static bool txnset_unchanged(const txnset_t *txnset, const workbase_t *wb)
+{
+	int i;
+
+	if (!txnset->txn_arena || wb->txns != txnset->txns)
+		return false;
+	for (i = 0; i < wb->txns; i++) {
+		const gbttxn_t *txn = &wb->gbttxns[i];
+
+		if (memcmp(txnset->ids + i * 64, txn->txid, 32) ||
+		    memcmp(txnset->ids + i * 64 + 32, txn->hash, 32))
+			return false;
+	}
+	return true;
+}
+
+/* Store the transaction set of a newly processed local workbase */
+static void save_txnset(txnset_t *txnset, const workbase_t *wb)
+{
+	int i;
+
+	clear_txnset(txnset);
+	if (!wb->txn_arena)
+		return;
+	txnset->ids = ckalloc(wb->txns * 64 + 1);
+	for (i = 0; i < wb->txns; i++) {
+		txnsetid_t *id;
+
+		memcpy(txnset->ids + i * 64, wb->gbttxns[i].txid, 32);
+		memcpy(txnset->ids + i * 64 + 32, wb->gbttxns[i].hash, 32);
+		HASH_FIND(hh, txnset->txids, wb->gbttxns[i].txid, 32, id);
+		if (unlikely(id))
+			continue;
+		id = ckalloc(sizeof(txnsetid_t));
+		memcpy(id->txid, wb->gbttxns[i].txid, 32);
+		memcpy(id->hash, wb->gbttxns[i].hash, 32);
+		HASH_ADD(hh, txnset->txids, txid, 32, id);
+	}
+	txnset->txns = wb->txns;
+	txnset->txn_arena = wb->txn_arena;
+	get_txnarena(txnset->txn_arena);
+	txnset->merkles = wb->merkles;
+	memcpy(txnset->merklehash, wb->merklehash, sizeof(wb->merklehash));
+	memcpy(txnset->merklebin, wb->merklebin, sizeof(wb->merklebin));
+	txnset->insert_witness = wb->insert_witness;
+	memcpy(txnset->witnessdata, wb->witnessdata, sizeof(wb->witnessdata));
+}
+
+/* Set up a local workbase from the unchanged transaction set of the last one,
+ * sharing its transaction data and marking its transactions as still in use
+ * in the transaction table. */
+static void reuse_txnset(sdata_t *sdata, const txnset_t *txnset, workbase_t *wb)
+{
+	txntable_t *txn;
+	int i;
+
+	free(wb->txn_data);
+	wb->txn_arena = txnset->txn_arena;
+	get_txnarena(wb->txn_arena);
+	wb->txn_data = (char *)wb->txn_arena->buf;
+	wb->merkles = txnset->merkles;
+	memcpy(wb->merklehash, txnset->merklehash, sizeof(wb->merklehash));
+	memcpy(wb->merklebin, txnset->merklebin, sizeof(wb->merklebin));
+	wb->merkle_array = json_array();
+	for (i = 0; i < wb->merkles; i++)
+		json_array_append_new(wb->merkle_array, json_string(&wb->merklehash[i][0]));
+	wb->insert_witness = txnset->insert_witness;
+	memcpy(wb->witnessdata, txnset->witnessdata, sizeof(wb->witnessdata));
+
+	ck_wlock(&sdata->txn_lock);
+	for (i = 0; i < wb->txns; i++) {
+		HASH_FIND(hh, sdata->txns, wb->gbttxns[i].hash, 32, txn);
+		if (unlikely(!txn))
+			continue;
+		if (txn->refcount < REFCOUNT_LOCAL)
+			txn->refcount = REFCOUNT_LOCAL;
+		txn->seen = true;
+	}
+	ck_wunlock(&sdata->txn_lock);
+
+	LOGNOTICE("Stored local workbase with %d unchanged transactions", wb->txns);
+}
+
+/* Record the parts of a new template a replay needs to serve an equivalent
+ * one, with previousblockhash back in the byte order bitcoind sent it. */
+static void capture_workbase(const workbase_t *wb, const bool unchanged)
+{
+	char hash_swap[32], tmp[32], prevhash[68];
+	json_t *val;
+	char *buf;
+
+	hex2bin(tmp, wb->prevhash, 32);
+	swap_256(hash_swap, tmp);
+	__bin2hex(prevhash, hash_swap, 32);
+	JSON_CPACK(val, "{ss,ss,ss,si,si,si,sI,ss,si,sb}",
+		   "previousblockhash", prevhash, "target", wb->target, "bits", wb->nbit,
+		   "version", wb->version, "curtime", wb->curtime, "height", wb->height,
+		   "coinbasevalue", wb->coinbasevalue, "flags", wb->flags ? wb->flags : "",
+		   "txns", wb->txns, "unchanged", unchanged);
+	buf = json_dumps(val, JSON_COMPACT);
+	json_decref(val);
+	connector_capture(CAPTURE_REC_WORKBASE, 0, 0, buf, strlen(buf));
+	free(buf);
+}
+
 /* This function assumes it will only receive a valid json gbt base template
  * since checking should have been done earlier, and creates the base template
  * for generating work templates. This is a ckmsgq so all uses of this function
  * are serialised. */
 static void block_update(ckpool_t *ckp, int *prio)
 {
-	bool new_block = false, ret = false;
-	const char *witnessdata_check;
+	bool new_block = false, ret = false, unchanged;
 	sdata_t *sdata = ckp->sdata;
-	json_t *txn_array;
 	txntable_t *txns;
 	int retries = 0;
 	workbase_t *wb;
 
 retry:
-	wb = generator_getbase(ckp);
+	/* New blocks and retries can't use a prefetched template */
+	wb = generator_getbase(ckp, *prio == GEN_PRIORITY || retries);
 	if (unlikely(!wb)) {
 		if (retries++ < 5 || *prio == GEN_PRIORITY) {
 			LOGWARNING("Generator returned failure in update_base, retry #%d", retries);
@@ -1493,22 +2456,34 @@ retry:
 
 	wb->ckp = ckp;
 
-	txn_array = json_object_get(wb->json, "transactions");
-	txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, true);
-
-	wb->insert_witness = false;
+	/* Most templates only differ from the last in their header so reuse
+	 * the transaction data and merkle branches of an unchanged set */
+	unchanged = txnset_unchanged(&sdata->txnset, wb);
+	if (unchanged) {
+		reuse_txnset(sdata, &sdata->txnset, wb);
+		txns = NULL;
+	} else {
+		txns = wb_merkle_bin_txns(ckp, sdata, wb, true);
+		wb->insert_witness = false;
+	}
 
-	witnessdata_check = json_string_value(json_object_get(wb->json, "default_witness_commitment"));
-	if (likely(witnessdata_check)) {
-		LOGDEBUG("Default witness commitment present, adding witness data");
-		gbt_witness_data(wb, txn_array);
+	if (likely(wb->witness_commitment[0])) {
+		if (!unchanged) {
+			LOGDEBUG("Default witness commitment present, adding witness data");
+			gbt_witness_data(wb);
+		}
 		// Verify against the pre-calculated value if it exists. Skip the size/OP_RETURN bytes.
-		if (wb->insert_witness && safecmp(witnessdata_check + 4, wb->witnessdata) != 0)
-			LOGERR("Witness from btcd: %s. Calculated Witness: %s", witnessdata_check + 4, wb->witnessdata);
+		if (wb->insert_witness && safecmp(wb->witness_commitment + 4, wb->witnessdata) != 0)
+			LOGERR("Witness from btcd: %s. Calculated Witness: %s", wb->witness_commitment + 4, wb->witnessdata);
 	}
+	if (!unchanged)
+		save_txnset(&sdata->txnset, wb);
 
 	generate_coinbase(ckp, wb);
 
+	if (ckp->capturefile)
+		capture_workbase(wb, unchanged);
+
 	add_base(ckp, sdata, wb, &new_block);
 
 	if (new_block)
@@ -1521,13 +2496,14 @@ retry:
 	LOGINFO("Broadcast updated stratum base");
 	/* Update transactions after stratum broadcast to not delay
 	 * propagation. */
-	if (likely(txns))
-		update_txns(ckp, sdata, txns, true);
+	if (likely(txns) || unchanged)
+		update_txns(ckp, sdata, txns, NULL, true);
 	/* Reset the update time to avoid stacked low priority notifies. Bring
 	 * forward the next notify in case of a new block. */
 	sdata->update_time = time(NULL);
 	if (new_block)
 		sdata->update_time -= ckp->update_interval / 2;
+	generator_prefetch(ckp, sdata->update_time + ckp->update_interval);
 out:
 
 	cksem_post(&sdata->update_sem);
@@ -1563,8 +2539,8 @@ static void downstream_json(sdata_t *sdata, const json_t *val, const int64_t cli
 		if (client->id == client_id)
 			continue;
 		json_msg = json_deep_copy(val);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckmsg_slab);
+		msg = ckslab_zalloc(smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1605,95 +2581,154 @@ static void request_txns(ckpool_t *ckp, sdata_t *sdata, json_t *txns)
 	}
 }
 
+/* Store the referenced transactions as those of a remote workbase in the form
+ * parsed from a local getblocktemplate, assembling its binary txn_data from
+ * them and dropping the references. */
+static void wb_gbttxns(workbase_t *wb, txnref_t *refs)
+{
+	int i, len = 0, ofs = 0;
+
+	for (i = 0; i < wb->txns; i++)
+		len += refs[i].len;
+	free(wb->gbttxns);
+	if (wb->txn_arena) {
+		put_txnarena(wb->txn_arena);
+		wb->txn_arena = NULL;
+	} else
+		free(wb->txn_data);
+	wb->gbttxns = ckzalloc(sizeof(gbttxn_t) * (wb->txns + 1));
+	wb->txn_data = ckalloc(len + 1);
+	wb->txn_datalen = len;
+
+	for (i = 0; i < wb->txns; i++) {
+		gbttxn_t *txn = &wb->gbttxns[i];
+		txnref_t *ref = &refs[i];
+
+		memcpy(txn->txid, ref->hash, 32);
+		memcpy(txn->hash, txn->txid, 32);
+		txn->ofs = ofs;
+		txn->len = ref->len;
+		memcpy(wb->txn_data + ofs, ref->arena->buf + ref->ofs, ref->len);
+		ofs += ref->len;
+		put_txnarena(ref->arena);
+	}
+}
+
 /* Rebuilds transactions from txnhashes to be able to construct wb_merkle_bins
- * on remote workbases */
+ * on remote workbases. Only references to the data of transactions are taken
+ * under txn_lock, the workbase's txn_data being assembled from them after. */
 static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 {
 	const char *hashes = wb->txn_hashes;
-	json_t *txn_array, *missing_txns;
+	int i, len = 0, found = 0;
 	char hash[68] = {};
+	json_t *missing_txns;
 	bool ret = false;
 	txntable_t *txns;
-	int i, len = 0;
+	txnref_t *refs;
 
 	/* We'll only see this on testnet now */
 	if (unlikely(!wb->txns)) {
 		ret = true;
 		goto out;
 	}
+	/* The count is as sent by the remote, so check it before the hashes
+	 * are scanned by it */
+	if (unlikely(wb->txns < 0)) {
+		LOGERR("Invalid transaction count %d in rebuild_txns", wb->txns);
+		goto out;
+	}
 	if (likely(hashes))
 		len = strlen(hashes);
 	if (!hashes || !len)
 		goto out;
 
-	if (unlikely(len < wb->txns * 65)) {
+	if (unlikely(len < (int64_t)wb->txns * 65)) {
 		LOGERR("Truncated transactions in rebuild_txns only %d long", len);
 		goto out;
 	}
 	ret = true;
-	txn_array = json_array();
+	refs = ckalloc(sizeof(txnref_t) * wb->txns);
 	missing_txns = json_array();
 
 	for (i = 0; i < wb->txns; i++) {
-		json_t *txn_val = NULL;
-		txntable_t *txn;
+		txntable_t *txn, *new;
+		txnarena_t *arena = NULL;
+		uchar hashbin[32], *bin;
 		char *data;
 
 		memcpy(hash, hashes + i * 65, 64);
+		if (unlikely(!hex2bin(hashbin, hash, 32))) {
+			LOGERR("Failed to hex2bin hash in rebuild_txns");
+			ret = false;
+			break;
+		}
 
 		ck_wlock(&sdata->txn_lock);
-		HASH_FIND_STR(sdata->txns, hash, txn);
+		HASH_FIND(hh, sdata->txns, hashbin, 32, txn);
 		if (likely(txn)) {
 			txn->refcount = REFCOUNT_REMOTE;
 			txn->seen = true;
-			JSON_CPACK(txn_val, "{ss,ss}",
-				   "hash", hash, "data", txn->data);
-			json_array_append_new(txn_array, txn_val);
+			__ref_txn(&refs[found++], txn);
 		}
 		ck_wunlock(&sdata->txn_lock);
 
-		if (likely(txn_val))
+		if (likely(txn))
 			continue;
 		/* See if we can find it in our local bitcoind */
 		data = generator_get_txn(ckp, hash);
 		if (!data) {
-			txn_val = json_string(hash);
-			json_array_append_new(missing_txns, txn_val);
+			json_array_append_new(missing_txns, json_string(hash));
 			ret = false;
 			continue;
 		}
+		bin = txn_arena_append(&arena, data, strlen(data));
+		free(data);
+		if (unlikely(!bin)) {
+			LOGWARNING("Failed to decode transaction data in rebuild_txns");
+			if (arena)
+				put_txnarena(arena);
+			ret = false;
+			break;
+		}
+		/* The new transaction takes the creator's reference */
+		new = ckzalloc(sizeof(txntable_t));
+		memcpy(new->hash, hashbin, 32);
+		new->arena = arena;
+		new->len = arena->len;
 
 		/* We've found it, let's add it to the table */
 		ck_wlock(&sdata->txn_lock);
 		/* One last check in case it got added while we dropped the lock */
-		HASH_FIND_STR(sdata->txns, hash, txn);
+		HASH_FIND(hh, sdata->txns, hashbin, 32, txn);
 		if (likely(!txn)) {
-			txn = ckzalloc(sizeof(txntable_t));
-			memcpy(txn->hash, hash, 65);
-			txn->data = data;
-			HASH_ADD_STR(sdata->txns, hash, txn);
+			txn = new;
+			new = NULL;
+			HASH_ADD(hh, sdata->txns, hash, 32, txn);
+			sdata->txns_datalen += txn->len;
 			sdata->txns_generated++;
-		} else {
-			free(data);
 		}
 		txn->refcount = REFCOUNT_REMOTE;
 		txn->seen = true;
-		JSON_CPACK(txn_val, "{ss,ss}",
-			   "hash", hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
+		__ref_txn(&refs[found++], txn);
 		ck_wunlock(&sdata->txn_lock);
+
+		if (unlikely(new))
+			clear_txn(new);
 	}
 
 	if (ret) {
 		wb->incomplete = false;
 		LOGINFO("Rebuilt txns into workbase with %d transactions", i);
-		/* These two structures are regenerated so free their ram */
+		/* This is regenerated so free its ram */
 		json_decref(wb->merkle_array);
-		dealloc(wb->txn_hashes);
-		txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, false);
+		wb_gbttxns(wb, refs);
+		txns = wb_merkle_bin_txns(ckp, sdata, wb, false);
 		if (likely(txns))
-			update_txns(ckp, sdata, txns, false);
+			update_txns(ckp, sdata, txns, NULL, false);
 	} else {
+		for (i = 0; i < found; i++)
+			put_txnarena(refs[i].arena);
 		if (!sdata->wbincomplete) {
 			sdata->wbincomplete = true;
 			if (ckp->proxy)
@@ -1703,7 +2738,7 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		request_txns(ckp, sdata, missing_txns);
 	}
 
-	json_decref(txn_array);
+	free(refs);
 	json_decref(missing_txns);
 out:
 	return ret;
@@ -1721,11 +2756,12 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 {
 	stratum_instance_t *client;
 	ckmsg_t *bulk_send = NULL;
+	json_t *val, *delta_val;
 	workbase_t *tmp, *tmpa;
 	int messages = 0;
 	int64_t skip;
-	json_t *val;
 
+	wb_block_body(wb);
 	ts_realtime(&wb->gentime);
 
 	ck_wlock(&sdata->workbase_lock);
@@ -1736,7 +2772,7 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 			break;
 		if (wb == tmp)
 			continue;
-		if (tmp->readcount)
+		if (__atomic_load_n(&tmp->readcount, __ATOMIC_ACQUIRE))
 			continue;
 		/*  Age old workbases older than 10 minutes old */
 		if (tmp->gentime.tv_sec < wb->gentime.tv_sec - 600) {
@@ -1767,6 +2803,8 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 	skip = subclient(wb->client_id);
 
 	/* Send a copy of this to all OTHER remote trusted servers as well */
+	mutex_lock(&sdata->txnbase_lock);
+	delta_val = __workinfo_delta(sdata, wb, val);
 	ck_rlock(&sdata->instance_lock);
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
 		ckmsg_t *client_msg;
@@ -1776,10 +2814,10 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		/* Don't send remote workinfo back to the source remote */
 		if (client->id == wb->client_id)
 			continue;
-		json_msg = json_deep_copy(val);
+		json_msg = __client_workinfo(sdata, client, wb, val, delta_val);
 		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckmsg_slab);
+		msg = ckslab_zalloc(smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1794,10 +2832,10 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		/* Don't send node workinfo back to the source node */
 		if (client->id == skip)
 			continue;
-		json_msg = json_deep_copy(val);
+		json_msg = __client_workinfo(sdata, client, wb, val, delta_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckmsg_slab);
+		msg = ckslab_zalloc(smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -1805,13 +2843,75 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		messages++;
 	}
 	ck_runlock(&sdata->instance_lock);
-
-	json_decref(val);
-
+	__set_txnbase(sdata, wb, val);
+	/* Queue them in the order they were delta encoded */
 	if (bulk_send) {
 		LOGINFO("Sending remote workinfo to %d other remote servers", messages);
 		ssend_bulk_append(sdata, bulk_send, messages);
 	}
+	mutex_unlock(&sdata->txnbase_lock);
+
+	if (delta_val)
+		json_decref(delta_val);
+	json_decref(val);
+}
+
+/* Rebuild the txn_hashes of a delta encoded workinfo from those of the last
+ * workinfo we received from upstream. */
+static bool txn_undelta(sdata_t *sdata, workbase_t *wb, const json_t *val)
+{
+	const char *parent = sdata->txnparent;
+	json_t *delta, *entry;
+	int64_t parentid = 0;
+	bool ret = false;
+	size_t index;
+	int ofs = 0;
+
+	json_get_int64(&parentid, val, "parentid");
+	if (!parent || parentid != sdata->txnparent_id) {
+		LOGWARNING("Unable to decode workinfo %"PRId64" without parent workinfo %"PRId64,
+			   wb->id, parentid);
+		return ret;
+	}
+	delta = json_object_get(val, "txndelta");
+	wb->txn_hashes = ckzalloc(wb->txns * 65 + 1);
+	memset(wb->txn_hashes, 0x20, wb->txns * 65); // Spaces
+	json_array_foreach(delta, index, entry) {
+		const char *hash = json_string_value(entry);
+		int start, count;
+
+		if (hash) {
+			if (ofs >= wb->txns || strlen(hash) != 64)
+				goto out;
+			memcpy(wb->txn_hashes + ofs++ * 65, hash, 64);
+			continue;
+		}
+		start = json_integer_value(json_array_get(entry, 0));
+		count = json_integer_value(json_array_get(entry, 1));
+		if (start < 0 || count < 1 || start + count > sdata->txnparent_txns ||
+		    ofs + count > wb->txns)
+			goto out;
+		memcpy(wb->txn_hashes + ofs * 65, parent + start * 65, count * 65);
+		ofs += count;
+	}
+	ret = ofs == wb->txns;
+out:
+	if (!ret) {
+		LOGWARNING("Invalid txndelta in workinfo %"PRId64, wb->id);
+		dealloc(wb->txn_hashes);
+	}
+	return ret;
+}
+
+/* Ask upstream to resend its last workinfo in full after one we could not
+ * decode */
+static void request_workinfo(ckpool_t *ckp)
+{
+	json_t *val = json_object();
+
+	LOGWARNING("Requesting full workinfo from upstream pool");
+	upstream_msgtype(ckp, val, SM_REQWORKINFO);
+	json_decref(val);
 }
 
 static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t client_id)
@@ -1843,7 +2943,23 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 	json_strdup(&wb->flags, val, "flags");
 
 	json_intcpy(&wb->txns, val, "txns");
-	json_strdup(&wb->txn_hashes, val, "txn_hashes");
+	if (!client_id && json_object_get(val, "txndelta")) {
+		if (!txn_undelta(sdata, wb, val)) {
+			/* Have the next workinfo sent in full */
+			if (ckp->remote)
+				request_workinfo(ckp);
+			clear_workbase(ckp, wb);
+			return;
+		}
+	} else
+		json_strdup(&wb->txn_hashes, val, "txn_hashes");
+	/* Only upstream sends us delta encoded workinfos */
+	if (wb->txn_hashes && !client_id) {
+		free(sdata->txnparent);
+		sdata->txnparent = strdup(wb->txn_hashes);
+		sdata->txnparent_txns = wb->txns;
+		sdata->txnparent_id = wb->id;
+	}
 	if (!ckp->proxy) {
 		/* This is a workbase from a trusted remote */
 		wb->merkle_array = json_object_dup(val, "merklehash");
@@ -1860,6 +2976,7 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 	json_intcpy(&wb->coinb1len, val, "coinb1len");
 	wb->coinb1bin = ckzalloc(wb->coinb1len);
 	hex2bin(wb->coinb1bin, wb->coinb1, wb->coinb1len);
+	coinb1_midstate(wb);
 	json_strdup(&wb->coinb2, val, "coinb2");
 	json_intcpy(&wb->coinb2len, val, "coinb2len");
 	wb->coinb2bin = ckzalloc(wb->coinb2len);
@@ -1895,11 +3012,7 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	   const uint32_t ntime32, uint32_t version_mask, const char *nonce,
 	   uchar *hash, uchar *swap, int *cblen)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32, benonce32;
-	uchar hash1[32];
-	char data[80];
-	int i;
+	uchar cbhash[32], root[32];
 
 	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
 	*cblen = wb->coinb1len;
@@ -1910,43 +3023,12 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	memcpy(coinbase + *cblen, wb->coinb2bin, wb->coinb2len);
 	*cblen += wb->coinb2len;
 
-	gen_hash((uchar *)coinbase, merkle_root, *cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip_32(swap32, data32);
-
-	/* Copy the cached header binary and insert the merkle root */
-	memcpy(data, wb->headerbin, 80);
-	memcpy(data + 36, merkle_root, 32);
-
-	/* Update nVersion when version_mask is in use */
-	if (version_mask) {
-		version_mask = htobe32(version_mask);
-		data32 = (uint32_t *)data;
-		*data32 |= version_mask;
-	}
-
-	/* Insert the nonce value into the data */
-	hex2bin(&benonce32, nonce, 4);
-	data32 = (uint32_t *)(data + 64 + 12);
-	*data32 = benonce32;
-
-	/* Insert the ntime value into the data */
-	data32 = (uint32_t *)(data + 68);
-	*data32 = htobe32(ntime32);
+	coinbase_hash(wb, (uchar *)coinbase, *cblen, cbhash);
+	merkle_root(root, cbhash, (uchar *)wb->merklebin, wb->merkles);
+	share_header(swap, (uchar *)wb->headerbin, root, version_mask, nonce, ntime32);
 
 	/* Hash the share */
-	data32 = (uint32_t *)data;
-	swap32 = (uint32_t *)swap;
-	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, hash);
+	gen_hash(swap, hash, 80);
 
 	/* Calculate the diff of the share here */
 	return diff_from_target(hash);
@@ -1990,8 +3072,8 @@ static void send_nodes_block(sdata_t *sdata, const json_t *block_val, const int6
 			continue;
 		json_msg = json_deep_copy(block_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_BLOCK]);
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
+		client_msg = ckslab_alloc(ckmsg_slab);
+		msg = ckslab_zalloc(smsg_slab);
 		msg->json_msg = json_msg;
 		msg->client_id = client->id;
 		client_msg->data = msg;
@@ -2030,50 +3112,35 @@ static void send_node_block(ckpool_t *ckp, sdata_t *sdata, const char *enonce1,
 	}
 }
 
-/* Process a block into a message for the generator to submit. Must hold
- * workbase readcount */
+/* Process a block's header and coinbase into a message for the generator to
+ * submit ahead of the workbase's transaction data. Must hold workbase
+ * readcount */
 static char *
 process_block(const workbase_t *wb, const char *coinbase, const int cblen,
 	      const uchar *data, const uchar *hash, uchar *flip32, char *blockhash)
 {
-	char *gbt_block, varint[12];
-	int txns = wb->txns + 1;
-	char hexcoinbase[1024];
+	char *gbt_block, *p;
 
 	flip_32(flip32, hash);
 	__bin2hex(blockhash, flip32, 32);
 
 	/* Message format: "data" */
-	gbt_block = ckzalloc(1024);
+	gbt_block = ckalloc(160 + sizeof(wb->txncount) + cblen * 2 + 1);
 	__bin2hex(gbt_block, data, 80);
-	if (txns < 0xfd) {
-		uint8_t val8 = txns;
-
-		__bin2hex(varint, (const unsigned char *)&val8, 1);
-	} else if (txns <= 0xffff) {
-		uint16_t val16 = htole16(txns);
-
-		strcat(gbt_block, "fd");
-		__bin2hex(varint, (const unsigned char *)&val16, 2);
-	} else {
-		uint32_t val32 = htole32(txns);
-
-		strcat(gbt_block, "fe");
-		__bin2hex(varint, (const unsigned char *)&val32, 4);
-	}
-	strcat(gbt_block, varint);
-	__bin2hex(hexcoinbase, coinbase, cblen);
-	strcat(gbt_block, hexcoinbase);
-	if (wb->txns)
-		realloc_strcat(&gbt_block, wb->txn_data);
+	p = stpcpy(gbt_block + 160, wb->txncount);
+	__bin2hex(p, coinbase, cblen);
 	return gbt_block;
 }
 
-/* Submit block data locally, absorbing and freeing gbt_block */
-static bool local_block_submit(ckpool_t *ckp, char *gbt_block, const uchar *flip32, int height)
+/* Submit block data locally, absorbing and freeing gbt_block. Must hold
+ * workbase readcount */
+static bool local_block_submit(ckpool_t *ckp, const workbase_t *wb, char *gbt_block,
+			       const uchar *flip32)
 {
-	bool ret = generator_submitblock(ckp, gbt_block);
+	bool ret = generator_submitblock(ckp, gbt_block, wb->txn_data,
+					 wb->txns ? wb->txn_datalen : 0);
 	char heighthash[68] = {}, rhash[68] = {};
+	const int height = wb->height;
 	uchar swap256[32];
 
 	free(gbt_block);
@@ -2102,15 +3169,35 @@ static bool local_block_submit(ckpool_t *ckp, char *gbt_block, const uchar *flip
 	return ret;
 }
 
+/* Look up a workbase by id without taking the workbase_lock so share
+ * processing never waits on a new template being added */
 static workbase_t *get_workbase(sdata_t *sdata, const int64_t id)
 {
-	workbase_t *wb;
-
-	ck_wlock(&sdata->workbase_lock);
-	HASH_FIND_I64(sdata->workbases, &id, wb);
+	workbase_t *wb = NULL;
+	wbindex_t *index;
+	int slot, lo, hi;
+
+	slot = wbindex_enter(sdata);
+	index = __atomic_load_n(&sdata->wbindex, __ATOMIC_ACQUIRE);
+	if (likely(index)) {
+		lo = 0;
+		hi = index->count - 1;
+		while (lo <= hi) {
+			int mid = (lo + hi) / 2;
+
+			if (index->wbs[mid]->id < id)
+				lo = mid + 1;
+			else if (index->wbs[mid]->id > id)
+				hi = mid - 1;
+			else {
+				wb = index->wbs[mid];
+				break;
+			}
+		}
+	}
 	if (wb)
-		wb->readcount++;
-	ck_wunlock(&sdata->workbase_lock);
+		__atomic_fetch_add(&wb->readcount, 1, __ATOMIC_RELAXED);
+	wbindex_exit(sdata, slot);
 
 	return wb;
 }
@@ -2128,24 +3215,22 @@ static workbase_t *get_remote_workbase(sdata_t *sdata, const int64_t id, const i
 {
 	workbase_t *wb;
 
-	ck_wlock(&sdata->workbase_lock);
+	ck_rlock(&sdata->workbase_lock);
 	wb = __find_remote_workbase(sdata, id, client_id);
 	if (wb) {
 		if (wb->incomplete)
 			wb = NULL;
 		else
-			wb->readcount++;
+			__atomic_fetch_add(&wb->readcount, 1, __ATOMIC_RELAXED);
 	}
-	ck_wunlock(&sdata->workbase_lock);
+	ck_runlock(&sdata->workbase_lock);
 
 	return wb;
 }
 
-static void put_workbase(sdata_t *sdata, workbase_t *wb)
+static void put_workbase(sdata_t __maybe_unused *sdata, workbase_t *wb)
 {
-	ck_wlock(&sdata->workbase_lock);
-	wb->readcount--;
-	ck_wunlock(&sdata->workbase_lock);
+	__atomic_fetch_sub(&wb->readcount, 1, __ATOMIC_RELEASE);
 }
 
 #define put_remote_workbase(sdata, wb) put_workbase(sdata, wb)
@@ -2234,7 +3319,7 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 
 	/* Now we have enough to assemble a block */
 	gbt_block = process_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
-	ret = local_block_submit(ckp, gbt_block, flip32, wb->height);
+	ret = local_block_submit(ckp, wb, gbt_block, flip32);
 
 	JSON_CPACK(bval, "{si,ss,ss,sI,ss,ss,si,ss,sI,sf,ss,ss,ss,ss}",
 			 "height", wb->height,
@@ -2302,6 +3387,20 @@ static void __kill_instance(sdata_t *sdata, stratum_instance_t *client)
 	DL_APPEND2(sdata->recycled_instances, client, recycled_prev, recycled_next);
 }
 
+/* Queue a user whose stats have changed to be stored by the next statsupdate,
+ * the unlocked check being only a shortcut for users already queued */
+static void dirty_user(sdata_t *sdata, user_instance_t *user)
+{
+	if (__atomic_load_n(&user->dirty, __ATOMIC_RELAXED))
+		return;
+	mutex_lock(&sdata->dirty_lock);
+	if (!user->dirty) {
+		__atomic_store_n(&user->dirty, true, __ATOMIC_RELAXED);
+		DL_APPEND2(sdata->dirty_users, user, dirty_prev, dirty_next);
+	}
+	mutex_unlock(&sdata->dirty_lock);
+}
+
 /* Called with instance_lock held. Note stats.users is protected by
  * instance lock to avoid recursive locking. */
 static void __inc_worker(sdata_t *sdata, user_instance_t *user, worker_instance_t *worker)
@@ -2310,6 +3409,7 @@ static void __inc_worker(sdata_t *sdata, user_instance_t *user, worker_instance_
 	if (!user->workers++)
 		sdata->stats.users++;
 	worker->instance_count++;
+	dirty_user(sdata, user);
 }
 
 static void __dec_worker(sdata_t *sdata, user_instance_t *user, worker_instance_t *worker)
@@ -2318,20 +3418,29 @@ static void __dec_worker(sdata_t *sdata, user_instance_t *user, worker_instance_
 	if (!--user->workers)
 		sdata->stats.users--;
 	worker->instance_count--;
+	dirty_user(sdata, user);
+}
+
+static void __del_session(sdata_t *sdata, session_t *session)
+{
+	HASH_DEL(sdata->disconnected_sessions, session);
+	DL_DELETE(sdata->session_list, session);
+	dealloc(session);
+	sdata->stats.disconnected--;
 }
 
 static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *client)
 {
+	ckpool_t *ckp = sdata->ckp;
 	time_t now_t = time(NULL);
-	session_t *session, *tmp;
+	session_t *session;
 
-	/* Opportunity to age old sessions */
-	HASH_ITER(hh, sdata->disconnected_sessions, session, tmp) {
-		if (now_t - session->added > 600) {
-			HASH_DEL(sdata->disconnected_sessions, session);
-			dealloc(session);
-			sdata->stats.disconnected--;
-		}
+	/* Opportunity to age old sessions, which are only ever looked at from
+	 * the oldest end of the list */
+	while ((session = sdata->session_list) != NULL &&
+	       now_t - session->added > ckp->sessionexpiry) {
+		__del_session(sdata, session);
+		sdata->sessions_expired++;
 	}
 
 	if (!client->enonce1_64 || !client->user_instance || !client->authorised)
@@ -2339,6 +3448,11 @@ static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *clien
 	HASH_FIND_INT(sdata->disconnected_sessions, &client->session_id, session);
 	if (session)
 		return;
+	/* Make room by dropping the oldest sessions */
+	while (ckp->maxsessions && sdata->stats.disconnected >= ckp->maxsessions) {
+		__del_session(sdata, sdata->session_list);
+		sdata->sessions_evicted++;
+	}
 	session = ckalloc(sizeof(session_t));
 	session->enonce1_64 = client->enonce1_64;
 	session->session_id = client->session_id;
@@ -2347,10 +3461,36 @@ static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *clien
 	session->added = now_t;
 	strcpy(session->address, client->address);
 	HASH_ADD_INT(sdata->disconnected_sessions, session_id, session);
+	DL_APPEND(sdata->session_list, session);
 	sdata->stats.disconnected++;
 	sdata->disconnected_generated++;
 }
 
+/* Place client in the idle wheel slot for the minute of when, bounded to
+ * the wheel's next IDLE_HORIZON minutes */
+static void __idle_schedule(sdata_t *sdata, stratum_instance_t *client, const time_t when)
+{
+	int64_t minute = when / 60;
+	int slot;
+
+	if (minute <= sdata->idle_minute)
+		minute = sdata->idle_minute + 1;
+	else if (minute > sdata->idle_minute + IDLE_HORIZON)
+		minute = sdata->idle_minute + IDLE_HORIZON;
+	slot = minute % IDLE_SLOTS;
+	DL_APPEND2(sdata->idle_wheel[slot], client, idle_prev, idle_next);
+	client->idle_slot = slot + 1;
+}
+
+static void __idle_unschedule(sdata_t *sdata, stratum_instance_t *client)
+{
+	if (client->idle_slot && client->idle_slot != IDLE_BUSY)
+		DL_DELETE2(sdata->idle_wheel[client->idle_slot - 1], client, idle_prev, idle_next);
+	client->idle_slot = 0;
+	if (__atomic_exchange_n(&client->idle_counted, false, __ATOMIC_RELAXED))
+		__atomic_fetch_sub(&sdata->idle_clients, 1, __ATOMIC_RELAXED);
+}
+
 /* Removes a client instance we know is on the stratum_instances list and from
  * the user client list if it's been placed on it */
 static void __del_client(sdata_t *sdata, stratum_instance_t *client)
@@ -2358,6 +3498,7 @@ static void __del_client(sdata_t *sdata, stratum_instance_t *client)
 	user_instance_t *user = client->user_instance;
 
 	HASH_DEL(sdata->stratum_instances, client);
+	__idle_unschedule(sdata, client);
 	if (user) {
 		DL_DELETE2(user->clients, client, user_prev, user_next );
 		__dec_worker(sdata, user, client->worker_instance);
@@ -2415,9 +3556,13 @@ static sdata_t *duplicate_sdata(const sdata_t *sdata)
 	dsdata->sshareq = sdata->sshareq;
 	dsdata->sauthq = sdata->sauthq;
 	dsdata->stxnq = sdata->stxnq;
+	dsdata->sharelogq = sdata->sharelogq;
 
 	/* Give the sbuproxy its own workbase list and lock */
 	cklock_init(&dsdata->workbase_lock);
+	mutex_init(&dsdata->wbsync_lock);
+	cklock_init(&dsdata->share_lock);
+	mutex_init(&dsdata->share_slab_lock);
 	cksem_init(&dsdata->update_sem);
 	cksem_post(&dsdata->update_sem);
 	return dsdata;
@@ -3029,6 +4174,7 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	json_strcpy(wb->coinb1, val, "coinbase1");
 	hex2bin(wb->coinb1bin, wb->coinb1, wb->coinb1len);
 	wb->height = get_sernumber(wb->coinb1bin + 42);
+	coinb1_midstate(wb);
 	json_strdup(&wb->coinb2, val, "coinbase2");
 	wb->coinb2len = strlen(wb->coinb2) / 2;
 	wb->coinb2bin = ckalloc(wb->coinb2len);
@@ -3172,15 +4318,23 @@ static void free_proxy(ckpool_t *ckp, proxy_t *proxy)
 
 	/* Delete any shares in the proxy's hashtable. */
 	if (dsdata) {
-		share_t *share, *tmpshare;
+		share_partition_t *part, *tmppart, *parts = NULL;
+		share_slab_t *slab, *tmpslab;
 		workbase_t *wb, *tmpwb;
 
-		mutex_lock(&dsdata->share_lock);
-		HASH_ITER(hh, dsdata->shares, share, tmpshare) {
-			HASH_DEL(dsdata->shares, share);
-			dealloc(share);
+		ck_wlock(&dsdata->share_lock);
+		HASH_ITER(hh, dsdata->share_partitions, part, tmppart) {
+			HASH_DEL(dsdata->share_partitions, part);
+			part->next = parts;
+			parts = part;
+		}
+		ck_wunlock(&dsdata->share_lock);
+		free_share_partitions(dsdata, parts);
+
+		DL_FOREACH_SAFE(dsdata->share_slabs, slab, tmpslab) {
+			DL_DELETE(dsdata->share_slabs, slab);
+			free(slab);
 		}
-		mutex_unlock(&dsdata->share_lock);
 
 		/* Do we need to check readcount here if freeing the proxy? */
 		ck_wlock(&dsdata->workbase_lock);
@@ -3188,6 +4342,11 @@ static void free_proxy(ckpool_t *ckp, proxy_t *proxy)
 			HASH_DEL(dsdata->workbases, wb);
 			clear_workbase(ckp, wb);
 		}
+		HASH_ITER(hh, dsdata->retired_workbases, wb, tmpwb) {
+			HASH_DEL(dsdata->retired_workbases, wb);
+			clear_workbase(ckp, wb);
+		}
+		free(dsdata->wbindex);
 		ck_wunlock(&dsdata->workbase_lock);
 	}
 
@@ -3422,6 +4581,7 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 
 	ck_wlock(&sdata->instance_lock);
 	HASH_ADD_I64(sdata->stratum_instances, id, client);
+	__idle_schedule(sdata, client, client->start_time + 60);
 	return client;
 }
 
@@ -3434,13 +4594,14 @@ static uint64_t disconnected_sessionid_exists(sdata_t *sdata, const int session_
 
 	ck_wlock(&sdata->instance_lock);
 	HASH_FIND_INT(sdata->disconnected_sessions, &session_id, session);
-	if (!session)
+	if (!session) {
+		sdata->session_misses++;
 		goto out_unlock;
-	HASH_DEL(sdata->disconnected_sessions, session);
-	sdata->stats.disconnected--;
+	}
+	sdata->session_hits++;
 	ret = session->enonce1_64;
 	old_id = session->client_id;
-	dealloc(session);
+	__del_session(sdata, session);
 out_unlock:
 	ck_wunlock(&sdata->instance_lock);
 
@@ -3479,6 +4640,7 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 	sdata_t *ckp_sdata = ckp->sdata;
 	stratum_instance_t *client, *tmp;
 	ckmsg_t *bulk_send = NULL;
+	ckshared_t *shared;
 	int messages = 0;
 
 	if (unlikely(!val)) {
@@ -3491,6 +4653,10 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 		return;
 	}
 
+	/* Serialise the message once for all local clients, only subclients
+	 * needing their own copy with the node.method added */
+	shared = create_ckshared(json_dumps(val, JSON_EOL | JSON_COMPACT));
+
 	ck_rlock(&ckp_sdata->instance_lock);
 	HASH_ITER(hh, ckp_sdata->stratum_instances, client, tmp) {
 		ckmsg_t *client_msg;
@@ -3506,11 +4672,16 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 		if (msg_type == SM_MSG && !client->messages)
 			continue;
 
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
-		if (subclient(client->id))
-			json_set_string(val, "node.method", stratum_msgs[msg_type]);
-		msg->json_msg = json_deep_copy(val);
+		client_msg = ckslab_alloc(ckmsg_slab);
+		msg = ckslab_zalloc(smsg_slab);
+		if (subclient(client->id)) {
+			msg->json_msg = json_deep_copy(val);
+			json_set_string(msg->json_msg, "node.method", stratum_msgs[msg_type]);
+		} else {
+			/* Not yet visible to any other thread */
+			shared->refs++;
+			msg->shared = shared;
+		}
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
@@ -3522,10 +4693,13 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 
 	if (likely(bulk_send))
 		ssend_bulk_append(sdata, bulk_send, messages);
+	put_ckshared(shared);
 }
 
-static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
-			     const int msg_type)
+/* Share results of tokenised shares pass on the stamp of their connector read
+ * to time the rest of their way back to the client. */
+static void stratum_add_timed_send(sdata_t *sdata, json_t *val, const int64_t client_id,
+				   const int msg_type, const int64_t stamp)
 {
 	ckpool_t *ckp = sdata->ckp;
 	int64_t remote_id;
@@ -3552,13 +4726,23 @@ static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_i
 		dec_instance_ref(sdata, remote);
 	}
 	LOGDEBUG("Sending stratum message %s", stratum_msgs[msg_type]);
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = ckslab_zalloc(smsg_slab);
 	msg->json_msg = val;
 	msg->client_id = client_id;
+	if (stamp) {
+		msg->stamp = stamp;
+		msg->queued = monotonic_ns();
+	}
 	if (likely(ckmsgq_add(sdata->ssends, msg)))
 		return;
 	json_decref(msg->json_msg);
-	free(msg);
+	ckslab_free(smsg_slab, msg);
+}
+
+static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
+			     const int msg_type)
+{
+	stratum_add_timed_send(sdata, val, client_id, msg_type, 0);
 }
 
 static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
@@ -3648,6 +4832,7 @@ static void reset_bestshares(sdata_t *sdata)
 		DL_FOREACH(user->worker_instances, worker) {
 			worker->best_diff = 0;
 		}
+		dirty_user(sdata, user);
 	}
 	ck_runlock(&sdata->instance_lock);
 }
@@ -3669,25 +4854,76 @@ static user_instance_t *user_by_workername(sdata_t *sdata, const char *workernam
 
 static worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, const char *workername);
 
+/* Rates are no longer decayed once a minute while idle, so decay f by the
+ * whole minutes of tdiff as though they had been, with no shares in each
+ * minute dividing it by the same factor. */
+static double idle_rate(double f, const double tdiff, const double interval)
+{
+	double minutes = floor(tdiff / 60);
+
+	if (minutes < 1 || !f)
+		return f;
+	f *= pow(2.0 - 1 / exp(60 / interval), -minutes);
+	if (unlikely(f < 2E-16))
+		f = 0;
+	return f;
+}
+
+/* The rates of a user or worker as read at a given time */
+typedef struct rates {
+	double dsps1;
+	double dsps5;
+	double dsps60;
+	double dsps1440;
+	double dsps10080;
+} rates_t;
+
+static void user_rates(const user_instance_t *user, const tv_t *now, rates_t *rates)
+{
+	double tdiff = tvdiff((tv_t *)now, (tv_t *)&user->last_decay);
+
+	rates->dsps1 = idle_rate(user->dsps1, tdiff, MIN1);
+	rates->dsps5 = idle_rate(user->dsps5, tdiff, MIN5);
+	rates->dsps60 = idle_rate(user->dsps60, tdiff, HOUR);
+	rates->dsps1440 = idle_rate(user->dsps1440, tdiff, DAY);
+	rates->dsps10080 = idle_rate(user->dsps10080, tdiff, WEEK);
+}
+
+static void worker_rates(const worker_instance_t *worker, const tv_t *now, rates_t *rates)
+{
+	double tdiff = tvdiff((tv_t *)now, (tv_t *)&worker->last_decay);
+
+	rates->dsps1 = idle_rate(worker->dsps1, tdiff, MIN1);
+	rates->dsps5 = idle_rate(worker->dsps5, tdiff, MIN5);
+	rates->dsps60 = idle_rate(worker->dsps60, tdiff, HOUR);
+	rates->dsps1440 = idle_rate(worker->dsps1440, tdiff, DAY);
+	rates->dsps10080 = idle_rate(worker->dsps10080, tdiff, WEEK);
+}
+
 static json_t *worker_stats(const worker_instance_t *worker)
 {
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
+	rates_t rates;
 	json_t *val;
 	double ghs;
+	tv_t now;
+
+	tv_time(&now);
+	worker_rates(worker, &now, &rates);
 
-	ghs = worker->dsps1 * nonces;
+	ghs = rates.dsps1 * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
 
-	ghs = worker->dsps5 * nonces;
+	ghs = rates.dsps5 * nonces;
 	suffix_string(ghs, suffix5, 16, 0);
 
-	ghs = worker->dsps60 * nonces;
+	ghs = rates.dsps60 * nonces;
 	suffix_string(ghs, suffix60, 16, 0);
 
-	ghs = worker->dsps1440 * nonces;
+	ghs = rates.dsps1440 * nonces;
 	suffix_string(ghs, suffix1440, 16, 0);
 
-	ghs = worker->dsps10080 * nonces;
+	ghs = rates.dsps10080 * nonces;
 	suffix_string(ghs, suffix10080, 16, 0);
 
 	JSON_CPACK(val, "{ss,ss,ss,ss,ss}",
@@ -3702,22 +4938,27 @@ static json_t *worker_stats(const worker_instance_t *worker)
 static json_t *user_stats(const user_instance_t *user)
 {
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
+	rates_t rates;
 	json_t *val;
 	double ghs;
+	tv_t now;
+
+	tv_time(&now);
+	user_rates(user, &now, &rates);
 
-	ghs = user->dsps1 * nonces;
+	ghs = rates.dsps1 * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
 
-	ghs = user->dsps5 * nonces;
+	ghs = rates.dsps5 * nonces;
 	suffix_string(ghs, suffix5, 16, 0);
 
-	ghs = user->dsps60 * nonces;
+	ghs = rates.dsps60 * nonces;
 	suffix_string(ghs, suffix60, 16, 0);
 
-	ghs = user->dsps1440 * nonces;
+	ghs = rates.dsps1440 * nonces;
 	suffix_string(ghs, suffix1440, 16, 0);
 
-	ghs = user->dsps10080 * nonces;
+	ghs = rates.dsps10080 * nonces;
 	suffix_string(ghs, suffix10080, 16, 0);
 
 	JSON_CPACK(val, "{ss,ss,ss,ss,ss,sI,sI}",
@@ -3846,23 +5087,99 @@ static void broadcast_ping(sdata_t *sdata)
 
 static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
 {
-	int64_t memsize, generated;
+	int64_t latencies[CKRING_BUCKETS], depths[CKRING_BUCKETS];
+	int64_t memsize, generated, maxdepth;
+	ckring_t *ring = ckmsgq->ring;
+	json_t *latency, *depth;
+	int objects, i, r, rings;
 	ckmsg_t *msg;
-	int objects;
 
-	mutex_lock(ckmsgq->lock);
-	DL_COUNT(ckmsgq->msgs, msg, objects);
-	generated = ckmsgq->messages;
-	mutex_unlock(ckmsgq->lock);
+	if (!ring) {
+		mutex_lock(ckmsgq->lock);
+		DL_COUNT(ckmsgq->msgs, msg, objects);
+		generated = ckmsgq->messages;
+		mutex_unlock(ckmsgq->lock);
+
+		memsize = (sizeof(ckmsg_t) + size) * objects;
+		JSON_CPACK(*val, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
+		return;
+	}
+
+	/* Ring stats are read unlocked and only approximate. Affine queues
+	 * have a ring per thread which are summed. */
+	rings = ckmsgq->affine ? ckmsgq->count : 1;
+	objects = generated = maxdepth = 0;
+	memset(latencies, 0, sizeof(latencies));
+	memset(depths, 0, sizeof(depths));
+	for (r = 0; r < rings; r++) {
+		ring = ckmsgq[r].ring;
+		objects += ring->head - ring->tail;
+		generated += ckmsgq[r].messages;
+		if (ring->maxdepth > maxdepth)
+			maxdepth = ring->maxdepth;
+		for (i = 0; i < CKRING_BUCKETS; i++) {
+			latencies[i] += ring->latency[i];
+			depths[i] += ring->depth[i];
+		}
+	}
+	memsize = (sizeof(ckring_t) + sizeof(ckring_cell_t) * CKRING_SIZE) * rings + size * objects;
+	latency = json_array();
+	depth = json_array();
+	for (i = 0; i < CKRING_BUCKETS; i++) {
+		json_array_append_new(latency, json_integer(latencies[i]));
+		json_array_append_new(depth, json_integer(depths[i]));
+	}
+	/* Histogram buckets are log2, bucket n counting values < 2^n */
+	JSON_CPACK(*val, "{si,si,sI,so,so,sI}", "count", objects, "memory", memsize,
+		   "generated", generated, "latency_us", latency, "depth", depth,
+		   "maxdepth", maxdepth);
+}
+
+/* Pool stats are read unlocked, so a scrape may mix values from adjacent
+ * updates. Share totals are the accounted ones, folded in by the stats thread,
+ * as the unaccounted ones are zeroed before being added. */
+void stratifier_metrics(ckpool_t *ckp, char **buf)
+{
+	sdata_t *sdata = ckp->sdata;
+	pool_stats_t *stats = &sdata->stats;
 
-	memsize = (sizeof(ckmsg_t) + size) * objects;
-	JSON_CPACK(*val, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
+	add_metric(buf, "gauge", "users", NULL, stats->users);
+	add_metric(buf, "gauge", "workers", NULL, stats->workers);
+	add_metric(buf, "gauge", "disconnected", NULL, stats->disconnected);
+	add_metric(buf, "gauge", "remote_users", NULL, stats->remote_users);
+	add_metric(buf, "gauge", "remote_workers", NULL, stats->remote_workers);
+	add_metric(buf, "gauge", "shares_per_second", "window=\"1m\"", stats->sps1);
+	add_metric(buf, NULL, "shares_per_second", "window=\"5m\"", stats->sps5);
+	add_metric(buf, NULL, "shares_per_second", "window=\"15m\"", stats->sps15);
+	add_metric(buf, NULL, "shares_per_second", "window=\"1h\"", stats->sps60);
+	add_metric(buf, "gauge", "hashrate", "window=\"1m\"", stats->dsps1 * nonces);
+	add_metric(buf, NULL, "hashrate", "window=\"5m\"", stats->dsps5 * nonces);
+	add_metric(buf, NULL, "hashrate", "window=\"15m\"", stats->dsps15 * nonces);
+	add_metric(buf, NULL, "hashrate", "window=\"1h\"", stats->dsps60 * nonces);
+	add_metric(buf, NULL, "hashrate", "window=\"6h\"", stats->dsps360 * nonces);
+	add_metric(buf, NULL, "hashrate", "window=\"1d\"", stats->dsps1440 * nonces);
+	add_metric(buf, NULL, "hashrate", "window=\"7d\"", stats->dsps10080 * nonces);
+	add_metric(buf, "counter", "shares_total", NULL, stats->accounted_shares);
+	add_metric(buf, "counter", "diff_shares_total", NULL, stats->accounted_diff_shares);
+	add_metric(buf, "counter", "diff_rejects_total", NULL, stats->accounted_rejects);
+	add_metric(buf, "gauge", "network_diff", NULL, stats->network_diff);
+	add_metric(buf, "gauge", "best_diff", NULL, stats->best_diff);
+	add_metric(buf, "counter", "workbases_generated_total", NULL, sdata->workbases_generated);
+	add_metric(buf, "counter", "txns_generated_total", NULL, sdata->txns_generated);
+	add_metric(buf, "counter", "stratum_instances_generated_total", NULL, sdata->stratum_generated);
+	add_metric(buf, "counter", "disconnected_generated_total", NULL, sdata->disconnected_generated);
+	add_metric(buf, "counter", "session_resumes_total", "result=\"hit\"", sdata->session_hits);
+	add_metric(buf, NULL, "session_resumes_total", "result=\"miss\"", sdata->session_misses);
+	add_metric(buf, "counter", "sessions_expired_total", NULL, sdata->sessions_expired);
+	add_metric(buf, "counter", "sessions_evicted_total", NULL, sdata->sessions_evicted);
+	add_metric(buf, "counter", "shares_generated_total", NULL, sdata->shares_generated);
 }
 
 char *stratifier_stats(ckpool_t *ckp, void *data)
 {
 	json_t *val = json_object(), *subval;
 	int64_t memsize, generated;
+	share_partition_t *part;
 	sdata_t *sdata = data;
 	int objects;
 	char *buf;
@@ -3912,27 +5229,46 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	generated = sdata->disconnected_generated;
 	memsize = SAFE_HASH_OVERHEAD(sdata->disconnected_sessions);
 	memsize += sizeof(session_t) * sdata->stats.disconnected;
-	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
+	JSON_CPACK(subval, "{si,si,sI,sI,sI,sI,sI}", "count", objects, "memory", memsize,
+		   "generated", generated, "resumed", sdata->session_hits,
+		   "missed", sdata->session_misses, "expired", sdata->sessions_expired,
+		   "evicted", sdata->sessions_evicted);
 	json_set_object(val, "disconnected", subval);
 	ck_runlock(&sdata->instance_lock);
 
-	mutex_lock(&sdata->share_lock);
+	ck_rlock(&sdata->share_lock);
 	generated = sdata->shares_generated;
-	objects = HASH_COUNT(sdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(sdata->shares) + sizeof(share_t) * objects;
-	mutex_unlock(&sdata->share_lock);
+	objects = 0;
+	memsize = SAFE_HASH_OVERHEAD(sdata->share_partitions);
+	for (part = sdata->share_partitions; part; part = part->hh.next) {
+		share_slab_t *slab;
+
+		mutex_lock(&part->lock);
+		generated += part->generated;
+		objects += part->count;
+		memsize += sizeof(share_partition_t) + SAFE_HASH_OVERHEAD(part->shares);
+		DL_FOREACH(part->slabs, slab)
+			memsize += sizeof(share_slab_t);
+		mutex_unlock(&part->lock);
+	}
+	ck_runlock(&sdata->share_lock);
+	mutex_lock(&sdata->share_slab_lock);
+	memsize += sizeof(share_slab_t) * sdata->free_share_slabs;
+	mutex_unlock(&sdata->share_slab_lock);
 
 	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "shares", subval);
 
 	ck_rlock(&sdata->txn_lock);
 	objects = HASH_COUNT(sdata->txns);
-	memsize = SAFE_HASH_OVERHEAD(sdata->txns) + sizeof(txntable_t) * objects;
+	memsize = SAFE_HASH_OVERHEAD(sdata->txns) + sizeof(txntable_t) * objects + sdata->txns_datalen;
 	generated = sdata->txns_generated;
 	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "transactions", subval);
 	ck_runlock(&sdata->txn_lock);
 
+	json_set_object(val, "slabs", ckslab_stats());
+
 	ckmsgq_stats(sdata->ssends, sizeof(smsg_t), &subval);
 	json_set_object(val, "ssends", subval);
 	/* Don't know exactly how big the string is so just count the pointer for now */
@@ -3940,6 +5276,17 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_set_object(val, "srecvs", subval);
 	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval);
 	json_set_object(val, "stxnq", subval);
+	ckmsgq_stats(sdata->sshareq, sizeof(json_params_t), &subval);
+	json_set_object(val, "sshareq", subval);
+	ckmsgq_stats(sdata->sauthq, sizeof(json_params_t), &subval);
+	json_set_object(val, "sauthq", subval);
+	if (sdata->sharelogq) {
+		ckmsgq_stats(sdata->sharelogq, sizeof(sharelog_t), &subval);
+		mutex_lock(&sdata->sharelog_lock);
+		json_set_int64(subval, "spilled", sdata->sharelogs_spilled);
+		mutex_unlock(&sdata->sharelog_lock);
+		json_set_object(val, "sharelogq", subval);
+	}
 
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
@@ -4000,136 +5347,287 @@ static void reconnect_client_id(sdata_t *sdata, const int64_t client_id)
 
 /* API commands */
 
-static json_t *userinfo(const user_instance_t *user)
-{
-	json_t *val;
+/* Seconds an API snapshot is listed from before it is retaken */
+#define API_SNAPSHOT_INTERVAL 1
+
+static void *snapshot_grow(void *ptr, int *size, const int need, const size_t len)
+{
+	if (likely(need <= *size))
+		return ptr;
+	*size = MAX(need, *size * 2);
+	ptr = realloc(ptr, *size * len);
+	if (unlikely(!ptr))
+		quit(1, "Failed to realloc api snapshot to %d entries", *size);
+	return ptr;
+}
+
+/* Copy str into the strings arena, returning its offset */
+static int snapshot_string(api_snapshot_t *snap, const char *str)
+{
+	int len, ofs = snap->strlen;
+
+	if (!str)
+		str = "";
+	len = strlen(str) + 1;
+	snap->strings = snapshot_grow(snap->strings, &snap->strsize, ofs + len, 1);
+	memcpy(snap->strings + ofs, str, len);
+	snap->strlen += len;
+	return ofs;
+}
+
+static void copy_user(api_user_t *u, const user_instance_t *user, const tv_t *now)
+{
+	rates_t rates;
+
+	user_rates(user, now, &rates);
+	u->user = user;
+	u->workers = user->workers;
+	u->best_diff = user->best_diff;
+	u->dsps1 = rates.dsps1;
+	u->dsps5 = rates.dsps5;
+	u->dsps60 = rates.dsps60;
+	u->dsps1440 = rates.dsps1440;
+	u->dsps10080 = rates.dsps10080;
+	u->last_share = user->last_share.tv_sec;
+}
+
+static void copy_worker(api_worker_t *w, const user_instance_t *user, const worker_instance_t *worker,
+			const tv_t *now)
+{
+	rates_t rates;
+
+	worker_rates(worker, now, &rates);
+	w->user = user;
+	w->worker = worker;
+	w->dsps1 = rates.dsps1;
+	w->dsps5 = rates.dsps5;
+	w->dsps60 = rates.dsps60;
+	w->dsps1440 = rates.dsps1440;
+	w->last_share = worker->last_share.tv_sec;
+	w->best_diff = worker->best_diff;
+	w->mindiff = worker->mindiff;
+	w->idle = now->tv_sec - worker->last_share.tv_sec > 60;
+}
+
+static void copy_client(api_snapshot_t *snap, api_client_t *c, stratum_instance_t *client,
+			tv_t *now)
+{
+	double tdiff = tvdiff(now, &client->last_decay);
+
+	c->user = client->user_instance;
+	c->worker = client->worker_instance;
+	c->id = client->id;
+	memcpy(c->enonce1, client->enonce1, sizeof(c->enonce1));
+	memcpy(c->enonce1var, client->enonce1var, sizeof(c->enonce1var));
+	c->enonce1_64 = client->enonce1_64;
+	c->diff = client->diff;
+	c->dsps1 = idle_rate(client->dsps1, tdiff, MIN1);
+	c->dsps5 = idle_rate(client->dsps5, tdiff, MIN5);
+	c->dsps60 = idle_rate(client->dsps60, tdiff, HOUR);
+	c->dsps1440 = idle_rate(client->dsps1440, tdiff, DAY);
+	c->dsps10080 = idle_rate(client->dsps10080, tdiff, WEEK);
+	c->last_share = client->last_share.tv_sec;
+	c->start_time = client->start_time;
+	memcpy(c->address, client->address, sizeof(c->address));
+	c->subscribed = client->subscribed;
+	c->authorised = client->authorised;
+	c->idle = client->idle;
+	c->useragent = snapshot_string(snap, client->useragent);
+	c->workername = snapshot_string(snap, client->workername);
+	c->user_id = client->user_id;
+	c->server = client->server;
+	c->best_diff = client->best_diff;
+	c->proxyid = client->proxyid;
+	c->subproxyid = client->subproxyid;
+}
+
+/* Retake the snapshot if it is older than API_SNAPSHOT_INTERVAL. The
+ * instance_lock is only held for the flat copies, with all json building,
+ * filtering and paging done from the snapshot afterwards. */
+static api_snapshot_t *api_snapshot(sdata_t *sdata)
+{
+	api_snapshot_t *snap = &sdata->api_snapshot;
+	stratum_instance_t *client;
+	worker_instance_t *worker;
+	user_instance_t *user;
+	time_t now = time(NULL);
+	tv_t now_t;
 
-	JSON_CPACK(val, "{ss,si,si,sf,sf,sf,sf,sf,sf,si}",
-		   "user", user->username, "id", user->id, "workers", user->workers,
-	    "bestdiff", user->best_diff, "dsps1", user->dsps1, "dsps5", user->dsps5,
-	    "dsps60", user->dsps60, "dsps1440", user->dsps1440, "dsps10080", user->dsps10080,
-	    "lastshare", user->last_share.tv_sec);
-	return val;
+	if (snap->stamp && now - snap->stamp < API_SNAPSHOT_INTERVAL)
+		return snap;
+	tv_time(&now_t);
+	snap->nusers = snap->nworkers = snap->nclients = snap->strlen = 0;
+
+	ck_rlock(&sdata->instance_lock);
+	for (user = sdata->user_instances; user; user = user->hh.next) {
+		snap->users = snapshot_grow(snap->users, &snap->maxusers, snap->nusers + 1,
+					    sizeof(api_user_t));
+		copy_user(&snap->users[snap->nusers++], user, &now_t);
+		DL_FOREACH(user->worker_instances, worker) {
+			snap->workers = snapshot_grow(snap->workers, &snap->maxworkers,
+						      snap->nworkers + 1, sizeof(api_worker_t));
+			copy_worker(&snap->workers[snap->nworkers++], user, worker, &now_t);
+		}
+	}
+	for (client = sdata->stratum_instances; client; client = client->hh.next) {
+		snap->clients = snapshot_grow(snap->clients, &snap->maxclients, snap->nclients + 1,
+					      sizeof(api_client_t));
+		copy_client(snap, &snap->clients[snap->nclients++], client, &now_t);
+	}
+	ck_runlock(&sdata->instance_lock);
+
+	snap->stamp = now;
+	return snap;
 }
 
-static void getuser(sdata_t *sdata, const char *buf, int *sockd)
+/* Optional parameters of the listing commands */
+typedef struct api_filter {
+	int offset;
+	int limit;
+	char *username;
+	char *workername;
+	int idle; /* -1 for either */
+} api_filter_t;
+
+/* Parse any json parameters following the command in buf of offset and limit
+ * for paging, and user, worker and idle to filter on. A key named required
+ * must be present. Returns false with res set on failure. */
+static bool api_filter(const char *buf, api_filter_t *filter, const char *required, json_t **res)
 {
-	json_t *val = NULL, *res = NULL;
-	char *username = NULL;
-	user_instance_t *user;
 	json_error_t err_val;
+	json_t *val;
+	bool idle;
 
-	val = json_loads(buf, 0, &err_val);
-	if (unlikely(!val)) {
-		res = json_encode_errormsg(&err_val);
-		goto out;
+	memset(filter, 0, sizeof(api_filter_t));
+	filter->limit = INT_MAX;
+	filter->idle = -1;
+	while (*buf && *buf != '{')
+		buf++;
+	if (*buf) {
+		val = json_loads(buf, 0, &err_val);
+		if (unlikely(!val)) {
+			*res = json_encode_errormsg(&err_val);
+			return false;
+		}
+		json_get_int(&filter->offset, val, "offset");
+		json_get_int(&filter->limit, val, "limit");
+		json_get_string(&filter->username, val, "user");
+		json_get_string(&filter->workername, val, "worker");
+		if (json_get_bool(&idle, val, "idle"))
+			filter->idle = idle;
+		json_decref(val);
 	}
-	if (!json_get_string(&username, val, "user")) {
-		res = json_errormsg("Failed to find user key");
-		goto out;
+	if (filter->offset < 0)
+		filter->offset = 0;
+	if (filter->limit < 0)
+		filter->limit = INT_MAX;
+	if (!required)
+		return true;
+	if (!strcmp(required, "user") && (!filter->username || !strlen(filter->username))) {
+		*res = json_errormsg("Failed to find user key");
+		return false;
 	}
-	if (!strlen(username)) {
-		res = json_errormsg("Zero length user key");
-		goto out;
+	if (!strcmp(required, "worker") && (!filter->workername || !strlen(filter->workername))) {
+		*res = json_errormsg("Failed to find worker key");
+		return false;
 	}
-	user = get_user(sdata, username);
-	res = userinfo(user);
-out:
-	if (val)
-		json_decref(val);
-	free(username);
-	send_api_response(res, *sockd);
+	return true;
 }
 
-static void userclients(sdata_t *sdata, const char *buf, int *sockd)
+static bool filter_match(const api_filter_t *filter, const user_instance_t *user,
+			 const worker_instance_t *worker, const bool idle)
 {
-	json_t *val = NULL, *res = NULL, *client_arr;
-	stratum_instance_t *client;
-	char *username = NULL;
-	user_instance_t *user;
-	json_error_t err_val;
+	if (filter->username && (!user || strcmp(user->username, filter->username)))
+		return false;
+	if (filter->workername && (!worker || strcmp(worker->workername, filter->workername)))
+		return false;
+	if (filter->idle != -1 && idle != filter->idle)
+		return false;
+	return true;
+}
 
-	val = json_loads(buf, 0, &err_val);
-	if (unlikely(!val)) {
-		res = json_encode_errormsg(&err_val);
-		goto out;
-	}
-	if (!json_get_string(&username, val, "user")) {
-		res = json_errormsg("Failed to find user key");
-		goto out;
-	}
-	if (!strlen(username)) {
-		res = json_errormsg("Zero length user key");
-		goto out;
-	}
-	user = get_user(sdata, username);
-	client_arr = json_array();
+/* Is the matched'th entry within the page requested */
+static bool filter_page(const api_filter_t *filter, const int matched)
+{
+	return matched >= filter->offset && matched - filter->offset < filter->limit;
+}
 
-	ck_rlock(&sdata->instance_lock);
-	DL_FOREACH2(user->clients, client, user_next) {
-		json_array_append_new(client_arr, json_integer(client->id));
-	}
-	ck_runlock(&sdata->instance_lock);
+static json_t *filter_response(const api_snapshot_t *snap, api_filter_t *filter, const char *key,
+			       json_t *arr, const int total)
+{
+	json_t *val = json_object();
 
-	JSON_CPACK(res, "{ss,so}", "user", username, "clients", client_arr);
-out:
-	if (val)
-		json_decref(val);
-	free(username);
-	send_api_response(res, *sockd);
+	if (filter->username)
+		json_set_string(val, "user", filter->username);
+	if (filter->workername)
+		json_set_string(val, "worker", filter->workername);
+	json_set_object(val, key, arr);
+	json_set_int(val, "total", total);
+	json_set_int(val, "offset", filter->offset);
+	json_set_int64(val, "snapshot", snap->stamp);
+	return val;
 }
 
-static void workerclients(sdata_t *sdata, const char *buf, int *sockd)
+static void filter_free(api_filter_t *filter)
 {
-	json_t *val = NULL, *res = NULL, *client_arr;
-	char *tmp, *username, *workername = NULL;
-	stratum_instance_t *client;
+	dealloc(filter->username);
+	dealloc(filter->workername);
+}
+
+static json_t *userinfo(const api_user_t *u)
+{
+	json_t *val;
+
+	JSON_CPACK(val, "{ss,si,si,sf,sf,sf,sf,sf,sf,si}",
+		   "user", u->user->username, "id", u->user->id, "workers", u->workers,
+	    "bestdiff", u->best_diff, "dsps1", u->dsps1, "dsps5", u->dsps5,
+	    "dsps60", u->dsps60, "dsps1440", u->dsps1440, "dsps10080", u->dsps10080,
+	    "lastshare", u->last_share);
+	return val;
+}
+
+static void getuser(sdata_t *sdata, const char *buf, int *sockd)
+{
+	json_t *val = NULL, *res = NULL;
+	char *username = NULL;
 	user_instance_t *user;
 	json_error_t err_val;
+	api_user_t u;
+	tv_t now;
 
 	val = json_loads(buf, 0, &err_val);
 	if (unlikely(!val)) {
 		res = json_encode_errormsg(&err_val);
 		goto out;
 	}
-	if (!json_get_string(&workername, val, "worker")) {
-		res = json_errormsg("Failed to find worker key");
+	if (!json_get_string(&username, val, "user")) {
+		res = json_errormsg("Failed to find user key");
 		goto out;
 	}
-	if (!strlen(workername)) {
-		res = json_errormsg("Zero length worker key");
+	if (!strlen(username)) {
+		res = json_errormsg("Zero length user key");
 		goto out;
 	}
-	tmp = strdupa(workername);
-	username = strsep(&tmp, "._");
 	user = get_user(sdata, username);
-	client_arr = json_array();
-
-	ck_rlock(&sdata->instance_lock);
-	DL_FOREACH2(user->clients, client, user_next) {
-		if (strcmp(client->workername, workername))
-			continue;
-		json_array_append_new(client_arr, json_integer(client->id));
-	}
-	ck_runlock(&sdata->instance_lock);
-
-	JSON_CPACK(res, "{ss,so}", "worker", workername, "clients", client_arr);
+	tv_time(&now);
+	copy_user(&u, user, &now);
+	res = userinfo(&u);
 out:
 	if (val)
 		json_decref(val);
-	free(workername);
+	free(username);
 	send_api_response(res, *sockd);
 }
 
-static json_t *workerinfo(const user_instance_t *user, const worker_instance_t *worker)
+static json_t *workerinfo(const api_worker_t *w)
 {
 	json_t *val;
 
 	JSON_CPACK(val, "{ss,ss,si,sf,sf,sf,sf,si,sf,si,sb}",
-		   "user", user->username, "worker", worker->workername, "id", user->id,
-	    "dsps1", worker->dsps1, "dsps5", worker->dsps5, "dsps60", worker->dsps60,
-	    "dsps1440", worker->dsps1440, "lastshare", worker->last_share.tv_sec,
-	    "bestdiff", worker->best_diff, "mindiff", worker->mindiff, "idle", worker->idle);
+		   "user", w->user->username, "worker", w->worker->workername, "id", w->user->id,
+	    "dsps1", w->dsps1, "dsps5", w->dsps5, "dsps60", w->dsps60,
+	    "dsps1440", w->dsps1440, "lastshare", w->last_share,
+	    "bestdiff", w->best_diff, "mindiff", w->mindiff, "idle", w->idle);
 	return val;
 }
 
@@ -4140,6 +5638,8 @@ static void getworker(sdata_t *sdata, const char *buf, int *sockd)
 	worker_instance_t *worker;
 	user_instance_t *user;
 	json_error_t err_val;
+	api_worker_t w;
+	tv_t now;
 
 	val = json_loads(buf, 0, &err_val);
 	if (unlikely(!val)) {
@@ -4158,7 +5658,9 @@ static void getworker(sdata_t *sdata, const char *buf, int *sockd)
 	username = strsep(&tmp, "._");
 	user = get_user(sdata, username);
 	worker = get_worker(sdata, user, workername);
-	res = workerinfo(user, worker);
+	tv_time(&now);
+	copy_worker(&w, user, worker, &now);
+	res = workerinfo(&w);
 out:
 	if (val)
 		json_decref(val);
@@ -4166,71 +5668,84 @@ out:
 	send_api_response(res, *sockd);
 }
 
-static void getworkers(sdata_t *sdata, int *sockd)
+static void getworkers(sdata_t *sdata, const char *buf, int *sockd)
 {
-	json_t *val = NULL, *worker_arr;
-	worker_instance_t *worker;
-	user_instance_t *user;
+	json_t *res = NULL, *worker_arr;
+	api_snapshot_t *snap;
+	api_filter_t filter;
+	int i, matched = 0;
 
+	if (!api_filter(buf, &filter, NULL, &res))
+		goto out;
+	snap = api_snapshot(sdata);
 	worker_arr = json_array();
+	for (i = 0; i < snap->nworkers; i++) {
+		api_worker_t *w = &snap->workers[i];
 
-	ck_rlock(&sdata->instance_lock);
-	for (user = sdata->user_instances; user; user = user->hh.next) {
-		DL_FOREACH(user->worker_instances, worker) {
-			json_array_append_new(worker_arr, workerinfo(user, worker));
-		}
+		if (!filter_match(&filter, w->user, w->worker, w->idle))
+			continue;
+		if (filter_page(&filter, matched++))
+			json_array_append_new(worker_arr, workerinfo(w));
 	}
-	ck_runlock(&sdata->instance_lock);
-
-	JSON_CPACK(val, "{so}", "workers", worker_arr);
-	send_api_response(val, *sockd);
+	res = filter_response(snap, &filter, "workers", worker_arr, matched);
+out:
+	filter_free(&filter);
+	send_api_response(res, *sockd);
 }
 
-static void getusers(sdata_t *sdata, int *sockd)
+static void getusers(sdata_t *sdata, const char *buf, int *sockd)
 {
-	json_t *val = NULL, *user_array;
-	user_instance_t *user;
+	json_t *res = NULL, *user_array;
+	api_snapshot_t *snap;
+	api_filter_t filter;
+	int i, matched = 0;
 
+	if (!api_filter(buf, &filter, NULL, &res))
+		goto out;
+	snap = api_snapshot(sdata);
 	user_array = json_array();
+	for (i = 0; i < snap->nusers; i++) {
+		api_user_t *u = &snap->users[i];
 
-	ck_rlock(&sdata->instance_lock);
-	for (user = sdata->user_instances; user; user = user->hh.next) {
-		json_array_append_new(user_array, userinfo(user));
+		if (filter.username && strcmp(u->user->username, filter.username))
+			continue;
+		if (filter_page(&filter, matched++))
+			json_array_append_new(user_array, userinfo(u));
 	}
-	ck_runlock(&sdata->instance_lock);
-
-	JSON_CPACK(val, "{so}", "users", user_array);
-	send_api_response(val, *sockd);
+	res = filter_response(snap, &filter, "users", user_array, matched);
+out:
+	filter_free(&filter);
+	send_api_response(res, *sockd);
 }
 
-static json_t *clientinfo(const stratum_instance_t *client)
+static json_t *clientinfo(const api_snapshot_t *snap, const api_client_t *c)
 {
 	json_t *val = json_object();
 
 	/* Too many fields for a pack object, do each discretely to keep track */
-	json_set_int(val, "id", client->id);
-	json_set_string(val, "enonce1", client->enonce1);
-	json_set_string(val, "enonce1var", client->enonce1var);
-	json_set_int(val, "enonce1_64", client->enonce1_64);
-	json_set_double(val, "diff", client->diff);
-	json_set_double(val, "dsps1", client->dsps1);
-	json_set_double(val, "dsps5", client->dsps5);
-	json_set_double(val, "dsps60", client->dsps60);
-	json_set_double(val, "dsps1440", client->dsps1440);
-	json_set_double(val, "dsps10080", client->dsps10080);
-	json_set_int(val, "lastshare", client->last_share.tv_sec);
-	json_set_int(val, "starttime", client->start_time);
-	json_set_string(val, "address", client->address);
-	json_set_bool(val, "subscribed", client->subscribed);
-	json_set_bool(val, "authorised", client->authorised);
-	json_set_bool(val, "idle", client->idle);
-	json_set_string(val, "useragent", client->useragent ? client->useragent : "");
-	json_set_string(val, "workername", client->workername ? client->workername : "");
-	json_set_int(val, "userid", client->user_id);
-	json_set_int(val, "server", client->server);
-	json_set_double(val, "bestdiff", client->best_diff);
-	json_set_int(val, "proxyid", client->proxyid);
-	json_set_int(val, "subproxyid", client->subproxyid);
+	json_set_int(val, "id", c->id);
+	json_set_string(val, "enonce1", c->enonce1);
+	json_set_string(val, "enonce1var", c->enonce1var);
+	json_set_int(val, "enonce1_64", c->enonce1_64);
+	json_set_double(val, "diff", c->diff);
+	json_set_double(val, "dsps1", c->dsps1);
+	json_set_double(val, "dsps5", c->dsps5);
+	json_set_double(val, "dsps60", c->dsps60);
+	json_set_double(val, "dsps1440", c->dsps1440);
+	json_set_double(val, "dsps10080", c->dsps10080);
+	json_set_int(val, "lastshare", c->last_share);
+	json_set_int(val, "starttime", c->start_time);
+	json_set_string(val, "address", c->address);
+	json_set_bool(val, "subscribed", c->subscribed);
+	json_set_bool(val, "authorised", c->authorised);
+	json_set_bool(val, "idle", c->idle);
+	json_set_string(val, "useragent", snap->strings + c->useragent);
+	json_set_string(val, "workername", snap->strings + c->workername);
+	json_set_int(val, "userid", c->user_id);
+	json_set_int(val, "server", c->server);
+	json_set_double(val, "bestdiff", c->best_diff);
+	json_set_int(val, "proxyid", c->proxyid);
+	json_set_int(val, "subproxyid", c->subproxyid);
 
 	return val;
 }
@@ -4240,7 +5755,10 @@ static void getclient(sdata_t *sdata, const char *buf, int *sockd)
 	json_t *val = NULL, *res = NULL;
 	stratum_instance_t *client;
 	json_error_t err_val;
+	api_snapshot_t snap;
 	int64_t client_id;
+	api_client_t c;
+	tv_t now_t;
 
 	val = json_loads(buf, 0, &err_val);
 	if (unlikely(!val)) {
@@ -4256,109 +5774,48 @@ static void getclient(sdata_t *sdata, const char *buf, int *sockd)
 		res = json_errormsg("Failed to find client %"PRId64, client_id);
 		goto out;
 	}
-	res = clientinfo(client);
-
-	dec_instance_ref(sdata, client);
-out:
-	if (val)
-		json_decref(val);
-	send_api_response(res, *sockd);
-}
-
-static void getclients(sdata_t *sdata, int *sockd)
-{
-	json_t *val = NULL, *client_arr;
-	stratum_instance_t *client;
-
-	client_arr = json_array();
-
-	ck_rlock(&sdata->instance_lock);
-	for (client = sdata->stratum_instances; client; client = client->hh.next) {
-		json_array_append_new(client_arr, clientinfo(client));
-	}
-	ck_runlock(&sdata->instance_lock);
-
-	JSON_CPACK(val, "{so}", "clients", client_arr);
-	send_api_response(val, *sockd);
-}
-
-static void user_clientinfo(sdata_t *sdata, const char *buf, int *sockd)
-{
-	json_t *val = NULL, *res = NULL, *client_arr;
-	stratum_instance_t *client;
-	char *username = NULL;
-	user_instance_t *user;
-	json_error_t err_val;
-
-	val = json_loads(buf, 0, &err_val);
-	if (unlikely(!val)) {
-		res = json_encode_errormsg(&err_val);
-		goto out;
-	}
-	if (!json_get_string(&username, val, "user")) {
-		res = json_errormsg("Failed to find user key");
-		goto out;
-	}
-	if (!strlen(username)) {
-		res = json_errormsg("Zero length user key");
-		goto out;
-	}
-	user = get_user(sdata, username);
-	client_arr = json_array();
-
-	ck_rlock(&sdata->instance_lock);
-	DL_FOREACH2(user->clients, client, user_next) {
-		json_array_append_new(client_arr, clientinfo(client));
-	}
-	ck_runlock(&sdata->instance_lock);
+	memset(&snap, 0, sizeof(snap));
+	tv_time(&now_t);
+	copy_client(&snap, &c, client, &now_t);
+	dec_instance_ref(sdata, client);
 
-	JSON_CPACK(res, "{ss,so}", "user", username, "clients", client_arr);
+	res = clientinfo(&snap, &c);
+	free(snap.strings);
 out:
 	if (val)
 		json_decref(val);
-	free(username);
 	send_api_response(res, *sockd);
 }
 
-static void worker_clientinfo(sdata_t *sdata, const char *buf, int *sockd)
+/* Lists clients matching any filter, or only their ids if ids is set, with
+ * the key named by required needing to be in the parameters */
+static void getclients(sdata_t *sdata, const char *buf, int *sockd, const char *required,
+		       const bool ids)
 {
-	json_t *val = NULL, *res = NULL, *client_arr;
-	char *tmp, *username, *workername = NULL;
-	stratum_instance_t *client;
-	user_instance_t *user;
-	json_error_t err_val;
+	json_t *res = NULL, *client_arr;
+	api_snapshot_t *snap;
+	api_filter_t filter;
+	int i, matched = 0;
 
-	val = json_loads(buf, 0, &err_val);
-	if (unlikely(!val)) {
-		res = json_encode_errormsg(&err_val);
-		goto out;
-	}
-	if (!json_get_string(&workername, val, "worker")) {
-		res = json_errormsg("Failed to find worker key");
-		goto out;
-	}
-	if (!strlen(workername)) {
-		res = json_errormsg("Zero length worker key");
+	if (!api_filter(buf, &filter, required, &res))
 		goto out;
-	}
-	tmp = strdupa(workername);
-	username = strsep(&tmp, "._");
-	user = get_user(sdata, username);
+	snap = api_snapshot(sdata);
 	client_arr = json_array();
+	for (i = 0; i < snap->nclients; i++) {
+		api_client_t *c = &snap->clients[i];
 
-	ck_rlock(&sdata->instance_lock);
-	DL_FOREACH2(user->clients, client, user_next) {
-		if (strcmp(client->workername, workername))
+		if (!filter_match(&filter, c->user, c->worker, c->idle))
+			continue;
+		if (!filter_page(&filter, matched++))
 			continue;
-		json_array_append_new(client_arr, clientinfo(client));
+		if (ids)
+			json_array_append_new(client_arr, json_integer(c->id));
+		else
+			json_array_append_new(client_arr, clientinfo(snap, c));
 	}
-	ck_runlock(&sdata->instance_lock);
-
-	JSON_CPACK(res, "{ss,so}", "worker", workername, "clients", client_arr);
+	res = filter_response(snap, &filter, "clients", client_arr, matched);
 out:
-	if (val)
-		json_decref(val);
-	free(workername);
+	filter_free(&filter);
 	send_api_response(res, *sockd);
 }
 
@@ -4553,7 +6010,7 @@ retry:
 
 		/* This is a message for a node */
 		if (likely(val))
-			ckmsgq_add(sdata->srecvs, val);
+			stratifier_add_recv(ckp, val);
 		goto retry;
 	}
 	if (cmdmatch(buf, "ping")) {
@@ -4571,15 +6028,15 @@ retry:
 	}
 	/* Parse API commands here to return a message to sockd */
 	if (cmdmatch(buf, "clients")) {
-		getclients(sdata, &umsg->sockd);
+		getclients(sdata, buf + 7, &umsg->sockd, NULL, false);
 		goto retry;
 	}
 	if (cmdmatch(buf, "workers")) {
-		getworkers(sdata, &umsg->sockd);
+		getworkers(sdata, buf + 7, &umsg->sockd);
 		goto retry;
 	}
 	if (cmdmatch(buf, "users")) {
-		getusers(sdata, &umsg->sockd);
+		getusers(sdata, buf + 5, &umsg->sockd);
 		goto retry;
 	}
 	if (cmdmatch(buf, "getclient")) {
@@ -4595,11 +6052,11 @@ retry:
 		goto retry;
 	}
 	if (cmdmatch(buf, "userclients")) {
-		userclients(sdata, buf + 12, &umsg->sockd);
+		getclients(sdata, buf + 11, &umsg->sockd, "user", true);
 		goto retry;
 	}
 	if (cmdmatch(buf, "workerclients")) {
-		workerclients(sdata, buf + 14, &umsg->sockd);
+		getclients(sdata, buf + 13, &umsg->sockd, "worker", true);
 		goto retry;
 	}
 	if (cmdmatch(buf, "getproxy")) {
@@ -4619,7 +6076,7 @@ retry:
 		goto retry;
 	}
 	if (cmdmatch(buf, "ucinfo")) {
-		user_clientinfo(sdata, buf + 7, &umsg->sockd);
+		getclients(sdata, buf + 6, &umsg->sockd, "user", false);
 		goto retry;
 	}
 	if (cmdmatch(buf,"uptime")) {
@@ -4627,7 +6084,7 @@ retry:
 		goto retry;
 	}
 	if (cmdmatch(buf, "wcinfo")) {
-		worker_clientinfo(sdata, buf + 7, &umsg->sockd);
+		getclients(sdata, buf + 6, &umsg->sockd, "worker", false);
 		goto retry;
 	}
 
@@ -4718,6 +6175,23 @@ static void __fill_enonce1data(const workbase_t *wb, stratum_instance_t *client)
 	__bin2hex(client->enonce1, client->enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
 }
 
+/* Map a counter value into this host's slice of the enonce1 space when it is
+ * shared by clusterhosts stratifiers, each taking the same workbases from one
+ * upstream template source. The clusterid selects the top bits of the
+ * nonce1length bytes so no two hosts can hand out the same enonce1 and work
+ * can never overlap across hosts. */
+static uint64_t cluster_enonce1(const ckpool_t *ckp, const uint64_t enonce1)
+{
+	uint64_t top, span;
+
+	if (ckp->nonce1length >= 8)
+		top = UINT64_MAX;
+	else
+		top = (1ull << (ckp->nonce1length * 8)) - 1;
+	span = top / ckp->clusterhosts;
+	return span * ckp->clusterid + enonce1 % span;
+}
+
 /* Create a new enonce1 from the 64 bit enonce1_64 value, using only the number
  * of bytes we have to work with when we are proxying with a split nonce2.
  * When the proxy space is less than 32 bits to work with, we look for an
@@ -4755,7 +6229,10 @@ static bool new_enonce1(ckpool_t *ckp, sdata_t *ckp_sdata, sdata_t *sdata, strat
 	ck_wlock(&ckp_sdata->instance_lock);
 	enonce1 = le64toh(ckp_sdata->enonce1_64);
 	enonce1++;
-	client->enonce1_64 = ckp_sdata->enonce1_64 = htole64(enonce1);
+	ckp_sdata->enonce1_64 = htole64(enonce1);
+	if (ckp->clusterhosts > 1)
+		enonce1 = cluster_enonce1(ckp, enonce1);
+	client->enonce1_64 = htole64(enonce1);
 	if (proxy) {
 		client->proxy = proxy;
 		proxy->clients++;
@@ -4862,6 +6339,25 @@ out:
 	return ret;
 }
 
+/* Does the stratifier hold a disconnected session of this id that a subscribe
+ * asking for it would resume, for the connector to admit it ahead of new
+ * clients. Looked up without taking the session. */
+bool stratifier_session_resumable(ckpool_t *ckp, const char *sessionid)
+{
+	int session_id = int_from_sessionid(sessionid);
+	sdata_t *sdata = ckp->sdata;
+	session_t *session;
+
+	if (ckp->proxy || !session_id)
+		return false;
+
+	ck_rlock(&sdata->instance_lock);
+	HASH_FIND_INT(sdata->disconnected_sessions, &session_id, session);
+	ck_runlock(&sdata->instance_lock);
+
+	return !!session;
+}
+
 static int userid_from_sessionid(sdata_t *sdata, const int session_id)
 {
 	session_t *session;
@@ -4869,12 +6365,13 @@ static int userid_from_sessionid(sdata_t *sdata, const int session_id)
 
 	ck_wlock(&sdata->instance_lock);
 	HASH_FIND_INT(sdata->disconnected_sessions, &session_id, session);
-	if (!session)
+	if (!session) {
+		sdata->session_misses++;
 		goto out_unlock;
-	HASH_DEL(sdata->disconnected_sessions, session);
-	sdata->stats.disconnected--;
+	}
+	sdata->session_hits++;
 	ret = session->userid;
-	dealloc(session);
+	__del_session(sdata, session);
 out_unlock:
 	ck_wunlock(&sdata->instance_lock);
 
@@ -4885,11 +6382,13 @@ out_unlock:
 
 static int userid_from_sessionip(sdata_t *sdata, const char *address)
 {
-	session_t *session, *tmp;
+	session_t *session;
 	int ret = -1;
 
 	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->disconnected_sessions, session, tmp) {
+	/* Search from the most recently disconnected */
+	for (session = sdata->session_list ? sdata->session_list->prev : NULL; session;
+	     session = session == sdata->session_list ? NULL : session->prev) {
 		if (!strcmp(session->address, address)) {
 			ret = session->userid;
 			break;
@@ -4897,9 +6396,7 @@ static int userid_from_sessionip(sdata_t *sdata, const char *address)
 	}
 	if (ret == -1)
 		goto out_unlock;
-	HASH_DEL(sdata->disconnected_sessions, session);
-	sdata->stats.disconnected--;
-	dealloc(session);
+	__del_session(sdata, session);
 out_unlock:
 	ck_wunlock(&sdata->instance_lock);
 
@@ -5062,11 +6559,21 @@ static void decay_client(stratum_instance_t *client, double diff, tv_t *now_t)
 {
 	double tdiff = sane_tdiff(now_t, &client->last_decay);
 
-	/* If we're calling the hashmeter too frequently we'll just end up
-	 * racing and having inappropriate values, so store up diff and update
-	 * at most 20 times per second. Use an integer for uadiff to make the
-	 * update atomic */
-	if (tdiff < 0.05) {
+	/* Catch up on the minutes spent idle first */
+	if (tdiff >= 60) {
+		client->dsps1 = idle_rate(client->dsps1, tdiff, MIN1);
+		client->dsps5 = idle_rate(client->dsps5, tdiff, MIN5);
+		client->dsps60 = idle_rate(client->dsps60, tdiff, HOUR);
+		client->dsps1440 = idle_rate(client->dsps1440, tdiff, DAY);
+		client->dsps10080 = idle_rate(client->dsps10080, tdiff, WEEK);
+		tdiff = fmod(tdiff, 60);
+		if (tdiff < 0.001)
+			tdiff = 0.001;
+	} else if (tdiff < 0.05) {
+		/* If we're calling the hashmeter too frequently we'll just end
+		 * up racing and having inappropriate values, so store up diff
+		 * and update at most 20 times per second. Use an integer for
+		 * uadiff to make the update atomic */
 		client->uadiff += diff;
 		return;
 	}
@@ -5084,7 +6591,17 @@ static void decay_worker(worker_instance_t *worker, double diff, tv_t *now_t)
 {
 	double tdiff = sane_tdiff(now_t, &worker->last_decay);
 
-	if (tdiff < 0.05) {
+	/* Catch up on the minutes spent idle first */
+	if (tdiff >= 60) {
+		worker->dsps1 = idle_rate(worker->dsps1, tdiff, MIN1);
+		worker->dsps5 = idle_rate(worker->dsps5, tdiff, MIN5);
+		worker->dsps60 = idle_rate(worker->dsps60, tdiff, HOUR);
+		worker->dsps1440 = idle_rate(worker->dsps1440, tdiff, DAY);
+		worker->dsps10080 = idle_rate(worker->dsps10080, tdiff, WEEK);
+		tdiff = fmod(tdiff, 60);
+		if (tdiff < 0.001)
+			tdiff = 0.001;
+	} else if (tdiff < 0.05) {
 		worker->uadiff += diff;
 		return;
 	}
@@ -5102,7 +6619,17 @@ static void decay_user(user_instance_t *user, double diff, tv_t *now_t)
 {
 	double tdiff = sane_tdiff(now_t, &user->last_decay);
 
-	if (tdiff < 0.05) {
+	/* Catch up on the minutes spent idle first */
+	if (tdiff >= 60) {
+		user->dsps1 = idle_rate(user->dsps1, tdiff, MIN1);
+		user->dsps5 = idle_rate(user->dsps5, tdiff, MIN5);
+		user->dsps60 = idle_rate(user->dsps60, tdiff, HOUR);
+		user->dsps1440 = idle_rate(user->dsps1440, tdiff, DAY);
+		user->dsps10080 = idle_rate(user->dsps10080, tdiff, WEEK);
+		tdiff = fmod(tdiff, 60);
+		if (tdiff < 0.001)
+			tdiff = 0.001;
+	} else if (tdiff < 0.05) {
 		user->uadiff += diff;
 		return;
 	}
@@ -5120,7 +6647,134 @@ static user_instance_t *get_create_user(sdata_t *sdata, const char *username, bo
 static worker_instance_t *get_create_worker(sdata_t *sdata, user_instance_t *user,
 					    const char *workername, bool *new_worker);
 
-/* Load the statistics of and create all known users at startup */
+/* Apply the stats json of a user and their workers loaded at startup */
+static void load_userstats(sdata_t *sdata, user_instance_t *user, json_t *val, tv_t *now,
+			   const int tvsec_diff, int *workers)
+{
+	const char *username = user->username;
+	json_t *worker_array, *arr_val;
+	int64_t authorised;
+	int lastshare;
+	size_t index;
+
+	copy_tv(&user->last_share, now);
+	/* Rates decay lazily for the time the pool was down */
+	copy_tv(&user->last_decay, now);
+	if (tvsec_diff > 60)
+		user->last_decay.tv_sec -= tvsec_diff;
+	user->dsps1 = dsps_from_key(val, "hashrate1m");
+	user->dsps5 = dsps_from_key(val, "hashrate5m");
+	user->dsps60 = dsps_from_key(val, "hashrate1hr");
+	user->dsps1440 = dsps_from_key(val, "hashrate1d");
+	user->dsps10080 = dsps_from_key(val, "hashrate7d");
+	json_get_int(&lastshare, val, "lastshare");
+	user->last_share.tv_sec = lastshare;
+	json_get_int64(&user->shares, val, "shares");
+	json_get_double(&user->best_diff, val, "bestshare");
+	json_get_int64(&user->best_ever, val, "bestever");
+	json_get_int64(&authorised, val, "authorised");
+	user->auth_time = authorised;
+	if (user->best_diff > user->best_ever)
+		user->best_ever = user->best_diff;
+	LOGINFO("Successfully read user %s stats %f %f %f %f %f %f %ld %ld", user->username,
+		user->dsps1, user->dsps5, user->dsps60, user->dsps1440,
+		user->dsps10080, user->best_diff, user->best_ever, user->auth_time);
+
+	worker_array = json_object_get(val, "worker");
+	json_array_foreach(worker_array, index, arr_val) {
+		const char *workername = json_string_value(json_object_get(arr_val, "workername"));
+		worker_instance_t *worker;
+		bool new_worker = false;
+
+		if (unlikely(!workername || !strlen(workername)) ||
+		    !strstr(workername, username)) {
+			LOGWARNING("Invalid workername in read_userstats %s", workername);
+			continue;
+		}
+		worker = get_create_worker(sdata, user, workername, &new_worker);
+		if (unlikely(!new_worker)) {
+			LOGWARNING("Duplicate worker in read_userstats %s", workername);
+			continue;
+		}
+		(*workers)++;
+		copy_tv(&worker->last_decay, &user->last_decay);
+		worker->dsps1 = dsps_from_key(arr_val, "hashrate1m");
+		worker->dsps5 = dsps_from_key(arr_val, "hashrate5m");
+		worker->dsps60 = dsps_from_key(arr_val, "hashrate1hr");
+		worker->dsps1440 = dsps_from_key(arr_val, "hashrate1d");
+		worker->dsps10080 = dsps_from_key(arr_val, "hashrate7d");
+		json_get_int(&lastshare, arr_val, "lastshare");
+		worker->last_share.tv_sec = lastshare;
+		json_get_double(&worker->best_diff, arr_val, "bestshare");
+		json_get_int64(&worker->best_ever, arr_val, "bestever");
+		if (worker->best_diff > worker->best_ever)
+			worker->best_ever = worker->best_diff;
+		json_get_int64(&worker->shares, arr_val, "shares");
+		LOGINFO("Successfully read worker %s stats %f %f %f %f %f %ld", worker->workername,
+			worker->dsps1, worker->dsps5, worker->dsps60, worker->dsps1440, worker->best_diff, worker->best_ever);
+	}
+}
+
+/* Load users from the userstats store, one json line per user appended each
+ * time their stats changed, with later lines replacing earlier ones. Returns
+ * false if there is no store to read. */
+static bool read_userstore(ckpool_t *ckp, sdata_t *sdata, const int tvsec_diff)
+{
+	int users = 0, workers = 0, lines = 0, bad = 0;
+	json_t *store, *val;
+	const char *username;
+	size_t len = 0;
+	char *buf = NULL;
+	tv_t now;
+	FILE *fp;
+
+	ASPRINTF(&buf, "%suserstats.log", ckp->logdir);
+	fp = fopen(buf, "re");
+	dealloc(buf);
+	if (!fp)
+		return false;
+
+	store = json_object();
+	while (getline(&buf, &len, fp) != -1) {
+		const char *name;
+
+		lines++;
+		val = json_loads(buf, 0, NULL);
+		if (unlikely(!val || !(name = json_string_value(json_object_get(val, "user"))))) {
+			/* Expected only of a line torn by a crash mid write */
+			bad++;
+			if (val)
+				json_decref(val);
+			continue;
+		}
+		json_object_set_new(store, name, val);
+	}
+	free(buf);
+	fclose(fp);
+	if (unlikely(bad))
+		LOGWARNING("Skipped %d unreadable lines of %d in userstats store", bad, lines);
+
+	tv_time(&now);
+	json_object_foreach(store, username, val) {
+		user_instance_t *user;
+		bool new_user = false;
+
+		user = get_create_user(sdata, username, &new_user);
+		if (unlikely(!new_user)) {
+			LOGWARNING("Duplicate user in read_userstats %s", username);
+			continue;
+		}
+		users++;
+		load_userstats(sdata, user, val, &now, tvsec_diff, &workers);
+	}
+	json_decref(store);
+
+	LOGWARNING("Loaded %d users and %d workers from %d userstats lines", users, workers, lines);
+	return true;
+}
+
+/* Load the statistics of and create all known users at startup, from the
+ * userstats store or the per user files if there is no store yet */
 static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 {
 	char dnam[256], s[4096], *username, *buf;
@@ -5135,6 +6789,9 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 	DIR *d;
 	int fd;
 
+	if (read_userstore(ckp, sdata, tvsec_diff))
+		return;
+
 	snprintf(dnam, 255, "%susers", ckp->logdir);
 	d = opendir(dnam);
 	if (!d) {
@@ -5145,11 +6802,6 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 	tv_time(&now);
 
 	while ((dir = readdir(d)) != NULL) {
-		json_t *worker_array, *arr_val;
-		int64_t authorised;
-		int lastshare;
-		size_t index;
-
 		username = basename(dir->d_name);
 		if (!strcmp(username, "/") || !strcmp(username, ".") || !strcmp(username, ".."))
 			continue;
@@ -5193,63 +6845,7 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 		}
 		dealloc(buf);
 
-		copy_tv(&user->last_share, &now);
-		copy_tv(&user->last_decay, &now);
-		user->dsps1 = dsps_from_key(val, "hashrate1m");
-		user->dsps5 = dsps_from_key(val, "hashrate5m");
-		user->dsps60 = dsps_from_key(val, "hashrate1hr");
-		user->dsps1440 = dsps_from_key(val, "hashrate1d");
-		user->dsps10080 = dsps_from_key(val, "hashrate7d");
-		json_get_int(&lastshare, val, "lastshare");
-		user->last_share.tv_sec = lastshare;
-		json_get_int64(&user->shares, val, "shares");
-		json_get_double(&user->best_diff, val, "bestshare");
-		json_get_int64(&user->best_ever, val, "bestever");
-		json_get_int64(&authorised, val, "authorised");
-		user->auth_time = authorised;
-		if (user->best_diff > user->best_ever)
-			user->best_ever = user->best_diff;
-		LOGINFO("Successfully read user %s stats %f %f %f %f %f %f %ld %ld", user->username,
-			user->dsps1, user->dsps5, user->dsps60, user->dsps1440,
-			user->dsps10080, user->best_diff, user->best_ever, user->auth_time);
-		if (tvsec_diff > 60)
-			decay_user(user, 0, &now);
-
-		worker_array = json_object_get(val, "worker");
-		json_array_foreach(worker_array, index, arr_val) {
-			const char *workername = json_string_value(json_object_get(arr_val, "workername"));
-			worker_instance_t *worker;
-			bool new_worker = false;
-
-			if (unlikely(!workername || !strlen(workername)) ||
-			    !strstr(workername, username)) {
-				LOGWARNING("Invalid workername in read_userstats %s", workername);
-				continue;
-			}
-			worker = get_create_worker(sdata, user, workername, &new_worker);
-			if (unlikely(!new_worker)) {
-				LOGWARNING("Duplicate worker in read_userstats %s", workername);
-				continue;
-			}
-			workers++;
-			copy_tv(&worker->last_decay, &now);
-			worker->dsps1 = dsps_from_key(arr_val, "hashrate1m");
-			worker->dsps5 = dsps_from_key(arr_val, "hashrate5m");
-			worker->dsps60 = dsps_from_key(arr_val, "hashrate1hr");
-			worker->dsps1440 = dsps_from_key(arr_val, "hashrate1d");
-			worker->dsps10080 = dsps_from_key(arr_val, "hashrate7d");
-			json_get_int(&lastshare, arr_val, "lastshare");
-			worker->last_share.tv_sec = lastshare;
-			json_get_double(&worker->best_diff, arr_val, "bestshare");
-			json_get_int64(&worker->best_ever, arr_val, "bestever");
-			if (worker->best_diff > worker->best_ever)
-				worker->best_ever = worker->best_diff;
-			json_get_int64(&worker->shares, arr_val, "shares");
-			LOGINFO("Successfully read worker %s stats %f %f %f %f %f %ld", worker->workername,
-				worker->dsps1, worker->dsps5, worker->dsps60, worker->dsps1440, worker->best_diff, worker->best_ever);
-			if (tvsec_diff > 60)
-				decay_worker(worker, 0, &now);
-		}
+		load_userstats(sdata, user, val, &now, tvsec_diff, &workers);
 		json_decref(val);
 	}
 	closedir(d);
@@ -5426,6 +7022,7 @@ static void client_auth(ckpool_t *ckp, stratum_instance_t *client, user_instance
 		user->throttled = false;
 		if (!user->auth_time)
 			user->auth_time = time(NULL);
+		dirty_user(ckp->sdata, user);
 	} else {
 		if (user->throttled) {
 			LOGINFO("Client %s %s worker %s failed to authorise as throttled user %s",
@@ -5457,6 +7054,30 @@ static void update_solo_client(sdata_t *sdata, workbase_t *wb, const int64_t cli
 	stratum_add_send(sdata, json_msg, client_id, SM_UPDATE);
 }
 
+/* Send the first solo template generated for user and the diff to a newly
+ * authorised client. Needs to be entered with client holding a ref count. */
+static void init_solo_client(ckpool_t *ckp, stratum_instance_t *client, user_instance_t *user)
+{
+	sdata_t *sdata = ckp->sdata;
+	workbase_t *wb;
+
+	/* To avoid grabbing recursive lock */
+	ck_rlock(&sdata->workbase_lock);
+	wb = sdata->current_workbase;
+	__atomic_fetch_add(&wb->readcount, 1, __ATOMIC_RELAXED);
+	ck_runlock(&sdata->workbase_lock);
+
+	ck_wlock(&sdata->instance_lock);
+	__generate_userwb(sdata, wb, user);
+	ck_wunlock(&sdata->instance_lock);
+
+	update_solo_client(sdata, wb, client->id, user);
+
+	put_workbase(sdata, wb);
+
+	stratum_send_diff(sdata, client);
+}
+
 /* Needs to be entered with client holding a ref count. */
 static json_t *parse_authorise(stratum_instance_t *client, const json_t *params_val,
 			       json_t **err_val)
@@ -5534,28 +7155,8 @@ static json_t *parse_authorise(stratum_instance_t *client, const json_t *params_
 	if (!ckp->remote || ckp->btcsolo)
 		client_auth(ckp, client, user, ret);
 out:
-	if (ckp->btcsolo && ret && !client->remote) {
-		sdata_t *sdata = ckp->sdata;
-		workbase_t *wb;
-
-		/* To avoid grabbing recursive lock */
-		ck_wlock(&sdata->workbase_lock);
-		wb = sdata->current_workbase;
-		wb->readcount++;
-		ck_wunlock(&sdata->workbase_lock);
-
-		ck_wlock(&sdata->instance_lock);
-		__generate_userwb(sdata, wb, user);
-		ck_wunlock(&sdata->instance_lock);
-
-		update_solo_client(sdata, wb, client->id, user);
-
-		ck_wlock(&sdata->workbase_lock);
-		wb->readcount--;
-		ck_wunlock(&sdata->workbase_lock);
-
-		stratum_send_diff(sdata, client);
-	}
+	if (ckp->btcsolo && ret && !client->remote)
+		init_solo_client(ckp, client, user);
 	return json_boolean(ret);
 }
 
@@ -5638,11 +7239,14 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 
 	decay_worker(worker, diff, &now_t);
 	copy_tv(&worker->last_share, &now_t);
-	worker->idle = false;
 
 	decay_user(user, diff, &now_t);
 	copy_tv(&user->last_share, &now_t);
+	dirty_user(ckp_sdata, user);
 	client->idle = false;
+	if (unlikely(client->idle_counted) &&
+	    __atomic_exchange_n(&client->idle_counted, false, __ATOMIC_RELAXED))
+		__atomic_fetch_sub(&ckp_sdata->idle_clients, 1, __ATOMIC_RELAXED);
 
 	/* Once we've updated user/client statistics in node mode, we can't
 	 * alter diff ourselves. */
@@ -5805,7 +7409,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 
 	/* Submit block locally after sending it to remote locations avoiding
 	 * the delay of local verification */
-	ret = local_block_submit(ckp, gbt_block, flip32, wb->height);
+	ret = local_block_submit(ckp, wb, gbt_block, flip32);
 	if (ret)
 		block_solve(ckp, val);
 	else
@@ -5835,26 +7439,87 @@ out_nouserwb:
 	return wb->coinb2bin;
 }
 
-/* Needs to be entered with workbase readcount and client holding a ref count. */
-static double submission_diff(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
-			      const char *nonce2, const uint32_t ntime32, uint32_t version_mask,
-			      const char *nonce, uchar *hash, const bool stale)
+/* Maximum number of shares taken off the sshareq and verified at once */
+#define SHARE_BATCH SHA256_MAX_LANES
+
+/* Share state carried from parsing a submission, through batched hashing of
+ * its header, to completing it. */
+typedef struct submission {
+	stratum_instance_t *client;
+	json_t *json_msg;
+	json_t *err_val;
+	enum share_err err;
+
+	/* Whether the submission is a share and whether it has a header to
+	 * be hashed */
+	bool share;
+	bool hashed;
+	bool stale;
+	bool noworkbase;
+
+	const char *ntime;
+	char *nonce2;
+	char *nonce;
+	char nonce2buf[36];
+	char noncebuf[12];
+	uint32_t ntime32;
+	uint32_t version_mask32;
+
+	char idstring[24];
+	char cdfield[64];
+	char *fname;
+	workbase_t *wb;
+	int64_t id;
+	ts_t now;
+
+	/* Batch slot whose coinbase buffer coinbase points into */
+	int slot;
+	char *coinbase;
+	int cblen;
+	uchar swap[80];
+	uchar hash[32];
+} submission_t;
+
+/* Coinbases of each batch of shares are built in buffers kept per share
+ * processor thread, only reallocated for a workbase needing a larger one */
+struct cbbuf {
+	char *buf;
+	int size;
+};
+
+static __thread struct cbbuf cbbufs[SHARE_BATCH];
+
+static char *share_coinbase(const int slot, const int len)
+{
+	struct cbbuf *cbbuf = &cbbufs[slot];
+
+	if (unlikely(cbbuf->size < len)) {
+		free(cbbuf->buf);
+		cbbuf->size = round_up_page(len);
+		cbbuf->buf = ckalloc(cbbuf->size);
+	}
+	return cbbuf->buf;
+}
+
+/* Build the coinbase and block header for a submission, leaving the header in
+ * sub->swap ready to be hashed. Needs to be entered with workbase readcount
+ * and client holding a ref count. */
+static void submission_header(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
+			      submission_t *sub)
 {
-	unsigned char merkle_root[32], merkle_sha[64];
-	uint32_t *data32, *swap32, benonce32;
-	char *coinbase, data[80];
-	uchar swap[80], hash1[32];
-	int cblen, i, cb2len;
+	uchar cbhash[32], root[32];
+	int cblen, cb2len;
 	uchar *coinb2bin;
-	double ret;
+	char *coinbase;
 
 	/* Leave enough room for 25 byte generation address + length counter */
-	coinbase = alloca(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len + 26 + wb->coinb3len);
+	coinbase = share_coinbase(sub->slot, wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen +
+				  wb->enonce2varlen + wb->coinb2len + 26 + wb->coinb3len);
 	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
 	cblen = wb->coinb1len;
 	memcpy(coinbase + cblen, &client->enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
 	cblen += wb->enonce1constlen + wb->enonce1varlen;
-	hex2bin(coinbase + cblen, nonce2, wb->enonce2varlen);
+	hex2bin(coinbase + cblen, sub->nonce2, wb->enonce2varlen);
 	cblen += wb->enonce2varlen;
 
 	ck_rlock(&sdata->instance_lock);
@@ -5864,74 +7529,105 @@ static double submission_diff(sdata_t *sdata, const stratum_instance_t *client,
 
 	cblen += cb2len;
 
-	gen_hash((uchar *)coinbase, merkle_root, cblen);
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < wb->merkles; i++) {
-		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
-	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip_32(swap32, data32);
-
-	/* Copy the cached header binary and insert the merkle root */
-	memcpy(data, wb->headerbin, 80);
-	memcpy(data + 36, merkle_root, 32);
+	coinbase_hash(wb, (uchar *)coinbase, cblen, cbhash);
+	merkle_root(root, cbhash, (uchar *)wb->merklebin, wb->merkles);
+	share_header(sub->swap, (uchar *)wb->headerbin, root, sub->version_mask32, sub->nonce, sub->ntime32);
 
-	/* Update nVersion when version_mask is in use */
-	if (version_mask) {
-		version_mask = htobe32(version_mask);
-		data32 = (uint32_t *)data;
-		*data32 |= version_mask;
-	}
-
-	/* Insert the nonce value into the data */
-	hex2bin(&benonce32, nonce, 4);
-	data32 = (uint32_t *)(data + 64 + 12);
-	*data32 = benonce32;
-
-	/* Insert the ntime value into the data */
-	data32 = (uint32_t *)(data + 68);
-	*data32 = htobe32(ntime32);
+	sub->coinbase = coinbase;
+	sub->cblen = cblen;
+	sub->hashed = true;
+}
 
-	/* Hash the share */
-	data32 = (uint32_t *)data;
-	swap32 = (uint32_t *)swap;
-	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, hash);
+/* Calculate the diff of a submission once its header has been hashed into
+ * sub->hash. Needs to be entered with workbase readcount and client holding a
+ * ref count. */
+static double submission_diff(const stratum_instance_t *client, const workbase_t *wb,
+			      const submission_t *sub)
+{
+	double ret;
 
 	/* Calculate the diff of the share here */
-	ret = diff_from_target(hash);
+	ret = diff_from_target((uchar *)sub->hash);
 
 	/* Test we haven't solved a block regardless of share status */
-	test_blocksolve(client, wb, swap, hash, ret, coinbase, cblen, nonce2, nonce, ntime32, version_mask, stale);
+	test_blocksolve(client, wb, sub->swap, sub->hash, ret, sub->coinbase, sub->cblen,
+			sub->nonce2, sub->nonce, sub->ntime32, htobe32(sub->version_mask32),
+			sub->stale);
 
 	return ret;
 }
 
-/* Optimised for the common case where shares are new */
-static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
+/* Take the next free share entry from a partition's slabs, getting a new slab
+ * from the pool when the current one is full. Must be entered with the
+ * partition lock held. */
+static share_t *__share_from_slab(sdata_t *sdata, share_partition_t *part)
 {
-	share_t *share = ckzalloc(sizeof(share_t)), *match = NULL;
-	bool ret = true;
+	share_slab_t *slab = part->slabs;
 
-	memcpy(share->hash, hash, 32);
-	share->workbase_id = wb_id;
+	if (unlikely(!slab || slab->used >= SHARE_SLAB_SHARES)) {
+		mutex_lock(&sdata->share_slab_lock);
+		slab = sdata->share_slabs;
+		if (likely(slab)) {
+			DL_DELETE(sdata->share_slabs, slab);
+			sdata->free_share_slabs--;
+		}
+		mutex_unlock(&sdata->share_slab_lock);
+		if (unlikely(!slab))
+			slab = ckzalloc(sizeof(share_slab_t));
+		/* Keep the slab in use at the head of the list */
+		DL_PREPEND(part->slabs, slab);
+	}
+	return &slab->shares[slab->used++];
+}
 
-	mutex_lock(&sdata->share_lock);
-	sdata->shares_generated++;
-	HASH_FIND(hh, sdata->shares, hash, 32, match);
-	if (likely(!match))
-		HASH_ADD(hh, sdata->shares, hash, 32, share);
-	mutex_unlock(&sdata->share_lock);
+/* Must be entered with share_lock write lock held */
+static share_partition_t *__create_share_partition(sdata_t *sdata, const int64_t wb_id)
+{
+	share_partition_t *part;
 
-	if (unlikely(match)) {
-		dealloc(share);
-		ret = false;
-	}
-	return ret;
+	HASH_FIND_I64(sdata->share_partitions, &wb_id, part);
+	if (part)
+		return part;
+	part = ckzalloc(sizeof(share_partition_t));
+	part->workbase_id = wb_id;
+	mutex_init(&part->lock);
+	HASH_ADD_I64(sdata->share_partitions, workbase_id, part);
+	return part;
+}
+
+/* Optimised for the common case where shares are new and the workbase's
+ * partition already exists, only needing the share_lock read lock and the
+ * partition's own lock. */
+static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
+{
+	share_partition_t *part;
+	share_t *share, *match = NULL;
+	bool write = false;
+
+	ck_rlock(&sdata->share_lock);
+	HASH_FIND_I64(sdata->share_partitions, &wb_id, part);
+	if (unlikely(!part)) {
+		ck_runlock(&sdata->share_lock);
+		ck_wlock(&sdata->share_lock);
+		write = true;
+		part = __create_share_partition(sdata, wb_id);
+	}
+	mutex_lock(&part->lock);
+	part->generated++;
+	HASH_FIND(hh, part->shares, hash, 32, match);
+	if (likely(!match)) {
+		share = __share_from_slab(sdata, part);
+		memcpy(share->hash, hash, 32);
+		HASH_ADD(hh, part->shares, hash, 32, share);
+		part->count++;
+	}
+	mutex_unlock(&part->lock);
+	if (unlikely(write))
+		ck_wunlock(&sdata->share_lock);
+	else
+		ck_runlock(&sdata->share_lock);
+
+	return !match;
 }
 
 static void update_client(const stratum_instance_t *client, const int64_t client_id);
@@ -5993,138 +7689,292 @@ static void check_best_diff(sdata_t *sdata, user_instance_t *user,worker_instanc
 
 #define JSON_ERR(err) json_string(SHARE_ERR(err))
 
-/* Needs to be entered with client holding a ref count. */
-static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
-			    const json_t *params_val, json_t **err_val)
+/* Parse a submission and build its header for hashing, leaving the rest of
+ * the processing to complete_submit once the header has been hashed. Needs to
+ * be entered with client holding a ref count. */
+static void parse_submit(stratum_instance_t *client, submission_t *sub, const json_params_t *jp)
 {
-	bool share = false, result = false, invalid = true, submit = false, stale = false;
-	const char *workername, *job_id, *ntime, *version_mask;
-	double diff = client->diff, wdiff = 0, sdiff = -1;
-	char hexhash[68] = {}, sharehash[32], cdfield[64];
-	user_instance_t *user = client->user_instance;
-	char *fname = NULL, *s, *nonce, *nonce2;
-	uint32_t ntime32, version_mask32 = 0;
-	sdata_t *sdata = client->sdata;
-	enum share_err err = SE_NONE;
+	const char *workername, *job_id, *version_mask;
+	const json_t *params_val = jp->params;
 	ckpool_t *ckp = client->ckp;
-	char idstring[24] = {};
-	workbase_t *wb = NULL;
-	uchar hash[32];
+	sdata_t *sdata = client->sdata;
+	json_t *json_msg = sub->json_msg;
+	char *nonce, *nonce2;
+	workbase_t *wb;
 	int nlen, len;
-	time_t now_t;
-	json_t *val;
-	int64_t id;
-	ts_t now;
-	FILE *fp;
-
-	ts_realtime(&now);
-	now_t = now.tv_sec;
-	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 
-	if (unlikely(!json_is_array(params_val))) {
-		err = SE_NOT_ARRAY;
-		*err_val = JSON_ERR(err);
-		goto out;
-	}
-	if (unlikely(json_array_size(params_val) < 5)) {
-		err = SE_INVALID_SIZE;
-		*err_val = JSON_ERR(err);
-		goto out;
+	sub->client = client;
+	sub->id = 0;
+	sub->err = SE_NONE;
+	ts_realtime(&sub->now);
+	sprintf(sub->cdfield, "%lu,%lu", sub->now.tv_sec, sub->now.tv_nsec);
+
+	if (jp->submit) {
+		stratum_submit_t *submit = jp->submit;
+
+		/* The connector only tokenises at least 5 string params */
+		workername = submit->workername;
+		job_id = submit->job_id;
+		nonce2 = submit->nonce2;
+		sub->ntime = submit->ntime;
+		nonce = submit->nonce;
+		version_mask = submit->nparams > 5 ? submit->version_mask : NULL;
+	} else {
+		if (unlikely(!json_is_array(params_val))) {
+			sub->err = SE_NOT_ARRAY;
+			sub->err_val = JSON_ERR(sub->err);
+			return;
+		}
+		if (unlikely(json_array_size(params_val) < 5)) {
+			sub->err = SE_INVALID_SIZE;
+			sub->err_val = JSON_ERR(sub->err);
+			return;
+		}
+		workername = json_string_value(json_array_get(params_val, 0));
+		job_id = json_string_value(json_array_get(params_val, 1));
+		nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
+		sub->ntime = json_string_value(json_array_get(params_val, 3));
+		nonce = (char *)json_string_value(json_array_get(params_val, 4));
+		version_mask = json_string_value(json_array_get(params_val, 5));
 	}
-	workername = json_string_value(json_array_get(params_val, 0));
 	if (unlikely(!workername || !strlen(workername))) {
-		err = SE_NO_USERNAME;
-		*err_val = JSON_ERR(err);
-		goto out;
+		sub->err = SE_NO_USERNAME;
+		sub->err_val = JSON_ERR(sub->err);
+		return;
 	}
-	job_id = json_string_value(json_array_get(params_val, 1));
 	if (unlikely(!job_id || !strlen(job_id))) {
-		err = SE_NO_JOBID;
-		*err_val = JSON_ERR(err);
-		goto out;
+		sub->err = SE_NO_JOBID;
+		sub->err_val = JSON_ERR(sub->err);
+		return;
 	}
-	nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
 	if (unlikely(!nonce2 || !strlen(nonce2) || !validhex(nonce2))) {
-		err = SE_NO_NONCE2;
-		*err_val = JSON_ERR(err);
-		goto out;
+		sub->err = SE_NO_NONCE2;
+		sub->err_val = JSON_ERR(sub->err);
+		return;
 	}
-	ntime = json_string_value(json_array_get(params_val, 3));
-	if (unlikely(!ntime || !strlen(ntime) || !validhex(ntime))) {
-		err = SE_NO_NTIME;
-		*err_val = JSON_ERR(err);
-		goto out;
+	if (unlikely(!sub->ntime || !strlen(sub->ntime) || !validhex(sub->ntime))) {
+		sub->err = SE_NO_NTIME;
+		sub->err_val = JSON_ERR(sub->err);
+		return;
 	}
-	nonce = (char *)json_string_value(json_array_get(params_val, 4));
 	if (unlikely(!nonce || strlen(nonce) < 8 || !validhex(nonce))) {
-		err = SE_NO_NONCE;
-		*err_val = JSON_ERR(err);
-		goto out;
+		sub->err = SE_NO_NONCE;
+		sub->err_val = JSON_ERR(sub->err);
+		return;
 	}
 
-	version_mask = json_string_value(json_array_get(params_val, 5));
 	if (version_mask && strlen(version_mask) && validhex(version_mask)) {
-		sscanf(version_mask, "%x", &version_mask32);
+		sscanf(version_mask, "%x", &sub->version_mask32);
 		// check version mask
-		if (version_mask32 && ((~ckp->version_mask) & version_mask32) != 0) {
+		if (sub->version_mask32 && ((~ckp->version_mask) & sub->version_mask32) != 0) {
 			// means client changed some bits which server doesn't allow to change
-			err = SE_INVALID_VERSION_MASK;
-			*err_val = JSON_ERR(err);
-			goto out;
+			sub->err = SE_INVALID_VERSION_MASK;
+			sub->err_val = JSON_ERR(sub->err);
+			return;
 		}
 	}
 	if (safecmp(workername, client->workername)) {
-		err = SE_WORKER_MISMATCH;
-		*err_val = JSON_ERR(err);
-		goto out;
+		sub->err = SE_WORKER_MISMATCH;
+		sub->err_val = JSON_ERR(sub->err);
+		return;
 	}
-	sscanf(job_id, "%lx", &id);
-	sscanf(ntime, "%x", &ntime32);
+	sscanf(job_id, "%lx", &sub->id);
+	sscanf(sub->ntime, "%x", &sub->ntime32);
+	sub->nonce2 = nonce2;
+	sub->nonce = nonce;
 
-	share = true;
+	sub->share = true;
 
-	if (unlikely(!sdata->current_workbase))
-		return json_boolean(false);
+	if (unlikely(!sdata->current_workbase)) {
+		sub->noworkbase = true;
+		return;
+	}
 
-	wb = get_workbase(sdata, id);
+	wb = get_workbase(sdata, sub->id);
 	if (unlikely(!wb)) {
-		id = sdata->current_workbase->id;
-		err = SE_INVALID_JOBID;
-		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
-		strncpy(idstring, job_id, 19);
-		ASPRINTF(&fname, "%s.sharelog", sdata->current_workbase->logdir);
-		goto out_nowb;
+		sub->id = sdata->current_workbase->id;
+		sub->err = SE_INVALID_JOBID;
+		json_set_string(json_msg, "reject-reason", SHARE_ERR(sub->err));
+		strncpy(sub->idstring, job_id, 19);
+		ASPRINTF(&sub->fname, "%s.%s", sdata->current_workbase->logdir, SHARELOG_EXT(ckp));
+		return;
 	}
-	wdiff = wb->diff;
-	strncpy(idstring, wb->idstring, 20);
-	ASPRINTF(&fname, "%s.sharelog", wb->logdir);
+	strncpy(sub->idstring, wb->idstring, 20);
+	ASPRINTF(&sub->fname, "%s.%s", wb->logdir, SHARELOG_EXT(ckp));
 	/* Fix broken clients sending too many chars. Nonce2 is part of the
-	 * read only json so use a temporary variable and modify it. */
+	 * read only json so use a copy in the submission and modify it, which
+	 * must fit the workbase's nonce2 length. */
 	len = wb->enonce2varlen * 2;
+	if (unlikely(len >= (int)sizeof(sub->nonce2buf))) {
+		put_workbase(sdata, wb);
+		sub->err = SE_INVALID_NONCE2;
+		json_set_string(json_msg, "reject-reason", SHARE_ERR(sub->err));
+		return;
+	}
+	sub->wb = wb;
 	nlen = strlen(nonce2);
 	if (unlikely(nlen != len)) {
 		if (nlen > len) {
-			nonce2 = strdupa(nonce2);
-			nonce2[len] = '\0';
+			memcpy(sub->nonce2buf, nonce2, len);
 		} else if (nlen < len) {
-			char *tmp = nonce2;
-
-			nonce2 = strdupa("0000000000000000");
-			memcpy(nonce2, tmp, nlen);
-			nonce2[len] = '\0';
+			memset(sub->nonce2buf, '0', len);
+			memcpy(sub->nonce2buf, nonce2, nlen);
 		}
+		sub->nonce2buf[len] = '\0';
+		sub->nonce2 = sub->nonce2buf;
 	}
 	/* Same with nonce, but we need at least 8 chars. We checked for this
 	 * earlier. */
 	len = 8;
 	nlen = strlen(nonce);
 	if (unlikely(nlen > len)) {
-		nonce = strdupa(nonce);
-		nonce[len] = '\0';
+		memcpy(sub->noncebuf, nonce, len);
+		sub->noncebuf[len] = '\0';
+		sub->nonce = sub->noncebuf;
+	}
+	if (sub->id < sdata->blockchange_id)
+		sub->stale = true;
+	submission_header(sdata, client, wb, sub);
+}
+
+/* Pack the fields of a share for the share logger to write as a binary
+ * record, the equivalent of the json share log entry. */
+static sharelog_t *sharelog_binary(ckpool_t *ckp, const stratum_instance_t *client,
+				   const user_instance_t *user, const submission_t *sub,
+				   const int64_t id, const double diff, const double sdiff,
+				   const char *hexhash, const bool result, json_t *json_msg)
+{
+	const char *interned[SHARELOG_INTERNED], *inlined[SHARELOG_INLINE];
+	int interned_len[SHARELOG_INTERNED], inlined_len[SHARELOG_INLINE];
+	int len = sizeof(struct sharelog_share), i;
+	struct sharelog_share *share;
+	sharelog_t *sharelog;
+	char *str;
+
+	interned[SHARELOG_ENONCE1] = client->enonce1;
+	interned[SHARELOG_REJECT] = json_string_value(json_object_get(json_msg, "reject-reason"));
+	interned[SHARELOG_ERROR] = json_string_value(sub->err_val);
+	interned[SHARELOG_CREATEINET] = ckp->serverurl[client->server];
+	interned[SHARELOG_WORKERNAME] = client->workername;
+	interned[SHARELOG_USERNAME] = user->username;
+	interned[SHARELOG_ADDRESS] = client->address;
+	interned[SHARELOG_AGENT] = client->useragent;
+	inlined[SHARELOG_NONCE2] = sub->nonce2;
+	inlined[SHARELOG_NONCE] = sub->nonce;
+	inlined[SHARELOG_NTIME] = sub->ntime;
+	/* Full hashes are stored binary instead */
+	inlined[SHARELOG_HASH] = strlen(hexhash) == 64 ? NULL : hexhash;
+
+	for (i = 0; i < SHARELOG_INTERNED; i++) {
+		interned_len[i] = interned[i] ? MIN(strlen(interned[i]), SHARELOG_MAXSTR) : -1;
+		len += interned_len[i] + 1;
+	}
+	for (i = 0; i < SHARELOG_INLINE; i++) {
+		inlined_len[i] = inlined[i] ? MIN(strlen(inlined[i]), SHARELOG_MAXSTR) : 0;
+		len += inlined_len[i];
+	}
+
+	sharelog = ckalloc(sizeof(sharelog_t));
+	sharelog->buf = ckzalloc(len);
+	sharelog->len = len;
+	sharelog->binary = true;
+
+	share = (struct sharelog_share *)sharelog->buf;
+	share->rec.type = SHARELOG_REC_SHARE;
+	if (result)
+		share->rec.flags |= SHARELOG_RESULT;
+	share->workinfoid = id;
+	share->clientid = ckp->remote ? client->virtualid : client->id;
+	share->diff = diff;
+	share->sdiff = sdiff;
+	share->createsec = sub->now.tv_sec;
+	share->creatensec = sub->now.tv_nsec;
+	share->errn = sub->err;
+	if (!inlined[SHARELOG_HASH]) {
+		share->rec.flags |= SHARELOG_HASHBIN;
+		hex2bin(share->hash, hexhash, 32);
+	}
+
+	str = sharelog->buf + sizeof(struct sharelog_share);
+	for (i = 0; i < SHARELOG_INTERNED; i++) {
+		if (interned_len[i] < 0)
+			continue;
+		share->ids[i] = 1;
+		memcpy(str, interned[i], interned_len[i]);
+		str += interned_len[i] + 1;
+	}
+	for (i = 0; i < SHARELOG_INLINE; i++) {
+		if (!inlined[i]) {
+			if (i != SHARELOG_HASH)
+				share->inlinelen[i] = SHARELOG_ABSENT;
+			continue;
+		}
+		share->inlinelen[i] = inlined_len[i];
+		memcpy(str, inlined[i], inlined_len[i]);
+		str += inlined_len[i];
+	}
+	return sharelog;
+}
+
+/* Share logging must never stall share processing nor lose records, so those
+ * the share logger's queue has no room for are spilled to an unbounded
+ * overflow list. Once anything is spilled all records are until the share
+ * logger has caught up, keeping them in order. */
+static void add_sharelog(ckpool_t *ckp, sharelog_t *sharelog)
+{
+	sdata_t *sdata = ckp->sdata;
+	static time_t last_warn;
+	time_t now_t;
+
+	if (likely(!__atomic_load_n(&sdata->sharelog_overflow, __ATOMIC_ACQUIRE) &&
+		   ckmsgq_tryadd(sdata->sharelogq, sharelog)))
+		return;
+
+	now_t = time(NULL);
+	mutex_lock(&sdata->sharelog_lock);
+	DL_APPEND(sdata->sharelog_overflow, sharelog);
+	sdata->sharelogs_spilled++;
+	if (now_t - last_warn >= 60) {
+		last_warn = now_t;
+		LOGWARNING("Share logger falling behind, spilled %"PRId64" share log records",
+			   sdata->sharelogs_spilled);
 	}
-	if (id < sdata->blockchange_id)
-		stale = true;
-	sdiff = submission_diff(sdata, client, wb, nonce2, ntime32, version_mask32, nonce, hash, stale);
+	mutex_unlock(&sdata->sharelog_lock);
+}
+
+/* Complete a submission from parse_submit once its header, if any, has been
+ * hashed into sub->hash. Needs to be entered with client holding a ref count. */
+static json_t *complete_submit(submission_t *sub)
+{
+	bool result = false, invalid = true, submit = false;
+	stratum_instance_t *client = sub->client;
+	double diff = client->diff, wdiff = 0, sdiff = -1;
+	char hexhash[68] = {}, sharehash[32];
+	user_instance_t *user = client->user_instance;
+	sdata_t *sdata = client->sdata;
+	ckpool_t *ckp = client->ckp;
+	json_t *json_msg = sub->json_msg;
+	workbase_t *wb = sub->wb;
+	int64_t id = sub->id, start;
+	sharelog_t *sharelog;
+	time_t now_t;
+	json_t *val;
+
+	now_t = sub->now.tv_sec;
+
+	if (!sub->share)
+		goto out;
+
+	if (unlikely(sub->noworkbase))
+		return json_boolean(false);
+
+	if (unlikely(!wb))
+		goto out_nowb;
+
+	wdiff = wb->diff;
+	start = monotonic_ns();
+	sdiff = submission_diff(client, wb, sub);
+	stage_latency(STAGE_DIFF, start);
 	if (sdiff > client->best_diff) {
 		worker_instance_t *worker = client->worker_instance;
 
@@ -6133,17 +7983,17 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 			worker->workername, client->identity, sdiff);
 		check_best_diff(sdata, user, worker, sdiff, client);
 	}
-	bswap_256(sharehash, hash);
+	bswap_256(sharehash, sub->hash);
 	__bin2hex(hexhash, sharehash, 32);
 
-	if (stale) {
+	if (sub->stale) {
 		/* Accept shares if they're received on remote nodes before the
 		 * workbase was retired. */
 		if (client->latency) {
 			int latency;
 			tv_t now_tv;
 
-			ts_to_tv(&now_tv, &now);
+			ts_to_tv(&now_tv, &sub->now);
 			latency = ms_tvdiff(&now_tv, &wb->retired);
 			if (latency < client->latency) {
 				LOGDEBUG("Accepting %dms late share from client %s",
@@ -6151,15 +8001,15 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 				goto no_stale;
 			}
 		}
-		err = SE_STALE;
-		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
+		sub->err = SE_STALE;
+		json_set_string(json_msg, "reject-reason", SHARE_ERR(sub->err));
 		goto out_submit;
 	}
 no_stale:
 	/* Ntime cannot be less, but allow forward ntime rolling up to max */
-	if (ntime32 < wb->ntime32 || ntime32 > wb->ntime32 + 7000) {
-		err = SE_NTIME_INVALID;
-		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
+	if (sub->ntime32 < wb->ntime32 || sub->ntime32 > wb->ntime32 + 7000) {
+		sub->err = SE_NTIME_INVALID;
+		json_set_string(json_msg, "reject-reason", SHARE_ERR(sub->err));
 		goto out_put;
 	}
 	invalid = false;
@@ -6183,37 +8033,55 @@ out_nowb:
 
 		suffix_string(wdiff, wdiffsuffix, 16, 0);
 		if (sdiff >= diff) {
-			if (new_share(sdata, hash, id)) {
+			if (new_share(sdata, sub->hash, id)) {
 				LOGINFO("Accepted client %s share diff %.1f/%.0f/%s: %s",
 					client->identity, sdiff, diff, wdiffsuffix, hexhash);
 				result = true;
 			} else {
-				err = SE_DUPE;
-				json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
+				sub->err = SE_DUPE;
+				json_set_string(json_msg, "reject-reason", SHARE_ERR(sub->err));
 				LOGINFO("Rejected client %s dupe diff %.1f/%.0f/%s: %s",
 					client->identity, sdiff, diff, wdiffsuffix, hexhash);
 				submit = false;
 			}
 		} else {
-			err = SE_HIGH_DIFF;
+			sub->err = SE_HIGH_DIFF;
 			LOGINFO("Rejected client %s high diff %.1f/%.0f/%s: %s",
 				client->identity, sdiff, diff, wdiffsuffix, hexhash);
-			json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
+			json_set_string(json_msg, "reject-reason", SHARE_ERR(sub->err));
 			submit = false;
 		}
 	}  else
-		LOGINFO("Rejected client %s invalid share %s", client->identity, SHARE_ERR(err));
+		LOGINFO("Rejected client %s invalid share %s", client->identity, SHARE_ERR(sub->err));
 
 	/* Submit share to upstream pool in proxy mode. We submit valid and
 	 * stale shares and filter out the rest. */
 	if (wb && wb->proxy && submit) {
 		LOGINFO("Submitting share upstream: %s", hexhash);
-		submit_share(client, id, nonce2, ntime, nonce);
+		submit_share(client, id, sub->nonce2, sub->ntime, sub->nonce);
 	}
 
+	start = monotonic_ns();
 	add_submit(ckp, client, diff, result, submit);
+	stage_latency(STAGE_ADD, start);
+
+	if (ckp->remote)
+		batch_remote_share(ckp, sdata, client->workername, diff, sdiff);
 
-	/* Now write to the pool's sharelog. */
+	/* Now write to the pool's sharelog, only building the json entry if
+	 * it's needed for a json share log. */
+	if (!ckp->logshares)
+		goto out;
+	if (ckp->logsharebin) {
+		sharelog = sharelog_binary(ckp, client, user, sub, id, diff, sdiff, hexhash,
+					   result, json_msg);
+
+		/* The share logger takes ownership of fname */
+		sharelog->fname = sub->fname;
+		sub->fname = NULL;
+		add_sharelog(ckp, sharelog);
+		goto out;
+	}
 	val = json_object();
 	json_set_int(val, "workinfoid", id);
 	if (ckp->remote)
@@ -6221,43 +8089,35 @@ out_nowb:
 	else
 		json_set_int64(val, "clientid", client->id);
 	json_set_string(val, "enonce1", client->enonce1);
-	json_set_string(val, "nonce2", nonce2);
-	json_set_string(val, "nonce", nonce);
-	json_set_string(val, "ntime", ntime);
+	json_set_string(val, "nonce2", sub->nonce2);
+	json_set_string(val, "nonce", sub->nonce);
+	json_set_string(val, "ntime", sub->ntime);
 	json_set_double(val, "diff", diff);
 	json_set_double(val, "sdiff", sdiff);
 	json_set_string(val, "hash", hexhash);
 	json_set_bool(val, "result", result);
 	json_object_set(val, "reject-reason", json_object_get(json_msg, "reject-reason"));
-	json_object_set(val, "error", *err_val);
-	json_set_int(val, "errn", err);
-	json_set_string(val, "createdate", cdfield);
+	json_object_set(val, "error", sub->err_val);
+	json_set_int(val, "errn", sub->err);
+	json_set_string(val, "createdate", sub->cdfield);
 	json_set_string(val, "createby", "code");
-	json_set_string(val, "createcode", __func__);
+	json_set_string(val, "createcode", "parse_submit");
 	json_set_string(val, "createinet", ckp->serverurl[client->server]);
 	json_set_string(val, "workername", client->workername);
 	json_set_string(val, "username", user->username);
         json_set_string(val, "address", client->address);
         json_set_string(val, "agent", client->useragent);
 
-	if (ckp->logshares) {
-		fp = fopen(fname, "ae");
-		if (likely(fp)) {
-			s = json_dumps(val, JSON_EOL);
-			len = strlen(s);
-			len = fprintf(fp, "%s", s);
-			free(s);
-			fclose(fp);
-			if (unlikely(len < 0))
-				LOGERR("Failed to fwrite to %s", fname);
-		} else
-			LOGERR("Failed to fopen %s", fname);
-	}
-	if (ckp->remote)
-		upstream_json_msgtype(ckp, val, SM_SHARE);
+	sharelog = ckzalloc(sizeof(sharelog_t));
+	/* The share logger takes ownership of fname */
+	sharelog->fname = sub->fname;
+	sub->fname = NULL;
+	sharelog->buf = json_dumps(val, JSON_EOL);
+	sharelog->len = strlen(sharelog->buf);
+	add_sharelog(ckp, sharelog);
 	json_decref(val);
 out:
-	if (!sdata->wbincomplete && ((!result && !submit) || !share)) {
+	if (!sdata->wbincomplete && ((!result && !submit) || !sub->share)) {
 		/* Is this the first in a run of invalids? */
 		if (client->first_invalid < client->last_share.tv_sec || !client->first_invalid)
 			client->first_invalid = now_t;
@@ -6283,7 +8143,7 @@ out:
 		client->reject = 0;
 	}
 
-	if (!share) {
+	if (!sub->share) {
 		if (ckp->remote) {
 			val = json_object();
 			if (ckp->remote)
@@ -6296,17 +8156,17 @@ out:
 			json_set_int(val, "workinfoid", sdata->current_workbase->id);
 			json_set_string(val, "workername", client->workername);
 			json_set_string(val, "username", user->username);
-			json_object_set(val, "error", *err_val);
-			json_set_int(val, "errn", err);
-			json_set_string(val, "createdate", cdfield);
+			json_object_set(val, "error", sub->err_val);
+			json_set_int(val, "errn", sub->err);
+			json_set_string(val, "createdate", sub->cdfield);
 			json_set_string(val, "createby", "code");
-			json_set_string(val, "createcode", __func__);
+			json_set_string(val, "createcode", "parse_submit");
 			json_set_string(val, "createinet", ckp->serverurl[client->server]);
 			json_decref(val);
 		}
 		LOGINFO("Invalid share from client %s: %s", client->identity, client->workername);
 	}
-	free(fname);
+	free(sub->fname);
 	return json_boolean(result);
 }
 
@@ -6392,31 +8252,218 @@ static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user,
 	return val;
 }
 
-/* Sends a stratum update with a unique coinb2 for every client. Avoid
- * recursive locking. */
+/* Users whose notifies are built per snotifier job */
+#define NOTIFY_BATCH 256
+
+/* Placeholder coinb2 in the notify template, never valid hex */
+#define NOTIFY_COINB2 "COINB2"
+
+/* One broadcast of per user notifies for a workbase */
+typedef struct notify_batch {
+	const workbase_t *wb;
+	char *tmpl; /* Notify serialised with the placeholder coinb2 */
+	int headlen; /* Length of tmpl up to where coinb2 goes */
+	const char *tail; /* Rest of tmpl following coinb2 */
+	int taillen;
+
+	int users;
+	user_instance_t **user;
+	struct userwb **userwb; /* Existing userwb, or NULL to generate one */
+	struct userwb **newwb; /* Generated when there was none */
+	ckshared_t **shared; /* Each user's serialised notify */
+
+	int jobs; /* snotifier jobs still running, protected by notify_lock */
+} notify_batch_t;
+
+typedef struct notify_job {
+	sdata_t *sdata;
+	notify_batch_t *batch;
+	int start;
+	int end;
+} notify_job_t;
+
+/* Serialise the notify for wb once with a placeholder coinb2 and split it
+ * there so every user's notify is only a concatenation. */
+static bool notify_template(const workbase_t *wb, const bool clean, notify_batch_t *batch)
+{
+	char *marker;
+	json_t *val;
+
+	JSON_CPACK(val, "{s:[ssssOsssb],s:o,s:s}",
+			"params",
+			wb->idstring,
+			wb->prevhash,
+			wb->coinb1,
+			NOTIFY_COINB2,
+			wb->merkle_array,
+			wb->bbversion,
+			wb->nbit,
+			wb->ntime,
+			clean,
+			"id", json_null(),
+			"method", "mining.notify");
+	batch->tmpl = json_dumps(val, JSON_EOL | JSON_COMPACT);
+	json_decref(val);
+	if (unlikely(!batch->tmpl))
+		return false;
+	marker = strstr(batch->tmpl, "\"" NOTIFY_COINB2 "\"");
+	if (unlikely(!marker)) {
+		LOGWARNING("Failed to find coinb2 in notify template");
+		dealloc(batch->tmpl);
+		return false;
+	}
+	batch->headlen = marker + 1 - batch->tmpl;
+	batch->tail = marker + 1 + strlen(NOTIFY_COINB2);
+	batch->taillen = strlen(batch->tail);
+	return true;
+}
+
+/* Generate any missing coinb2 and serialise the notify for users start to end
+ * of batch. Takes no locks as users and the workbase stay put and only the
+ * slots of these users are written. */
+static void build_user_notifies(notify_batch_t *batch, const int start, const int end)
+{
+	int i;
+
+	for (i = start; i < end; i++) {
+		struct userwb *userwb = batch->userwb[i];
+		int len;
+		char *buf;
+
+		if (!userwb)
+			userwb = batch->newwb[i] = new_userwb(batch->wb, batch->user[i]);
+		len = batch->headlen + userwb->coinb2len * 2 + batch->taillen;
+		buf = ckalloc(len + 1);
+		memcpy(buf, batch->tmpl, batch->headlen);
+		memcpy(buf + batch->headlen, userwb->coinb2, userwb->coinb2len * 2);
+		memcpy(buf + len - batch->taillen, batch->tail, batch->taillen + 1);
+		batch->shared[i] = create_ckshared(buf);
+	}
+}
+
+static void snotify_process(ckpool_t __maybe_unused *ckp, notify_job_t *job)
+{
+	notify_batch_t *batch = job->batch;
+	sdata_t *sdata = job->sdata;
+
+	build_user_notifies(batch, job->start, job->end);
+	free(job);
+
+	mutex_lock(&sdata->notify_lock);
+	if (!--batch->jobs)
+		pthread_cond_broadcast(&sdata->notify_cond);
+	mutex_unlock(&sdata->notify_lock);
+}
+
+/* Sends a stratum update with a unique coinb2 for every user with clients,
+ * generated for them on demand and cached in their userwbs. Notifies are
+ * serialised once per user from a template, split across the snotifier
+ * threads when there are many users, and the list of sends is then built
+ * under lock and appended in bulk. */
 static void stratum_broadcast_updates(sdata_t *sdata, bool clean)
 {
-	stratum_instance_t *client, *tmp;
-	json_t *json_msg;
+	user_instance_t *user, *tmpuser;
+	stratum_instance_t *client;
+	ckmsg_t *bulk_send = NULL;
+	notify_batch_t batch;
+	int i, messages = 0;
+	workbase_t *wb;
 
-	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		if (!client->user_instance)
+	memset(&batch, 0, sizeof(batch));
+
+	ck_rlock(&sdata->workbase_lock);
+	wb = sdata->current_workbase;
+	__atomic_fetch_add(&wb->readcount, 1, __ATOMIC_RELAXED);
+	ck_runlock(&sdata->workbase_lock);
+
+	batch.wb = wb;
+	if (unlikely(!notify_template(wb, clean, &batch)))
+		goto out;
+
+	ck_rlock(&sdata->instance_lock);
+	i = HASH_COUNT(sdata->user_instances);
+	batch.user = ckalloc(sizeof(user_instance_t *) * (i + 1));
+	batch.userwb = ckalloc(sizeof(struct userwb *) * (i + 1));
+	HASH_ITER(hh, sdata->user_instances, user, tmpuser) {
+		int64_t id = wb->id;
+
+		if (!user->clients || !user->btcaddress)
 			continue;
-		__inc_instance_ref(client);
-		ck_wunlock(&sdata->instance_lock);
+		batch.user[batch.users] = user;
+		HASH_FIND_I64(user->userwbs, &id, batch.userwb[batch.users]);
+		batch.users++;
+	}
+	ck_runlock(&sdata->instance_lock);
+
+	batch.newwb = ckzalloc(sizeof(struct userwb *) * (batch.users + 1));
+	batch.shared = ckalloc(sizeof(ckshared_t *) * (batch.users + 1));
+	if (batch.users > NOTIFY_BATCH && sdata->snotifyq) {
+		batch.jobs = (batch.users + NOTIFY_BATCH - 1) / NOTIFY_BATCH;
+		for (i = 0; i < batch.users; i += NOTIFY_BATCH) {
+			notify_job_t *job = ckalloc(sizeof(notify_job_t));
+
+			job->sdata = sdata;
+			job->batch = &batch;
+			job->start = i;
+			job->end = MIN(i + NOTIFY_BATCH, batch.users);
+			ckmsgq_add(sdata->snotifyq, job);
+		}
+		mutex_lock(&sdata->notify_lock);
+		while (batch.jobs)
+			cond_wait(&sdata->notify_cond, &sdata->notify_lock);
+		mutex_unlock(&sdata->notify_lock);
+	} else
+		build_user_notifies(&batch, 0, batch.users);
 
-		ck_rlock(&sdata->workbase_lock);
-		json_msg = __user_notify(sdata->current_workbase, client->user_instance, clean);
-		ck_runlock(&sdata->workbase_lock);
+	ck_wlock(&sdata->instance_lock);
+	for (i = 0; i < batch.users; i++) {
+		ckshared_t *shared = batch.shared[i];
+		json_t *json_msg = NULL;
 
-		if (likely(json_msg))
-			stratum_add_send(sdata, json_msg, client->id, SM_UPDATE);
+		user = batch.user[i];
+		if (batch.newwb[i])
+			__add_userwb(sdata, user, batch.newwb[i]);
 
-		ck_wlock(&sdata->instance_lock);
-		__dec_instance_ref(client);
+		DL_FOREACH2(user->clients, client, user_next) {
+			ckmsg_t *client_msg;
+			smsg_t *msg;
+
+			if (!client_active(client))
+				continue;
+
+			client_msg = ckslab_alloc(ckmsg_slab);
+			msg = ckslab_zalloc(smsg_slab);
+			if (subclient(client->id)) {
+				if (!json_msg)
+					json_msg = json_loads(shared->buf, 0, NULL);
+				msg->json_msg = json_deep_copy(json_msg);
+				json_set_string(msg->json_msg, "node.method", stratum_msgs[SM_UPDATE]);
+			} else {
+				shared->refs++;
+				msg->shared = shared;
+			}
+			msg->client_id = client->id;
+			client_msg->data = msg;
+			DL_APPEND(bulk_send, client_msg);
+			messages++;
+		}
+		if (json_msg)
+			json_decref(json_msg);
+		/* Drops the creator reference, freeing it if unused */
+		put_ckshared(shared);
 	}
 	ck_wunlock(&sdata->instance_lock);
+
+	if (likely(bulk_send))
+		ssend_bulk_append(sdata, bulk_send, messages);
+
+	free(batch.user);
+	free(batch.userwb);
+	free(batch.newwb);
+	free(batch.shared);
+	free(batch.tmpl);
+out:
+	put_workbase(sdata, wb);
 }
 
 static void send_json_err(sdata_t *sdata, const int64_t client_id, json_t *id_val, const char *err_msg)
@@ -6451,6 +8498,8 @@ static json_params_t
 	jp->params = json_deep_copy(params);
 	jp->id_val = json_deep_copy(id_val);
 	jp->client_id = client_id;
+	jp->submit = NULL;
+	jp->queued = monotonic_ns();
 	return jp;
 }
 
@@ -6501,19 +8550,30 @@ static void init_client(const stratum_instance_t *client, const int64_t client_i
  * current ones to it. */
 static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
 {
-	json_t *txn_array, *val, *txn_val;
+	int i, count = 0, size = 0;
+	json_t *txn_array, *val;
 	txntable_t *txn, *tmp;
+	txnref_t *refs = NULL;
 	smsg_t *msg;
 
-	txn_array = json_array();
-
+	/* Encode them only once we've dropped the lock */
 	ck_rlock(&sdata->txn_lock);
 	HASH_ITER(hh, sdata->txns, txn, tmp) {
-		JSON_CPACK(txn_val, "{ss,ss}", "hash", txn->hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
+		if (count == size) {
+			size = size ? size * 2 : 1024;
+			refs = realloc(refs, sizeof(txnref_t) * size);
+			if (unlikely(!refs))
+				quit(1, "Failed to realloc refs in send_node_all_txns");
+		}
+		__ref_txn(&refs[count++], txn);
 	}
 	ck_runlock(&sdata->txn_lock);
 
+	txn_array = json_array();
+	for (i = 0; i < count; i++)
+		json_array_append_new(txn_array, txnref_json(&refs[i]));
+	free(refs);
+
 	if (client->trusted) {
 		JSON_CPACK(val, "{ss,so}", "method", stratum_msgs[SM_TRANSACTIONS],
 			   "transaction", txn_array);
@@ -6521,7 +8581,7 @@ static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
 		JSON_CPACK(val, "{ss,so}", "node.method", stratum_msgs[SM_TRANSACTIONS],
 			   "transaction", txn_array);
 	}
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = ckslab_zalloc(smsg_slab);
 	msg->json_msg = val;
 	msg->client_id = client->id;
 	ckmsgq_add(sdata->ssends, msg);
@@ -6574,6 +8634,19 @@ static void add_remote_server(sdata_t *sdata, stratum_instance_t *client)
 	dec_instance_ref(sdata, client);
 }
 
+/* Does the params array of a connecting node or remote name feature */
+static bool params_advertise(const json_t *params_val, const char *feature)
+{
+	json_t *param;
+	size_t index;
+
+	json_array_foreach(params_val, index, param) {
+		if (!safecmp(json_string_value(param), feature))
+			return true;
+	}
+	return false;
+}
+
 /* Enter with client holding ref count */
 static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *client,
 			 const int64_t client_id, json_t *id_val, json_t *method_val,
@@ -6588,7 +8661,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	if (likely(cmdmatch(method, "mining.submit") && client->authorised)) {
 		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
 
-		ckmsgq_add(sdata->sshareq, jp);
+		ckmsgq_add_affine(sdata->sshareq, jp, client_id);
 		return;
 	}
 
@@ -6632,8 +8705,15 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 				  client->identity, client->address, client->server);
 			connector_drop_client(ckp, client_id);
 		} else {
+			json_t *val;
+
 			snprintf(buf, 255, "remote=%"PRId64, client_id);
 			send_proc(ckp->connector, buf);
+			/* Accept the remote ahead of anything add_remote_server
+			 * sends it */
+			JSON_CPACK(val, "{sb}", "result", true);
+			stratum_add_send(sdata, val, client_id, SM_NONE);
+			client->txndelta = params_advertise(params_val, "txndelta");
 			add_remote_server(sdata, client);
 		}
 		sprintf(client->identity, "remote:%"PRId64, client_id);
@@ -6671,9 +8751,13 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 			/*Flag this as a passthrough and manage its messages
 			 * accordingly. No data from this client id should ever
 			 * come directly back to this stratifier. */
-			LOGNOTICE("Adding passthrough client %s %s", client->identity, client->address);
+			const char *relay = json_string_value(json_array_get(params_val, 1));
+			bool raw = !safecmp(relay, "raw");
+
+			LOGNOTICE("Adding %spassthrough client %s %s", raw ? "raw relaying " : "",
+				  client->identity, client->address);
 			client->passthrough = true;
-			snprintf(buf, 255, "passthrough=%"PRId64, client_id);
+			snprintf(buf, 255, "passthrough=%"PRId64"%s", client_id, raw ? ":raw" : "");
 			send_proc(ckp->connector, buf);
 			sprintf(client->identity, "passthrough:%"PRId64, client_id);
 		}
@@ -6749,7 +8833,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 static void free_smsg(smsg_t *msg)
 {
 	json_decref(msg->json_msg);
-	free(msg);
+	ckslab_free(smsg_slab, msg);
 }
 
 /* Even though we check the results locally in node mode, check the upstream
@@ -6876,32 +8960,22 @@ static user_instance_t *generate_remote_user(ckpool_t *ckp, const char *workerna
 	return user;
 }
 
-static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
+/* Account shares totalling diff, the best of which was sdiff, from a remote
+ * server's worker */
+static void add_remote_shares(ckpool_t *ckp, sdata_t *sdata, const char *workername,
+			      const int shares, const double diff, const double sdiff)
 {
-	json_t *workername_val = json_object_get(val, "workername");
 	worker_instance_t *worker;
-	const char *workername;
-	double diff, sdiff = 0;
 	user_instance_t *user;
 	tv_t now_t;
 
-	workername = json_string_value(workername_val);
-	if (unlikely(!workername_val || !workername)) {
-		LOGWARNING("Failed to get workername from remote message %s", buf);
-		return;
-	}
-	if (unlikely(!json_get_double(&diff, val, "diff") || diff < 1)) {
-		LOGWARNING("Unable to parse valid diff from remote message %s", buf);
-		return;
-	}
-	json_get_double(&sdiff, val, "sdiff");
 	user = generate_remote_user(ckp, workername);
 	user->authorised = true;
 	worker = get_worker(sdata, user, workername);
 	check_best_diff(sdata, user, worker, sdiff, NULL);
 
 	mutex_lock(&sdata->uastats_lock);
-	sdata->stats.unaccounted_shares++;
+	sdata->stats.unaccounted_shares += shares;
 	sdata->stats.unaccounted_diff_shares += diff;
 	mutex_unlock(&sdata->uastats_lock);
 
@@ -6911,14 +8985,57 @@ static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 
 	decay_worker(worker, diff, &now_t);
 	copy_tv(&worker->last_share, &now_t);
-	worker->idle = false;
 
 	decay_user(user, diff, &now_t);
 	copy_tv(&user->last_share, &now_t);
+	dirty_user(sdata, user);
 
 	LOGINFO("Added %.0lf remote shares to worker %s", diff, workername);
 }
 
+static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
+{
+	json_t *workername_val = json_object_get(val, "workername");
+	const char *workername;
+	double diff, sdiff = 0;
+
+	workername = json_string_value(workername_val);
+	if (unlikely(!workername_val || !workername)) {
+		LOGWARNING("Failed to get workername from remote message %s", buf);
+		return;
+	}
+	if (unlikely(!json_get_double(&diff, val, "diff") || diff < 1)) {
+		LOGWARNING("Unable to parse valid diff from remote message %s", buf);
+		return;
+	}
+	json_get_double(&sdiff, val, "sdiff");
+	add_remote_shares(ckp, sdata, workername, 1, diff, sdiff);
+}
+
+/* A batch of [workername, shares, diff, sdiff] totals per worker */
+static void parse_remote_sharebatch(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
+{
+	json_t *workers = json_object_get(val, "workers"), *worker;
+	size_t index;
+
+	if (unlikely(!json_is_array(workers))) {
+		LOGWARNING("Failed to get workers from remote message %s", buf);
+		return;
+	}
+	json_array_foreach(workers, index, worker) {
+		const char *workername = json_string_value(json_array_get(worker, 0));
+		int shares = json_integer_value(json_array_get(worker, 1));
+		double diff = json_number_value(json_array_get(worker, 2));
+		double sdiff = json_number_value(json_array_get(worker, 3));
+
+		if (unlikely(!workername || shares < 1 || diff < 1)) {
+			LOGWARNING("Invalid worker entry %d in remote sharebatch", (int)index);
+			continue;
+		}
+		add_remote_shares(ckp, sdata, workername, shares, diff, sdiff);
+	}
+}
+
 static void parse_remote_shareerr(ckpool_t *ckp, json_t *val, const char *buf)
 {
 	const char *workername;
@@ -7086,6 +9203,7 @@ static void parse_remote_workers(sdata_t *sdata, const json_t *val, const char *
 		return;
 	}
 	user->remote_workers += workers;
+	dirty_user(sdata, user);
 	LOGDEBUG("Adding %d remote workers to user %s", workers, username);
 }
 
@@ -7140,7 +9258,7 @@ static void parse_remote_block(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 		/* We rely on the remote server to give us the ID_BLOCK
 		 * responses, so only use this response to determine if we
 		 * should reset the best shares. */
-		if (local_block_submit(ckp, gbt_block, flip32, wb->height)) {
+		if (local_block_submit(ckp, wb, gbt_block, flip32)) {
 			block_share_summary(sdata);
 			reset_bestshares(sdata);
 		}
@@ -7189,32 +9307,39 @@ static void send_remote_pong(sdata_t *sdata, stratum_instance_t *client)
 static void add_node_txns(ckpool_t *ckp, sdata_t *sdata, const json_t *val)
 {
 	json_t *txn_array, *txn_val, *data_val, *hash_val;
+	txnarena_t *arena = NULL;
 	txntable_t *txns = NULL;
 	int i, arr_size;
-	int added = 0;
 
 	txn_array = json_object_get(val, "transaction");
 	arr_size = json_array_size(txn_array);
 
 	for (i = 0; i < arr_size; i++) {
 		const char *hash, *data;
+		uchar hashbin[32], *bin;
 
 		txn_val = json_array_get(txn_array, i);
 		data_val = json_object_get(txn_val, "data");
 		hash_val = json_object_get(txn_val, "hash");
 		data = json_string_value(data_val);
 		hash = json_string_value(hash_val);
-		if (unlikely(!data || !hash)) {
+		if (unlikely(!data || !hash || !hex2bin(hashbin, hash, 32))) {
 			LOGERR("Failed to get hash/data in add_node_txns");
 			continue;
 		}
 
-		if (add_txn(ckp, sdata, &txns, hash, data, false))
-			added++;
+		if (txn_known(sdata, hashbin, false))
+			continue;
+		bin = txn_arena_append(&arena, data, strlen(data));
+		if (unlikely(!bin)) {
+			LOGWARNING("Failed to decode transaction data in add_node_txns");
+			continue;
+		}
+		add_txn(ckp, sdata, &txns, arena, hashbin, bin, strlen(data) / 2, false);
 	}
 
-	if (added)
-		update_txns(ckp, sdata, txns, false);
+	if (arena)
+		update_txns(ckp, sdata, txns, arena, false);
 }
 
 void parse_remote_txns(ckpool_t *ckp, const json_t *val)
@@ -7225,25 +9350,30 @@ void parse_remote_txns(ckpool_t *ckp, const json_t *val)
 static json_t *get_hash_transactions(sdata_t *sdata, const json_t *hashes)
 {
 	json_t *txn_array = json_array(), *arr_val;
-	int found = 0;
+	int i, found = 0;
+	txnref_t *refs;
 	size_t index;
 
+	refs = ckalloc(sizeof(txnref_t) * (json_array_size(hashes) + 1));
 	ck_rlock(&sdata->txn_lock);
 	json_array_foreach(hashes, index, arr_val) {
 		const char *hash = json_string_value(arr_val);
-		json_t *txn_val;
+		uchar hashbin[32];
 		txntable_t *txn;
 
-		HASH_FIND_STR(sdata->txns, hash, txn);
+		if (unlikely(!hash || strlen(hash) != 64 || !hex2bin(hashbin, hash, 32)))
+			continue;
+		HASH_FIND(hh, sdata->txns, hashbin, 32, txn);
 		if (!txn)
 			continue;
-		JSON_CPACK(txn_val, "{ss,ss}",
-			   "hash", hash, "data", txn->data);
-		json_array_append_new(txn_array, txn_val);
-		found++;
+		__ref_txn(&refs[found++], txn);
 	}
 	ck_runlock(&sdata->txn_lock);
 
+	for (i = 0; i < found; i++)
+		json_array_append_new(txn_array, txnref_json(&refs[i]));
+	free(refs);
+
 	return txn_array;
 }
 
@@ -7292,6 +9422,26 @@ void parse_upstream_reqtxns(ckpool_t *ckp, json_t *val)
 	connector_upstream_msg(ckp, msg);
 }
 
+/* Resend the last workinfo in full to a remote that could not decode it,
+ * which later workinfos can then be delta encoded against */
+static void resend_workinfo(sdata_t *sdata, stratum_instance_t *client)
+{
+	json_t *json_msg = NULL;
+
+	mutex_lock(&sdata->txnbase_lock);
+	client->last_workinfo = 0;
+	if (sdata->txnbase_val) {
+		json_msg = json_deep_copy(sdata->txnbase_val);
+		json_set_string(json_msg, "method", stratum_msgs[SM_WORKINFO]);
+		client->last_workinfo = sdata->txnbase_id;
+		stratum_add_send(sdata, json_msg, client->id, SM_WORKINFO);
+	}
+	mutex_unlock(&sdata->txnbase_lock);
+
+	LOGNOTICE("Remote %s requested %s workinfo", client->identity,
+		  json_msg ? "and was resent the last" : "the last but there is no");
+}
+
 static void parse_trusted_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val, stratum_instance_t *client)
 {
 	json_t *method_val = json_object_get(val, "method");
@@ -7305,7 +9455,9 @@ static void parse_trusted_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val, stratu
 		goto out;
 	}
 
-	if (likely(!safecmp(method, stratum_msgs[SM_SHARE])))
+	if (likely(!safecmp(method, stratum_msgs[SM_SHAREBATCH])))
+		parse_remote_sharebatch(ckp, sdata, val, buf);
+	else if (!safecmp(method, stratum_msgs[SM_SHARE]))
 		parse_remote_share(ckp, sdata, val, buf);
 	else if (!safecmp(method, stratum_msgs[SM_TRANSACTIONS]))
 		add_node_txns(ckp, sdata, val);
@@ -7319,6 +9471,8 @@ static void parse_trusted_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val, stratu
 		parse_remote_block(ckp, sdata, val, buf, client->id);
 	else if (!safecmp(method, stratum_msgs[SM_REQTXNS]))
 		parse_remote_reqtxns(sdata, val, client->id);
+	else if (!safecmp(method, stratum_msgs[SM_REQWORKINFO]))
+		resend_workinfo(sdata, client);
 	else if (!safecmp(method, "workers"))
 		parse_remote_workers(sdata, val, buf);
 	else if (!safecmp(method, "ping"))
@@ -7351,7 +9505,7 @@ static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *clie
 	switch (msg_type) {
 		case SM_SHARE:
 			jp = create_json_params(client->id, method, params, id_val);
-			ckmsgq_add(sdata->sshareq, jp);
+			ckmsgq_add_affine(sdata->sshareq, jp, client->id);
 			break;
 		case SM_SHARERESULT:
 			parse_share_result(ckp, client, res_val);
@@ -7468,9 +9622,10 @@ static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg, strat
 static void srecv_process(ckpool_t *ckp, json_t *val)
 {
 	char address[INET6_ADDRSTRLEN], *buf = NULL;
-	bool noid = false, dropped = false;
+	bool noid = false, dropped = false, submit;
 	sdata_t *sdata = ckp->sdata;
 	stratum_instance_t *client;
+	int64_t start = 0;
 	smsg_t *msg;
 	int server;
 
@@ -7478,8 +9633,12 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 		LOGWARNING("srecv_process received NULL val!");
 		return;
 	}
+	/* Only time the shares that weren't tokenised by the connector */
+	submit = !safecmp(json_string_value(json_object_get(val, "method")), "mining.submit");
+	if (submit)
+		start = monotonic_ns();
 
-	msg = ckzalloc(sizeof(smsg_t));
+	msg = ckslab_zalloc(smsg_slab);
 	msg->json_msg = val;
 	val = json_object_get(msg->json_msg, "client_id");
 	if (unlikely(!val)) {
@@ -7536,44 +9695,275 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 	if (unlikely(noid))
 		LOGINFO("Stratifier added instance %s server %d", client->identity, server);
 
-	if (client->trusted)
-		parse_trusted_msg(ckp, sdata, msg->json_msg, client);
-	else if (ckp->node)
-		node_client_msg(ckp, msg->json_msg, client);
-	else
-		parse_instance_msg(ckp, sdata, msg, client);
-	dec_instance_ref(sdata, client);
-out:
-	free_smsg(msg);
-	free(buf);
+	if (client->trusted)
+		parse_trusted_msg(ckp, sdata, msg->json_msg, client);
+	else if (ckp->node)
+		node_client_msg(ckp, msg->json_msg, client);
+	else
+		parse_instance_msg(ckp, sdata, msg, client);
+	dec_instance_ref(sdata, client);
+out:
+	free_smsg(msg);
+	free(buf);
+	if (submit)
+		stage_latency(STAGE_SRECV, start);
+}
+
+void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line)
+{
+	sdata_t *sdata;
+
+	if (unlikely(!val)) {
+		LOGWARNING("_stratifier_add_recv received NULL val from %s %s:%d", file, func, line);
+		return;
+	}
+	sdata = ckp->sdata;
+	/* Node messages without a client_id all go to the same thread */
+	ckmsgq_add_affine(sdata->srecvs, val, json_integer_value(json_object_get(val, "client_id")));
+}
+
+/* Shares tokenised by the connector skip the receive threads and go straight
+ * to the share processors, copied into the same allocation as their
+ * json_params. */
+void stratifier_add_submit(ckpool_t *ckp, const stratum_submit_t *submit)
+{
+	json_params_t *jp = ckzalloc(sizeof(json_params_t) + sizeof(stratum_submit_t));
+	sdata_t *sdata = ckp->sdata;
+
+	jp->submit = (stratum_submit_t *)(jp + 1);
+	memcpy(jp->submit, submit, sizeof(stratum_submit_t));
+	jp->client_id = submit->client_id;
+	jp->queued = monotonic_ns();
+	ckmsgq_add_affine(sdata->sshareq, jp, jp->client_id);
+}
+
+static void ssend_process(ckpool_t *ckp, smsg_t *msg)
+{
+	/* Shared messages pass their reference on to the connector */
+	if (msg->shared) {
+		connector_add_shared(ckp, msg->shared, msg->client_id);
+		ckslab_free(smsg_slab, msg);
+		return;
+	}
+	if (unlikely(!msg->json_msg)) {
+		LOGERR("Sent null json msg to stratum_sender");
+		ckslab_free(smsg_slab, msg);
+		return;
+	}
+
+	/* Add client_id to the json message and send it to the
+	 * connector process to be delivered */
+	json_object_set_new_nocheck(msg->json_msg, "client_id", json_integer(msg->client_id));
+	if (msg->stamp) {
+		stage_latency(STAGE_SSEND, msg->queued);
+		connector_add_result(ckp, msg->json_msg, msg->stamp);
+	} else
+		connector_add_message(ckp, msg->json_msg);
+	/* The connector will free msg->json_msg */
+	ckslab_free(smsg_slab, msg);
+}
+
+static void sharelog_write(sharelog_file_t *file, const char *buf, const int len)
+{
+	int ofs = 0;
+
+	while (ofs < len) {
+		int ret = write(file->fd, buf + ofs, len - ofs);
+
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Failed to write to %s", file->fname);
+			break;
+		}
+		ofs += ret;
+	}
+	file->unsynced = true;
+}
+
+/* Write out all buffered share log records of file */
+static void sharelog_flush(sharelog_file_t *file)
+{
+	if (file->len)
+		sharelog_write(file, file->buf, file->len);
+	file->len = 0;
+}
+
+static void sharelog_append(sharelog_file_t *file, const void *buf, const int len)
+{
+	if (file->len + len > SHARELOG_BUFSIZE)
+		sharelog_flush(file);
+	/* Unbuffered for records larger than the buffer */
+	if (unlikely(len > SHARELOG_BUFSIZE))
+		sharelog_write(file, buf, len);
+	else {
+		memcpy(file->buf + file->len, buf, len);
+		file->len += len;
+	}
+}
+
+static void sharelog_close(ckpool_t *ckp, sdata_t *sdata, sharelog_file_t *file)
+{
+	sharelog_str_t *str, *tmp;
+
+	HASH_DEL(sdata->sharelog_files, file);
+	sharelog_flush(file);
+	if (ckp->logsharesync)
+		fsync(file->fd);
+	close(file->fd);
+	HASH_ITER(hh, file->strings, str, tmp) {
+		HASH_DEL(file->strings, str);
+		free(str);
+	}
+	free(file->buf);
+	free(file->fname);
+	free(file);
+}
+
+static sharelog_file_t *sharelog_open(sdata_t *sdata, char *fname, const bool binary,
+				      const time_t now_t)
+{
+	sharelog_file_t *file;
+	struct stat statbuf;
+	int fd;
+
+	fd = open(fname, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (unlikely(fd < 0)) {
+		LOGERR("Failed to open %s", fname);
+		return NULL;
+	}
+	file = ckzalloc(sizeof(sharelog_file_t));
+	file->fname = strdup(fname);
+	file->fd = fd;
+	file->buf = ckalloc(SHARELOG_BUFSIZE);
+	file->last_sync = now_t;
+	HASH_ADD_KEYPTR(hh, sdata->sharelog_files, file->fname, strlen(file->fname), file);
+
+	/* New binary share logs start with the version record */
+	if (binary && !fstat(fd, &statbuf) && !statbuf.st_size) {
+		struct sharelog_version version;
+
+		version.rec.type = SHARELOG_REC_VERSION;
+		version.rec.flags = 0;
+		version.rec.len = sizeof(version);
+		version.magic = SHARELOG_MAGIC;
+		version.version = SHARELOG_VERSION;
+		sharelog_append(file, &version, sizeof(version));
+	}
+	return file;
+}
+
+/* Return the id of str in this file, writing a string record the first time
+ * it's seen since the file was opened. */
+static uint32_t sharelog_intern(sharelog_file_t *file, const char *str, const int len)
+{
+	struct sharelog_string string;
+	sharelog_str_t *interned;
+
+	HASH_FIND(hh, file->strings, str, len, interned);
+	if (interned)
+		return interned->id;
+
+	interned = ckalloc(sizeof(sharelog_str_t) + len + 1);
+	memcpy(interned->str, str, len + 1);
+	interned->id = ++file->string_ids;
+	HASH_ADD(hh, file->strings, str[0], len, interned);
+
+	string.rec.type = SHARELOG_REC_STRING;
+	string.rec.flags = 0;
+	string.rec.len = sizeof(string) + len;
+	string.id = interned->id;
+	sharelog_append(file, &string, sizeof(string));
+	sharelog_append(file, str, len);
+	return interned->id;
+}
+
+/* Replace the interned strings of a queued binary record with their ids */
+static void sharelog_append_bin(sharelog_file_t *file, sharelog_t *sharelog)
+{
+	struct sharelog_share *share = (struct sharelog_share *)sharelog->buf;
+	const char *str = sharelog->buf + sizeof(struct sharelog_share);
+	int i, taillen;
+
+	for (i = 0; i < SHARELOG_INTERNED; i++) {
+		int len;
+
+		if (!share->ids[i])
+			continue;
+		len = strlen(str);
+		share->ids[i] = sharelog_intern(file, str, len);
+		str += len + 1;
+	}
+	taillen = sharelog->len - (str - sharelog->buf);
+	share->rec.len = sizeof(struct sharelog_share) + taillen;
+	sharelog_append(file, share, sizeof(struct sharelog_share));
+	sharelog_append(file, str, taillen);
 }
 
-void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line)
+/* Append a record to its share log file, opening it if need be, and free it */
+static void sharelog_record(sdata_t *sdata, sharelog_t *sharelog, const time_t now_t)
 {
-	sdata_t *sdata;
+	sharelog_file_t *file;
 
-	if (unlikely(!val)) {
-		LOGWARNING("_stratifier_add_recv received NULL val from %s %s:%d", file, func, line);
-		return;
+	HASH_FIND_STR(sdata->sharelog_files, sharelog->fname, file);
+	if (!file)
+		file = sharelog_open(sdata, sharelog->fname, sharelog->binary, now_t);
+	if (likely(file)) {
+		if (sharelog->binary)
+			sharelog_append_bin(file, sharelog);
+		else
+			sharelog_append(file, sharelog->buf, sharelog->len);
+		file->last_write = now_t;
 	}
-	sdata = ckp->sdata;
-	ckmsgq_add(sdata->srecvs, val);
+	free(sharelog->buf);
+	free(sharelog->fname);
+	free(sharelog);
 }
 
-static void ssend_process(ckpool_t *ckp, smsg_t *msg)
+/* Share log records are appended to buffers for each file held open, with
+ * each buffer written out once per batch or when it fills, and files are
+ * fsynced every logsharesync seconds if set. Files are closed once they
+ * stop receiving shares. Called with no records each idle second so buffers
+ * are still written, synced and closed without new shares. Records spilled
+ * while the queue was full are written once it has been emptied. */
+static void sharelog_process(ckpool_t *ckp, void **data, int count)
 {
-	if (unlikely(!msg->json_msg)) {
-		LOGERR("Sent null json msg to stratum_sender");
-		free(msg);
-		return;
+	sharelog_t *overflow, *sharelog, *tmpsharelog;
+	sharelog_file_t *file, *tmp;
+	sdata_t *sdata = ckp->sdata;
+	time_t now_t = time(NULL);
+	int i;
+
+	for (i = 0; i < count; i++)
+		sharelog_record(sdata, data[i], now_t);
+
+	/* Nothing is queued while there are spilled records so once the queue
+	 * is empty everything queued before them has been written */
+	if (unlikely(__atomic_load_n(&sdata->sharelog_overflow, __ATOMIC_ACQUIRE) &&
+		     ckmsgq_empty(sdata->sharelogq))) {
+		mutex_lock(&sdata->sharelog_lock);
+		overflow = sdata->sharelog_overflow;
+		__atomic_store_n(&sdata->sharelog_overflow, NULL, __ATOMIC_RELEASE);
+		mutex_unlock(&sdata->sharelog_lock);
+
+		DL_FOREACH_SAFE(overflow, sharelog, tmpsharelog) {
+			DL_DELETE(overflow, sharelog);
+			sharelog_record(sdata, sharelog, now_t);
+		}
 	}
 
-	/* Add client_id to the json message and send it to the
-	 * connector process to be delivered */
-	json_object_set_new_nocheck(msg->json_msg, "client_id", json_integer(msg->client_id));
-	connector_add_message(ckp, msg->json_msg);
-	/* The connector will free msg->json_msg */
-	free(msg);
+	HASH_ITER(hh, sdata->sharelog_files, file, tmp) {
+		if (now_t - file->last_write > SHARELOG_IDLE) {
+			sharelog_close(ckp, sdata, file);
+			continue;
+		}
+		sharelog_flush(file);
+		if (ckp->logsharesync && file->unsynced && now_t - file->last_sync >= ckp->logsharesync) {
+			fsync(file->fd);
+			file->unsynced = false;
+			file->last_sync = now_t;
+		}
+	}
 }
 
 static void discard_json_params(json_params_t *jp)
@@ -7585,6 +9975,21 @@ static void discard_json_params(json_params_t *jp)
 	free(jp);
 }
 
+/* Recreate the id of a tokenised share to respond with */
+static json_t *submit_id(const stratum_submit_t *submit)
+{
+	switch (submit->idtype) {
+		case SUBMIT_ID_NULL:
+			return json_null();
+		case SUBMIT_ID_INT:
+			return json_integer(submit->intid);
+		case SUBMIT_ID_STR:
+			return json_string(submit->strid);
+		default:
+			return NULL;
+	}
+}
+
 static void steal_json_id(json_t *val, json_params_t *jp)
 {
 	/* Steal the id_val as is to avoid a copy */
@@ -7592,34 +9997,82 @@ static void steal_json_id(json_t *val, json_params_t *jp)
 	jp->id_val = NULL;
 }
 
-static void sshare_process(ckpool_t *ckp, json_params_t *jp)
+/* Shares are taken off the sshareq in batches so their headers can all be
+ * hashed at once with the multi-buffer sha256 kernel. */
+static void sshare_process(ckpool_t *ckp, void **data, const int count)
 {
-	json_t *result_val, *json_msg, *err_val = NULL;
-	stratum_instance_t *client;
+	const uchar *headers[SHARE_BATCH];
+	uchar *hashes[SHARE_BATCH];
+	submission_t subs[SHARE_BATCH];
+	int64_t start = monotonic_ns(), end;
 	sdata_t *sdata = ckp->sdata;
-	int64_t client_id;
+	int i, hashed = 0;
 
-	client_id = jp->client_id;
+	memset(subs, 0, sizeof(submission_t) * count);
+	for (i = 0; i < count; i++) {
+		json_params_t *jp = data[i];
+		submission_t *sub = &subs[i];
+		stratum_instance_t *client;
+		int64_t client_id;
 
-	client = ref_instance_by_id(sdata, client_id);
-	if (unlikely(!client)) {
-		LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!", client_id);
-		goto out;
+		share_latency_add(STAGE_SSHAREQ, start - jp->queued);
+		client_id = jp->client_id;
+		sub->slot = i;
+
+		client = ref_instance_by_id(sdata, client_id);
+		if (unlikely(!client)) {
+			LOGINFO("Share processor failed to find client id %"PRId64" in hashtable!", client_id);
+			/* Tokenised shares never went through srecv_process
+			 * which would have dropped this client */
+			if (jp->submit)
+				connector_drop_client(ckp, client_id);
+			continue;
+		}
+		/* Likewise check what parse_instance_msg would have */
+		if (jp->submit && unlikely(client->reject == 3 || !client->subscribed)) {
+			LOGINFO("Dropping mining.submit from %s client %s %s",
+				client->reject == 3 ? "invalidated" : "unsubscribed",
+				client->identity, client->address);
+			connector_drop_client(ckp, client_id);
+			dec_instance_ref(sdata, client);
+			continue;
+		}
+		if (unlikely(!client->authorised)) {
+			LOGDEBUG("Client %s no longer authorised to submit shares", client->identity);
+			dec_instance_ref(sdata, client);
+			continue;
+		}
+		sub->json_msg = json_object();
+		parse_submit(client, sub, jp);
+		if (sub->hashed) {
+			headers[hashed] = sub->swap;
+			hashes[hashed++] = sub->hash;
+		}
 	}
-	if (unlikely(!client->authorised)) {
-		LOGDEBUG("Client %s no longer authorised to submit shares", client->identity);
-		goto out_decref;
+
+	sha256d_80_multi(headers, hashes, hashed);
+	end = monotonic_ns();
+	for (i = 0; i < hashed; i++)
+		share_latency_add(STAGE_HASH, end - start);
+
+	for (i = 0; i < count; i++) {
+		json_params_t *jp = data[i];
+		submission_t *sub = &subs[i];
+		json_t *result_val;
+
+		if (likely(sub->client)) {
+			result_val = complete_submit(sub);
+			json_object_set_new_nocheck(sub->json_msg, "result", result_val);
+			json_object_set_new_nocheck(sub->json_msg, "error", sub->err_val ? sub->err_val : json_null());
+			if (jp->submit)
+				jp->id_val = submit_id(jp->submit);
+			steal_json_id(sub->json_msg, jp);
+			stratum_add_timed_send(sdata, sub->json_msg, jp->client_id, SM_SHARERESULT,
+					       jp->submit ? jp->submit->stamp : 0);
+			dec_instance_ref(sdata, sub->client);
+		}
+		discard_json_params(jp);
 	}
-	json_msg = json_object();
-	result_val = parse_submit(client, json_msg, jp->params, &err_val);
-	json_object_set_new_nocheck(json_msg, "result", result_val);
-	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
-	steal_json_id(json_msg, jp);
-	stratum_add_send(sdata, json_msg, client_id, SM_SHARERESULT);
-out_decref:
-	dec_instance_ref(sdata, client);
-out:
-	discard_json_params(jp);
 }
 
 /* As ref_instance_by_id but only returns clients not authorising or authorised,
@@ -7861,6 +10314,61 @@ static void dump_log_entries(log_entry_t **entries)
 	}
 }
 
+/* Append the lines of users whose stats changed to the userstats store, or
+ * when compacting replace the store with the lines of every user, keeping
+ * count of the lines in the store. Returns false on failure. */
+static bool store_userstats(ckpool_t *ckp, char_entry_t **entries, const bool compact,
+			    int64_t *lines)
+{
+	char *fname, *tmpname = NULL;
+	char_entry_t *entry, *tmp;
+	int64_t written = 0;
+	bool ret = false;
+	FILE *fp;
+
+	if (!*entries && !compact)
+		return true;
+	ASPRINTF(&fname, "%suserstats.log", ckp->logdir);
+	if (compact) {
+		ASPRINTF(&tmpname, "%s.tmp", fname);
+		fp = fopen(tmpname, "we");
+	} else
+		fp = fopen(fname, "ae");
+	if (unlikely(!fp))
+		LOGERR("Failed to fopen %s in store_userstats", compact ? tmpname : fname);
+	DL_FOREACH_SAFE(*entries, entry, tmp) {
+		DL_DELETE(*entries, entry);
+		if (likely(fp)) {
+			fputs(entry->buf, fp);
+			fputc('\n', fp);
+			written++;
+		}
+		free(entry->buf);
+		free(entry);
+	}
+	if (unlikely(!fp))
+		goto out;
+	if (unlikely(fclose(fp))) {
+		LOGERR("Failed to write %s in store_userstats", compact ? tmpname : fname);
+		goto out;
+	}
+	if (!compact) {
+		*lines += written;
+		ret = true;
+		goto out;
+	}
+	if (unlikely(rename(tmpname, fname))) {
+		LOGERR("Failed to rename %s to %s in store_userstats", tmpname, fname);
+		goto out;
+	}
+	*lines = written;
+	ret = true;
+out:
+	free(fname);
+	free(tmpname);
+	return ret;
+}
+
 static void upstream_workers(ckpool_t *ckp, user_instance_t *user)
 {
 	char *msg;
@@ -7871,6 +10379,30 @@ static void upstream_workers(ckpool_t *ckp, user_instance_t *user)
 }
 
 
+/* Take the users queued since the last statsupdate, marking them as taken
+ * for this pass so a compacting pass walking every user can tell them apart */
+static user_instance_t **take_dirty_users(sdata_t *sdata, const int64_t pass, int *count)
+{
+	user_instance_t *user, *tmp, **users = NULL;
+	int n = 0;
+
+	mutex_lock(&sdata->dirty_lock);
+	DL_COUNT2(sdata->dirty_users, user, n, dirty_next);
+	if (n)
+		users = ckalloc(sizeof(user_instance_t *) * n);
+	n = 0;
+	DL_FOREACH_SAFE2(sdata->dirty_users, user, tmp, dirty_next) {
+		DL_DELETE2(sdata->dirty_users, user, dirty_prev, dirty_next);
+		__atomic_store_n(&user->dirty, false, __ATOMIC_RELAXED);
+		user->stored_pass = pass;
+		users[n++] = user;
+	}
+	mutex_unlock(&sdata->dirty_lock);
+
+	*count = n;
+	return users;
+}
+
 /* To iterate over all users, if user is initially NULL, this will return the first entry,
  * otherwise it will return the entry after user, and NULL if there are no more entries.
  * Allows us to grab and drop the lock on each iteration. */
@@ -7899,11 +10431,96 @@ static worker_instance_t *next_worker(sdata_t *sdata, user_instance_t *user, wor
 	return worker;
 }
 
+/* Check the clients due in the idle wheel instead of every client, dropping
+ * those that never authorised, testing idle ones are still connected and
+ * rescheduling each for when it next needs checking. Idle hashrates are not
+ * decayed here but whenever they are read. Returns the count of idle
+ * clients. */
+static int check_idle_clients(ckpool_t *ckp, sdata_t *sdata)
+{
+	stratum_instance_t **due = &sdata->idle_wheel[IDLE_SLOTS], *client, *tmp;
+	int64_t minute = time(NULL) / 60;
+	int checked = 0;
+
+	ck_wlock(&sdata->instance_lock);
+	if (minute - sdata->idle_minute > IDLE_SLOTS)
+		sdata->idle_minute = minute - IDLE_SLOTS;
+	while (sdata->idle_minute < minute) {
+		stratum_instance_t **slot = &sdata->idle_wheel[++sdata->idle_minute % IDLE_SLOTS];
+
+		DL_FOREACH_SAFE2(*slot, client, tmp, idle_next) {
+			DL_DELETE2(*slot, client, idle_prev, idle_next);
+			DL_APPEND2(*due, client, idle_prev, idle_next);
+			client->idle_slot = IDLE_DUE;
+		}
+	}
+	while ((client = *due) != NULL) {
+		double per_tdiff;
+		time_t when;
+		tv_t now;
+
+		DL_DELETE2(*due, client, idle_prev, idle_next);
+		client->idle_slot = IDLE_BUSY;
+		__inc_instance_ref(client);
+		ck_wunlock(&sdata->instance_lock);
+
+		checked++;
+		tv_time(&now);
+		if (client->dropped) {
+			/* Look for clients that may have been dropped which the
+			 * stratifier has not been informed about and ask the
+			 * connector if they still exist */
+			connector_test_client(ckp, client->id);
+			when = now.tv_sec + 60;
+		} else if (remote_server(client)) {
+			/* Do nothing to these */
+			when = now.tv_sec + IDLE_HORIZON * 60;
+		} else if (!client->authorised) {
+			/* Drop clients that haven't authed in over a minute
+			 * lazily */
+			if (now.tv_sec > client->start_time + 60) {
+				client->dropped = true;
+				connector_drop_client(ckp, client->id);
+			}
+			when = client->start_time + 60;
+		} else {
+			per_tdiff = tvdiff(&now, &client->last_share);
+			if (per_tdiff > 60) {
+				/* No shares for over a minute */
+				if (!__atomic_exchange_n(&client->idle_counted, true, __ATOMIC_RELAXED))
+					__atomic_fetch_add(&sdata->idle_clients, 1, __ATOMIC_RELAXED);
+				if (per_tdiff > 600)
+					client->idle = true;
+				/* Test idle clients are still connected, less
+				 * often the longer they have been idle */
+				connector_test_client(ckp, client->id);
+				when = now.tv_sec + (client->idle ? IDLE_HORIZON * 60 : 60);
+			} else {
+				if (__atomic_exchange_n(&client->idle_counted, false, __ATOMIC_RELAXED))
+					__atomic_fetch_sub(&sdata->idle_clients, 1, __ATOMIC_RELAXED);
+				when = client->last_share.tv_sec + 61;
+			}
+		}
+
+		ck_wlock(&sdata->instance_lock);
+		/* Not rescheduled if removed while being checked */
+		if (client->idle_slot == IDLE_BUSY)
+			__idle_schedule(sdata, client, when);
+		__dec_instance_ref(client);
+	}
+	ck_wunlock(&sdata->instance_lock);
+
+	LOGDEBUG("Checked %d clients for idleness", checked);
+	return __atomic_load_n(&sdata->idle_clients, __ATOMIC_RELAXED);
+}
+
 static void *statsupdate(void *arg)
 {
 	ckpool_t *ckp = (ckpool_t *)arg;
 	sdata_t *sdata = ckp->sdata;
 	pool_stats_t *stats = &sdata->stats;
+	/* Lines in the userstats store, and users at its last compaction */
+	int64_t store_lines = 0, store_users = 0, pass = 0;
 
 	pthread_detach(pthread_self());
 	rename_proc("statsupdate");
@@ -7917,11 +10534,11 @@ static void *statsupdate(void *arg)
 			per_tdiff, percent;
 		char suffix1[16], suffix5[16], suffix15[16], suffix60[16], cdfield[64];
 		char suffix360[16], suffix1440[16], suffix10080[16];
-		int remote_users = 0, remote_workers = 0, idle_workers = 0;
+		int remote_users = 0, remote_workers = 0, idle_workers, ndirty, nextdirty = 0;
+		char_entry_t *char_list = NULL, *store_entries = NULL;
+		user_instance_t *user, **dirty;
 		log_entry_t *log_entries = NULL;
-		char_entry_t *char_list = NULL;
-		stratum_instance_t *client;
-		user_instance_t *user;
+		bool compact;
 		char *fname, *s, *sp;
 		tv_t now, diff;
 		ts_t ts_now;
@@ -7932,92 +10549,56 @@ static void *statsupdate(void *arg)
 		tv_time(&now);
 		timersub(&now, &stats->start_time, &diff);
 
-		ck_wlock(&sdata->instance_lock);
-		/* Grab the first entry */
-		client = sdata->stratum_instances;
-		if (likely(client))
-			__inc_instance_ref(client);
-		ck_wunlock(&sdata->instance_lock);
-
-		while (client) {
-			tv_time(&now);
-			/* Look for clients that may have been dropped which the
-			 * stratifier has not been informed about and ask the
-			 * connector if they still exist */
-			if (client->dropped)
-				connector_test_client(ckp, client->id);
-			else if (remote_server(client)) {
-				/* Do nothing to these */
-			} else if (!client->authorised) {
-				/* Test for clients that haven't authed in over a minute
-				 * and drop them lazily */
-				if (now.tv_sec > client->start_time + 60) {
-					client->dropped = true;
-					connector_drop_client(ckp, client->id);
-				}
-			} else {
-				per_tdiff = tvdiff(&now, &client->last_share);
-				/* Decay times per connected instance */
-				if (per_tdiff > 60) {
-					/* No shares for over a minute, decay to 0 */
-					decay_client(client, 0, &now);
-					idle_workers++;
-					if (per_tdiff > 600)
-						client->idle = true;
-					/* Test idle clients are still connected */
-					connector_test_client(ckp, client->id);
-				}
-			}
+		idle_workers = check_idle_clients(ckp, sdata);
 
-			ck_wlock(&sdata->instance_lock);
-			/* Drop the reference of the last entry we examined,
-			 * then grab the next client. */
-			__dec_instance_ref(client);
-			client = client->hh.next;
-			/* Grab a reference to this client allowing us to examine
-			 * it without holding the lock */
-			if (likely(client))
-				__inc_instance_ref(client);
-			ck_wunlock(&sdata->instance_lock);
-		}
+		/* Rewrite the store with only current lines once it has grown to
+		 * over double the users, and on the first pass to adopt any
+		 * users loaded from their own files */
+		compact = !store_users || store_lines > store_users * 2 + 1024;
 
+		/* Only users with new stats are walked, their rates being
+		 * decayed whenever they're read, with every user walked only
+		 * when compacting the store */
+		dirty = take_dirty_users(sdata, ++pass, &ndirty);
 		user = NULL;
 
-		while ((user = next_user(sdata, user)) != NULL) {
+		while ((user = compact ? next_user(sdata, user) :
+			nextdirty < ndirty ? dirty[nextdirty++] : NULL) != NULL) {
 			worker_instance_t *worker;
+			bool idle, dormant;
 			json_t *user_array;
-			bool idle = false;
-
-			if (!user->authorised)
-				continue;
+			rates_t rates;
+			bool update;
 
 			tv_time(&now);
 
-			/* Decay times per user */
 			per_tdiff = tvdiff(&now, &user->last_share);
-			if (per_tdiff > 60) {
-				/* Drop storage of users idle for 1 week */
-				if (per_tdiff > 600000) {
-					LOGDEBUG("Skipping user %s", user->username);
-					continue;
-				}
-				decay_user(user, 0, &now);
-				idle = true;
+			/* Users not authorised since startup or idle for 1 week
+			 * have no storage, but are kept in the store when
+			 * compacting it */
+			dormant = !user->authorised || per_tdiff > 600000;
+			/* Only write out users whose stats have changed */
+			update = !dormant && user->stored_pass == pass;
+			if (!update && !compact) {
+				LOGDEBUG("Skipping user %s", user->username);
+				continue;
 			}
+			idle = per_tdiff > 60;
+			user_rates(user, &now, &rates);
 
-			ghs = user->dsps1440 * nonces;
+			ghs = rates.dsps1440 * nonces;
 			suffix_string(ghs, suffix1440, 16, 0);
 
-			ghs = user->dsps1 * nonces;
+			ghs = rates.dsps1 * nonces;
 			suffix_string(ghs, suffix1, 16, 0);
 
-			ghs = user->dsps5 * nonces;
+			ghs = rates.dsps5 * nonces;
 			suffix_string(ghs, suffix5, 16, 0);
 
-			ghs = user->dsps60 * nonces;
+			ghs = rates.dsps60 * nonces;
 			suffix_string(ghs, suffix60, 16, 0);
 
-			ghs = user->dsps10080 * nonces;
+			ghs = rates.dsps10080 * nonces;
 			suffix_string(ghs, suffix10080, 16, 0);
 
 			JSON_CPACK(val, "{ss,ss,ss,ss,ss,si,si,sI,sf,sI, sI}",
@@ -8043,7 +10624,7 @@ static void *statsupdate(void *arg)
 					remote_users++;
 			}
 
-			if (!idle) {
+			if (!idle && !dormant) {
 				s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT);
 				ASPRINTF(&sp, "User %s:%s", user->username, s);
 				dealloc(s);
@@ -8052,34 +10633,30 @@ static void *statsupdate(void *arg)
 			user_array = json_array();
 			worker = NULL;
 
-			/* Decay times per worker */
 			while ((worker = next_worker(sdata, user, worker)) != NULL) {
 				json_t *wval;
 
+				/* Drop storage of workers idle for 1 week */
 				per_tdiff = tvdiff(&now, &worker->last_share);
-				if (per_tdiff > 60) {
-					/* Drop storage of workers idle for 1 week */
-					if (per_tdiff > 600000) {
-						LOGDEBUG("Skipping worker %s", worker->workername);
-						continue;
-					}
-					decay_worker(worker, 0, &now);
-					worker->idle = true;
+				if (per_tdiff > 600000 && !dormant) {
+					LOGDEBUG("Skipping worker %s", worker->workername);
+					continue;
 				}
+				worker_rates(worker, &now, &rates);
 
-				ghs = worker->dsps1440 * nonces;
+				ghs = rates.dsps1440 * nonces;
 				suffix_string(ghs, suffix1440, 16, 0);
 
-				ghs = worker->dsps1 * nonces;
+				ghs = rates.dsps1 * nonces;
 				suffix_string(ghs, suffix1, 16, 0);
 
-				ghs = worker->dsps5 * nonces;
+				ghs = rates.dsps5 * nonces;
 				suffix_string(ghs, suffix5, 16, 0);
 
-				ghs = worker->dsps60 * nonces;
+				ghs = rates.dsps60 * nonces;
 				suffix_string(ghs, suffix60, 16, 0);
 
-				ghs = worker->dsps10080 * nonces;
+				ghs = rates.dsps10080 * nonces;
 				suffix_string(ghs, suffix10080, 16, 0);
 
 				LOGDEBUG("Storing worker %s", worker->workername);
@@ -8099,14 +10676,21 @@ static void *statsupdate(void *arg)
 			}
 
 			json_object_set_new_nocheck(val, "worker", user_array);
-			ASPRINTF(&fname, "%s/users/%s", ckp->logdir, user->username);
-			s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL |
-				JSON_REAL_PRECISION(16) | JSON_INDENT(1));
-			add_log_entry(&log_entries, &fname, &s);
+			if (update) {
+				s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL |
+					JSON_REAL_PRECISION(16) | JSON_INDENT(1));
+				ASPRINTF(&fname, "%s/users/%s", ckp->logdir, user->username);
+				add_log_entry(&log_entries, &fname, &s);
+			}
+			json_set_string(val, "user", user->username);
+			s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT |
+				JSON_REAL_PRECISION(16));
+			add_msg_entry(&store_entries, &s);
 			json_decref(val);
-			if (ckp->remote)
+			if (ckp->remote && update)
 				upstream_workers(ckp, user);
 		}
+		free(dirty);
 
 		if (remote_workers) {
 			mutex_lock(&sdata->stats_lock);
@@ -8117,6 +10701,8 @@ static void *statsupdate(void *arg)
 
 		/* Dump log entries out of instance_lock */
 		dump_log_entries(&log_entries);
+		if (store_userstats(ckp, &store_entries, compact, &store_lines) && compact)
+			store_users = store_lines;
 		notice_msg_entries(&char_list);
 
 		ghs1 = stats->dsps1 * nonces;
@@ -8441,6 +11027,84 @@ void *throbber(void *arg)
 	return NULL;
 }
 
+#ifdef HAVE_ZMQ_H
+/* Subsidy at height on the 210000 block halving schedule */
+static uint64_t block_subsidy(const int height)
+{
+	int halvings = height / 210000;
+
+	if (halvings >= 64)
+		return 0;
+	return 5000000000ull >> halvings;
+}
+
+/* Build and broadcast a transaction-less workbase on top of the block hash
+ * from a ZMQ notification so miners leave stale work before the full template
+ * has been fetched and processed. */
+static void empty_update(ckpool_t *ckp, sdata_t *sdata, const uchar *hashbin)
+{
+	bool new_block = false;
+	workbase_t *wb, *old;
+	char swap[32];
+	time_t now;
+
+	/* Serialise with block_update */
+	cksem_wait(&sdata->update_sem);
+
+	wb = ckzalloc(sizeof(workbase_t));
+	swap_256(swap, hashbin);
+	__bin2hex(wb->prevhash, swap, 32);
+
+	ck_rlock(&sdata->workbase_lock);
+	old = sdata->current_workbase;
+	if (old && strncmp(wb->prevhash, sdata->lasthash, 64)) {
+		memcpy(wb->target, old->target, sizeof(wb->target));
+		wb->diff = old->diff;
+		wb->version = old->version;
+		wb->curtime = old->curtime;
+		memcpy(wb->bbversion, old->bbversion, sizeof(wb->bbversion));
+		memcpy(wb->nbit, old->nbit, sizeof(wb->nbit));
+		wb->coinbasevalue = old->coinbasevalue;
+		wb->height = old->height + 1;
+		wb->flags = strdup(old->flags);
+	}
+	ck_runlock(&sdata->workbase_lock);
+
+	/* No work yet or we already have this block. The bits may change at a
+	 * retarget, and the subsidy can only be derived for the standard
+	 * halving schedule. */
+	if (!wb->flags || !(wb->height % 2016) ||
+	    wb->coinbasevalue < block_subsidy(wb->height - 1)) {
+		LOGINFO("Not generating empty work for block height %d", wb->height);
+		free(wb->flags);
+		free(wb);
+		goto out;
+	}
+	wb->coinbasevalue = block_subsidy(wb->height);
+	now = time(NULL);
+	if (now > wb->curtime)
+		wb->curtime = now;
+	snprintf(wb->ntime, 9, "%08x", wb->curtime);
+	wb->ntime32 = wb->curtime;
+
+	wb->ckp = ckp;
+	wb->txn_data = ckzalloc(1);
+	wb->txn_hashes = ckzalloc(1);
+	wb->merkle_array = json_array();
+	generate_coinbase(ckp, wb);
+	add_base(ckp, sdata, wb, &new_block);
+
+	if (ckp->btcsolo)
+		stratum_broadcast_updates(sdata, new_block);
+	else
+		stratum_broadcast_update(sdata, wb, new_block);
+	LOGNOTICE("Broadcast empty work on block hash %s height %d", sdata->lastswaphash,
+		  wb->height);
+out:
+	cksem_post(&sdata->update_sem);
+}
+#endif
+
 static void *zmqnotify(void *arg)
 {
 #ifdef HAVE_ZMQ_H
@@ -8488,6 +11152,8 @@ static void *zmqnotify(void *arg)
 					LOGDEBUG("ZMQ sequence number");
 					break;
 				case 32:
+					if (ckp->zmqempty)
+						empty_update(ckp, sdata, zmq_msg_data(&message));
 					update_base(sdata, GEN_PRIORITY);
 					__bin2hex(hexhash, zmq_msg_data(&message), 32);
 					LOGNOTICE("ZMQ block hash %s", hexhash);
@@ -8510,6 +11176,145 @@ static void *zmqnotify(void *arg)
 	return NULL;
 }
 
+/* Serialise the state of established clients for handing them over to a new
+ * instance along with the ids it must not reuse */
+json_t *stratifier_handover(ckpool_t *ckp)
+{
+	json_t *val, *clients = json_array(), *entry;
+	sdata_t *sdata = ckp->sdata;
+	stratum_instance_t *client;
+
+	ck_rlock(&sdata->instance_lock);
+	for (client = sdata->stratum_instances; client; client = client->hh.next) {
+		if (client->dropped || !client->subscribed || client->node || client->trusted ||
+		    client->remote || client->passthrough || subclient(client->id))
+			continue;
+		JSON_CPACK(entry, "{sI,ss,si,si,sI,sI,sI,sb,sI,sf,ss}",
+			   "id", client->id, "address", client->address, "server", client->server,
+			   "sessionid", client->session_id, "enonce1_64", (int64_t)client->enonce1_64,
+			   "diff", client->diff, "suggestdiff", client->suggest_diff,
+			   "messages", client->messages, "starttime", (int64_t)client->start_time,
+			   "bestdiff", client->best_diff, "useragent", client->useragent ? : "");
+		if (client->authorised && client->workername) {
+			json_set_string(entry, "workername", client->workername);
+			json_set_string(entry, "password", client->password ? : "");
+		}
+		json_array_append_new(clients, entry);
+	}
+	JSON_CPACK(val, "{sI,si,sI,so}", "workbaseid", sdata->workbase_id,
+		   "sessionid", sdata->session_id, "enonce1_64", (int64_t)sdata->enonce1_64,
+		   "clients", clients);
+	ck_runlock(&sdata->instance_lock);
+
+	return val;
+}
+
+/* Recreate an inherited client as it was, its subscription and authorisation
+ * intact, and send it fresh work and its diff. */
+static void adopt_client(ckpool_t *ckp, sdata_t *sdata, json_t *entry)
+{
+	char *address = NULL, *workername = NULL;
+	stratum_instance_t *client;
+	user_instance_t *user;
+	int64_t id, enonce1, start_time;
+	int server = 0;
+
+	if (!json_get_int64(&id, entry, "id") || !json_get_string(&address, entry, "address"))
+		goto out;
+	json_get_int(&server, entry, "server");
+
+	ck_wlock(&sdata->instance_lock);
+	client = __stratum_add_instance(ckp, id, address, server);
+	__inc_instance_ref(client);
+	ck_wunlock(&sdata->instance_lock);
+
+	json_get_int(&client->session_id, entry, "sessionid");
+	json_get_int64(&enonce1, entry, "enonce1_64");
+	client->enonce1_64 = enonce1;
+	ck_rlock(&sdata->workbase_lock);
+	__fill_enonce1data(sdata->current_workbase, client);
+	ck_runlock(&sdata->workbase_lock);
+	json_get_int64(&client->diff, entry, "diff");
+	if (client->diff < ckp->mindiff)
+		client->diff = ckp->mindiff;
+	client->old_diff = client->diff;
+	json_get_int64(&client->suggest_diff, entry, "suggestdiff");
+	json_get_bool(&client->messages, entry, "messages");
+	if (json_get_int64(&start_time, entry, "starttime"))
+		client->start_time = start_time;
+	json_get_double(&client->best_diff, entry, "bestdiff");
+	if (!json_get_string(&client->useragent, entry, "useragent"))
+		client->useragent = ckzalloc(1);
+	client->subscribed = true;
+
+	if (json_get_string(&workername, entry, "workername")) {
+		user = generate_user(ckp, client, workername);
+		client->user_id = user->id;
+		client->workername = workername;
+		if (!json_get_string(&client->password, entry, "password"))
+			client->password = strdup("");
+		if (!ckp->btcsolo || user->btcaddress)
+			client_auth(ckp, client, user, true);
+		if (client->authorised) {
+			if (ckp->btcsolo)
+				init_solo_client(ckp, client, user);
+			else
+				init_client(client, client->id);
+		}
+	}
+	LOGINFO("Adopted inherited client %s %s enonce1 %s", client->identity, client->address,
+		client->enonce1);
+	dec_instance_ref(sdata, client);
+out:
+	free(address);
+}
+
+/* Once we have work to give them, adopt the clients inherited on handover
+ * that the connector has instances for, then let it start receiving from
+ * them. */
+static void *adopt_clients(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->sdata;
+	json_t *entry;
+	size_t index;
+
+	pthread_detach(pthread_self());
+	rename_proc("sadopter");
+
+	while (!ckp->connector_ready || !sdata->current_workbase)
+		cksleep_ms(10);
+
+	json_array_foreach(json_object_get(ckp->handover_clients, "clients"), index, entry) {
+		if (!json_is_true(json_object_get(entry, "failed")))
+			adopt_client(ckp, sdata, entry);
+	}
+	connector_adopt_clients(ckp);
+
+	json_decref(ckp->handover_clients);
+	ckp->handover_clients = NULL;
+	dealloc(ckp->handover_fds);
+	return NULL;
+}
+
+/* Make sure ids generated from here on are beyond those of the instance we
+ * inherited clients from */
+static void inherit_ids(ckpool_t *ckp, sdata_t *sdata)
+{
+	int64_t workbase_id, enonce1;
+	int session_id;
+
+	if (json_get_int64(&workbase_id, ckp->handover_clients, "workbaseid") &&
+	    workbase_id >= sdata->workbase_id)
+		sdata->blockchange_id = sdata->workbase_id = workbase_id + 1;
+	if (json_get_int(&session_id, ckp->handover_clients, "sessionid") &&
+	    session_id > sdata->session_id)
+		sdata->session_id = session_id;
+	if (json_get_int64(&enonce1, ckp->handover_clients, "enonce1_64") &&
+	    le64toh((uint64_t)enonce1) > le64toh(sdata->enonce1_64))
+		sdata->enonce1_64 = enonce1;
+}
+
 void *stratifier(void *arg)
 {
 	pthread_t pth_blockupdate, pth_statsupdate, pth_throbber, pth_zmqnotify;
@@ -8521,6 +11326,7 @@ void *stratifier(void *arg)
 
 	rename_proc(pi->processname);
 	LOGWARNING("%s stratifier starting", ckp->name);
+	smsg_slab = create_ckslab("smsg", sizeof(smsg_t));
 	sdata = ckzalloc(sizeof(sdata_t));
 	ckp->sdata = sdata;
 	sdata->ckp = ckp;
@@ -8562,6 +11368,7 @@ void *stratifier(void *arg)
 	}
 
 	randomiser = time(NULL);
+	sdata->idle_minute = randomiser / 60;
 	sdata->enonce1_64 = htole64(randomiser);
 	sdata->session_id = randomiser;
 	/* Set the initial id to time as high bits so as to not send the same
@@ -8569,8 +11376,15 @@ void *stratifier(void *arg)
 	randomiser <<= 32;
 	if (!ckp->proxy)
 		sdata->blockchange_id = sdata->workbase_id = randomiser;
+	if (ckp->handover_clients)
+		inherit_ids(ckp, sdata);
+	if (ckp->clusterhosts > 1)
+		LOGNOTICE("Cluster host %d of %d using its own enonce1 partition",
+			  ckp->clusterid, ckp->clusterhosts);
 
 	cklock_init(&sdata->instance_lock);
+	cklock_init(&sdata->share_lock);
+	mutex_init(&sdata->share_slab_lock);
 	cksem_init(&sdata->update_sem);
 	cksem_post(&sdata->update_sem);
 
@@ -8578,11 +11392,34 @@ void *stratifier(void *arg)
 	 * are CPUs */
 	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
 	sdata->updateq = create_ckmsgq(ckp, "updater", &block_update);
-	sdata->sshareq = create_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
-	sdata->ssends = create_ckmsgqs(ckp, "ssender", &ssend_process, threads);
+	/* In affinity mode each client's receives and shares are always
+	 * processed by the same numbered threads, optionally pinned to the
+	 * same CPU, to keep their per client state core local. Auth is
+	 * already serialised on one thread. */
+	if (ckp->affinity) {
+		sdata->sshareq = create_ckmsgqs_affine(ckp, "sprocessor", &sshare_process, threads, SHARE_BATCH);
+		sdata->srecvs = create_ckmsgqs_affine(ckp, "sreceiver", &srecv_process, threads, 0);
+		LOGNOTICE("Routing client work by affinity to %d %s threads", threads,
+			  ckp->pincpus ? "pinned" : "unpinned");
+	} else {
+		sdata->sshareq = create_ckmsgqs_batch(ckp, "sprocessor", &sshare_process, threads, SHARE_BATCH);
+		sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
+	}
+	LOGNOTICE("Verifying shares with %s %d lane sha256", sha256_multi_kernel(), sha256_multi_lanes());
+	LOGNOTICE("Encoding and decoding hex with %s kernel", hex_kernel());
+	/* ssends has bulk lists appended and prepended directly */
+	sdata->ssends = create_ckmsgqs_list(ckp, "ssender", &ssend_process, threads);
+	if (ckp->btcsolo) {
+		mutex_init(&sdata->notify_lock);
+		cond_init(&sdata->notify_cond);
+		sdata->snotifyq = create_ckmsgqs(ckp, "snotifier", &snotify_process, threads);
+	}
 	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
-	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
+	if (ckp->logshares) {
+		mutex_init(&sdata->sharelog_lock);
+		sdata->sharelogq = create_ckmsgqs_timed(ckp, "sharelog", &sharelog_process, 1, SHARELOG_BATCH);
+	}
 	create_pthread(&pth_throbber, throbber, ckp);
 	read_poolstats(ckp, &tvsec_diff);
 	read_userstats(ckp, sdata, tvsec_diff);
@@ -8592,6 +11429,7 @@ void *stratifier(void *arg)
 
 	cklock_init(&sdata->txn_lock);
 	cklock_init(&sdata->workbase_lock);
+	mutex_init(&sdata->wbsync_lock);
 	if (!ckp->proxy)
 		create_pthread(&pth_blockupdate, blockupdate, ckp);
 	else {
@@ -8599,14 +11437,28 @@ void *stratifier(void *arg)
 	}
 
 	mutex_init(&sdata->stats_lock);
+	mutex_init(&sdata->txnbase_lock);
+	mutex_init(&sdata->sharebatch_lock);
 	mutex_init(&sdata->uastats_lock);
+	mutex_init(&sdata->dirty_lock);
 	if (!ckp->passthrough || ckp->node)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
 
-	mutex_init(&sdata->share_lock);
 	if (!ckp->proxy)
 		create_pthread(&pth_zmqnotify, zmqnotify, ckp);
 
+	if (ckp->remote) {
+		pthread_t pth_sharebatcher;
+
+		create_pthread(&pth_sharebatcher, sharebatcher, ckp);
+	}
+
+	if (ckp->handover_clients) {
+		pthread_t pth_adopt;
+
+		create_pthread(&pth_adopt, adopt_clients, ckp);
+	}
+
 	ckp->stratifier_ready = true;
 	LOGWARNING("%s stratifier ready", ckp->name);
 
@@ -10,6 +10,17 @@
 #ifndef STRATIFIER_H
 #define STRATIFIER_H
 
+/* A template transaction, its raw data being at ofs in the binary txn_data of
+ * its workbase and its ids stored in binary as decoded from hex */
+struct gbttxn {
+	int ofs;
+	int len;
+	uchar txid[32];
+	uchar hash[32];
+};
+
+typedef struct gbttxn gbttxn_t;
+
 /* Generic structure for both workbase in stratifier and gbtbase in generator */
 struct genwork {
 	/* Hash table data */
@@ -23,8 +34,8 @@ struct genwork {
 
 	char idstring[20];
 
-	/* How many readers we currently have of this workbase, set
-	 * under write workbase_lock */
+	/* How many readers we currently have of this workbase, updated
+	 * atomically as shares look it up without the workbase_lock */
 	int readcount;
 
 	/* The id a remote workinfo is mapped to locally */
@@ -48,9 +59,14 @@ struct genwork {
 	int height;
 	char *flags;
 	int txns;
-	char *txn_data;
+	gbttxn_t *gbttxns;
+	char *txn_data; // Binary transaction data
+	struct txnarena *txn_arena; // Owns txn_data when shared with the transaction table
 	char *txn_hashes;
+	char txncount[12]; // Hex varint of the block transaction count
+	int txn_datalen; // Length of txn_data
 	char witnessdata[80]; //null-terminated ascii
+	char witness_commitment[80]; // default_witness_commitment from gbt
 	bool insert_witness;
 	int merkles;
 	char merklehash[16][68];
@@ -61,6 +77,8 @@ struct genwork {
 	char *coinb1; // coinbase1
 	uchar *coinb1bin;
 	int coinb1len; // length of above
+	uint32_t coinb1mid[8]; // sha256 midstate of the full 64 byte blocks of coinb1
+	int coinb1midlen; // length of coinb1 covered by the midstate
 
 	char enonce1const[32]; // extranonce1 section that is constant
 	uchar enonce1constbin[16];
@@ -84,10 +102,38 @@ struct genwork {
 	bool proxy; /* This workbase is proxied work */
 
 	bool incomplete; /* This is a remote workinfo without all the txn data */
+};
 
-	json_t *json; /* getblocktemplate json */
+/* Type of the id of a stratum request */
+enum submit_id {
+	SUBMIT_ID_NONE,
+	SUBMIT_ID_NULL,
+	SUBMIT_ID_INT,
+	SUBMIT_ID_STR
 };
 
+/* A mining.submit request tokenised by the connector straight from the
+ * message buffer, with its params as null terminated fixed size strings.
+ * Requests that don't fit are parsed as json instead. */
+struct stratum_submit {
+	int64_t client_id;
+	int64_t stamp; /* Monotonic ns the connector read it */
+
+	enum submit_id idtype;
+	int64_t intid;
+	char strid[64];
+
+	int nparams;
+	char workername[128];
+	char job_id[17]; /* Up to 64 bit hex */
+	char nonce2[36];
+	char ntime[12];
+	char nonce[12];
+	char version_mask[12];
+};
+
+typedef struct stratum_submit stratum_submit_t;
+
 void parse_remote_txns(ckpool_t *ckp, const json_t *val);
 #define parse_upstream_txns(ckp, val) parse_remote_txns(ckp, val)
 void parse_upstream_auth(ckpool_t *ckp, json_t *val);
@@ -95,8 +141,12 @@ void parse_upstream_workinfo(ckpool_t *ckp, json_t *val);
 void parse_upstream_block(ckpool_t *ckp, json_t *val);
 void parse_upstream_reqtxns(ckpool_t *ckp, json_t *val);
 char *stratifier_stats(ckpool_t *ckp, void *data);
+void stratifier_metrics(ckpool_t *ckp, char **buf);
+json_t *stratifier_handover(ckpool_t *ckp);
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line);
 #define stratifier_add_recv(ckp, val) _stratifier_add_recv(ckp, val, __FILE__, __func__, __LINE__)
+void stratifier_add_submit(ckpool_t *ckp, const stratum_submit_t *submit);
+bool stratifier_session_resumable(ckpool_t *ckp, const char *sessionid);
 void *stratifier(void *arg);
 
 #endif /* STRATIFIER_H */
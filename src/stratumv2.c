@@ -0,0 +1,816 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ckpool.h"
+#include "libckpool.h"
+#include "stratifier.h"
+#include "stratumv2.h"
+
+#define SV2_VERSION 2
+#define SV2_PROTOCOL_MINING 0
+
+/* Message types of the common and mining protocols we use */
+#define SV2_SETUP_CONNECTION		0x00
+#define SV2_SETUP_CONNECTION_SUCCESS	0x01
+#define SV2_SETUP_CONNECTION_ERROR	0x02
+#define SV2_OPEN_STANDARD_CHANNEL	0x10
+#define SV2_OPEN_STANDARD_SUCCESS	0x11
+#define SV2_OPEN_CHANNEL_ERROR		0x12
+#define SV2_OPEN_EXTENDED_CHANNEL	0x13
+#define SV2_OPEN_EXTENDED_SUCCESS	0x14
+#define SV2_NEW_MINING_JOB		0x15
+#define SV2_UPDATE_CHANNEL		0x16
+#define SV2_CLOSE_CHANNEL		0x18
+#define SV2_SUBMIT_STANDARD		0x1a
+#define SV2_SUBMIT_EXTENDED		0x1b
+#define SV2_SUBMIT_SUCCESS		0x1c
+#define SV2_SUBMIT_ERROR		0x1d
+#define SV2_NEW_EXTENDED_JOB		0x1f
+#define SV2_SET_NEW_PREV_HASH		0x20
+#define SV2_SET_TARGET			0x21
+#define SV2_RECONNECT			0x25
+
+/* Set in extension_type for messages addressed to a channel */
+#define SV2_CHANNEL_MSG 0x8000
+
+/* SetupConnection.Success flag telling miners not to roll the version */
+#define SV2_REQUIRES_FIXED_VERSION 0x1
+
+/* The only channel of each connection */
+#define SV2_CHANNEL_ID 1
+
+/* Jobs remembered per channel to find the V1 job of each submit */
+#define SV2_JOBS 256
+
+/* Ids of the V1 requests made on behalf of a client, their replies being
+ * recognised by them */
+#define SV2_SUBSCRIBE_ID "sv2.subscribe"
+#define SV2_AUTHORISE_ID "sv2.authorise"
+
+enum sv2_channel {
+	SV2_NONE,
+	SV2_STANDARD,
+	SV2_EXTENDED
+};
+
+typedef struct sv2_job sv2_job_t;
+
+struct sv2_job {
+	uint32_t id;
+	uint32_t version;
+	char jobid[20];
+};
+
+struct sv2_client {
+	/* Protects the state shared by the receiver reading frames and the
+	 * message processor translating messages to the client */
+	mutex_t lock;
+
+	bool setup;
+	char useragent[64];
+
+	enum sv2_channel type;
+	uint32_t request_id;
+	char user[128];
+	int min_extranonce;
+	/* Has the channel been opened, or failed to open */
+	bool open;
+	bool failed;
+
+	uchar enonce1[32];
+	int enonce1len;
+	int enonce2len;
+	double diff;
+
+	/* Latest job sent before the channel opened */
+	json_t *notify;
+
+	uint32_t next_job;
+	sv2_job_t jobs[SV2_JOBS];
+	/* V1 prevhash of the last job, a new one needing a SetNewPrevHash */
+	char prevhash[68];
+};
+
+typedef struct sv2_buf sv2_buf_t;
+
+/* Frames being built, with the offset of the header of the current one */
+struct sv2_buf {
+	char *buf;
+	int len;
+	int size;
+	int hdr;
+};
+
+typedef struct sv2_rd sv2_rd_t;
+
+/* Payload of a frame being read, flagging err on reading past its end */
+struct sv2_rd {
+	const uchar *p;
+	int len;
+	int ofs;
+	bool err;
+};
+
+static void put_bytes(sv2_buf_t *b, const void *data, const int len)
+{
+	if (b->len + len > b->size) {
+		b->size = round_up_page(b->len + len);
+		b->buf = realloc(b->buf, b->size);
+	}
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+}
+
+static void put_u8(sv2_buf_t *b, const uint8_t val)
+{
+	put_bytes(b, &val, 1);
+}
+
+static void put_u16(sv2_buf_t *b, const uint16_t val)
+{
+	uint16_t le = htole16(val);
+
+	put_bytes(b, &le, 2);
+}
+
+static void put_u32(sv2_buf_t *b, const uint32_t val)
+{
+	uint32_t le = htole32(val);
+
+	put_bytes(b, &le, 4);
+}
+
+static void put_u64(sv2_buf_t *b, const uint64_t val)
+{
+	uint64_t le = htole64(val);
+
+	put_bytes(b, &le, 8);
+}
+
+/* STR0_255 */
+static void put_str(sv2_buf_t *b, const char *str)
+{
+	int len = strlen(str);
+
+	if (len > 255)
+		len = 255;
+	put_u8(b, len);
+	put_bytes(b, str, len);
+}
+
+/* B0_64K */
+static void put_b64k(sv2_buf_t *b, const void *data, const int len)
+{
+	put_u16(b, len);
+	put_bytes(b, data, len);
+}
+
+static void begin_frame(sv2_buf_t *b, const uint8_t type, const bool channel_msg)
+{
+	b->hdr = b->len;
+	put_u16(b, channel_msg ? SV2_CHANNEL_MSG : 0);
+	put_u8(b, type);
+	put_bytes(b, "\0\0\0", 3);
+}
+
+static void end_frame(sv2_buf_t *b)
+{
+	uchar *hdr = (uchar *)b->buf + b->hdr;
+	int len = b->len - b->hdr - SV2_HDRLEN;
+
+	hdr[3] = len & 0xff;
+	hdr[4] = (len >> 8) & 0xff;
+	hdr[5] = (len >> 16) & 0xff;
+}
+
+static const uchar *rd_bytes(sv2_rd_t *r, const int len)
+{
+	const uchar *ret;
+
+	if (unlikely(r->err || r->len - r->ofs < len)) {
+		r->err = true;
+		return NULL;
+	}
+	ret = r->p + r->ofs;
+	r->ofs += len;
+	return ret;
+}
+
+static uint8_t rd_u8(sv2_rd_t *r)
+{
+	const uchar *p = rd_bytes(r, 1);
+
+	return p ? *p : 0;
+}
+
+static uint16_t rd_u16(sv2_rd_t *r)
+{
+	const uchar *p = rd_bytes(r, 2);
+
+	return p ? p[0] | p[1] << 8 : 0;
+}
+
+static uint32_t rd_u32(sv2_rd_t *r)
+{
+	const uchar *p = rd_bytes(r, 4);
+
+	return p ? p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24 : 0;
+}
+
+/* Reads a STR0_255 into buf of size len, or skips it if buf is NULL. Strings
+ * that don't fit flag an error. */
+static void rd_str(sv2_rd_t *r, char *buf, const int len)
+{
+	int slen = rd_u8(r);
+	const uchar *p = rd_bytes(r, slen);
+
+	if (!buf || !p)
+		return;
+	if (unlikely(slen >= len)) {
+		r->err = true;
+		return;
+	}
+	memcpy(buf, p, slen);
+	buf[slen] = '\0';
+}
+
+sv2_client_t *sv2_new_client(void)
+{
+	sv2_client_t *sv2 = ckzalloc(sizeof(sv2_client_t));
+
+	mutex_init(&sv2->lock);
+	return sv2;
+}
+
+void sv2_free_client(sv2_client_t *sv2)
+{
+	if (!sv2)
+		return;
+	if (sv2->notify)
+		json_decref(sv2->notify);
+	mutex_destroy(&sv2->lock);
+	free(sv2);
+}
+
+/* Returns the length of the complete frame at the start of buf, 0 if it is
+ * incomplete or -1 if it is too large to be valid */
+int sv2_frame(const char *buf, const int len)
+{
+	const uchar *hdr = (const uchar *)buf;
+	int msglen;
+
+	if (len < SV2_HDRLEN)
+		return 0;
+	msglen = hdr[3] | hdr[4] << 8 | hdr[5] << 16;
+	if (unlikely(msglen > SV2_MAXMSG))
+		return -1;
+	if (len < SV2_HDRLEN + msglen)
+		return 0;
+	return SV2_HDRLEN + msglen;
+}
+
+static void add_msg(sv2_recv_t *recv, json_t *val)
+{
+	recv->msgs[recv->nmsgs++] = val;
+}
+
+static void setup_error(sv2_buf_t *b, const char *code)
+{
+	begin_frame(b, SV2_SETUP_CONNECTION_ERROR, false);
+	put_u32(b, 0);
+	put_str(b, code);
+	end_frame(b);
+	LOGINFO("Stratum v2 client failed setup with %s", code);
+}
+
+static void setup_connection(const ckpool_t *ckp, sv2_client_t *sv2, sv2_rd_t *r, sv2_recv_t *recv,
+			     sv2_buf_t *b)
+{
+	uint16_t min_version, max_version;
+	char vendor[256];
+	uint8_t protocol;
+
+	protocol = rd_u8(r);
+	min_version = rd_u16(r);
+	max_version = rd_u16(r);
+	rd_u32(r); /* flags */
+	rd_str(r, NULL, 0); /* endpoint_host */
+	rd_u16(r); /* endpoint_port */
+	rd_str(r, vendor, sizeof(vendor));
+	if (unlikely(r->err)) {
+		recv->drop = true;
+		return;
+	}
+	if (protocol != SV2_PROTOCOL_MINING) {
+		setup_error(b, "unsupported-protocol");
+		return;
+	}
+	if (min_version > SV2_VERSION || max_version < SV2_VERSION) {
+		setup_error(b, "protocol-version-mismatch");
+		return;
+	}
+	sv2->setup = true;
+	snprintf(sv2->useragent, sizeof(sv2->useragent), "sv2/%.59s", vendor);
+
+	begin_frame(b, SV2_SETUP_CONNECTION_SUCCESS, false);
+	put_u16(b, SV2_VERSION);
+	put_u32(b, ckp->version_mask ? 0 : SV2_REQUIRES_FIXED_VERSION);
+	end_frame(b);
+}
+
+static void open_channel_error(sv2_client_t *sv2, sv2_buf_t *b, const uint32_t request_id,
+			       const char *code)
+{
+	begin_frame(b, SV2_OPEN_CHANNEL_ERROR, false);
+	put_u32(b, request_id);
+	put_str(b, code);
+	end_frame(b);
+	LOGINFO("Stratum v2 client %s failed to open channel with %s", sv2->user, code);
+}
+
+/* Open the channel by subscribing and authorising its user identity, the
+ * channel being confirmed once the authorise succeeds */
+static void open_channel(sv2_client_t *sv2, sv2_rd_t *r, sv2_recv_t *recv, sv2_buf_t *b,
+			 const enum sv2_channel type)
+{
+	uint32_t request_id;
+	char user[256];
+	json_t *val;
+
+	request_id = rd_u32(r);
+	rd_str(r, user, sizeof(user));
+	rd_bytes(r, 4); /* nominal_hash_rate */
+	rd_bytes(r, 32); /* max_target */
+	if (type == SV2_EXTENDED)
+		sv2->min_extranonce = rd_u16(r);
+	if (unlikely(r->err || !sv2->setup)) {
+		recv->drop = true;
+		return;
+	}
+	if (sv2->type != SV2_NONE) {
+		open_channel_error(sv2, b, request_id, "max-channels-reached");
+		return;
+	}
+	if (!strlen(user) || strlen(user) >= sizeof(sv2->user)) {
+		open_channel_error(sv2, b, request_id, "unknown-user");
+		return;
+	}
+	sv2->type = type;
+	sv2->request_id = request_id;
+	strcpy(sv2->user, user);
+
+	JSON_CPACK(val, "{ss,ss,s[s]}", "id", SV2_SUBSCRIBE_ID, "method", "mining.subscribe",
+		   "params", sv2->useragent);
+	add_msg(recv, val);
+	JSON_CPACK(val, "{ss,ss,s[ss]}", "id", SV2_AUTHORISE_ID, "method", "mining.authorize",
+		   "params", sv2->user, "");
+	add_msg(recv, val);
+}
+
+/* Map a channel's maximum target on to a suggested difficulty */
+static void update_channel(sv2_client_t *sv2, sv2_rd_t *r, sv2_recv_t *recv)
+{
+	uchar target[32];
+	const uchar *p;
+	int64_t diff;
+	json_t *val;
+
+	rd_u32(r); /* channel_id */
+	rd_bytes(r, 4); /* nominal_hash_rate */
+	p = rd_bytes(r, 32);
+	if (unlikely(!p)) {
+		recv->drop = true;
+		return;
+	}
+	if (!sv2->open)
+		return;
+	memcpy(target, p, 32);
+	diff = diff_from_target(target);
+	if (diff < 1)
+		return;
+	JSON_CPACK(val, "{sn,ss,s[I]}", "id", "method", "mining.suggest_difficulty",
+		   "params", diff);
+	add_msg(recv, val);
+}
+
+static void submit_error(sv2_buf_t *b, const uint32_t channel_id, const uint32_t seq,
+			 const char *code)
+{
+	begin_frame(b, SV2_SUBMIT_ERROR, true);
+	put_u32(b, channel_id);
+	put_u32(b, seq);
+	put_str(b, code);
+	end_frame(b);
+}
+
+/* Translate a share into the V1 submit of its job. Standard channels always
+ * have an enonce2 of zeroes. */
+static void submit_shares(const ckpool_t *ckp, sv2_client_t *sv2, sv2_rd_t *r, sv2_recv_t *recv,
+			  sv2_buf_t *b, const enum sv2_channel type)
+{
+	uint32_t channel_id, seq, job_id, nonce, ntime, version;
+	stratum_submit_t *submit = &recv->submit;
+	const uchar *extranonce = NULL;
+	int extranoncelen = 0;
+	sv2_job_t *job;
+
+	channel_id = rd_u32(r);
+	seq = rd_u32(r);
+	job_id = rd_u32(r);
+	nonce = rd_u32(r);
+	ntime = rd_u32(r);
+	version = rd_u32(r);
+	if (type == SV2_EXTENDED) {
+		extranoncelen = rd_u8(r);
+		extranonce = rd_bytes(r, extranoncelen);
+	}
+	if (unlikely(r->err)) {
+		recv->drop = true;
+		return;
+	}
+	if (!sv2->open || channel_id != SV2_CHANNEL_ID || type != sv2->type) {
+		submit_error(b, channel_id, seq, "invalid-channel-id");
+		return;
+	}
+	job = &sv2->jobs[job_id % SV2_JOBS];
+	if (job->id != job_id || !job->jobid[0]) {
+		submit_error(b, channel_id, seq, "invalid-job-id");
+		return;
+	}
+	if (type == SV2_EXTENDED && extranoncelen != sv2->enonce2len) {
+		submit_error(b, channel_id, seq, "invalid-extranonce");
+		return;
+	}
+
+	submit->idtype = SUBMIT_ID_INT;
+	submit->intid = seq;
+	submit->nparams = 6;
+	strcpy(submit->workername, sv2->user);
+	strcpy(submit->job_id, job->jobid);
+	if (extranonce)
+		__bin2hex(submit->nonce2, extranonce, extranoncelen);
+	else {
+		memset(submit->nonce2, '0', sv2->enonce2len * 2);
+		submit->nonce2[sv2->enonce2len * 2] = '\0';
+	}
+	sprintf(submit->ntime, "%08x", ntime);
+	sprintf(submit->nonce, "%08x", nonce);
+	/* V1 takes the version bits rolled rather than the version */
+	sprintf(submit->version_mask, "%08x", ckp->version_mask ? version ^ job->version : 0);
+	recv->submitted = true;
+}
+
+/* Translate a frame from a client into what it asks of the stratifier and
+ * any reply to send straight back */
+void sv2_recv_frame(const ckpool_t *ckp, sv2_client_t *sv2, const char *buf, const int len,
+		    sv2_recv_t *recv)
+{
+	uint16_t extension = le16toh(*(const uint16_t *)buf) & ~SV2_CHANNEL_MSG;
+	uint8_t type = buf[2];
+	sv2_buf_t b = {};
+	sv2_rd_t r;
+
+	memset(recv, 0, sizeof(sv2_recv_t));
+	/* We don't support any extensions */
+	if (extension)
+		return;
+	r.p = (const uchar *)buf + SV2_HDRLEN;
+	r.len = len - SV2_HDRLEN;
+	r.ofs = 0;
+	r.err = false;
+
+	mutex_lock(&sv2->lock);
+	switch (type) {
+		case SV2_SETUP_CONNECTION:
+			setup_connection(ckp, sv2, &r, recv, &b);
+			break;
+		case SV2_OPEN_STANDARD_CHANNEL:
+			open_channel(sv2, &r, recv, &b, SV2_STANDARD);
+			break;
+		case SV2_OPEN_EXTENDED_CHANNEL:
+			open_channel(sv2, &r, recv, &b, SV2_EXTENDED);
+			break;
+		case SV2_SUBMIT_STANDARD:
+			submit_shares(ckp, sv2, &r, recv, &b, SV2_STANDARD);
+			break;
+		case SV2_SUBMIT_EXTENDED:
+			submit_shares(ckp, sv2, &r, recv, &b, SV2_EXTENDED);
+			break;
+		case SV2_UPDATE_CHANNEL:
+			update_channel(sv2, &r, recv);
+			break;
+		case SV2_CLOSE_CHANNEL:
+			recv->drop = true;
+			break;
+		default:
+			LOGDEBUG("Ignoring stratum v2 message type 0x%02x", type);
+			break;
+	}
+	mutex_unlock(&sv2->lock);
+
+	recv->reply = b.buf;
+	recv->replylen = b.len;
+}
+
+static void set_target(sv2_client_t *sv2, sv2_buf_t *b)
+{
+	uchar target[32];
+
+	target_from_diff(target, sv2->diff);
+	begin_frame(b, SV2_SET_TARGET, true);
+	put_u32(b, SV2_CHANNEL_ID);
+	put_bytes(b, target, 32);
+	end_frame(b);
+}
+
+/* Translate a V1 notify into a new job, preceded by the prevhash when it
+ * changes which makes it a future job only activated by the prevhash */
+static void new_job(const ckpool_t *ckp, sv2_client_t *sv2, const json_t *val, sv2_buf_t *b)
+{
+	const char *jobid, *prevhash, *coinb1, *coinb2, *bbversion, *nbit, *ntime;
+	json_t *params = json_object_get(val, "params"), *merkle_arr;
+	int cb1len, cb2len, merkles, i;
+	uint32_t version, ntime32;
+	uchar *coinb1bin, *coinb2bin;
+	sv2_job_t *job;
+	bool future;
+
+	jobid = json_string_value(json_array_get(params, 0));
+	prevhash = json_string_value(json_array_get(params, 1));
+	coinb1 = json_string_value(json_array_get(params, 2));
+	coinb2 = json_string_value(json_array_get(params, 3));
+	merkle_arr = json_array_get(params, 4);
+	bbversion = json_string_value(json_array_get(params, 5));
+	nbit = json_string_value(json_array_get(params, 6));
+	ntime = json_string_value(json_array_get(params, 7));
+	if (unlikely(!jobid || strlen(jobid) >= sizeof(job->jobid) || !prevhash ||
+		     strlen(prevhash) != 64 || !coinb1 || !coinb2 || !json_is_array(merkle_arr) ||
+		     !bbversion || !nbit || !ntime)) {
+		LOGWARNING("Invalid notify for stratum v2 client %s", sv2->user);
+		return;
+	}
+	cb1len = strlen(coinb1) / 2;
+	cb2len = strlen(coinb2) / 2;
+	merkles = json_array_size(merkle_arr);
+	if (unlikely(cb1len > 65535 || cb2len > 65535 || merkles > 255)) {
+		LOGWARNING("Notify too large for stratum v2 client %s", sv2->user);
+		return;
+	}
+	coinb1bin = ckalloc(cb1len + sv2->enonce1len + sv2->enonce2len + cb2len);
+	hex2bin(coinb1bin, coinb1, cb1len);
+	coinb2bin = ckalloc(cb2len);
+	hex2bin(coinb2bin, coinb2, cb2len);
+	version = strtoul(bbversion, NULL, 16);
+	ntime32 = strtoul(ntime, NULL, 16);
+	future = json_is_true(json_array_get(params, 8)) || strcmp(prevhash, sv2->prevhash);
+
+	job = &sv2->jobs[sv2->next_job % SV2_JOBS];
+	job->id = sv2->next_job++;
+	job->version = version;
+	strcpy(job->jobid, jobid);
+
+	if (sv2->type == SV2_EXTENDED) {
+		begin_frame(b, SV2_NEW_EXTENDED_JOB, true);
+		put_u32(b, SV2_CHANNEL_ID);
+		put_u32(b, job->id);
+		put_u8(b, !future);
+		if (!future)
+			put_u32(b, ntime32);
+		put_u32(b, version);
+		put_u8(b, !!ckp->version_mask);
+		put_u8(b, merkles);
+		for (i = 0; i < merkles; i++) {
+			const char *merkle = json_string_value(json_array_get(merkle_arr, i));
+			uchar bin[32] = {};
+
+			if (merkle)
+				hex2bin(bin, merkle, 32);
+			put_bytes(b, bin, 32);
+		}
+		put_b64k(b, coinb1bin, cb1len);
+		put_b64k(b, coinb2bin, cb2len);
+		end_frame(b);
+	} else {
+		uchar merkle_sha[64], merkle_root[32];
+		uchar *coinbase = coinb1bin;
+		int cblen = cb1len;
+
+		/* Standard channels are sent the merkle root of the coinbase
+		 * with their complete extranonce */
+		memcpy(coinbase + cblen, sv2->enonce1, sv2->enonce1len);
+		cblen += sv2->enonce1len;
+		memset(coinbase + cblen, 0, sv2->enonce2len);
+		cblen += sv2->enonce2len;
+		memcpy(coinbase + cblen, coinb2bin, cb2len);
+		cblen += cb2len;
+		gen_hash(coinbase, merkle_root, cblen);
+		for (i = 0; i < merkles; i++) {
+			const char *merkle = json_string_value(json_array_get(merkle_arr, i));
+
+			memcpy(merkle_sha, merkle_root, 32);
+			memset(merkle_sha + 32, 0, 32);
+			if (merkle)
+				hex2bin(merkle_sha + 32, merkle, 32);
+			gen_hash(merkle_sha, merkle_root, 64);
+		}
+		begin_frame(b, SV2_NEW_MINING_JOB, true);
+		put_u32(b, SV2_CHANNEL_ID);
+		put_u32(b, job->id);
+		put_u8(b, !future);
+		if (!future)
+			put_u32(b, ntime32);
+		put_u32(b, version);
+		put_bytes(b, merkle_root, 32);
+		end_frame(b);
+	}
+	free(coinb1bin);
+	free(coinb2bin);
+
+	if (future) {
+		uchar bin[32], swap[32];
+
+		/* V1 prevhash has each 32 bit word byte swapped */
+		hex2bin(bin, prevhash, 32);
+		flip_32(swap, bin);
+		begin_frame(b, SV2_SET_NEW_PREV_HASH, true);
+		put_u32(b, SV2_CHANNEL_ID);
+		put_u32(b, job->id);
+		put_bytes(b, swap, 32);
+		put_u32(b, ntime32);
+		put_u32(b, strtoul(nbit, NULL, 16));
+		end_frame(b);
+		strcpy(sv2->prevhash, prevhash);
+	}
+}
+
+static void subscribe_result(sv2_client_t *sv2, const json_t *val, sv2_buf_t *b)
+{
+	json_t *result = json_object_get(val, "result");
+	const char *enonce1;
+	int len;
+
+	enonce1 = json_string_value(json_array_get(result, 1));
+	len = enonce1 ? strlen(enonce1) / 2 : 0;
+	if (unlikely(!len || len > (int)sizeof(sv2->enonce1) || !hex2bin(sv2->enonce1, enonce1, len))) {
+		open_channel_error(sv2, b, sv2->request_id, "subscribe-failed");
+		sv2->failed = true;
+		return;
+	}
+	sv2->enonce1len = len;
+	sv2->enonce2len = json_integer_value(json_array_get(result, 2));
+	if (sv2->type == SV2_EXTENDED && sv2->min_extranonce > sv2->enonce2len) {
+		open_channel_error(sv2, b, sv2->request_id, "min-extranonce-size-too-large");
+		sv2->failed = true;
+	} else if (sv2->type == SV2_STANDARD && len + sv2->enonce2len > 32) {
+		open_channel_error(sv2, b, sv2->request_id, "extranonce-too-large");
+		sv2->failed = true;
+	}
+}
+
+/* Confirm the channel is open once its user is authorised, sending it any job
+ * it was given before then */
+static void authorise_result(const ckpool_t *ckp, sv2_client_t *sv2, const json_t *val, sv2_buf_t *b)
+{
+	uchar target[32];
+
+	if (sv2->failed)
+		return;
+	if (!json_is_true(json_object_get(val, "result"))) {
+		open_channel_error(sv2, b, sv2->request_id, "unknown-user");
+		sv2->failed = true;
+		return;
+	}
+	sv2->open = true;
+	if (!sv2->diff)
+		sv2->diff = ckp->startdiff;
+	target_from_diff(target, sv2->diff);
+	if (sv2->type == SV2_EXTENDED) {
+		begin_frame(b, SV2_OPEN_EXTENDED_SUCCESS, false);
+		put_u32(b, sv2->request_id);
+		put_u32(b, SV2_CHANNEL_ID);
+		put_bytes(b, target, 32);
+		put_u16(b, sv2->enonce2len);
+		put_u8(b, sv2->enonce1len);
+		put_bytes(b, sv2->enonce1, sv2->enonce1len);
+		end_frame(b);
+	} else {
+		uchar zeroes[32] = {};
+
+		begin_frame(b, SV2_OPEN_STANDARD_SUCCESS, false);
+		put_u32(b, sv2->request_id);
+		put_u32(b, SV2_CHANNEL_ID);
+		put_bytes(b, target, 32);
+		put_u8(b, sv2->enonce1len + sv2->enonce2len);
+		put_bytes(b, sv2->enonce1, sv2->enonce1len);
+		put_bytes(b, zeroes, sv2->enonce2len);
+		put_u32(b, 0); /* group_channel_id */
+		end_frame(b);
+	}
+	LOGINFO("Stratum v2 client %s opened %s channel", sv2->user,
+		sv2->type == SV2_EXTENDED ? "extended" : "standard");
+	if (sv2->notify) {
+		new_job(ckp, sv2, sv2->notify, b);
+		json_decref(sv2->notify);
+		sv2->notify = NULL;
+	}
+}
+
+/* Map the V1 reject reasons on to the error codes miners expect */
+static const char *submit_code(const json_t *val)
+{
+	const char *reason = json_string_value(json_object_get(val, "reject-reason"));
+
+	if (!reason)
+		return "invalid-share";
+	if (!strcmp(reason, "Stale"))
+		return "stale-share";
+	if (!strcmp(reason, "Invalid JobID"))
+		return "invalid-job-id";
+	if (!strcmp(reason, "Above target"))
+		return "difficulty-too-low";
+	if (!strcmp(reason, "Duplicate"))
+		return "duplicate-share";
+	return "invalid-share";
+}
+
+static void submit_result(sv2_client_t *sv2, const json_t *val, sv2_buf_t *b)
+{
+	uint32_t seq = json_integer_value(json_object_get(val, "id"));
+
+	if (!json_is_true(json_object_get(val, "result"))) {
+		submit_error(b, SV2_CHANNEL_ID, seq, submit_code(val));
+		return;
+	}
+	begin_frame(b, SV2_SUBMIT_SUCCESS, true);
+	put_u32(b, SV2_CHANNEL_ID);
+	put_u32(b, seq);
+	put_u32(b, 1);
+	put_u64(b, sv2->diff);
+	end_frame(b);
+}
+
+static void reconnect(const json_t *val, sv2_buf_t *b)
+{
+	json_t *params = json_object_get(val, "params");
+	const char *host = json_string_value(json_array_get(params, 0));
+	json_t *port = json_array_get(params, 1);
+
+	begin_frame(b, SV2_RECONNECT, false);
+	put_str(b, host ? host : "");
+	if (json_is_string(port))
+		put_u16(b, atoi(json_string_value(port)));
+	else
+		put_u16(b, json_integer_value(port));
+	end_frame(b);
+}
+
+/* Translate a V1 message for a client into its V2 frames, returning NULL if
+ * it has no V2 equivalent */
+char *sv2_send_json(const ckpool_t *ckp, sv2_client_t *sv2, const json_t *val, int *len)
+{
+	const char *method = json_string_value(json_object_get(val, "method"));
+	json_t *id_val = json_object_get(val, "id");
+	sv2_buf_t b = {};
+
+	mutex_lock(&sv2->lock);
+	if (method) {
+		if (!strcmp(method, "mining.notify")) {
+			if (sv2->open)
+				new_job(ckp, sv2, val, &b);
+			else if (!sv2->failed) {
+				if (sv2->notify)
+					json_decref(sv2->notify);
+				sv2->notify = json_incref((json_t *)val);
+			}
+		} else if (!strcmp(method, "mining.set_difficulty")) {
+			sv2->diff = json_number_value(json_array_get(json_object_get(val, "params"), 0));
+			if (sv2->open && sv2->diff > 0)
+				set_target(sv2, &b);
+		} else if (!strcmp(method, "client.reconnect"))
+			reconnect(val, &b);
+	} else if (json_is_string(id_val)) {
+		const char *id = json_string_value(id_val);
+
+		if (!strcmp(id, SV2_SUBSCRIBE_ID))
+			subscribe_result(sv2, val, &b);
+		else if (!strcmp(id, SV2_AUTHORISE_ID))
+			authorise_result(ckp, sv2, val, &b);
+	} else if (json_is_integer(id_val) && sv2->open)
+		submit_result(sv2, val, &b);
+	mutex_unlock(&sv2->lock);
+
+	*len = b.len;
+	return b.buf;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2014-2018,2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef STRATUMV2_H
+#define STRATUMV2_H
+
+/* Stratum V2 mining protocol frontend, without the noise encryption layer.
+ * Each connection carries a single standard or extended channel mapped onto
+ * one stratum_instance in the stratifier. Its frames are translated into the
+ * V1 requests and shares the stratifier already handles, and the V1 messages
+ * sent to it are translated back into V2 frames by the connector. */
+
+/* Frames start with extension_type u16, msg_type u8 and msg_length u24 */
+#define SV2_HDRLEN 6
+
+/* Largest frame accepted from a client */
+#define SV2_MAXMSG 16384
+
+/* Most V1 requests a single frame from a client translates to */
+#define SV2_RECV_MSGS 2
+
+typedef struct sv2_client sv2_client_t;
+
+/* What a frame from a client translated to: V1 requests for the stratifier,
+ * a share, and a frame to send straight back to the client */
+struct sv2_recv {
+	json_t *msgs[SV2_RECV_MSGS];
+	int nmsgs;
+
+	stratum_submit_t submit;
+	bool submitted;
+
+	char *reply;
+	int replylen;
+
+	/* Should the client be dropped */
+	bool drop;
+};
+
+typedef struct sv2_recv sv2_recv_t;
+
+sv2_client_t *sv2_new_client(void);
+void sv2_free_client(sv2_client_t *sv2);
+int sv2_frame(const char *buf, const int len);
+void sv2_recv_frame(const ckpool_t *ckp, sv2_client_t *sv2, const char *buf, const int len,
+		    sv2_recv_t *recv);
+char *sv2_send_json(const ckpool_t *ckp, sv2_client_t *sv2, const json_t *val, int *len);
+
+#endif /* STRATUMV2_H */